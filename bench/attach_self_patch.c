@@ -0,0 +1,245 @@
+/**
+ * @file bench/attach_self_patch.c
+ *
+ * Checks that `dpatch-attach` patches a running process
+ * which was not started under `LD_AUDIT`.
+ *
+ * The `self_patch` demo is started without `LD_AUDIT`,
+ * writing to a pseudo-terminal so its output is line
+ * buffered. Once it prints "I am alpha.", `dpatch-attach`
+ * applies the demo's script, redirecting `alpha` to
+ * `bravo`, and the demo must then print "I am bravo.". The
+ * time `dpatch-attach` reports the target was stopped for
+ * must be no more than `max_stop_ms`.
+ *
+ *     attach_self_patch [max_stop_ms]
+ *
+ * The result is printed as a JSON object. The exit status
+ * is non-zero if the attach fails, the demo's output
+ * doesn't change in time, or the stop took too long.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAIT_TIMEOUT_MS 10000
+#define DEFAULT_MAX_STOP_MS 1000
+#define LINE_LEN 256
+
+/**
+ * Get the current monotonic time in milliseconds.
+ *
+ * @return Milliseconds since an arbitrary epoch.
+ */
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Start `self_patch` without `LD_AUDIT`, writing to a new
+ * pseudo-terminal.
+ *
+ * @param terminal Location to store the terminal's master
+ *      side, which the demo's output is read from.
+ * @return The demo's process ID, or -1 on failure.
+ */
+static pid_t start_demo(int* terminal)
+{
+    char* demo_argv[] = {SELF_PATCH_PATH, NULL};
+    char* replica_path = NULL;
+    int replica = -1;
+    pid_t demo = 0;
+    *terminal = posix_openpt(O_RDWR | O_NOCTTY);
+    if (*terminal == -1 || grantpt(*terminal) == -1 || unlockpt(*terminal) == -1)
+    {
+        return -1;
+    }
+    replica_path = ptsname(*terminal);
+    if (replica_path == NULL)
+    {
+        return -1;
+    }
+    demo = fork();
+    if (demo != 0)
+    {
+        return demo;
+    }
+    replica = open(replica_path, O_WRONLY | O_NOCTTY);
+    if (replica == -1 || dup2(replica, STDOUT_FILENO) == -1)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    close(replica);
+    close(*terminal);
+    /* `dpatch-attach` is the demo's sibling, which Yama only lets trace it if asked. */
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    unsetenv("LD_AUDIT");
+    execv(demo_argv[0], demo_argv);
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * Read the demo's output until it prints a line.
+ *
+ * @param terminal Master side of the demo's terminal.
+ * @param expected Text the line must contain.
+ * @return `true` if the line was printed in time.
+ */
+static bool await_line(int terminal, const char* expected)
+{
+    struct pollfd output = {terminal, POLLIN, 0};
+    char line[LINE_LEN];
+    size_t length = 0;
+    ssize_t result = 0;
+    int64_t deadline = now_ms() + WAIT_TIMEOUT_MS;
+    for (;;)
+    {
+        if (now_ms() >= deadline || poll(&output, 1, (int) (deadline - now_ms())) <= 0)
+        {
+            return false;
+        }
+        /* One byte at a time, so nothing after the line is consumed. */
+        result = read(terminal, &line[length], 1);
+        if (result != 1)
+        {
+            return false;
+        }
+        if (line[length] != '\n' && length < sizeof line - 2)
+        {
+            length++;
+            continue;
+        }
+        line[length + 1] = '\0';
+        if (strstr(line, expected) != NULL)
+        {
+            return true;
+        }
+        length = 0;
+    }
+}
+
+/**
+ * Apply the demo's script with `dpatch-attach`.
+ *
+ * @param demo The demo's process ID.
+ * @param stop_ms Location to store the time `dpatch-attach`
+ *      reports the demo was stopped for, or -1 if it
+ *      reports none.
+ * @param threads Location to store the number of threads
+ *      `dpatch-attach` reports it stopped.
+ * @return `dpatch-attach`'s exit status, or -1 if it could
+ * not be run.
+ */
+static int attach(pid_t demo, double* stop_ms, size_t* threads)
+{
+    posix_spawn_file_actions_t actions;
+    char pid[16];
+    char line[LINE_LEN];
+    char* attach_argv[] = {ATTACH_PATH, pid, SELF_PATCH_SCRIPT_PATH, DPATCH_LIBRARY_PATH, NULL};
+    int pipe_fds[2] = {-1, -1};
+    int status = 0;
+    int reported_pid = 0;
+    pid_t attacher = 0;
+    FILE* output = NULL;
+    *stop_ms = -1;
+    snprintf(pid, sizeof pid, "%d", (int) demo);
+    if (pipe(pipe_fds) == -1)
+    {
+        return -1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+    status = posix_spawn(&attacher, attach_argv[0], &actions, NULL, attach_argv, NULL);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fds[1]);
+    if (status != 0)
+    {
+        close(pipe_fds[0]);
+        return -1;
+    }
+    output = fdopen(pipe_fds[0], "r");
+    while (output != NULL && fgets(line, sizeof line, output) != NULL)
+    {
+        fputs(line, stderr);
+        if (
+            sscanf(line, "Target %d stopped for %lf ms (%zu threads).", &reported_pid, stop_ms, threads) == 3
+            && reported_pid != (int) demo
+        )
+        {
+            *stop_ms = -1;
+        }
+    }
+    if (output != NULL)
+    {
+        fclose(output);
+    }
+    else
+    {
+        close(pipe_fds[0]);
+    }
+    if (waitpid(attacher, &status, 0) != attacher || !WIFEXITED(status))
+    {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+int main(int argc, char** argv)
+{
+    double max_stop_ms = argc > 1 ? strtod(argv[1], NULL) : DEFAULT_MAX_STOP_MS;
+    double stop_ms = -1;
+    size_t threads = 0;
+    int terminal = -1;
+    int attach_status = -1;
+    bool started = false;
+    bool patched = false;
+    pid_t demo = start_demo(&terminal);
+    if (demo == -1)
+    {
+        perror("attach_self_patch: starting " SELF_PATCH_PATH);
+        return EXIT_FAILURE;
+    }
+    started = await_line(terminal, "I am alpha.");
+    if (started)
+    {
+        attach_status = attach(demo, &stop_ms, &threads);
+    }
+    if (attach_status == 0)
+    {
+        patched = await_line(terminal, "I am bravo.");
+    }
+    kill(demo, SIGKILL);
+    waitpid(demo, NULL, 0);
+    close(terminal);
+    printf(
+        "{\"bench\":\"attach_self_patch\",\"started\":%s,\"attach_status\":%d,"
+        "\"stop_ms\":%.3f,\"threads\":%zu,\"max_stop_ms\":%.3f,\"patched\":%s}\n",
+        started ? "true" : "false",
+        attach_status,
+        stop_ms,
+        threads,
+        max_stop_ms,
+        patched ? "true" : "false"
+    );
+    return patched && stop_ms > 0 && stop_ms <= max_stop_ms ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,246 @@
+/**
+ * @file bench/blob_rollout.c
+ *
+ * Checks that pre-forked workers sharing patches through
+ * `DPATCH_BLOB` apply each new script, rather than a blob
+ * left over from an earlier rollout.
+ *
+ * `rollout_target` is started under `LD_AUDIT` with a
+ * script redirecting `rollout_target` to version 1. The
+ * master is signalled first, and publishes a blob, then the
+ * worker, which applies it. The script is then changed to
+ * redirect to version 2, and the worker is signalled before
+ * the master, while the published blob still holds version
+ * 1. Both processes must end up running version 2.
+ *
+ * The exit status is non-zero if either process doesn't
+ * report the expected version in time.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAIT_TIMEOUT_MS 10000
+#define LINE_LEN 128
+#define ROLES 2
+
+/**
+ * The state of the target's processes, as last reported.
+ */
+struct rollout
+{
+    /** Stream of the target's reports. */
+    FILE* reports;
+
+    /** Process IDs of the master and worker, or 0. */
+    pid_t pids[ROLES];
+
+    /** Versions the master and worker last reported. */
+    int versions[ROLES];
+
+    /** Path to the script the target applies. */
+    char script_path[PATH_MAX];
+};
+
+/** Names of the target's processes, as it reports them. */
+static const char* roles[ROLES] = {"master", "worker"};
+
+/**
+ * Get the current monotonic time in milliseconds.
+ *
+ * @return Milliseconds since an arbitrary epoch.
+ */
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Write the script redirecting `rollout_target` to a
+ * version, replacing any earlier script atomically.
+ *
+ * @param rollout The rollout in progress.
+ * @param version The version to redirect to.
+ * @return `true` on success.
+ */
+static bool write_script(struct rollout* rollout, int version)
+{
+    char temporary[PATH_MAX + 4];
+    FILE* script = NULL;
+    snprintf(temporary, sizeof temporary, "%s.new", rollout->script_path);
+    script = fopen(temporary, "w");
+    if (script == NULL)
+    {
+        return false;
+    }
+    fprintf(script, "fn_replace_internal rollout_target rollout_version_%d\n", version);
+    if (fclose(script) != 0)
+    {
+        return false;
+    }
+    return rename(temporary, rollout->script_path) == 0;
+}
+
+/**
+ * Read reports from the target until a process reports a
+ * version.
+ *
+ * @param rollout The rollout in progress.
+ * @param role Index of the process in `roles`, or -1 to
+ *      wait for every process to report `version`.
+ * @param version The version to wait for.
+ * @return `true` if the version was reported in time.
+ */
+static bool await_version(struct rollout* rollout, int role, int version)
+{
+    struct pollfd reports = {fileno(rollout->reports), POLLIN, 0};
+    char line[LINE_LEN];
+    char name[LINE_LEN];
+    int64_t deadline = now_ms() + WAIT_TIMEOUT_MS;
+    int pid = 0;
+    int reported = 0;
+    int i = 0;
+    for (;;)
+    {
+        bool done = true;
+        for (i = 0; i < ROLES; i++)
+        {
+            if ((role == -1 || role == i) && rollout->versions[i] != version)
+            {
+                done = false;
+            }
+        }
+        if (done)
+        {
+            return true;
+        }
+        if (now_ms() >= deadline || poll(&reports, 1, (int) (deadline - now_ms())) <= 0)
+        {
+            return false;
+        }
+        if (fgets(line, sizeof line, rollout->reports) == NULL)
+        {
+            return false;
+        }
+        if (sscanf(line, "%127s %d %d", name, &pid, &reported) != 3)
+        {
+            continue;
+        }
+        for (i = 0; i < ROLES; i++)
+        {
+            if (strcmp(name, roles[i]) == 0)
+            {
+                rollout->pids[i] = (pid_t) pid;
+                rollout->versions[i] = reported;
+            }
+        }
+    }
+}
+
+/**
+ * Signal a process to patch itself, and wait for it to
+ * report a version.
+ *
+ * @param rollout The rollout in progress.
+ * @param role Index of the process in `roles`.
+ * @param version The version it should report.
+ * @return `true` if the process reported `version`.
+ */
+static bool patch_process(struct rollout* rollout, int role, int version)
+{
+    bool reported = false;
+    kill(rollout->pids[role], SIGUSR2);
+    reported = await_version(rollout, role, version);
+    printf(
+        "{\"process\":\"%s\",\"expected\":%d,\"reported\":%d,\"ok\":%s}\n",
+        roles[role],
+        version,
+        rollout->versions[role],
+        reported ? "true" : "false"
+    );
+    return reported;
+}
+
+int main(void)
+{
+    struct rollout rollout;
+    posix_spawn_file_actions_t actions;
+    char directory[] = "/tmp/dpatch-rollout-XXXXXX";
+    char blob_path[PATH_MAX];
+    char script_env[PATH_MAX + 16];
+    char blob_env[PATH_MAX + 16];
+    char audit_env[] = "LD_AUDIT=" DPATCH_LIBRARY_PATH;
+    char* target_argv[] = {ROLLOUT_TARGET_PATH, NULL};
+    char* target_env[] = {audit_env, script_env, blob_env, NULL};
+    int pipe_fds[2] = {-1, -1};
+    pid_t target = 0;
+    bool ok = false;
+    memset(&rollout, 0, sizeof rollout);
+    if (mkdtemp(directory) == NULL || pipe(pipe_fds) == -1)
+    {
+        perror("blob_rollout");
+        return EXIT_FAILURE;
+    }
+    snprintf(rollout.script_path, sizeof rollout.script_path, "%s/rollout.dpatch", directory);
+    snprintf(blob_path, sizeof blob_path, "%s/rollout.blob", directory);
+    snprintf(script_env, sizeof script_env, "DPATCH_SCRIPT=%s", rollout.script_path);
+    snprintf(blob_env, sizeof blob_env, "DPATCH_BLOB=%s", blob_path);
+    rollout.versions[0] = -1;
+    rollout.versions[1] = -1;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+    if (
+        write_script(&rollout, 1)
+        && posix_spawn(&target, target_argv[0], &actions, NULL, target_argv, target_env) == 0
+    )
+    {
+        close(pipe_fds[1]);
+        rollout.reports = fdopen(pipe_fds[0], "r");
+        if (rollout.reports != NULL)
+        {
+            /* Unbuffered, so `poll` sees every report not yet read. */
+            setvbuf(rollout.reports, NULL, _IONBF, 0);
+        }
+        ok = rollout.reports != NULL
+            && await_version(&rollout, -1, 0)
+            /* The first rollout: the master publishes, the worker follows. */
+            && patch_process(&rollout, 0, 1)
+            && patch_process(&rollout, 1, 1)
+            /* The second: the worker goes first, while the blob holds version 1. */
+            && write_script(&rollout, 2)
+            && patch_process(&rollout, 1, 2)
+            && patch_process(&rollout, 0, 2);
+        kill(target, SIGKILL);
+        waitpid(target, NULL, 0);
+    }
+    else
+    {
+        perror("blob_rollout: starting " ROLLOUT_TARGET_PATH);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (rollout.reports != NULL)
+    {
+        fclose(rollout.reports);
+    }
+    unlink(rollout.script_path);
+    unlink(blob_path);
+    rmdir(directory);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,494 @@
+/**
+ * @file bench/call_overhead.c
+ *
+ * Measures the steady-state cost of calling a function
+ * through each of dpatch's redirection strategies.
+ *
+ * A small function is called in a tight, serially
+ * dependent loop, through each strategy, with its entry
+ * point at several alignments and the replacement at
+ * several distances from the original. Each configuration
+ * reports nanoseconds per call, and branch and iTLB misses
+ * per call counted with `perf_event_open`. Counters the
+ * host does not provide are reported as `null`.
+ * Configurations a strategy can't reach are skipped.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "code_generator.h"
+#include "dispatch_table.h"
+#include "hot_text.h"
+#include "machine_code.h"
+#include "status.h"
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CALLS 10000000
+#define REPETITIONS 5
+#define COUNTER_COUNT 2
+#define SITE_REGION_LEN 4096
+#define PADDING_LEN 14
+
+/** `lea eax, [rdi + 1]; ret`: the function being patched. */
+static const uint8_t FUNCTION_BODY[] = {0x8d, 0x47, 0x01, 0xc3};
+
+/** Signature of the function being patched. */
+typedef int (*bench_function)(int);
+
+/**
+ * Places a redirection from an entry point to a
+ * replacement function, and returns the address callers
+ * should call.
+ *
+ * @param site The function's entry point.
+ * @param replacement The replacement function.
+ * @param entry Location to store the address to call.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+typedef dpatch_status (*strategy_install)(intptr_t site, intptr_t replacement, intptr_t* entry);
+
+/**
+ * A way of reaching a function.
+ */
+struct strategy
+{
+    /** Name of the strategy, for reporting. */
+    const char* name;
+
+    /** Sets the strategy up for one configuration. */
+    strategy_install install;
+};
+
+/**
+ * A distance between a function and its replacement.
+ */
+struct distance
+{
+    /** Name of the distance, for reporting. */
+    const char* name;
+
+    /** Requested distance in bytes, or 0 for anywhere. */
+    uint64_t bytes;
+};
+
+/**
+ * A group of hardware counters.
+ */
+struct counters
+{
+    /** File descriptors of the counters, or -1. */
+    int fds[COUNTER_COUNT];
+
+    /** Values counted by the last measurement. */
+    uint64_t values[COUNTER_COUNT];
+};
+
+/** Names of the counters, as reported. */
+static const char* counter_names[COUNTER_COUNT] = {
+    "branch_misses_per_call",
+    "itlb_misses_per_call",
+};
+
+/**
+ * Call the unpatched function.
+ */
+static dpatch_status install_original(intptr_t site, intptr_t replacement, intptr_t* entry)
+{
+    (void) replacement;
+    *entry = site;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Call the patched function, which detours through the
+ * long jump `dpatch` writes over its entry.
+ */
+static dpatch_status install_long_jump(intptr_t site, intptr_t replacement, intptr_t* entry)
+{
+    machine_code_t* machine_code = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    status = append_long_jump(machine_code, replacement);
+    if (!IS_ERROR(status))
+    {
+        status = machine_code_insert(machine_code, site);
+    }
+    machine_code_free(machine_code);
+    *entry = site;
+    return status;
+}
+
+/**
+ * Call the patched function, which detours through the
+ * 5-byte near jump `dpatch` writes over its entry when the
+ * replacement is within reach.
+ */
+static dpatch_status install_near_jump(intptr_t site, intptr_t replacement, intptr_t* entry)
+{
+    machine_code_t* machine_code = NULL;
+    intptr_t displacement = replacement - (site + 5);
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (displacement < INT32_MIN || displacement > INT32_MAX)
+    {
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    status = append_near_jump(machine_code, (int32_t) displacement);
+    if (!IS_ERROR(status))
+    {
+        status = machine_code_insert(machine_code, site);
+    }
+    machine_code_free(machine_code);
+    *entry = site;
+    return status;
+}
+
+/**
+ * Call the patched function, which detours through a near
+ * jump to a copy of the replacement in hot text.
+ */
+static dpatch_status install_hot_text(intptr_t site, intptr_t replacement, intptr_t* entry)
+{
+    intptr_t copy = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(hot_text_copy(site, replacement, sizeof FUNCTION_BODY, "call_overhead", 0, &copy), status);
+    return install_near_jump(site, copy, entry);
+}
+
+/**
+ * Call the patched function, which detours through the
+ * short jump `dpatch` enables at a patchable entry, and the
+ * indirect jump it stages in the padding before it.
+ */
+static dpatch_status install_padded(intptr_t site, intptr_t replacement, intptr_t* entry)
+{
+    machine_code_t* staged = NULL;
+    machine_code_t* enable = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_new(&staged), status);
+    status = machine_code_new(&enable);
+    if (IS_ERROR(status))
+    {
+        machine_code_free(staged);
+        return status;
+    }
+    /* The layout `-fpatchable-function-entry=16,14` reserves: pointer, jump, then the entry. */
+    status = append_address(staged, replacement);
+    if (!IS_ERROR(status))
+    {
+        status = append_indirect_jump(staged, -PADDING_LEN);
+    }
+    if (!IS_ERROR(status))
+    {
+        /* Back over itself and the 6-byte indirect jump. */
+        status = append_short_jump(enable, -8);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = machine_code_insert(staged, site - PADDING_LEN);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = machine_code_insert_atomic(enable, site);
+    }
+    machine_code_free(staged);
+    machine_code_free(enable);
+    *entry = site;
+    return status;
+}
+
+/**
+ * Call the patched function, which detours through the
+ * long jump to its thunk, then through its slot in the
+ * dispatch table.
+ */
+static dpatch_status install_dispatch_table(intptr_t site, intptr_t replacement, intptr_t* entry)
+{
+    intptr_t* previous = NULL;
+    intptr_t thunk = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(dispatch_table_thunk(0, &thunk), status);
+    PROPAGATE_ERROR(dispatch_table_publish(&replacement, 1, &previous), status);
+    return install_long_jump(site, thunk, entry);
+}
+
+/** Strategies compared. */
+static const struct strategy strategies[] = {
+    {"original", &install_original},
+    {"long_jump", &install_long_jump},
+    {"near_jump", &install_near_jump},
+    {"hot_text", &install_hot_text},
+    {"padded", &install_padded},
+    {"dispatch_table", &install_dispatch_table},
+};
+
+/** Distances from the original to the replacement. */
+static const struct distance distances[] = {
+    {"4KiB", 4096ull},
+    {"1MiB", 1ull << 20},
+    {"1GiB", 1ull << 30},
+    {"64GiB", 1ull << 36},
+};
+
+/** Offsets of the patched entry point from a cache line. */
+static const size_t alignments[] = {0, 16, 52, 60};
+
+/**
+ * Open a counter for the calling thread's user space.
+ *
+ * @param type `perf_event_attr.type` of the counter.
+ * @param config `perf_event_attr.config` of the counter.
+ * @return A file descriptor, or -1 if it is unavailable.
+ */
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof attributes);
+    attributes.size = sizeof attributes;
+    attributes.type = type;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+/**
+ * Open every counter the host supports.
+ *
+ * @param counters The counters to open.
+ */
+static void counters_open(struct counters* counters)
+{
+    counters->fds[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    counters->fds[1] = open_counter(
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_ITLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    );
+}
+
+/**
+ * Reset and enable, or disable and read, every open counter.
+ *
+ * @param counters The counters to control.
+ * @param enable Whether to start or stop counting.
+ */
+static void counters_switch(struct counters* counters, bool enable)
+{
+    size_t i = 0;
+    for (i = 0; i < COUNTER_COUNT; i++)
+    {
+        if (counters->fds[i] == -1)
+        {
+            continue;
+        }
+        if (enable)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+        else
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters->fds[i], &counters->values[i], sizeof counters->values[i]) != sizeof counters->values[i])
+            {
+                counters->values[i] = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Call a function `CALLS` times, each call depending on
+ * the result of the last.
+ *
+ * @param function The function to call.
+ * @return The result of the final call.
+ */
+static int __attribute__((noinline)) call_loop(bench_function function)
+{
+    int value = 0;
+    long i = 0;
+    for (i = 0; i < CALLS; i++)
+    {
+        value = function(value);
+    }
+    return value;
+}
+
+/**
+ * Map a region of executable memory, near `hint` if
+ * possible.
+ *
+ * @param hint Preferred address, or 0 for anywhere.
+ * @return The region, or `NULL` on failure.
+ */
+static uint8_t* map_code(uintptr_t hint)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (hint != 0 ? MAP_FIXED_NOREPLACE : 0);
+    void* region = mmap((void*) hint, SITE_REGION_LEN, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (region == MAP_FAILED && hint != 0)
+    {
+        region = mmap(NULL, SITE_REGION_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (region == MAP_FAILED)
+    {
+        return NULL;
+    }
+    memset(region, 0xcc, SITE_REGION_LEN);
+    return region;
+}
+
+/**
+ * Measure one strategy, distance and alignment.
+ *
+ * @param strategy The strategy to measure.
+ * @param distance Requested distance to the replacement.
+ * @param alignment Offset of the entry from a cache line.
+ * @param counters Open hardware counters.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status bench_configuration
+(
+    const struct strategy* strategy,
+    const struct distance* distance,
+    size_t alignment,
+    struct counters* counters
+)
+{
+    uint8_t* site_region = map_code(0);
+    uint8_t* replacement_region = NULL;
+    intptr_t site = 0;
+    intptr_t replacement = 0;
+    intptr_t entry = 0;
+    bench_function function = NULL;
+    uint64_t best_ns = UINT64_MAX;
+    uint64_t best_values[COUNTER_COUNT] = {0};
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    if (site_region == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    replacement_region = map_code((uintptr_t) site_region + distance->bytes);
+    if (replacement_region == NULL)
+    {
+        munmap(site_region, SITE_REGION_LEN);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    /* Place the entry in the middle of the page, at the requested cache line offset. */
+    site = (intptr_t) site_region + SITE_REGION_LEN / 2 + alignment;
+    replacement = (intptr_t) replacement_region + SITE_REGION_LEN / 2;
+    memcpy((void*) site, FUNCTION_BODY, sizeof FUNCTION_BODY);
+    memcpy((void*) replacement, FUNCTION_BODY, sizeof FUNCTION_BODY);
+    mprotect(site_region, SITE_REGION_LEN, PROT_READ | PROT_EXEC);
+    mprotect(replacement_region, SITE_REGION_LEN, PROT_READ | PROT_EXEC);
+    status = strategy->install(site, replacement, &entry);
+    if (!IS_ERROR(status))
+    {
+        /* Converting an object pointer to a function pointer isn't ISO C. */
+        memcpy(&function, &entry, sizeof function);
+        call_loop(function);
+        for (i = 0; i < REPETITIONS; i++)
+        {
+            counters_switch(counters, true);
+            start = now_ns();
+            call_loop(function);
+            elapsed = now_ns() - start;
+            counters_switch(counters, false);
+            if (elapsed < best_ns)
+            {
+                best_ns = elapsed;
+                memcpy(best_values, counters->values, sizeof best_values);
+            }
+        }
+        printf(
+            "{\"bench\":\"call_overhead\",\"strategy\":\"%s\",\"distance\":\"%s\","
+            "\"distance_bytes\":%lld,\"alignment\":%zu,\"calls\":%d,\"ns_per_call\":%.3f",
+            strategy->name,
+            distance->name,
+            (long long) (replacement - site),
+            alignment,
+            CALLS,
+            (double) best_ns / CALLS
+        );
+        for (i = 0; i < COUNTER_COUNT; i++)
+        {
+            if (counters->fds[i] == -1)
+            {
+                printf(",\"%s\":null", counter_names[i]);
+            }
+            else
+            {
+                printf(",\"%s\":%.6f", counter_names[i], (double) best_values[i] / CALLS);
+            }
+        }
+        printf("}\n");
+    }
+    munmap(site_region, SITE_REGION_LEN);
+    munmap(replacement_region, SITE_REGION_LEN);
+    return status;
+}
+
+int main(void)
+{
+    struct counters counters;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t s = 0;
+    size_t d = 0;
+    size_t a = 0;
+    counters_open(&counters);
+    for (s = 0; s < sizeof strategies / sizeof strategies[0]; s++)
+    {
+        for (d = 0; d < sizeof distances / sizeof distances[0]; d++)
+        {
+            for (a = 0; a < sizeof alignments / sizeof alignments[0]; a++)
+            {
+                status = bench_configuration(&strategies[s], &distances[d], alignments[a], &counters);
+                if (status == DPATCH_STATUS_EUNKNOWN)
+                {
+                    continue;
+                }
+                if (IS_ERROR(status))
+                {
+                    fprintf(
+                        stderr, "%s, %s, %zu: %s\n",
+                        strategies[s].name, distances[d].name, alignments[a], dpatch_str_status(status)
+                    );
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,481 @@
+/**
+ * @file bench/patch_stress.c
+ *
+ * Patches a function while many threads call it, to check
+ * patching under load neither crashes the process, nor
+ * lets a caller run a version of the function which was
+ * never installed, nor stalls callers.
+ *
+ * Worker threads call `stress_target` in a tight loop,
+ * timing every call into a latency histogram. Meanwhile
+ * the main thread repeatedly redirects `stress_target`
+ * through `dpatch.h`: to one version, to the same version
+ * again, and alternating between versions. Each call's
+ * result is checked against the versions which could have
+ * been installed while it ran. Calls made during an apply,
+ * or shortly after one, are timed separately from calls
+ * made while no patch was being applied.
+ *
+ * The stress runs in a child process, so a crash is
+ * reported rather than ending the benchmark. Usage:
+ *
+ *     patch_stress [threads] [duration_ms] [interval_us]
+ *
+ * The result is printed as a JSON object. The exit status
+ * is non-zero if the child crashed, an apply failed, or a
+ * call returned the wrong version.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <dpatch.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION_MS 2000
+#define DEFAULT_INTERVAL_US 200
+#define MAX_THREADS 256
+#define DISTURBANCE_WINDOW_NS 100000ull
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64u * HISTOGRAM_SUB_BUCKETS)
+#define ORIGINAL_VERSION 0
+
+/** Signature of the function being patched. */
+typedef int (*stress_function)(void);
+
+/**
+ * A latency histogram with logarithmic buckets, each
+ * split into `HISTOGRAM_SUB_BUCKETS` linear buckets.
+ */
+struct histogram
+{
+    /** The number of samples in each bucket. */
+    uint64_t counts[HISTOGRAM_BUCKETS];
+
+    /** The number of samples. */
+    uint64_t total;
+
+    /** The largest sample. */
+    uint64_t max;
+};
+
+/**
+ * A worker thread's results.
+ */
+struct worker
+{
+    /** Latency of calls made while no patch was applied. */
+    struct histogram quiet;
+
+    /** Latency of calls made during or just after an apply. */
+    struct histogram disturbed;
+
+    /** The number of calls which returned a version that
+     * could not have been installed. */
+    uint64_t wrong_version;
+};
+
+/**
+ * An apply in the schedule the patcher cycles through.
+ */
+struct step
+{
+    /** Function `stress_target` is redirected to. */
+    const char* replacement;
+
+    /** The value `replacement` returns. */
+    int version;
+};
+
+/**
+ * Cycle of applies: redirect, re-apply the same redirect,
+ * then alternate between versions.
+ */
+static const struct step schedule[] = {
+    {"stress_version_a", 1},
+    {"stress_version_a", 1},
+    {"stress_version_b", 2},
+    {"stress_version_c", 3},
+    {"stress_version_b", 2},
+};
+
+/** The number of applies which have started. */
+static uint64_t applies_started = 0;
+
+/** The number of applies which have finished. */
+static uint64_t applies_finished = 0;
+
+/** Calls ending before this time may have been disturbed by an apply. */
+static uint64_t disturbed_until_ns = 0;
+
+/** Set when the workers should stop. */
+static bool stopping = false;
+
+/** Called through a pointer the compiler can't see through. */
+static stress_function volatile target_pointer = NULL;
+
+int __attribute__((noinline)) stress_target(void)
+{
+    return ORIGINAL_VERSION;
+}
+
+int __attribute__((noinline)) stress_version_a(void)
+{
+    return 1;
+}
+
+int __attribute__((noinline)) stress_version_b(void)
+{
+    return 2;
+}
+
+int __attribute__((noinline)) stress_version_c(void)
+{
+    return 3;
+}
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Record a sample in a histogram.
+ *
+ * @param histogram The histogram to record in.
+ * @param value The sample.
+ */
+static void histogram_add(struct histogram* histogram, uint64_t value)
+{
+    unsigned int msb = 0;
+    size_t bucket = value;
+    if (value >= HISTOGRAM_SUB_BUCKETS)
+    {
+        msb = 63u - (unsigned int) __builtin_clzll(value);
+        bucket = (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+            + ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    }
+    histogram->counts[bucket]++;
+    histogram->total++;
+    histogram->max = value > histogram->max ? value : histogram->max;
+}
+
+/**
+ * Get the smallest value in a histogram's bucket.
+ *
+ * @param bucket Index of the bucket.
+ * @return The smallest value recorded in `bucket`.
+ */
+static uint64_t histogram_bucket_value(size_t bucket)
+{
+    size_t shift = 0;
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+/**
+ * Get a percentile of the samples in a histogram.
+ *
+ * @param histogram The histogram.
+ * @param percentile The percentile, from 0 to 100.
+ * @return The smallest value in the bucket holding the
+ * percentile, or 0 if the histogram is empty.
+ */
+static uint64_t histogram_percentile(const struct histogram* histogram, double percentile)
+{
+    uint64_t rank = (uint64_t) (histogram->total * percentile / 100.0);
+    uint64_t seen = 0;
+    size_t i = 0;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen > rank)
+        {
+            return histogram_bucket_value(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add one histogram's samples to another.
+ *
+ * @param into The histogram to add to.
+ * @param from The histogram to add.
+ */
+static void histogram_merge(struct histogram* into, const struct histogram* from)
+{
+    size_t i = 0;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+/**
+ * Get the version `stress_target` runs after an apply.
+ *
+ * @param apply The number of applies which have finished.
+ * @return The version installed by the `apply`th apply.
+ */
+static int version_after(uint64_t apply)
+{
+    if (apply == 0)
+    {
+        return ORIGINAL_VERSION;
+    }
+    return schedule[(apply - 1) % (sizeof schedule / sizeof schedule[0])].version;
+}
+
+/**
+ * Test if a call could have run a version.
+ *
+ * @param version The version the call returned.
+ * @param finished Applies finished before the call.
+ * @param started Applies started after the call.
+ * @return `true` if one of the applies in progress during
+ * the call installed `version`.
+ */
+static bool version_possible(int version, uint64_t finished, uint64_t started)
+{
+    uint64_t apply = 0;
+    if (started - finished > sizeof schedule / sizeof schedule[0])
+    {
+        return true;
+    }
+    for (apply = finished; apply <= started; apply++)
+    {
+        if (version_after(apply) == version)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Call `stress_target` until stopped, recording each
+ * call's latency and checking its result.
+ *
+ * @param args The thread's `struct worker`.
+ * @return Nothing.
+ */
+static void* worker_thread(void* args)
+{
+    struct worker* worker = args;
+    uint64_t finished = 0;
+    uint64_t started = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    int version = 0;
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+    {
+        finished = __atomic_load_n(&applies_finished, __ATOMIC_ACQUIRE);
+        start = now_ns();
+        version = target_pointer();
+        end = now_ns();
+        started = __atomic_load_n(&applies_started, __ATOMIC_ACQUIRE);
+        if (!version_possible(version, finished, started))
+        {
+            worker->wrong_version++;
+        }
+        if (started != finished || end < __atomic_load_n(&disturbed_until_ns, __ATOMIC_RELAXED))
+        {
+            histogram_add(&worker->disturbed, end - start);
+        }
+        else
+        {
+            histogram_add(&worker->quiet, end - start);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Redirect `stress_target` to the next step of the
+ * schedule.
+ *
+ * @param step The step to apply.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status apply_step(const struct step* step)
+{
+    dpatch_patch_t* patch = NULL;
+    struct dpatch_entry entry = {"fn_replace_internal", "stress_target", NULL, NULL};
+    dpatch_status status = DPATCH_STATUS_OK;
+    entry.new_symbol = step->replacement;
+    status = dpatch_patch_new(&patch);
+    if (status == DPATCH_STATUS_OK)
+    {
+        status = dpatch_patch_add(patch, &entry);
+    }
+    if (status == DPATCH_STATUS_OK)
+    {
+        status = dpatch_patch_apply(patch, 0);
+    }
+    if (patch != NULL)
+    {
+        dpatch_patch_free(patch);
+    }
+    return status;
+}
+
+/**
+ * Run the stress and print its results.
+ *
+ * @param thread_count The number of worker threads.
+ * @param duration_ms How long to patch for.
+ * @param interval_us Pause between applies.
+ * @return `EXIT_SUCCESS` if every apply succeeded and no
+ * call returned the wrong version.
+ */
+static int stress(size_t thread_count, uint64_t duration_ms, uint64_t interval_us)
+{
+    static struct worker workers[MAX_THREADS];
+    static struct histogram quiet;
+    static struct histogram disturbed;
+    static struct histogram apply_latency;
+    pthread_t threads[MAX_THREADS];
+    struct timespec interval;
+    uint64_t wrong_version = 0;
+    uint64_t failed = 0;
+    uint64_t deadline = 0;
+    uint64_t start = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    interval.tv_sec = (time_t) (interval_us / 1000000);
+    interval.tv_nsec = (long) (interval_us % 1000000 * 1000);
+    target_pointer = &stress_target;
+    for (i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, &worker_thread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "patch_stress: Failed to start worker %zu.\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    deadline = now_ns() + duration_ms * 1000000ull;
+    while (now_ns() < deadline)
+    {
+        __atomic_store_n(&applies_started, applies_started + 1, __ATOMIC_RELEASE);
+        start = now_ns();
+        status = apply_step(&schedule[(applies_started - 1) % (sizeof schedule / sizeof schedule[0])]);
+        histogram_add(&apply_latency, now_ns() - start);
+        __atomic_store_n(&disturbed_until_ns, now_ns() + DISTURBANCE_WINDOW_NS, __ATOMIC_RELAXED);
+        if (status != DPATCH_STATUS_OK)
+        {
+            /* The redirect may be half applied, so stop checking versions. */
+            fprintf(stderr, "patch_stress: Apply %llu failed: %s\n",
+                (unsigned long long) applies_started, dpatch_str_status(status));
+            failed++;
+            break;
+        }
+        __atomic_store_n(&applies_finished, applies_started, __ATOMIC_RELEASE);
+        nanosleep(&interval, NULL);
+    }
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    for (i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        histogram_merge(&quiet, &workers[i].quiet);
+        histogram_merge(&disturbed, &workers[i].disturbed);
+        wrong_version += workers[i].wrong_version;
+    }
+    printf(
+        "{\"bench\":\"patch_stress\",\"threads\":%zu,\"duration_ms\":%llu,\"interval_us\":%llu,"
+        "\"crashed\":false,\"applies\":%llu,\"failed_applies\":%llu,\"calls\":%llu,"
+        "\"wrong_version\":%llu,\"events_dropped\":%llu,"
+        "\"apply_us_p50\":%.1f,\"apply_us_p99\":%.1f,\"apply_us_max\":%.1f,"
+        "\"quiet_calls\":%llu,\"quiet_ns_p50\":%llu,\"quiet_ns_p99\":%llu,\"quiet_ns_max\":%llu,"
+        "\"disturbed_calls\":%llu,\"disturbed_ns_p50\":%llu,\"disturbed_ns_p99\":%llu,"
+        "\"disturbed_ns_max\":%llu}\n",
+        thread_count,
+        (unsigned long long) duration_ms,
+        (unsigned long long) interval_us,
+        (unsigned long long) applies_started,
+        (unsigned long long) failed,
+        (unsigned long long) (quiet.total + disturbed.total),
+        (unsigned long long) wrong_version,
+        (unsigned long long) dpatch_events_dropped(),
+        (double) histogram_percentile(&apply_latency, 50) / 1e3,
+        (double) histogram_percentile(&apply_latency, 99) / 1e3,
+        (double) apply_latency.max / 1e3,
+        (unsigned long long) quiet.total,
+        (unsigned long long) histogram_percentile(&quiet, 50),
+        (unsigned long long) histogram_percentile(&quiet, 99),
+        (unsigned long long) quiet.max,
+        (unsigned long long) disturbed.total,
+        (unsigned long long) histogram_percentile(&disturbed, 50),
+        (unsigned long long) histogram_percentile(&disturbed, 99),
+        (unsigned long long) disturbed.max
+    );
+    fflush(stdout);
+    return failed == 0 && wrong_version == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+    size_t thread_count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_THREADS;
+    uint64_t duration_ms = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_DURATION_MS;
+    uint64_t interval_us = argc > 3 ? strtoull(argv[3], NULL, 10) : DEFAULT_INTERVAL_US;
+    pid_t child = 0;
+    int status = 0;
+    if (thread_count == 0 || thread_count > MAX_THREADS)
+    {
+        fprintf(stderr, "patch_stress: threads must be from 1 to %d.\n", MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+    child = fork();
+    if (child == -1)
+    {
+        perror("patch_stress: fork");
+        return EXIT_FAILURE;
+    }
+    if (child == 0)
+    {
+        exit(stress(thread_count, duration_ms, interval_us));
+    }
+    if (waitpid(child, &status, 0) != child)
+    {
+        perror("patch_stress: waitpid");
+        return EXIT_FAILURE;
+    }
+    if (WIFSIGNALED(status))
+    {
+        printf(
+            "{\"bench\":\"patch_stress\",\"threads\":%zu,\"duration_ms\":%llu,\"interval_us\":%llu,"
+            "\"crashed\":true,\"signal\":\"%s\"}\n",
+            thread_count,
+            (unsigned long long) duration_ms,
+            (unsigned long long) interval_us,
+            strsignal(WTERMSIG(status))
+        );
+        return EXIT_FAILURE;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file bench/rollout_target.c
+ *
+ * A pre-forked program for `blob_rollout` to patch: a
+ * master and one worker, which each print the version
+ * `rollout_target` returns whenever it changes, as
+ *
+ *     <master|worker> <pid> <version>
+ *
+ * The worker exits when the master does.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#define POLL_INTERVAL_US 1000
+
+/** Signature of the function being patched. */
+typedef int (*rollout_function)(void);
+
+int __attribute__((noinline)) rollout_target(void)
+{
+    return 0;
+}
+
+int __attribute__((noinline)) rollout_version_1(void)
+{
+    return 1;
+}
+
+int __attribute__((noinline)) rollout_version_2(void)
+{
+    return 2;
+}
+
+/** Called through a pointer the compiler can't see through. */
+static rollout_function volatile target_pointer = &rollout_target;
+
+int main(void)
+{
+    const char* role = "master";
+    int last = -1;
+    int version = 0;
+    pid_t worker = fork();
+    if (worker == -1)
+    {
+        perror("rollout_target: fork");
+        return EXIT_FAILURE;
+    }
+    if (worker == 0)
+    {
+        role = "worker";
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+    }
+    for (;;)
+    {
+        version = target_pointer();
+        if (version != last)
+        {
+            printf("%s %d %d\n", role, (int) getpid(), version);
+            fflush(stdout);
+            last = version;
+        }
+        usleep(POLL_INTERVAL_US);
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * @file bench/startup_target.c
+ *
+ * A program with many external functions, which exits
+ * immediately. `startup_time` starts it built with and
+ * without every function exported as a dynamic symbol.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <stdlib.h>
+
+/* Define 8^4 = 4096 distinct functions. */
+#define FUNCTION(n) int startup_function_##n(int x) { return x + 1; }
+#define FUNCTIONS_8(n) \
+    FUNCTION(n##0) FUNCTION(n##1) FUNCTION(n##2) FUNCTION(n##3) \
+    FUNCTION(n##4) FUNCTION(n##5) FUNCTION(n##6) FUNCTION(n##7)
+#define FUNCTIONS_64(n) \
+    FUNCTIONS_8(n##0) FUNCTIONS_8(n##1) FUNCTIONS_8(n##2) FUNCTIONS_8(n##3) \
+    FUNCTIONS_8(n##4) FUNCTIONS_8(n##5) FUNCTIONS_8(n##6) FUNCTIONS_8(n##7)
+#define FUNCTIONS_512(n) \
+    FUNCTIONS_64(n##0) FUNCTIONS_64(n##1) FUNCTIONS_64(n##2) FUNCTIONS_64(n##3) \
+    FUNCTIONS_64(n##4) FUNCTIONS_64(n##5) FUNCTIONS_64(n##6) FUNCTIONS_64(n##7)
+#define FUNCTIONS_4096(n) \
+    FUNCTIONS_512(n##0) FUNCTIONS_512(n##1) FUNCTIONS_512(n##2) FUNCTIONS_512(n##3) \
+    FUNCTIONS_512(n##4) FUNCTIONS_512(n##5) FUNCTIONS_512(n##6) FUNCTIONS_512(n##7)
+
+FUNCTIONS_4096(_)
+
+int main(void)
+{
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file bench/startup_time.c
+ *
+ * Measures how long a program with many functions takes to
+ * start and exit, when linked with and without every
+ * function exported as a dynamic symbol (`-rdynamic`).
+ *
+ * dpatch can find functions which aren't exported in a
+ * program's `.symtab`, so programs no longer need to pay
+ * for exporting them. Each variant reports the size of its
+ * `.dynsym` and `.gnu.hash`, and the best and mean time to
+ * start and exit.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <elf.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define RUNS 200
+
+extern char** environ;
+
+/**
+ * A build of the program being started.
+ */
+struct variant
+{
+    /** Name of the variant, for reporting. */
+    const char* name;
+
+    /** Path to the program. */
+    const char* path;
+};
+
+/** Variants compared. */
+static const struct variant variants[] = {
+    {"exported", STARTUP_EXPORTED_PATH},
+    {"not_exported", STARTUP_PLAIN_PATH},
+};
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Get the size of a section of an ELF file.
+ *
+ * @param path Path to the file.
+ * @param type `sh_type` of the section to find.
+ * @return The size of the first section of type `type`,
+ * or 0 if there is none.
+ */
+static uint64_t section_size(const char* path, uint32_t type)
+{
+    Elf64_Ehdr header;
+    Elf64_Shdr section;
+    uint64_t size = 0;
+    size_t i = 0;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    if (fread(&header, sizeof header, 1, file) == 1)
+    {
+        for (i = 0; i < header.e_shnum && size == 0; i++)
+        {
+            if (
+                fseek(file, (long) (header.e_shoff + i * sizeof section), SEEK_SET) != 0
+                || fread(&section, sizeof section, 1, file) != 1
+            )
+            {
+                break;
+            }
+            size = section.sh_type == type ? section.sh_size : 0;
+        }
+    }
+    fclose(file);
+    return size;
+}
+
+/**
+ * Start a program and wait for it to exit.
+ *
+ * @param path Path to the program.
+ * @return Nanoseconds from starting the program to
+ * reaping it, or 0 on failure.
+ */
+static uint64_t time_start(const char* path)
+{
+    char* argv[] = {(char*) path, NULL};
+    uint64_t start = now_ns();
+    pid_t pid = 0;
+    int status = 0;
+    if (posix_spawn(&pid, path, NULL, NULL, argv, environ) != 0)
+    {
+        return 0;
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return 0;
+    }
+    return now_ns() - start;
+}
+
+int main(void)
+{
+    uint64_t best_ns = 0;
+    uint64_t total_ns = 0;
+    uint64_t elapsed = 0;
+    size_t v = 0;
+    size_t i = 0;
+    for (v = 0; v < sizeof variants / sizeof variants[0]; v++)
+    {
+        best_ns = UINT64_MAX;
+        total_ns = 0;
+        /* Warm the page cache. */
+        time_start(variants[v].path);
+        for (i = 0; i < RUNS; i++)
+        {
+            elapsed = time_start(variants[v].path);
+            if (elapsed == 0)
+            {
+                fprintf(stderr, "Failed to run %s.\n", variants[v].path);
+                return EXIT_FAILURE;
+            }
+            best_ns = elapsed < best_ns ? elapsed : best_ns;
+            total_ns += elapsed;
+        }
+        printf(
+            "{\"bench\":\"startup_time\",\"variant\":\"%s\",\"dynsym_bytes\":%llu,"
+            "\"gnu_hash_bytes\":%llu,\"runs\":%d,\"best_us\":%.1f,\"mean_us\":%.1f}\n",
+            variants[v].name,
+            (unsigned long long) section_size(variants[v].path, SHT_DYNSYM),
+            (unsigned long long) section_size(variants[v].path, SHT_GNU_HASH),
+            RUNS,
+            (double) best_ns / 1e3,
+            (double) total_ns / RUNS / 1e3
+        );
+    }
+    return EXIT_SUCCESS;
+}
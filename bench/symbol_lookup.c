@@ -0,0 +1,180 @@
+/**
+ * @file bench/symbol_lookup.c
+ *
+ * Compares attributing instruction pointers to functions
+ * with `dladdr` and with dpatch's symbol index.
+ *
+ * Random addresses in the executable segments of every
+ * loaded object are looked up both ways. The benchmark
+ * reports the time to build the index, the cost per
+ * lookup, and how often the two agree on the containing
+ * function's entry point.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "status.h"
+#include "symbol_index.h"
+#include <dlfcn.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUPS 200000
+#define MAX_SEGMENTS 256
+
+/**
+ * An executable segment of a loaded object.
+ */
+struct segment
+{
+    /** Address of the first byte of the segment. */
+    uintptr_t start;
+
+    /** Size of the segment in bytes. */
+    size_t size;
+};
+
+/**
+ * Executable segments found by `collect_segment`.
+ */
+struct segments
+{
+    /** The segments. */
+    struct segment segments[MAX_SEGMENTS];
+
+    /** The number of `segments`. */
+    size_t length;
+
+    /** Total size of the segments in bytes. */
+    size_t size;
+};
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Record the executable segments of a loaded object.
+ *
+ * @param info The object's program headers.
+ * @param size Size of `info`.
+ * @param data The `struct segments` to add to.
+ * @return 0, to continue iterating.
+ */
+static int collect_segment(struct dl_phdr_info* info, size_t size, void* data)
+{
+    struct segments* segments = data;
+    int i = 0;
+    (void) size;
+    for (i = 0; i < info->dlpi_phnum && segments->length < MAX_SEGMENTS; i++)
+    {
+        const ElfW(Phdr)* header = &info->dlpi_phdr[i];
+        if (header->p_type != PT_LOAD || (header->p_flags & PF_X) == 0)
+        {
+            continue;
+        }
+        segments->segments[segments->length].start = info->dlpi_addr + header->p_vaddr;
+        segments->segments[segments->length].size = header->p_memsz;
+        segments->size += header->p_memsz;
+        segments->length++;
+    }
+    return 0;
+}
+
+/**
+ * Pick a random address in the executable segments.
+ *
+ * @param segments The segments to pick from.
+ * @return An address inside one of `segments`.
+ */
+static uintptr_t random_address(const struct segments* segments)
+{
+    size_t offset = ((size_t) rand() * ((size_t) RAND_MAX + 1) + (size_t) rand()) % segments->size;
+    size_t i = 0;
+    while (offset >= segments->segments[i].size)
+    {
+        offset -= segments->segments[i].size;
+        i++;
+    }
+    return segments->segments[i].start + offset;
+}
+
+int main(void)
+{
+    static struct segments segments;
+    static uintptr_t addresses[LOOKUPS];
+    static uintptr_t dladdr_starts[LOOKUPS];
+    struct symbol_info info;
+    Dl_info dl_info;
+    uint64_t start = 0;
+    uint64_t build_ns = 0;
+    uint64_t dladdr_ns = 0;
+    uint64_t index_ns = 0;
+    size_t dladdr_found = 0;
+    size_t index_found = 0;
+    size_t agreed = 0;
+    size_t i = 0;
+    srand(1);
+    dl_iterate_phdr(&collect_segment, &segments);
+    if (segments.size == 0)
+    {
+        fprintf(stderr, "No executable segments found.\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        addresses[i] = random_address(&segments);
+    }
+    start = now_ns();
+    symbol_index_lookup(addresses[0], &info);
+    build_ns = now_ns() - start;
+    start = now_ns();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        dladdr_starts[i] = 0;
+        if (dladdr((void*) addresses[i], &dl_info) != 0 && dl_info.dli_saddr != NULL)
+        {
+            dladdr_starts[i] = (uintptr_t) dl_info.dli_saddr;
+            dladdr_found++;
+        }
+    }
+    dladdr_ns = now_ns() - start;
+    start = now_ns();
+    for (i = 0; i < LOOKUPS; i++)
+    {
+        if (symbol_index_lookup(addresses[i], &info) == DPATCH_STATUS_OK)
+        {
+            index_found++;
+            agreed += info.start == dladdr_starts[i] ? 1 : 0;
+        }
+    }
+    index_ns = now_ns() - start;
+    printf(
+        "{\"bench\":\"symbol_lookup\",\"functions\":%zu,\"build_us\":%.1f,\"lookups\":%d,"
+        "\"dladdr_ns_per_lookup\":%.1f,\"index_ns_per_lookup\":%.1f,"
+        "\"dladdr_found\":%zu,\"index_found\":%zu,\"agreed\":%zu}\n",
+        symbol_index_length(),
+        (double) build_ns / 1e3,
+        LOOKUPS,
+        (double) dladdr_ns / LOOKUPS,
+        (double) index_ns / LOOKUPS,
+        dladdr_found,
+        index_found,
+        agreed
+    );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,292 @@
+/**
+ * @file bench/write_backend.c
+ *
+ * Compares the cost of `machine_code_insert`'s write
+ * backends, and the number of memory mappings each leaves
+ * behind after patching a text-like mapping many times.
+ *
+ * Each backend patches one site per page of a fresh,
+ * file-backed, read-only executable mapping, so every
+ * `mprotect` lands on a different page - as patches to
+ * functions scattered through a large binary would.
+ *
+ * Each backend then patches sites in an anonymous mapping
+ * backed by transparent huge pages, reporting the
+ * mapping's `AnonHugePages` before and after to show
+ * whether patching split the huge pages.
+ *
+ * Results are printed as one JSON object per line.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "code_generator.h"
+#include "machine_code.h"
+#include "memory_map.h"
+#include "status.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATCH_COUNT 1000
+#define HUGE_PAGE_COUNT 2
+#define HUGE_PATCH_COUNT 100
+#define X64_RET 0xc3
+
+/**
+ * Count the mappings (VMAs) in the current process.
+ *
+ * @return The number of lines in `/proc/self/maps`, or -1.
+ */
+static long count_vmas(void)
+{
+    long count = 0;
+    int c = 0;
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL)
+    {
+        return -1;
+    }
+    while ((c = fgetc(maps)) != EOF)
+    {
+        if (c == '\n')
+        {
+            count++;
+        }
+    }
+    fclose(maps);
+    return count;
+}
+
+/**
+ * Map a read-only, executable, file-backed region of
+ * `pages` pages filled with `ret` instructions.
+ *
+ * @param pages The number of pages to map.
+ * @param page_size The system page size.
+ * @return The mapping, or `NULL` on failure.
+ */
+static uint8_t* map_text(size_t pages, size_t page_size)
+{
+    size_t length = pages * page_size;
+    uint8_t* fill = NULL;
+    void* text = MAP_FAILED;
+    int fd = memfd_create("write_backend_text", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    fill = malloc(length);
+    if (fill == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    memset(fill, X64_RET, length);
+    if (write(fd, fill, length) == (ssize_t) length)
+    {
+        text = mmap(NULL, length, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    }
+    free(fill);
+    close(fd);
+    return text == MAP_FAILED ? NULL : text;
+}
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Benchmark a single write backend.
+ *
+ * @param name Name of the backend, for reporting.
+ * @param mode The backend to benchmark.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status bench_mode(const char* name, dpatch_write_mode mode)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    machine_code_t* machine_code = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint8_t* text = map_text(PATCH_COUNT, page_size);
+    long vmas_before = 0;
+    long vmas_after = 0;
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    size_t i = 0;
+    if (text == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    PROPAGATE_ERROR(append_long_jump(machine_code, (intptr_t) text), status);
+    machine_code_set_write_mode(mode);
+    vmas_before = count_vmas();
+    start = now_ns();
+    for (i = 0; i < PATCH_COUNT; i++)
+    {
+        /* Stagger sites so they don't share a page offset. */
+        intptr_t site = (intptr_t) (text + i * page_size + (i * 16) % (page_size - 16));
+        status = machine_code_insert(machine_code, site);
+        if (IS_ERROR(status))
+        {
+            break;
+        }
+    }
+    elapsed = now_ns() - start;
+    vmas_after = count_vmas();
+    machine_code_free(machine_code);
+    munmap(text, PATCH_COUNT * page_size);
+    if (IS_ERROR(status))
+    {
+        return status;
+    }
+    printf(
+        "{\"bench\":\"write_backend\",\"mode\":\"%s\",\"patches\":%d,"
+        "\"ns_per_patch\":%.1f,\"vmas_before\":%ld,\"vmas_after\":%ld}\n",
+        name,
+        PATCH_COUNT,
+        (double) elapsed / PATCH_COUNT,
+        vmas_before,
+        vmas_after
+    );
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Map a read-only, executable, anonymous region backed by
+ * transparent huge pages, filled with `ret` instructions.
+ *
+ * @param huge_page_size The size of a huge page.
+ * @return The huge page aligned mapping, or `NULL` on failure.
+ */
+static uint8_t* map_huge_text(size_t huge_page_size)
+{
+    uint8_t* text = NULL;
+    uint8_t* reservation = mmap(
+        NULL, (HUGE_PAGE_COUNT + 1) * huge_page_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    if (reservation == MAP_FAILED)
+    {
+        return NULL;
+    }
+    text = (uint8_t*) (((uintptr_t) reservation + huge_page_size - 1) & ~(huge_page_size - 1));
+    madvise(text, HUGE_PAGE_COUNT * huge_page_size, MADV_HUGEPAGE);
+    memset(text, X64_RET, HUGE_PAGE_COUNT * huge_page_size);
+    if (mprotect(text, HUGE_PAGE_COUNT * huge_page_size, PROT_READ | PROT_EXEC) == -1)
+    {
+        munmap(reservation, (HUGE_PAGE_COUNT + 1) * huge_page_size);
+        return NULL;
+    }
+    return text;
+}
+
+/**
+ * Benchmark a write backend against huge page backed text.
+ *
+ * @param name Name of the backend, for reporting.
+ * @param mode The backend to benchmark.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status bench_huge_mode(const char* name, dpatch_write_mode mode)
+{
+    size_t huge_page_size = memory_map_huge_page_size();
+    machine_code_t* machine_code = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    struct memory_region before;
+    struct memory_region after;
+    uint8_t* text = NULL;
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    size_t i = 0;
+    if (huge_page_size == 0)
+    {
+        /* Transparent huge pages are disabled; nothing to measure. */
+        return DPATCH_STATUS_OK;
+    }
+    text = map_huge_text(huge_page_size);
+    if (text == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    PROPAGATE_ERROR(append_long_jump(machine_code, (intptr_t) text), status);
+    machine_code_set_write_mode(mode);
+    PROPAGATE_ERROR(memory_map_find((uintptr_t) text, &before), status);
+    start = now_ns();
+    for (i = 0; i < HUGE_PATCH_COUNT; i++)
+    {
+        intptr_t site = (intptr_t) (text + (i * HUGE_PAGE_COUNT * huge_page_size) / HUGE_PATCH_COUNT);
+        status = machine_code_insert(machine_code, site);
+        if (IS_ERROR(status))
+        {
+            break;
+        }
+    }
+    elapsed = now_ns() - start;
+    if (!IS_ERROR(status))
+    {
+        status = memory_map_find((uintptr_t) text, &after);
+    }
+    machine_code_free(machine_code);
+    munmap(text, HUGE_PAGE_COUNT * huge_page_size);
+    if (IS_ERROR(status))
+    {
+        return status;
+    }
+    printf(
+        "{\"bench\":\"write_backend_huge\",\"mode\":\"%s\",\"patches\":%d,"
+        "\"ns_per_patch\":%.1f,\"anon_huge_kb_before\":%zu,\"anon_huge_kb_after\":%zu}\n",
+        name,
+        HUGE_PATCH_COUNT,
+        (double) elapsed / HUGE_PATCH_COUNT,
+        before.anon_huge_kb,
+        after.anon_huge_kb
+    );
+    return DPATCH_STATUS_OK;
+}
+
+int main(void)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    status = bench_mode("mprotect", DPATCH_WRITE_MPROTECT);
+    if (IS_ERROR(status))
+    {
+        fprintf(stderr, "mprotect: %s\n", dpatch_str_status(status));
+        return EXIT_FAILURE;
+    }
+    status = bench_mode("proc_mem", DPATCH_WRITE_PROC_MEM);
+    if (IS_ERROR(status))
+    {
+        fprintf(stderr, "proc_mem: %s\n", dpatch_str_status(status));
+        return EXIT_FAILURE;
+    }
+    status = bench_huge_mode("mprotect", DPATCH_WRITE_MPROTECT);
+    if (IS_ERROR(status))
+    {
+        fprintf(stderr, "mprotect (huge pages): %s\n", dpatch_str_status(status));
+        return EXIT_FAILURE;
+    }
+    status = bench_huge_mode("proc_mem", DPATCH_WRITE_PROC_MEM);
+    if (IS_ERROR(status))
+    {
+        fprintf(stderr, "proc_mem (huge pages): %s\n", dpatch_str_status(status));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#include <dpatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void alpha(void)
+{
+    printf("I am alpha.\n");
+}
+
+void bravo(void)
+{
+    printf("I am bravo.\n");
+}
+
+int main(void)
+{
+    dpatch_patch_t* patch = NULL;
+    struct dpatch_entry entry = {"fn_replace_internal", "alpha", "bravo", NULL};
+    struct dpatch_result result;
+    dpatch_status status = DPATCH_STATUS_OK;
+    alpha();
+    status = dpatch_patch_new(&patch);
+    if (status == DPATCH_STATUS_OK)
+    {
+        status = dpatch_patch_add(patch, &entry);
+    }
+    if (status == DPATCH_STATUS_OK)
+    {
+        status = dpatch_patch_apply(patch, 0);
+        dpatch_patch_result(patch, &result);
+        printf(
+            "Patch %llu: %s. %zu redirects, %zu writes, prepared in %.1f us, committed in %.1f us.\n",
+            (unsigned long long) result.patch_id,
+            dpatch_str_status(result.status),
+            result.redirects,
+            result.writes,
+            result.prepare_us,
+            result.commit_us
+        );
+    }
+    if (patch != NULL)
+    {
+        dpatch_patch_free(patch);
+    }
+    if (status != DPATCH_STATUS_OK)
+    {
+        fprintf(stderr, "api_patch: %s\n", dpatch_str_status(status));
+        exit(EXIT_FAILURE);
+    }
+    alpha();
+    exit(EXIT_SUCCESS);
+}
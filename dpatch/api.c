@@ -0,0 +1,291 @@
+/**
+ * @file dpatch/api.c
+ *
+ * `api.c` implements dpatch's public, in-process API on
+ * top of `patch_set_t`.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "dispatch_table.h"
+#include "dpatch.h"
+#include "event_log.h"
+#include "hot_text.h"
+#include "machine_code.h"
+#include "patch.h"
+#include "patch_guard.h"
+#include "patch_script.h"
+#include "patch_set.h"
+#include "perf_map.h"
+#include "pointer_scan.h"
+#include "redirect.h"
+#include "safepoint.h"
+#include "status.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+/**
+ * A patch built through the public API.
+ */
+struct dpatch_patch
+{
+    /** The operations making up the patch. */
+    patch_set_t* patch_set;
+
+    /** The outcome of the most recent attempt to apply it. */
+    struct dpatch_result result;
+};
+
+/** Ensures `api_init` runs once. */
+static pthread_once_t api_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Start dpatch's services for a program using the API,
+ * as `la_preinit` does for an audited program.
+ */
+static void api_init(void)
+{
+    LOG_ON_ERROR(event_log_start());
+    LOG_ON_ERROR(machine_code_init_write_mode());
+    LOG_ON_ERROR(dispatch_table_init_mode());
+    LOG_ON_ERROR(perf_map_init());
+    LOG_ON_ERROR(patch_guard_init_mode());
+    LOG_ON_ERROR(hot_text_init_mode());
+    LOG_ON_ERROR(pointer_scan_init_mode());
+    LOG_ON_ERROR(safepoint_init_mode());
+}
+
+/**
+ * Get the current monotonic time in microseconds.
+ *
+ * @return Microseconds since an arbitrary epoch.
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Allocate and initialise a new, empty patch.
+ *
+ * @param patch Location to store the new patch handle.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dpatch_patch_new(dpatch_patch_t** patch)
+{
+    dpatch_patch_t* handle = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(patch != NULL);
+    handle = calloc(1, sizeof *handle);
+    *patch = handle;
+    if (handle == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    status = patch_set_new(&handle->patch_set);
+    if (IS_ERROR(status))
+    {
+        free(handle);
+        *patch = NULL;
+        return status;
+    }
+    handle->result.patch_id = patch_set_id(handle->patch_set);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Deallocate a patch.
+ *
+ * Deallocating a patch does not revert it.
+ *
+ * @param patch Handle to the patch to free.
+ */
+void dpatch_patch_free(dpatch_patch_t* patch)
+{
+    assert(patch != NULL);
+    patch_set_free(patch->patch_set);
+    free(patch);
+}
+
+/**
+ * Add an operation to a patch.
+ *
+ * @param patch Handle to the patch to add to.
+ * @param entry The operation to add. Its strings are copied.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the operation is not known, or an error on failure.
+ */
+dpatch_status dpatch_patch_add(dpatch_patch_t* patch, const struct dpatch_entry* entry)
+{
+    dpatch_operation operation = DPATCH_OP_NOP;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(patch != NULL);
+    assert(entry != NULL);
+    if (entry->operation == NULL || entry->old_symbol == NULL || entry->new_symbol == NULL)
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    /*
+     * The internal interfaces only read these strings, and
+     * copy what they keep.
+     */
+    PROPAGATE_ERROR(str_to_patch_operation((char*) entry->operation, &operation), status);
+    return patch_set_add_operation(
+        patch->patch_set,
+        operation,
+        (char*) entry->old_symbol,
+        (char*) entry->new_symbol,
+        (char*) entry->library
+    );
+}
+
+/**
+ * Add an operation to a patch, written as a line of a
+ * patch script.
+ *
+ * @param patch Handle to the patch to add to.
+ * @param line The operation, such as "fn_replace_internal
+ *      alpha bravo:libbravo.so".
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * line is malformed, or an error on failure.
+ */
+dpatch_status dpatch_patch_add_line(dpatch_patch_t* patch, const char* line)
+{
+    char buffer[PATCH_SCRIPT_MAX_LINE_LEN];
+    assert(patch != NULL);
+    assert(line != NULL);
+    if (strlen(line) >= sizeof buffer)
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    strcpy(buffer, line);
+    return parse_script_line(buffer, patch->patch_set);
+}
+
+/**
+ * Apply a patch to the calling process.
+ *
+ * The patch is prepared, loading libraries and resolving
+ * symbols, then committed. If the commit can not finish
+ * within `budget_us` microseconds, the process is left
+ * unpatched and `DPATCH_STATUS_ETIMEDOUT` is returned.
+ *
+ * While threads are registered with
+ * `dpatch_safepoint_register`, the prepared patch is
+ * committed by the registered threads at their next safe
+ * points, and `dpatch_patch_apply` waits for them.
+ *
+ * The first call starts dpatch's event log, which drains
+ * on a background thread.
+ *
+ * @param patch Handle to the patch to apply.
+ * @param budget_us Time allowed for the commit, or 0 for
+ *      no limit.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dpatch_patch_apply(dpatch_patch_t* patch, uint64_t budget_us)
+{
+    struct dpatch_result* result = NULL;
+    redirect_batch_t* batch = NULL;
+    double prepare_start = 0;
+    assert(patch != NULL);
+    pthread_once(&api_once, api_init);
+    result = &patch->result;
+    memset(result, 0, sizeof *result);
+    result->patch_id = patch_set_id(patch->patch_set);
+    prepare_start = now_us();
+    result->status = patch_set_prepare(patch->patch_set);
+    result->prepare_us = now_us() - prepare_start;
+    batch = patch_set_batch(patch->patch_set);
+    if (batch != NULL)
+    {
+        result->redirects = redirect_batch_length(batch);
+        result->writes = redirect_batch_writes(batch);
+    }
+    if (!IS_ERROR(result->status))
+    {
+        result->status = safepoint_commit(patch->patch_set, budget_us, &result->commit_us);
+    }
+    if (IS_ERROR(result->status))
+    {
+        result->writes = 0;
+    }
+    event_logf(
+        LOG_INFO,
+        result->status,
+        result->patch_id,
+        "Patch applied through the API: %s. Prepared in %.1f us, committed in %.1f us.",
+        dpatch_str_status(result->status),
+        result->prepare_us,
+        result->commit_us
+    );
+    return result->status;
+}
+
+/**
+ * Get the outcome of the most recent attempt to apply a
+ * patch.
+ *
+ * @param patch Handle to the patch to query.
+ * @param result Location to store the outcome.
+ */
+void dpatch_patch_result(dpatch_patch_t* patch, struct dpatch_result* result)
+{
+    assert(patch != NULL);
+    assert(result != NULL);
+    *result = patch->result;
+}
+
+/**
+ * Get the number of events dpatch's event log has dropped.
+ *
+ * @return The number of events dropped since dpatch was
+ * loaded.
+ */
+uint64_t dpatch_events_dropped(void)
+{
+    return event_log_dropped();
+}
+
+/**
+ * Register the calling thread as an event loop thread.
+ *
+ * @param fd Location to store a descriptor which becomes
+ *      readable when the thread should call
+ *      `dpatch_safepoint`.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dpatch_safepoint_register(int* fd)
+{
+    assert(fd != NULL);
+    pthread_once(&api_once, api_init);
+    return safepoint_register(fd);
+}
+
+/**
+ * Unregister the calling thread, closing its descriptor.
+ */
+void dpatch_safepoint_unregister(void)
+{
+    safepoint_unregister();
+}
+
+/**
+ * Mark a safe point in the calling thread, waiting there
+ * while a pending patch is committed.
+ *
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ETIMEDOUT` if
+ * the patch was withdrawn, or the status of the commit.
+ */
+dpatch_status dpatch_safepoint(void)
+{
+    return safepoint_reach();
+}
@@ -0,0 +1,353 @@
+/**
+ * @file dpatch/cpu_features.c
+ *
+ * `cpu_features.c` defines functions for detecting the
+ * instruction set extensions available to the program, and
+ * for matching them against the extensions a function's
+ * name says it needs.
+ *
+ * An extension which uses the AVX or AVX-512 registers is
+ * only available if `xgetbv` reports the kernel saves those
+ * registers, since `cpuid` alone reports what the CPU can
+ * do, not what the kernel allows.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "cpu_features.h"
+#include <cpuid.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/* `cpuid` leaf 1, `ecx`. */
+#define CPUID_1_ECX_SSE3 (1u << 0)
+#define CPUID_1_ECX_SSSE3 (1u << 9)
+#define CPUID_1_ECX_FMA (1u << 12)
+#define CPUID_1_ECX_SSE4_1 (1u << 19)
+#define CPUID_1_ECX_SSE4_2 (1u << 20)
+#define CPUID_1_ECX_POPCNT (1u << 23)
+#define CPUID_1_ECX_OSXSAVE (1u << 27)
+#define CPUID_1_ECX_AVX (1u << 28)
+
+/* `cpuid` leaf 1, `edx`. */
+#define CPUID_1_EDX_SSE (1u << 25)
+#define CPUID_1_EDX_SSE2 (1u << 26)
+
+/* `cpuid` leaf 7, subleaf 0, `ebx`. */
+#define CPUID_7_EBX_BMI1 (1u << 3)
+#define CPUID_7_EBX_AVX2 (1u << 5)
+#define CPUID_7_EBX_BMI2 (1u << 8)
+#define CPUID_7_EBX_AVX512F (1u << 16)
+#define CPUID_7_EBX_AVX512DQ (1u << 17)
+#define CPUID_7_EBX_AVX512CD (1u << 28)
+#define CPUID_7_EBX_AVX512BW (1u << 30)
+#define CPUID_7_EBX_AVX512VL (1u << 31)
+
+/* `XCR0` state components: SSE and AVX, then the AVX-512 opmask and upper ZMM registers. */
+#define XCR0_YMM_STATE 0x06u
+#define XCR0_ZMM_STATE 0xe0u
+
+/* `XCR0` state components holding x87, SSE, AVX and AVX-512 registers. */
+#define XCR0_VECTOR_STATE 0xe7u
+
+/* Size of the legacy region and header of an `xsave` area. */
+#define XSAVE_HEADER_END 576u
+
+/* Alignment `xsave` requires of its area. */
+#define XSAVE_ALIGNMENT 64u
+
+/**
+ * Instruction set extensions a function may need.
+ */
+enum cpu_feature
+{
+    CPU_FEATURE_SSE = 1u << 0,
+    CPU_FEATURE_SSE2 = 1u << 1,
+    CPU_FEATURE_SSE3 = 1u << 2,
+    CPU_FEATURE_SSSE3 = 1u << 3,
+    CPU_FEATURE_SSE4_1 = 1u << 4,
+    CPU_FEATURE_SSE4_2 = 1u << 5,
+    CPU_FEATURE_POPCNT = 1u << 6,
+    CPU_FEATURE_AVX = 1u << 7,
+    CPU_FEATURE_FMA = 1u << 8,
+    CPU_FEATURE_AVX2 = 1u << 9,
+    CPU_FEATURE_BMI1 = 1u << 10,
+    CPU_FEATURE_BMI2 = 1u << 11,
+    CPU_FEATURE_AVX512F = 1u << 12,
+    CPU_FEATURE_AVX512DQ = 1u << 13,
+    CPU_FEATURE_AVX512CD = 1u << 14,
+    CPU_FEATURE_AVX512BW = 1u << 15,
+    CPU_FEATURE_AVX512VL = 1u << 16,
+};
+
+/**
+ * The name of an extension, as it appears in function
+ * names.
+ */
+struct cpu_feature_name
+{
+    /** The name. */
+    const char* name;
+
+    /** The extensions it stands for. */
+    uint32_t features;
+};
+
+/** Extension names recognised in function names. */
+static const struct cpu_feature_name FEATURE_NAMES[] = {
+    {"avx512f", CPU_FEATURE_AVX512F},
+    {"avx512dq", CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512DQ},
+    {"avx512cd", CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512CD},
+    {"avx512bw", CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512BW},
+    {"avx512vl", CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512VL},
+    {"avx512", CPU_FEATURE_AVX512F},
+    {"avx2", CPU_FEATURE_AVX2},
+    {"avx", CPU_FEATURE_AVX},
+    {"fma", CPU_FEATURE_FMA},
+    {"bmi2", CPU_FEATURE_BMI2},
+    {"bmi", CPU_FEATURE_BMI1},
+    {"popcnt", CPU_FEATURE_POPCNT},
+    {"sse4_2", CPU_FEATURE_SSE4_2},
+    {"sse42", CPU_FEATURE_SSE4_2},
+    {"sse4_1", CPU_FEATURE_SSE4_1},
+    {"sse41", CPU_FEATURE_SSE4_1},
+    {"ssse3", CPU_FEATURE_SSSE3},
+    {"sse3", CPU_FEATURE_SSE3},
+    {"sse2", CPU_FEATURE_SSE2},
+    {"sse", CPU_FEATURE_SSE},
+};
+
+/** Names used to describe each extension bit, in bit order. */
+static const char* const FEATURE_BIT_NAMES[] = {
+    "sse", "sse2", "sse3", "ssse3", "sse4_1", "sse4_2", "popcnt", "avx", "fma",
+    "avx2", "bmi1", "bmi2", "avx512f", "avx512dq", "avx512cd", "avx512bw", "avx512vl",
+};
+
+/** The extensions detected. */
+static uint32_t detected = 0;
+
+/** The `xsave` state components holding vector registers. */
+static uint32_t vector_state = 0;
+
+/** Size of an `xsave` area holding `vector_state`. */
+static size_t vector_state_size = 0;
+
+/** Ensures the extensions are detected once. */
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Read extended control register 0, which holds the
+ * register state the kernel saves on context switches.
+ *
+ * @return The low 32 bits of `XCR0`.
+ */
+static uint32_t read_xcr0(void)
+{
+    uint32_t low = 0;
+    uint32_t high = 0;
+    __asm__ volatile ("xgetbv" : "=a" (low), "=d" (high) : "c" (0));
+    (void) high;
+    return low;
+}
+
+/**
+ * Find the `xsave` state components holding vector
+ * registers the kernel has enabled, and store them and the
+ * size of an area holding them in `vector_state` and
+ * `vector_state_size`.
+ *
+ * @param xcr0 The low 32 bits of `XCR0`.
+ */
+static void detect_vector_state(uint32_t xcr0)
+{
+    unsigned int eax = 0;
+    unsigned int ebx = 0;
+    unsigned int ecx = 0;
+    unsigned int edx = 0;
+    size_t size = XSAVE_HEADER_END;
+    unsigned int component = 0;
+    /* Components 0 and 1 live in the legacy region. */
+    for (component = 2; component < 32; component++)
+    {
+        if (
+            (xcr0 & XCR0_VECTOR_STATE & (1u << component))
+            && __get_cpuid_count(0xd, component, &eax, &ebx, &ecx, &edx) != 0
+            && (size_t) ebx + eax > size
+        )
+        {
+            size = (size_t) ebx + eax;
+        }
+    }
+    vector_state = xcr0 & XCR0_VECTOR_STATE;
+    vector_state_size = (size + XSAVE_ALIGNMENT - 1) / XSAVE_ALIGNMENT * XSAVE_ALIGNMENT;
+}
+
+/**
+ * Detect the extensions available, and store them in
+ * `detected`.
+ */
+static void detect(void)
+{
+    unsigned int eax = 0;
+    unsigned int ebx = 0;
+    unsigned int ecx = 0;
+    unsigned int edx = 0;
+    uint32_t xcr0 = 0;
+    uint32_t features = 0;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+    {
+        return;
+    }
+    features |= edx & CPUID_1_EDX_SSE ? CPU_FEATURE_SSE : 0;
+    features |= edx & CPUID_1_EDX_SSE2 ? CPU_FEATURE_SSE2 : 0;
+    features |= ecx & CPUID_1_ECX_SSE3 ? CPU_FEATURE_SSE3 : 0;
+    features |= ecx & CPUID_1_ECX_SSSE3 ? CPU_FEATURE_SSSE3 : 0;
+    features |= ecx & CPUID_1_ECX_SSE4_1 ? CPU_FEATURE_SSE4_1 : 0;
+    features |= ecx & CPUID_1_ECX_SSE4_2 ? CPU_FEATURE_SSE4_2 : 0;
+    features |= ecx & CPUID_1_ECX_POPCNT ? CPU_FEATURE_POPCNT : 0;
+    if (ecx & CPUID_1_ECX_OSXSAVE)
+    {
+        xcr0 = read_xcr0();
+        detect_vector_state(xcr0);
+    }
+    if ((xcr0 & XCR0_YMM_STATE) == XCR0_YMM_STATE)
+    {
+        features |= ecx & CPUID_1_ECX_AVX ? CPU_FEATURE_AVX : 0;
+        features |= ecx & CPUID_1_ECX_FMA ? CPU_FEATURE_FMA : 0;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0)
+    {
+        features |= ebx & CPUID_7_EBX_BMI1 ? CPU_FEATURE_BMI1 : 0;
+        features |= ebx & CPUID_7_EBX_BMI2 ? CPU_FEATURE_BMI2 : 0;
+        if ((xcr0 & XCR0_YMM_STATE) == XCR0_YMM_STATE)
+        {
+            features |= ebx & CPUID_7_EBX_AVX2 ? CPU_FEATURE_AVX2 : 0;
+        }
+        if ((xcr0 & (XCR0_YMM_STATE | XCR0_ZMM_STATE)) == (XCR0_YMM_STATE | XCR0_ZMM_STATE))
+        {
+            features |= ebx & CPUID_7_EBX_AVX512F ? CPU_FEATURE_AVX512F : 0;
+            features |= ebx & CPUID_7_EBX_AVX512DQ ? CPU_FEATURE_AVX512DQ : 0;
+            features |= ebx & CPUID_7_EBX_AVX512CD ? CPU_FEATURE_AVX512CD : 0;
+            features |= ebx & CPUID_7_EBX_AVX512BW ? CPU_FEATURE_AVX512BW : 0;
+            features |= ebx & CPUID_7_EBX_AVX512VL ? CPU_FEATURE_AVX512VL : 0;
+        }
+    }
+    detected = features;
+}
+
+/**
+ * Detect the extensions the CPU supports and the kernel
+ * saves the registers of. `cpuid` and `xgetbv` are only
+ * executed the first time.
+ *
+ * @return A bit set of the extensions supported.
+ */
+uint32_t cpu_features_detect(void)
+{
+    pthread_once(&detect_once, &detect);
+    return detected;
+}
+
+/**
+ * Find the register state which must be saved to preserve
+ * every x87 and vector register.
+ *
+ * @param size Location to store the size of an `xsave`
+ *      area holding the state, in bytes, or 0.
+ * @return The `xsave` state components to save, or 0 if the
+ * kernel hasn't enabled `xsave`, in which case the CPU has
+ * no registers `fxsave` doesn't save.
+ */
+uint32_t cpu_features_vector_state(size_t* size)
+{
+    pthread_once(&detect_once, &detect);
+    *size = vector_state_size;
+    return vector_state;
+}
+
+/**
+ * Test if a character can be part of a word in a function
+ * name.
+ *
+ * @param c The character to test.
+ * @return `true` if `c` is an ASCII letter or digit.
+ */
+static bool is_word_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+/**
+ * Find the extensions a function's name says it needs.
+ *
+ * An extension is needed if its name, such as `avx2`,
+ * `avx512` or `sse4_2`, appears in the function's name
+ * between characters which aren't letters or digits.
+ *
+ * @param name The function's name.
+ * @return A bit set of the extensions named, or 0 if the
+ * function needs none.
+ */
+uint32_t cpu_features_required(const char* name)
+{
+    uint32_t features = 0;
+    size_t length = 0;
+    size_t i = 0;
+    const char* word = name;
+    while (*word != '\0')
+    {
+        if (word != name && is_word_char(word[-1]))
+        {
+            word++;
+            continue;
+        }
+        for (i = 0; i < sizeof FEATURE_NAMES / sizeof FEATURE_NAMES[0]; i++)
+        {
+            length = strlen(FEATURE_NAMES[i].name);
+            if (strncmp(word, FEATURE_NAMES[i].name, length) == 0 && !is_word_char(word[length]))
+            {
+                features |= FEATURE_NAMES[i].features;
+                break;
+            }
+        }
+        word++;
+    }
+    return features;
+}
+
+/**
+ * Describe a set of extensions for the log.
+ *
+ * @param features The extensions to describe.
+ * @param buffer Location to store the space separated
+ *      names of the extensions.
+ * @param length Size of `buffer` in bytes.
+ */
+void cpu_features_describe(uint32_t features, char* buffer, size_t length)
+{
+    size_t used = 0;
+    size_t i = 0;
+    if (length == 0)
+    {
+        return;
+    }
+    buffer[0] = '\0';
+    for (i = 0; i < sizeof FEATURE_BIT_NAMES / sizeof FEATURE_BIT_NAMES[0]; i++)
+    {
+        if ((features & (1u << i)) == 0 || used >= length)
+        {
+            continue;
+        }
+        used += (size_t) snprintf(
+            buffer + used,
+            length - used,
+            "%s%s",
+            used == 0 ? "" : " ",
+            FEATURE_BIT_NAMES[i]
+        );
+    }
+}
@@ -0,0 +1,669 @@
+/**
+ * @file dpatch/deferred_patch.c
+ *
+ * `deferred_patch.c` defines deferred replacements, which
+ * replace functions in objects loaded after the patch was
+ * applied, such as plugins opened on demand.
+ *
+ * When `fn_replace_internal` can't find the function to
+ * replace, but its replacement is found, the replacement is
+ * staged here instead of failing the patch. Once the patch
+ * is committed, it stands: `la_objopen` checks every object
+ * loaded into the program's namespace for the function, and
+ * redirects it after the object is mapped, but before it is
+ * relocated or its constructors run. An object loaded again
+ * after being unloaded is patched again.
+ *
+ * Deferred replacements are only possible when dpatch is an
+ * audit library, since only the audit interface reports
+ * each object before its code runs.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "deferred_patch.h"
+#include "event_log.h"
+#include "redirect.h"
+#include "status.h"
+#include "symbol_index.h"
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define DEFERRED_DEFAULT_LENGTH 8
+
+/**
+ * A replacement waiting for the function it replaces to be
+ * loaded.
+ */
+struct deferred_patch
+{
+    /** Name of the function to replace. */
+    char* symbol;
+
+    /** The replacement. */
+    intptr_t to;
+
+    /** Description of the replacement, for the log. */
+    char* label;
+
+    /** Patch the replacement belongs to. */
+    uint64_t patch_id;
+
+    /** Whether the patch has been committed. */
+    bool committed;
+};
+
+/**
+ * The table of deferred replacements.
+ */
+struct deferred_table
+{
+    /** The number of `patches` allocated in memory. */
+    size_t allocated_length;
+
+    /** The number of replacements in the table. */
+    size_t length;
+
+    /** Array of deferred replacements. */
+    struct deferred_patch* patches;
+
+    /** The number of committed replacements. */
+    size_t committed;
+};
+
+/** Replacements waiting for their functions to be loaded. */
+static struct deferred_table table = {0, 0, NULL, 0};
+
+/**
+ * Serialises access to `table`.
+ *
+ * Objects are opened with the loader's lock held, so this
+ * lock must not be held while calling into the loader.
+ */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * An object in the program's namespace, as listed when a
+ * patch was committed.
+ */
+struct listed_object
+{
+    /** The object's link map. */
+    struct link_map* map;
+
+    /** Copy of the object's name. */
+    char* name;
+};
+
+/**
+ * The objects in the program's namespace.
+ */
+struct object_list
+{
+    /** The program, first in its namespace. */
+    struct link_map* program;
+
+    /** The program's namespace. */
+    Lmid_t namespace;
+
+    /** The number of `objects` allocated in memory. */
+    size_t allocated_length;
+
+    /** The number of objects in the list. */
+    size_t length;
+
+    /** Array of the listed objects. */
+    struct listed_object* objects;
+
+    /** Whether memory ran out while listing. */
+    bool failed;
+};
+
+/** Whether dpatch is told about objects as they are loaded. */
+static bool watching = false;
+
+/**
+ * Note that dpatch is an audit library, so it is told
+ * about each object as it is loaded, and replacements can
+ * be deferred.
+ */
+void deferred_patch_watch_loads(void)
+{
+    watching = true;
+}
+
+/**
+ * Test if replacements of functions which aren't loaded
+ * can be deferred.
+ *
+ * @return `true` if dpatch is told about objects as they
+ * are loaded.
+ */
+bool deferred_patch_available(void)
+{
+    return watching;
+}
+
+/**
+ * Remove a replacement from the table.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param index Index of the replacement to remove.
+ */
+static void remove_locked(size_t index)
+{
+    struct deferred_patch* patch = &table.patches[index];
+    if (patch->committed)
+    {
+        __atomic_sub_fetch(&table.committed, 1, __ATOMIC_RELAXED);
+    }
+    free(patch->symbol);
+    free(patch->label);
+    memmove(patch, patch + 1, (table.length - index - 1) * sizeof(struct deferred_patch));
+    table.length--;
+}
+
+/**
+ * Test if a patch stages a replacement of a function.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param symbol Name of the function.
+ * @param patch_id The patch to search.
+ * @return `true` if the patch has an uncommitted
+ * replacement of `symbol`.
+ */
+static bool staged_locked(const char* symbol, uint64_t patch_id)
+{
+    size_t i = 0;
+    for (i = 0; i < table.length; i++)
+    {
+        if (
+            table.patches[i].patch_id == patch_id
+            && !table.patches[i].committed
+            && strcmp(table.patches[i].symbol, symbol) == 0
+        )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Stage a replacement for a function which isn't loaded.
+ *
+ * The replacement is kept once its patch is committed, and
+ * applied to every object later loaded which defines
+ * `symbol`. It replaces any earlier deferred replacement of
+ * `symbol`.
+ *
+ * @param patch_id Patch the replacement belongs to.
+ * @param symbol Name of the function to replace.
+ * @param to The replacement.
+ * @param label Description of the replacement, for the
+ *      log.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status deferred_patch_add
+(
+    uint64_t patch_id,
+    const char* symbol,
+    intptr_t to,
+    const char* label
+)
+{
+    struct deferred_patch* realloc_result = NULL;
+    struct deferred_patch patch = {NULL, to, NULL, patch_id, false};
+    size_t new_length = 0;
+    patch.symbol = strdup(symbol);
+    patch.label = strdup(label);
+    if (patch.symbol == NULL || patch.label == NULL)
+    {
+        free(patch.symbol);
+        free(patch.label);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    pthread_mutex_lock(&table_lock);
+    if (table.length == table.allocated_length)
+    {
+        new_length = table.allocated_length == 0
+            ? DEFERRED_DEFAULT_LENGTH
+            : table.allocated_length * 2;
+        realloc_result = realloc(table.patches, new_length * sizeof(struct deferred_patch));
+        if (realloc_result == NULL)
+        {
+            pthread_mutex_unlock(&table_lock);
+            free(patch.symbol);
+            free(patch.label);
+            return DPATCH_STATUS_ENOMEM;
+        }
+        table.patches = realloc_result;
+        table.allocated_length = new_length;
+    }
+    table.patches[table.length++] = patch;
+    pthread_mutex_unlock(&table_lock);
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        patch_id,
+        "Deferred %s until an object defining %s is loaded.",
+        label,
+        symbol
+    );
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Find the address range an object is mapped over.
+ *
+ * The program headers are asked of the loader, which
+ * records them for every object, rather than read from the
+ * object's base address. `l_addr` is the difference between
+ * the object's addresses and those it was linked at, not
+ * the address of its ELF header.
+ *
+ * @param object The object to measure.
+ * @param start Location to store the object's first
+ *      address.
+ * @param end Location to store the address after the
+ *      object.
+ * @return `true` if the object's program headers could be
+ * found.
+ */
+static bool object_extent(struct link_map* object, intptr_t* start, intptr_t* end)
+{
+    const ElfW(Phdr)* program_headers = NULL;
+    intptr_t segment_start = 0;
+    intptr_t segment_end = 0;
+    int count = 0;
+    int i = 0;
+    /* A link map is the loader's handle to its object. */
+    count = dlinfo(object, RTLD_DI_PHDR, &program_headers);
+    if (count <= 0 || program_headers == NULL)
+    {
+        return false;
+    }
+    *start = INTPTR_MAX;
+    *end = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (program_headers[i].p_type != PT_LOAD)
+        {
+            continue;
+        }
+        segment_start = (intptr_t) (object->l_addr + program_headers[i].p_vaddr);
+        segment_end = segment_start + (intptr_t) program_headers[i].p_memsz;
+        if (segment_start < *start)
+        {
+            *start = segment_start;
+        }
+        if (segment_end > *end)
+        {
+            *end = segment_end;
+        }
+    }
+    return *end > *start;
+}
+
+/**
+ * Apply the committed replacements to an object.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param object The object to patch.
+ * @param patch_id Only apply replacements from this patch,
+ *      or 0 to apply every committed replacement.
+ */
+static void apply_locked(struct link_map* object, uint64_t patch_id)
+{
+    redirect_batch_t* batch = NULL;
+    uintptr_t from = 0;
+    intptr_t start = 0;
+    intptr_t end = 0;
+    bool has_extent = object_extent(object, &start, &end);
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    for (i = 0; i < table.length; i++)
+    {
+        struct deferred_patch* patch = &table.patches[i];
+        if (!patch->committed || (patch_id != 0 && patch->patch_id != patch_id))
+        {
+            continue;
+        }
+        /* The replacement's own library may define the name too. */
+        if (has_extent && patch->to >= start && patch->to < end)
+        {
+            continue;
+        }
+        if (IS_ERROR(symbol_index_find(object, patch->symbol, &from)))
+        {
+            continue;
+        }
+        if (redirect_resolve((intptr_t) from) == patch->to)
+        {
+            continue;
+        }
+        status = redirect_batch_new(&batch, patch->patch_id);
+        if (!IS_ERROR(status))
+        {
+            status = redirect_batch_add(batch, (intptr_t) from, patch->to, patch->label);
+        }
+        if (!IS_ERROR(status))
+        {
+            status = redirect_batch_commit(batch, NULL);
+        }
+        redirect_batch_free(batch);
+        batch = NULL;
+        event_logf(
+            IS_ERROR(status) ? LOG_ERR : LOG_INFO,
+            status,
+            patch->patch_id,
+            IS_ERROR(status)
+                ? "Failed to apply deferred %s to %s."
+                : "Applied deferred %s to %s.",
+            patch->label,
+            object->l_name[0] == '\0' ? "the program" : object->l_name
+        );
+    }
+}
+
+/**
+ * Add an object to a list of the program's objects.
+ *
+ * @param list The list to add to.
+ * @param map The object to add.
+ * @return `false` if memory couldn't be allocated.
+ */
+static bool list_object(struct object_list* list, struct link_map* map)
+{
+    struct listed_object* realloc_result = NULL;
+    char* name = NULL;
+    size_t new_length = 0;
+    if (list->length == list->allocated_length)
+    {
+        new_length = list->allocated_length == 0
+            ? DEFERRED_DEFAULT_LENGTH
+            : list->allocated_length * 2;
+        realloc_result = realloc(list->objects, new_length * sizeof(struct listed_object));
+        if (realloc_result == NULL)
+        {
+            return false;
+        }
+        list->objects = realloc_result;
+        list->allocated_length = new_length;
+    }
+    name = strdup(map->l_name);
+    if (name == NULL)
+    {
+        return false;
+    }
+    list->objects[list->length].map = map;
+    list->objects[list->length].name = name;
+    list->length++;
+    return true;
+}
+
+/**
+ * List the objects in the program's namespace, from
+ * `dl_iterate_phdr`, which holds the loader's lock, so none
+ * can be loaded or unloaded while the link map is walked.
+ *
+ * `dl_iterate_phdr` only visits the caller's namespace,
+ * which is dpatch's own when it is loaded by `LD_AUDIT`, so
+ * the program's namespace is walked from its first object
+ * on the first visit. Every namespace shares the one
+ * loader, and its lock.
+ *
+ * @param info Unused.
+ * @param size Unused.
+ * @param context The `struct object_list` to fill.
+ * @return 1, to stop after the first visit.
+ */
+static int list_objects(struct dl_phdr_info* info, size_t size, void* context)
+{
+    struct object_list* list = context;
+    struct link_map* map = NULL;
+    (void) info;
+    (void) size;
+    for (map = list->program; map != NULL && !list->failed; map = map->l_next)
+    {
+        list->failed = !list_object(list, map);
+    }
+    return 1;
+}
+
+/**
+ * Take a reference to a listed object, so it can't be
+ * unloaded while it is patched.
+ *
+ * The reference is taken by name, so the object is checked
+ * to be the one which was listed, rather than another
+ * loaded under the same name since.
+ *
+ * @param list The list of the program's objects.
+ * @param object The object to hold.
+ * @return A handle to release with `dlclose`, or `NULL` if
+ * the object has been unloaded.
+ */
+static void* hold_object(struct object_list* list, struct listed_object* object)
+{
+    struct link_map* held = NULL;
+    void* handle = NULL;
+    if (object->name[0] == '\0')
+    {
+        return NULL;
+    }
+    handle = dlmopen(list->namespace, object->name, RTLD_LAZY | RTLD_NOLOAD);
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &held) != 0 || held != object->map)
+    {
+        dlclose(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+/**
+ * Keep the replacements a committed patch deferred, and
+ * apply them to any matching objects loaded since the
+ * patch was prepared.
+ *
+ * The program's objects are listed under the loader's
+ * lock, then each is patched while dpatch holds a
+ * reference to it. The lock is not held while patching,
+ * since patching may call into the loader, and the loader
+ * holds its own lock while telling dpatch about new
+ * objects.
+ *
+ * @param patch_id The committed patch.
+ */
+void deferred_patch_commit(uint64_t patch_id)
+{
+    struct object_list list;
+    void* program = NULL;
+    void* handle = NULL;
+    bool staged = false;
+    size_t i = 0;
+    pthread_mutex_lock(&table_lock);
+    while (i < table.length)
+    {
+        if (table.patches[i].committed && staged_locked(table.patches[i].symbol, patch_id))
+        {
+            remove_locked(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    for (i = 0; i < table.length; i++)
+    {
+        if (table.patches[i].patch_id == patch_id && !table.patches[i].committed)
+        {
+            table.patches[i].committed = true;
+            __atomic_add_fetch(&table.committed, 1, __ATOMIC_RELAXED);
+            staged = true;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    if (!staged)
+    {
+        return;
+    }
+    /* The table is unlocked while the loader's lock is taken. */
+    memset(&list, 0, sizeof list);
+    program = dlopen(NULL, RTLD_LAZY);
+    if (program == NULL)
+    {
+        return;
+    }
+    if (
+        dlinfo(program, RTLD_DI_LINKMAP, &list.program) != 0
+        || list.program == NULL
+        || dlinfo(program, RTLD_DI_LMID, &list.namespace) != 0
+    )
+    {
+        dlclose(program);
+        return;
+    }
+    while (list.program->l_prev != NULL)
+    {
+        list.program = list.program->l_prev;
+    }
+    dl_iterate_phdr(&list_objects, &list);
+    if (list.failed)
+    {
+        event_log_post(
+            LOG_ERR,
+            DPATCH_STATUS_ENOMEM,
+            patch_id,
+            "Couldn't list the loaded objects. Deferred replacements will only be applied to objects loaded from now on."
+        );
+    }
+    for (i = 0; i < list.length && !list.failed; i++)
+    {
+        handle = list.objects[i].map == list.program ? program : hold_object(&list, &list.objects[i]);
+        if (handle == NULL)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&table_lock);
+        apply_locked(list.objects[i].map, patch_id);
+        pthread_mutex_unlock(&table_lock);
+        if (handle != program)
+        {
+            dlclose(handle);
+        }
+    }
+    for (i = 0; i < list.length; i++)
+    {
+        free(list.objects[i].name);
+    }
+    free(list.objects);
+    dlclose(program);
+}
+
+/**
+ * Count the replacements a patch staged which it hasn't
+ * committed.
+ *
+ * @param patch_id The patch to count.
+ * @return The number of uncommitted replacements `patch_id`
+ * deferred.
+ */
+size_t deferred_patch_staged(uint64_t patch_id)
+{
+    size_t count = 0;
+    size_t i = 0;
+    pthread_mutex_lock(&table_lock);
+    for (i = 0; i < table.length; i++)
+    {
+        count += table.patches[i].patch_id == patch_id && !table.patches[i].committed;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return count;
+}
+
+/**
+ * Drop the replacements a patch staged, if it was not
+ * committed.
+ *
+ * @param patch_id The patch to withdraw.
+ */
+void deferred_patch_withdraw(uint64_t patch_id)
+{
+    size_t i = 0;
+    pthread_mutex_lock(&table_lock);
+    while (i < table.length)
+    {
+        if (table.patches[i].patch_id == patch_id && !table.patches[i].committed)
+        {
+            remove_locked(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+/**
+ * Apply the deferred replacements to an object which was
+ * just loaded, before its code first runs.
+ *
+ * @param object The object which was loaded.
+ */
+void deferred_patch_object_opened(struct link_map* object)
+{
+    if (__atomic_load_n(&table.committed, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&table_lock);
+    apply_locked(object, 0);
+    pthread_mutex_unlock(&table_lock);
+}
+
+/**
+ * Forget the redirects of functions in an object which is
+ * being unloaded, so they aren't mistaken for functions
+ * later loaded at the same addresses.
+ *
+ * @param object The object which is being unloaded.
+ */
+void deferred_patch_object_closed(struct link_map* object)
+{
+    intptr_t start = 0;
+    intptr_t end = 0;
+    size_t forgotten = 0;
+    /* The program is only closed as the process exits. */
+    if (object->l_name[0] == '\0' || !object_extent(object, &start, &end))
+    {
+        return;
+    }
+    forgotten = redirect_forget(start, end);
+    if (forgotten > 0)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            0,
+            "Forgot %zu redirects in %s, which is being unloaded.",
+            forgotten,
+            object->l_name
+        );
+    }
+}
@@ -0,0 +1,227 @@
+/**
+ * @file dpatch/dispatch_table.c
+ *
+ * `dispatch_table.c` defines functions for routing
+ * redirected entries through a versioned dispatch table.
+ *
+ * Each slot has a thunk, in pages dpatch maps, which loads
+ * the current table and jumps through the slot. A new
+ * table is published by writing a complete copy and
+ * replacing `current_table` with a release store, so a
+ * call sees either every target of the old generation or
+ * every target of the new one.
+ *
+ * Tables are never freed, because there is no way to know
+ * when the last thread to load a table has jumped through
+ * it.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "code_generator.h"
+#include "dispatch_table.h"
+#include "machine_code.h"
+#include "status.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DISPATCH_TABLE_ENV_VAR "DPATCH_DISPATCH_TABLE"
+#define CACHE_LINE_LEN 64
+#define X64_INT3 0xcc
+
+/** Whether new redirects are routed through the table. */
+static bool enabled = false;
+
+/** The table every thunk jumps through. */
+static intptr_t* current_table = NULL;
+
+/** Pages holding thunks. */
+static uint8_t** thunk_pages = NULL;
+
+/** The number of `thunk_pages` mapped. */
+static size_t thunk_pages_length = 0;
+
+/** The number of thunks written. */
+static size_t thunks_length = 0;
+
+/**
+ * Enable or disable dispatch table mode.
+ *
+ * Only entries redirected for the first time after the
+ * mode is enabled are routed through the table.
+ *
+ * @param enable Whether new redirects use the table.
+ */
+void dispatch_table_set_enabled(bool enable)
+{
+    enabled = enable;
+}
+
+/**
+ * Test if dispatch table mode is enabled.
+ *
+ * @return `true` if new redirects use the table.
+ */
+bool dispatch_table_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * Enable dispatch table mode if the `DPATCH_DISPATCH_TABLE`
+ * environment variable is set to `1`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if the
+ * variable is set to something other than `0` or `1`.
+ */
+dpatch_status dispatch_table_init_mode(void)
+{
+    char* str = getenv(DISPATCH_TABLE_ENV_VAR);
+    if (str == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    if (strcmp(str, "0") != 0 && strcmp(str, "1") != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    dispatch_table_set_enabled(str[0] == '1');
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Map a new page of thunks, filled with breakpoints.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status map_thunk_page(void)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    uint8_t** pages = NULL;
+    void* page = NULL;
+    pages = realloc(thunk_pages, sizeof(uint8_t*) * (thunk_pages_length + 1));
+    if (pages == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    thunk_pages = pages;
+    page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    memset(page, X64_INT3, page_size);
+    if (mprotect(page, page_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(page, page_size);
+        return DPATCH_STATUS_EMPROT;
+    }
+    thunk_pages[thunk_pages_length++] = page;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Get the address of a slot's thunk.
+ *
+ * @param slot Index of the slot. Its page must be mapped.
+ * @return The address of the thunk.
+ */
+static intptr_t thunk_address(size_t slot)
+{
+    size_t per_page = (size_t) sysconf(_SC_PAGESIZE) / DISPATCH_TABLE_THUNK_LEN;
+    return (intptr_t) thunk_pages[slot / per_page] + (intptr_t) (slot % per_page * DISPATCH_TABLE_THUNK_LEN);
+}
+
+/**
+ * Get the thunk which jumps through a slot of the current
+ * table, creating it if needed.
+ *
+ * Thunks are created in slot order, so creating one
+ * creates every thunk before it.
+ *
+ * @warning Callers must serialise calls which change the
+ * table.
+ *
+ * @param slot Index of the slot.
+ * @param thunk Location to store the thunk's address.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dispatch_table_thunk(size_t slot, intptr_t* thunk)
+{
+    size_t per_page = (size_t) sysconf(_SC_PAGESIZE) / DISPATCH_TABLE_THUNK_LEN;
+    machine_code_t* machine_code = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    while (thunks_length <= slot)
+    {
+        if (thunks_length / per_page == thunk_pages_length)
+        {
+            PROPAGATE_ERROR(map_thunk_page(), status);
+        }
+        PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+        status = append_dispatch_jump(machine_code, (intptr_t) &current_table, (uint32_t) thunks_length);
+        if (!IS_ERROR(status))
+        {
+            status = machine_code_insert(machine_code, thunk_address(thunks_length));
+        }
+        machine_code_free(machine_code);
+        if (IS_ERROR(status))
+        {
+            return status;
+        }
+        thunks_length++;
+    }
+    *thunk = thunk_address(slot);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Publish a new table, switching every thunk to it with a
+ * single release store.
+ *
+ * The previous table is retained, as threads may still be
+ * jumping through it.
+ *
+ * @warning Callers must serialise calls which change the
+ * table.
+ *
+ * @param targets The target of each slot.
+ * @param length The number of slots.
+ * @param previous Location to store the previous table.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dispatch_table_publish
+(
+    const intptr_t* targets,
+    size_t length,
+    intptr_t** previous
+)
+{
+    void* table = NULL;
+    size_t size = sizeof(intptr_t) * length;
+    /* Keep the table on its own cache lines, so it is never invalidated by unrelated writes. */
+    size = (size + CACHE_LINE_LEN - 1) / CACHE_LINE_LEN * CACHE_LINE_LEN;
+    if (size == 0 || posix_memalign(&table, CACHE_LINE_LEN, size) != 0)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    memset(table, 0, size);
+    memcpy(table, targets, sizeof(intptr_t) * length);
+    *previous = current_table;
+    __atomic_store_n(&current_table, (intptr_t*) table, __ATOMIC_RELEASE);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Switch back to a table replaced by
+ * `dispatch_table_publish`.
+ *
+ * @param previous The table to switch back to.
+ */
+void dispatch_table_revert(intptr_t* previous)
+{
+    __atomic_store_n(&current_table, previous, __ATOMIC_RELEASE);
+}
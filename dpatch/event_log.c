@@ -0,0 +1,459 @@
+/**
+ * @file dpatch/event_log.c
+ *
+ * `event_log.c` defines a non-blocking log for dpatch
+ * events.
+ *
+ * The log is a bounded multi-producer, multi-consumer ring
+ * buffer. Each cell carries a sequence number which tells
+ * producers and consumers whose turn it is to use the
+ * cell, so neither needs a lock. Producers signal an
+ * `eventfd` to wake the drain thread; the `eventfd` is
+ * non-blocking, so producers never wait on it.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "status.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Must be a power of two. */
+#define EVENT_LOG_CAPACITY 1024
+#define EVENT_LOG_MASK (EVENT_LOG_CAPACITY - 1)
+
+#define LOG_FILE_ENV_VAR "DPATCH_LOG_FILE"
+
+/**
+ * A slot in the ring buffer.
+ */
+struct event_cell
+{
+    /**
+     * Equal to the cell's position when it is free to be
+     * written, and to its position plus one when it holds
+     * an event waiting to be read.
+     */
+    uint64_t sequence;
+
+    /** The event stored in the cell. */
+    struct dpatch_event event;
+};
+
+/** The ring buffer. */
+static struct event_cell ring[EVENT_LOG_CAPACITY];
+
+/** Position the next event will be written at. */
+static uint64_t enqueue_position = 0;
+
+/** Position the next event will be read from. */
+static uint64_t dequeue_position = 0;
+
+/** Set once the cells' sequence numbers are initialised. */
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/** The number of events dropped because the ring was full. */
+static uint64_t dropped = 0;
+
+/** The number of drops already reported in the log. */
+static uint64_t dropped_reported = 0;
+
+/** `eventfd` used to wake the drain thread, or -1. */
+static int wake_fd = -1;
+
+/** File events are appended to, or -1. */
+static int log_file_fd = -1;
+
+/** Whether the drain thread has been started. */
+static bool started = false;
+
+/** The process which started the drain thread. */
+static pid_t started_pid = 0;
+
+/** Serialises starting the drain thread. */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Initialise the ring buffer's sequence numbers.
+ */
+static void event_log_init_ring(void)
+{
+    uint64_t i = 0;
+    for (i = 0; i < EVENT_LOG_CAPACITY; i++)
+    {
+        __atomic_store_n(&ring[i].sequence, i, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Initialise the ring when the library is loaded, so
+ * producers in signal handlers never race initialisation.
+ */
+__attribute__((constructor)) static void event_log_construct(void)
+{
+    pthread_once(&ring_once, event_log_init_ring);
+}
+
+/**
+ * Claim the next free cell for writing.
+ *
+ * @param position Location to store the claimed position.
+ * @return The claimed cell, or `NULL` if the ring is full.
+ */
+static struct event_cell* event_log_claim(uint64_t* position)
+{
+    uint64_t pos = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    while (true)
+    {
+        struct event_cell* cell = &ring[pos & EVENT_LOG_MASK];
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t difference = (int64_t) (sequence - pos);
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(
+                &enqueue_position, &pos, pos + 1, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED
+            ))
+            {
+                *position = pos;
+                return cell;
+            }
+        }
+        else if (difference < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Take the oldest event out of the ring.
+ *
+ * @param event Location to copy the event to.
+ * @return `true` if an event was taken, or `false` if the
+ * ring is empty.
+ */
+static bool event_log_take(struct dpatch_event* event)
+{
+    uint64_t pos = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+    while (true)
+    {
+        struct event_cell* cell = &ring[pos & EVENT_LOG_MASK];
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t difference = (int64_t) (sequence - (pos + 1));
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(
+                &dequeue_position, &pos, pos + 1, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED
+            ))
+            {
+                *event = cell->event;
+                __atomic_store_n(&cell->sequence, pos + EVENT_LOG_CAPACITY, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Post an event to the log.
+ *
+ * `event_log_post` never blocks, and is safe to call from
+ * signal handlers.
+ *
+ * @param priority `syslog` priority of the event.
+ * @param status Status code associated with the event.
+ * @param patch_id Patch the event relates to, or 0.
+ * @param message Description of the event. It is truncated
+ *      to `DPATCH_EVENT_MESSAGE_LEN - 1` characters.
+ */
+void event_log_post
+(
+    int priority,
+    dpatch_status status,
+    uint64_t patch_id,
+    const char* message
+)
+{
+    uint64_t position = 0;
+    uint64_t wake = 1;
+    struct event_cell* cell = event_log_claim(&position);
+    size_t i = 0;
+    if (cell == NULL)
+    {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &cell->event.timestamp);
+    cell->event.priority = priority;
+    cell->event.status = status;
+    cell->event.patch_id = patch_id;
+    for (i = 0; i < DPATCH_EVENT_MESSAGE_LEN - 1 && message[i] != '\0'; i++)
+    {
+        cell->event.message[i] = message[i];
+    }
+    cell->event.message[i] = '\0';
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&wake_fd, __ATOMIC_ACQUIRE) != -1)
+    {
+        /* Non-blocking; a saturated counter still wakes the thread. */
+        if (write(wake_fd, &wake, sizeof wake) == -1)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Post an event with a formatted message to the log.
+ *
+ * @warning Unlike `event_log_post`, `event_logf` is not
+ * safe to call from signal handlers.
+ *
+ * @param priority `syslog` priority of the event.
+ * @param status Status code associated with the event.
+ * @param patch_id Patch the event relates to, or 0.
+ * @param format `printf` style format for the message.
+ */
+void event_logf
+(
+    int priority,
+    dpatch_status status,
+    uint64_t patch_id,
+    const char* format,
+    ...
+)
+{
+    char message[DPATCH_EVENT_MESSAGE_LEN];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof message, format, args);
+    va_end(args);
+    event_log_post(priority, status, patch_id, message);
+}
+
+/**
+ * Post an error to the log, recording where it occurred.
+ *
+ * @param status The error.
+ * @param file Source file the error occurred in.
+ * @param line Source line the error occurred on.
+ */
+void event_log_error(dpatch_status status, const char* file, int line)
+{
+    event_logf(LOG_ERR, status, 0, "Error: %s. (%s:%d)", dpatch_str_status(status), file, line);
+}
+
+/**
+ * Append an event to the log file as a single line.
+ *
+ * @param event The event to write.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status event_log_write_file(const struct dpatch_event* event)
+{
+    char line[DPATCH_EVENT_MESSAGE_LEN + 128];
+    char timestamp[32];
+    struct tm utc;
+    gmtime_r(&event->timestamp.tv_sec, &utc);
+    strftime(timestamp, sizeof timestamp, "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(
+        line, sizeof line,
+        "%s.%06ldZ pid=%d priority=%d patch=%llu status=%d %s\n",
+        timestamp,
+        event->timestamp.tv_nsec / 1000,
+        (int) getpid(),
+        event->priority,
+        (unsigned long long) event->patch_id,
+        (int) event->status,
+        event->message
+    );
+    if (write(log_file_fd, line, strnlen(line, sizeof line)) == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Write an event to the log's outputs.
+ *
+ * @param event The event to write.
+ */
+static void event_log_emit(const struct dpatch_event* event)
+{
+    if (event->patch_id != 0)
+    {
+        syslog(event->priority, "[patch %llu] %s", (unsigned long long) event->patch_id, event->message);
+    }
+    else
+    {
+        syslog(event->priority, "%s", event->message);
+    }
+    if (log_file_fd != -1 && IS_ERROR(event_log_write_file(event)))
+    {
+        syslog(LOG_WARNING, "Failed to write dpatch log file.");
+    }
+}
+
+/**
+ * Write out every event in the log from the calling
+ * thread.
+ */
+void event_log_flush(void)
+{
+    struct dpatch_event event;
+    uint64_t dropped_now = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    while (event_log_take(&event))
+    {
+        event_log_emit(&event);
+    }
+    if (dropped_now != __atomic_exchange_n(&dropped_reported, dropped_now, __ATOMIC_RELAXED))
+    {
+        syslog(LOG_WARNING, "%llu dpatch events dropped in total.", (unsigned long long) dropped_now);
+    }
+}
+
+/**
+ * Drains the log until the process exits.
+ *
+ * @param args Unused, but required by the `pthreads` API.
+ * @return Nothing - the thread never returns.
+ */
+static void* event_log_drain(void* args)
+{
+    struct pollfd wake = {wake_fd, POLLIN, 0};
+    uint64_t count = 0;
+    (void) args;
+    while (true)
+    {
+        event_log_flush();
+        poll(&wake, 1, -1);
+        if (read(wake_fd, &count, sizeof count) == -1)
+        {
+            /* Spurious wake-up, or interrupted; drain anyway. */
+            continue;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create the drain thread and its wake-up `eventfd`.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status event_log_launch(void)
+{
+    pthread_t drain_thread = 0;
+    pthread_attr_t attributes;
+    dpatch_status status = DPATCH_STATUS_OK;
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd == -1)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    /* Producers must never block on the wake-up. */
+    __atomic_store_n(&wake_fd, fd, __ATOMIC_RELEASE);
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&drain_thread, &attributes, &event_log_drain, NULL) != 0)
+    {
+        __atomic_store_n(&wake_fd, -1, __ATOMIC_RELEASE);
+        close(fd);
+        status = DPATCH_STATUS_ERROR;
+    }
+    pthread_attr_destroy(&attributes);
+    return status;
+}
+
+/**
+ * Start the background thread that drains the log.
+ *
+ * Events are written to `syslog`, and also appended to
+ * the file named by the `DPATCH_LOG_FILE` environment
+ * variable if it is set. Starting the log more than once
+ * has no effect, except in a process forked after the log
+ * was started, which restarts it.
+ *
+ * @note Only the forking thread survives `fork`, so a
+ * forked child must start its own drain thread, with its
+ * own `eventfd` - the inherited one is shared with the
+ * parent. `pthread_atfork` can't be used to do this: in an
+ * audit namespace it registers with dpatch's copy of libc,
+ * not the program's.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status event_log_start(void)
+{
+    char* log_file = getenv(LOG_FILE_ENV_VAR);
+    dpatch_status status = DPATCH_STATUS_OK;
+    pthread_once(&ring_once, event_log_init_ring);
+    pthread_mutex_lock(&start_lock);
+    if (started && started_pid == getpid())
+    {
+        pthread_mutex_unlock(&start_lock);
+        return DPATCH_STATUS_OK;
+    }
+    if (started)
+    {
+        close(__atomic_exchange_n(&wake_fd, -1, __ATOMIC_ACQ_REL));
+        status = event_log_launch();
+        started_pid = getpid();
+        pthread_mutex_unlock(&start_lock);
+        return status;
+    }
+    if (log_file != NULL)
+    {
+        log_file_fd = open(log_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (log_file_fd == -1)
+        {
+            status = DPATCH_STATUS_EFILE;
+        }
+    }
+    if (IS_ERROR(event_log_launch()))
+    {
+        pthread_mutex_unlock(&start_lock);
+        return DPATCH_STATUS_ERROR;
+    }
+    started = true;
+    started_pid = getpid();
+    pthread_mutex_unlock(&start_lock);
+    return status;
+}
+
+/**
+ * Get the number of events dropped because the log was
+ * full.
+ *
+ * @return The number of dropped events.
+ */
+uint64_t event_log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
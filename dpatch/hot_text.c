@@ -0,0 +1,477 @@
+/**
+ * @file dpatch/hot_text.c
+ *
+ * `hot_text.c` defines hot text, executable regions mapped
+ * near the code being patched which replacement functions
+ * are copied into.
+ *
+ * A replacement left where `dlopen` loaded it is usually
+ * too far from the code it replaces for a 5-byte jump, and
+ * on different pages, so every call through the redirect
+ * costs a long jump and often an instruction TLB miss. A
+ * copy in hot text is within a near jump of the replaced
+ * code, and is packed with other copies into a region
+ * backed by a transparent huge page when they are enabled.
+ *
+ * Regions are never unmapped, as threads may still be
+ * running the copies in them. Copies made for a batch
+ * which is never committed are released, so their space
+ * can be reused. A copy has no unwind
+ * information, so exceptions can't be thrown through it.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "hot_text.h"
+#include "machine_code.h"
+#include "memory_map.h"
+#include "perf_map.h"
+#include "relocator.h"
+#include "status.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+
+#define HOT_TEXT_ENV_VAR "DPATCH_HOT_TEXT"
+#define PERF_MAP_NAME_LEN 512
+#define X64_INT3 0xcc
+
+/** Size of a region if transparent huge pages are disabled. */
+#define DEFAULT_REGION_SIZE (2u << 20)
+
+/** Furthest a region is mapped from the code it is near. */
+#define MAX_REGION_DISTANCE ((intptr_t) 1 << 30)
+
+/** Alignment of each copy in a region. */
+#define COPY_ALIGNMENT 16
+
+/**
+ * A function copied into hot text.
+ */
+struct hot_text_copy
+{
+    /** Address of the copy. */
+    intptr_t start;
+
+    /** Length of the copy in bytes. */
+    size_t length;
+
+    /** The function copied. */
+    intptr_t function;
+};
+
+/**
+ * An executable region copies are written into.
+ */
+struct hot_text_region
+{
+    /** Address of the region's first byte. */
+    intptr_t start;
+
+    /** Size of the region in bytes. */
+    size_t size;
+
+    /** Bytes of the region used by copies. */
+    size_t used;
+
+    /** Copies in the region, in address order. */
+    struct hot_text_copy* copies;
+
+    /** The number of `copies`. */
+    size_t copies_length;
+
+    /** The number of `copies` allocated in memory. */
+    size_t copies_allocated;
+
+    /** The next region. */
+    struct hot_text_region* next;
+};
+
+/** Whether replacements are copied into hot text. */
+static bool enabled = false;
+
+/** Regions mapped, most recent first. */
+static struct hot_text_region* regions = NULL;
+
+/** Protects `regions`. */
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Enable hot text if the `DPATCH_HOT_TEXT` environment
+ * variable is set to `1`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if the
+ * variable is set to something other than `0` or `1`.
+ */
+dpatch_status hot_text_init_mode(void)
+{
+    char* str = getenv(HOT_TEXT_ENV_VAR);
+    if (str == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    if (strcmp(str, "0") != 0 && strcmp(str, "1") != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    enabled = str[0] == '1';
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Test if replacement functions are copied into hot text.
+ *
+ * @return `true` if replacements should be copied near the
+ * code they replace.
+ */
+bool hot_text_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * Test if every byte of a range is within
+ * `MAX_REGION_DISTANCE` of an address.
+ *
+ * @param near The address.
+ * @param start Address of the range's first byte.
+ * @param size Size of the range in bytes.
+ * @return `true` if the range is near `near`.
+ */
+static bool is_near(intptr_t near, intptr_t start, size_t size)
+{
+    return start > near - MAX_REGION_DISTANCE && start + (intptr_t) size < near + MAX_REGION_DISTANCE;
+}
+
+/**
+ * Map a new region near an address.
+ *
+ * Addresses are tried outwards from `near` a region at a
+ * time, so the region is as close as the address space
+ * allows and aligned for a huge page.
+ *
+ * @param near Address the region must be near.
+ * @param region Location to store the new region.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if no
+ * free address near `near` could be mapped, or an error on
+ * failure.
+ */
+static dpatch_status map_region(intptr_t near, struct hot_text_region** region)
+{
+    size_t size = memory_map_huge_page_size();
+    intptr_t base = 0;
+    intptr_t hint = 0;
+    intptr_t step = 0;
+    void* mapping = MAP_FAILED;
+    if (size == 0)
+    {
+        size = DEFAULT_REGION_SIZE;
+    }
+    base = near & ~((intptr_t) size - 1);
+    for (step = (intptr_t) size; step < MAX_REGION_DISTANCE && mapping == MAP_FAILED; step += (intptr_t) size)
+    {
+        /* Try above `near`, then below it. */
+        for (hint = base + step; mapping == MAP_FAILED; hint = base - step)
+        {
+            if (hint > 0 && is_near(near, hint, size))
+            {
+                mapping = mmap(
+                    (void*) hint, size,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                    -1, 0
+                );
+                /* Kernels older than 4.17 treat the address as a hint. */
+                if (mapping != MAP_FAILED && (intptr_t) mapping != hint)
+                {
+                    munmap(mapping, size);
+                    mapping = MAP_FAILED;
+                }
+            }
+            if (hint < base)
+            {
+                break;
+            }
+        }
+    }
+    if (mapping == MAP_FAILED)
+    {
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    madvise(mapping, size, MADV_HUGEPAGE);
+    memset(mapping, X64_INT3, size);
+    if (mprotect(mapping, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mapping, size);
+        return DPATCH_STATUS_EMPROT;
+    }
+    *region = calloc(1, sizeof(struct hot_text_region));
+    if (*region == NULL)
+    {
+        munmap(mapping, size);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    (*region)->start = (intptr_t) mapping;
+    (*region)->size = size;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Find a region near an address with space for a copy,
+ * mapping a new one if there is none.
+ *
+ * @param near Address the region must be near.
+ * @param length Space the copy needs, in bytes.
+ * @param region Location to store the region.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if no
+ * region could be mapped near `near`, or an error on
+ * failure.
+ */
+static dpatch_status find_region_locked(intptr_t near, size_t length, struct hot_text_region** region)
+{
+    struct hot_text_region* current = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    for (current = regions; current != NULL; current = current->next)
+    {
+        if (current->size - current->used >= length && is_near(near, current->start, current->size))
+        {
+            *region = current;
+            return DPATCH_STATUS_OK;
+        }
+    }
+    PROPAGATE_ERROR(map_region(near, &current), status);
+    if (current->size < length)
+    {
+        /* The region is kept for smaller copies. */
+        current->next = regions;
+        regions = current;
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    current->next = regions;
+    regions = current;
+    *region = current;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Record a copy made in a region.
+ *
+ * @warning The caller must hold `regions_lock`.
+ *
+ * @param region The region the copy is in.
+ * @param start Address of the copy.
+ * @param length Length of the copy in bytes.
+ * @param function The function copied.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status record_copy_locked
+(
+    struct hot_text_region* region,
+    intptr_t start,
+    size_t length,
+    intptr_t function
+)
+{
+    struct hot_text_copy* copies = NULL;
+    size_t allocated = region->copies_allocated == 0 ? 16 : region->copies_allocated * 2;
+    if (region->copies_length == region->copies_allocated)
+    {
+        copies = realloc(region->copies, allocated * sizeof(struct hot_text_copy));
+        if (copies == NULL)
+        {
+            return DPATCH_STATUS_ENOMEM;
+        }
+        region->copies = copies;
+        region->copies_allocated = allocated;
+    }
+    region->copies[region->copies_length].start = start;
+    region->copies[region->copies_length].length = length;
+    region->copies[region->copies_length].function = function;
+    region->copies_length++;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Copy a function into a hot text region near an address.
+ *
+ * @param near Address the copy must be reachable from with
+ *      a near jump.
+ * @param function Address of the function to copy.
+ * @param length Length of the function in bytes.
+ * @param label Description of the function, for the log.
+ * @param patch_id Patch the copy is made for, or 0.
+ * @param copy Location to store the address of the copy.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the function can't be relocated or no region could be
+ * mapped near `near`, or an error on failure.
+ */
+dpatch_status hot_text_copy
+(
+    intptr_t near,
+    intptr_t function,
+    size_t length,
+    const char* label,
+    uint64_t patch_id,
+    intptr_t* copy
+)
+{
+    char name[PERF_MAP_NAME_LEN];
+    struct hot_text_region* region = NULL;
+    machine_code_t* machine_code = NULL;
+    const char* reason = "no region could be mapped near it";
+    intptr_t destination = 0;
+    size_t copy_length = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    pthread_mutex_lock(&regions_lock);
+    status = find_region_locked(near, relocate_max_length(length), &region);
+    if (!IS_ERROR(status))
+    {
+        destination = region->start + (intptr_t) region->used;
+        status = relocate_function(function, length, destination, machine_code, &reason);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = machine_code_insert(machine_code, destination);
+    }
+    if (!IS_ERROR(status))
+    {
+        /* An unrecorded copy is overwritten by the next, as nothing jumps to it. */
+        copy_length = machine_code_length(machine_code);
+        status = record_copy_locked(region, destination, copy_length, function);
+    }
+    if (!IS_ERROR(status))
+    {
+        region->used += (copy_length + COPY_ALIGNMENT - 1) / COPY_ALIGNMENT * COPY_ALIGNMENT;
+    }
+    pthread_mutex_unlock(&regions_lock);
+    machine_code_free(machine_code);
+    if (status == DPATCH_STATUS_EUNKNOWN)
+    {
+        event_logf(
+            LOG_WARNING,
+            status,
+            patch_id,
+            "Can't copy %s into hot text, as %s, so it runs where it was loaded.",
+            label,
+            reason
+        );
+        return status;
+    }
+    if (IS_ERROR(status))
+    {
+        return status;
+    }
+    *copy = destination;
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        patch_id,
+        "Copied %s into hot text at %#lx, %zu bytes from the original %zu.",
+        label,
+        (unsigned long) destination,
+        copy_length,
+        length
+    );
+    if (perf_map_enabled())
+    {
+        snprintf(name, sizeof name, "dpatch hot text %s", label);
+        perf_map_record(destination, copy_length, name);
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Find the function a copy in hot text was made from.
+ *
+ * @param address An address in the copy.
+ * @return The function copied, or 0 if `address` isn't in
+ * a copy.
+ */
+intptr_t hot_text_origin(intptr_t address)
+{
+    struct hot_text_region* region = NULL;
+    intptr_t function = 0;
+    size_t low = 0;
+    size_t high = 0;
+    size_t middle = 0;
+    pthread_mutex_lock(&regions_lock);
+    for (region = regions; region != NULL && function == 0; region = region->next)
+    {
+        if (address < region->start || address >= region->start + (intptr_t) region->used)
+        {
+            continue;
+        }
+        /* Copies are appended in address order, so the last starting at or before `address` holds it. */
+        low = 0;
+        high = region->copies_length;
+        while (low < high)
+        {
+            middle = low + (high - low) / 2;
+            if (region->copies[middle].start <= address)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        if (low > 0 && address < region->copies[low - 1].start + (intptr_t) region->copies[low - 1].length)
+        {
+            function = region->copies[low - 1].function;
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+    return function;
+}
+
+/**
+ * Release a copy which nothing jumps to, such as one made
+ * for a batch which was never committed.
+ *
+ * The copy is forgotten, and its space is reused if no
+ * later copy in its region is still in use.
+ *
+ * @param copy Address of the copy.
+ */
+void hot_text_release(intptr_t copy)
+{
+    struct hot_text_region* region = NULL;
+    struct hot_text_copy* last = NULL;
+    size_t i = 0;
+    pthread_mutex_lock(&regions_lock);
+    for (region = regions; region != NULL; region = region->next)
+    {
+        if (copy < region->start || copy >= region->start + (intptr_t) region->used)
+        {
+            continue;
+        }
+        for (i = 0; i < region->copies_length && region->copies[i].start != copy; i++)
+        {
+        }
+        if (i == region->copies_length)
+        {
+            break;
+        }
+        memmove(
+            &region->copies[i],
+            &region->copies[i + 1],
+            (region->copies_length - i - 1) * sizeof(struct hot_text_copy)
+        );
+        region->copies_length--;
+        /* Space after the last copy is overwritten by the next, as nothing jumps to it. */
+        last = region->copies_length == 0 ? NULL : &region->copies[region->copies_length - 1];
+        region->used = last == NULL
+            ? 0
+            : (size_t) (last->start - region->start)
+                + (last->length + COPY_ALIGNMENT - 1) / COPY_ALIGNMENT * COPY_ALIGNMENT;
+        break;
+    }
+    pthread_mutex_unlock(&regions_lock);
+}
@@ -14,6 +14,7 @@
 
 #include "machine_code.h"
 #include "status.h"
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -25,7 +26,45 @@
 dpatch_status append_undefined_opcode(machine_code_t* machine_code);
 
 /**
- * Generate an opcode guaranteed to be undefined.
+ * Generate a short jump, relative to the end of the jump.
+ *
+ * @param machine_code The binary container to append to.
+ * @param displacement Signed distance to jump.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_short_jump(machine_code_t* machine_code, int8_t displacement);
+
+/**
+ * Generate a jump to the 64-bit address stored at a
+ * location relative to the end of the jump.
+ *
+ * @param machine_code The binary container to append to.
+ * @param displacement Signed distance from the end of the
+ *      jump to the address to jump to.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_indirect_jump(machine_code_t* machine_code, int32_t displacement);
+
+/**
+ * Append a 64-bit address, as data, to machine code.
+ *
+ * @param machine_code The binary container to append to.
+ * @param addr The address to append.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_address(machine_code_t* machine_code, intptr_t addr);
+
+/**
+ * Generate a near jump, relative to the end of the jump.
+ *
+ * @param machine_code The binary container to append to.
+ * @param displacement Signed distance to jump.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_near_jump(machine_code_t* machine_code, int32_t displacement);
+
+/**
+ * Generate a long jump to a 64-bit address.
  *
  * @param machine_code The binary container to append to.
  * @param addr Address to jump to.
@@ -33,4 +72,46 @@ dpatch_status append_undefined_opcode(machine_code_t* machine_code);
  */
 dpatch_status append_long_jump(machine_code_t* machine_code, intptr_t addr);
 
+/**
+ * Generate a jump through a slot of a dispatch table.
+ *
+ * @param machine_code The binary container to append to.
+ * @param table Address of the pointer to the current table.
+ * @param slot Index of the table entry to jump through.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_dispatch_jump(machine_code_t* machine_code, intptr_t table, uint32_t slot);
+
+/**
+ * Generate a stub which forwards most calls to `target`, and
+ * times every `*countdown`th call through `enter` and
+ * `leave`. The x87 and vector registers are saved whole
+ * around both calls.
+ *
+ * @param machine_code The binary container to append to.
+ * @param countdown Address of the 32-bit call counter.
+ * @param target Function unsampled calls are forwarded to.
+ * @param context Passed to `enter` and `leave`.
+ * @param enter Address of the function to call before a
+ *      sampled call.
+ * @param leave Address of the function to call after a
+ *      sampled call.
+ * @param vector_state The `xsave` state components to
+ *      save, or 0 to save with `fxsave`.
+ * @param vector_state_size Size of an `xsave` area holding
+ *      `vector_state`, in bytes.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_sampled_call
+(
+    machine_code_t* machine_code,
+    intptr_t countdown,
+    intptr_t target,
+    intptr_t context,
+    intptr_t enter,
+    intptr_t leave,
+    uint32_t vector_state,
+    size_t vector_state_size
+);
+
 #endif
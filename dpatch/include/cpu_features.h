@@ -0,0 +1,64 @@
+/**
+ * @file dpatch/include/cpu_features.h
+ *
+ * `cpu_features.h` declares functions for detecting the
+ * instruction set extensions the CPU and kernel support,
+ * and for reading the extensions a function's name says it
+ * was built for, such as `dot_avx2`.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_CPU_FEATURES_H_
+#define DPATCH_INCLUDE_CPU_FEATURES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Detect the extensions the CPU supports and the kernel
+ * saves the registers of. `cpuid` and `xgetbv` are only
+ * executed the first time.
+ *
+ * @return A bit set of the extensions supported.
+ */
+uint32_t cpu_features_detect(void);
+
+/**
+ * Find the register state which must be saved to preserve
+ * every x87 and vector register.
+ *
+ * @param size Location to store the size of an `xsave`
+ *      area holding the state, in bytes, or 0.
+ * @return The `xsave` state components to save, or 0 if the
+ * kernel hasn't enabled `xsave`, in which case the CPU has
+ * no registers `fxsave` doesn't save.
+ */
+uint32_t cpu_features_vector_state(size_t* size);
+
+/**
+ * Find the extensions a function's name says it needs.
+ *
+ * An extension is needed if its name, such as `avx2`,
+ * `avx512` or `sse4_2`, appears in the function's name
+ * between characters which aren't letters or digits.
+ *
+ * @param name The function's name.
+ * @return A bit set of the extensions named, or 0 if the
+ * function needs none.
+ */
+uint32_t cpu_features_required(const char* name);
+
+/**
+ * Describe a set of extensions for the log.
+ *
+ * @param features The extensions to describe.
+ * @param buffer Location to store the space separated
+ *      names of the extensions.
+ * @param length Size of `buffer` in bytes.
+ */
+void cpu_features_describe(uint32_t features, char* buffer, size_t length);
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file dpatch/include/deferred_patch.h
+ *
+ * `deferred_patch.h` declares functions for deferring
+ * function replacements until the object defining the
+ * function is loaded.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_DEFERRED_PATCH_H_
+#define DPATCH_INCLUDE_DEFERRED_PATCH_H_
+
+#include "status.h"
+#include <link.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Note that dpatch is an audit library, so it is told
+ * about each object as it is loaded, and replacements can
+ * be deferred.
+ */
+void deferred_patch_watch_loads(void);
+
+/**
+ * Test if replacements of functions which aren't loaded
+ * can be deferred.
+ *
+ * @return `true` if dpatch is told about objects as they
+ * are loaded.
+ */
+bool deferred_patch_available(void);
+
+/**
+ * Stage a replacement for a function which isn't loaded.
+ *
+ * The replacement is kept once its patch is committed, and
+ * applied to every object later loaded which defines
+ * `symbol`. It replaces any earlier deferred replacement of
+ * `symbol`.
+ *
+ * @param patch_id Patch the replacement belongs to.
+ * @param symbol Name of the function to replace.
+ * @param to The replacement.
+ * @param label Description of the replacement, for the
+ *      log.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status deferred_patch_add
+(
+    uint64_t patch_id,
+    const char* symbol,
+    intptr_t to,
+    const char* label
+);
+
+/**
+ * Keep the replacements a committed patch deferred, and
+ * apply them to any matching objects loaded since the
+ * patch was prepared.
+ *
+ * The program's objects are listed under the loader's
+ * lock, then each is patched while dpatch holds a
+ * reference to it. The lock is not held while patching,
+ * since patching may call into the loader, and the loader
+ * holds its own lock while telling dpatch about new
+ * objects.
+ *
+ * @param patch_id The committed patch.
+ */
+void deferred_patch_commit(uint64_t patch_id);
+
+/**
+ * Count the replacements a patch staged which it hasn't
+ * committed.
+ *
+ * @param patch_id The patch to count.
+ * @return The number of uncommitted replacements `patch_id`
+ * deferred.
+ */
+size_t deferred_patch_staged(uint64_t patch_id);
+
+/**
+ * Drop the replacements a patch staged, if it was not
+ * committed.
+ *
+ * @param patch_id The patch to withdraw.
+ */
+void deferred_patch_withdraw(uint64_t patch_id);
+
+/**
+ * Apply the deferred replacements to an object which was
+ * just loaded, before its code first runs.
+ *
+ * @param object The object which was loaded.
+ */
+void deferred_patch_object_opened(struct link_map* object);
+
+/**
+ * Forget the redirects of functions in an object which is
+ * being unloaded, so they aren't mistaken for functions
+ * later loaded at the same addresses.
+ *
+ * @param object The object which is being unloaded.
+ */
+void deferred_patch_object_closed(struct link_map* object);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * @file dpatch/include/dispatch_table.h
+ *
+ * `dispatch_table.h` declares functions for routing
+ * redirected entries through a versioned dispatch table.
+ *
+ * In dispatch table mode, each redirected entry jumps to a
+ * thunk owned by dpatch, which jumps through the entry's
+ * slot in the current table. Each patch generation
+ * publishes a complete new table, and switches every
+ * redirected entry at once by replacing the pointer to the
+ * current table.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_DISPATCH_TABLE_H_
+#define DPATCH_INCLUDE_DISPATCH_TABLE_H_
+
+#include "status.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Size of each slot's thunk, in bytes. */
+#define DISPATCH_TABLE_THUNK_LEN 32
+
+/**
+ * Enable or disable dispatch table mode.
+ *
+ * Only entries redirected for the first time after the
+ * mode is enabled are routed through the table.
+ *
+ * @param enabled Whether new redirects use the table.
+ */
+void dispatch_table_set_enabled(bool enabled);
+
+/**
+ * Test if dispatch table mode is enabled.
+ *
+ * @return `true` if new redirects use the table.
+ */
+bool dispatch_table_enabled(void);
+
+/**
+ * Enable dispatch table mode if the `DPATCH_DISPATCH_TABLE`
+ * environment variable is set to `1`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if the
+ * variable is set to something other than `0` or `1`.
+ */
+dpatch_status dispatch_table_init_mode(void);
+
+/**
+ * Get the thunk which jumps through a slot of the current
+ * table, creating it if needed.
+ *
+ * @warning Callers must serialise calls which change the
+ * table.
+ *
+ * @param slot Index of the slot.
+ * @param thunk Location to store the thunk's address.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dispatch_table_thunk(size_t slot, intptr_t* thunk);
+
+/**
+ * Publish a new table, switching every thunk to it with a
+ * single release store.
+ *
+ * The previous table is retained, as threads may still be
+ * jumping through it.
+ *
+ * @warning Callers must serialise calls which change the
+ * table.
+ *
+ * @param targets The target of each slot.
+ * @param length The number of slots.
+ * @param previous Location to store the previous table.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status dispatch_table_publish
+(
+    const intptr_t* targets,
+    size_t length,
+    intptr_t** previous
+);
+
+/**
+ * Switch back to a table replaced by
+ * `dispatch_table_publish`.
+ *
+ * @param previous The table to switch back to.
+ */
+void dispatch_table_revert(intptr_t* previous);
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ * @file dpatch/include/event_log.h
+ *
+ * `event_log.h` declares a non-blocking log for dpatch
+ * events.
+ *
+ * Events are posted into a fixed-size, lock-free ring
+ * buffer and written out by a background thread, so
+ * posting an event never blocks on I/O. Events posted
+ * while the ring is full are dropped and counted.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_EVENT_LOG_H_
+#define DPATCH_INCLUDE_EVENT_LOG_H_
+
+#include "status.h"
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+
+/** Maximum length of an event message, including `NUL`. */
+#define DPATCH_EVENT_MESSAGE_LEN 160
+
+/**
+ * A single logged event.
+ */
+struct dpatch_event
+{
+    /** `CLOCK_REALTIME` time the event was posted. */
+    struct timespec timestamp;
+
+    /** `syslog` priority of the event. */
+    int priority;
+
+    /** Status code associated with the event. */
+    dpatch_status status;
+
+    /** Identifier of the patch the event relates to, or 0. */
+    uint64_t patch_id;
+
+    /** Human readable description of the event. */
+    char message[DPATCH_EVENT_MESSAGE_LEN];
+};
+
+/**
+ * Post an event to the log.
+ *
+ * `event_log_post` never blocks, and is safe to call from
+ * signal handlers.
+ *
+ * @param priority `syslog` priority of the event.
+ * @param status Status code associated with the event.
+ * @param patch_id Patch the event relates to, or 0.
+ * @param message Description of the event. It is truncated
+ *      to `DPATCH_EVENT_MESSAGE_LEN - 1` characters.
+ */
+void event_log_post
+(
+    int priority,
+    dpatch_status status,
+    uint64_t patch_id,
+    const char* message
+);
+
+/**
+ * Post an event with a formatted message to the log.
+ *
+ * @warning Unlike `event_log_post`, `event_logf` is not
+ * safe to call from signal handlers.
+ *
+ * @param priority `syslog` priority of the event.
+ * @param status Status code associated with the event.
+ * @param patch_id Patch the event relates to, or 0.
+ * @param format `printf` style format for the message.
+ */
+void event_logf
+(
+    int priority,
+    dpatch_status status,
+    uint64_t patch_id,
+    const char* format,
+    ...
+) __attribute__((format(printf, 4, 5)));
+
+/**
+ * Post an error to the log, recording where it occurred.
+ *
+ * @param status The error.
+ * @param file Source file the error occurred in.
+ * @param line Source line the error occurred on.
+ */
+void event_log_error(dpatch_status status, const char* file, int line);
+
+/**
+ * Start the background thread that drains the log.
+ *
+ * Events are written to `syslog`, and also appended to
+ * the file named by the `DPATCH_LOG_FILE` environment
+ * variable if it is set. Starting the log more than once
+ * has no effect.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status event_log_start(void);
+
+/**
+ * Write out every event in the log from the calling
+ * thread.
+ *
+ * `event_log_flush` is intended for use before the process
+ * exits, and by hosts which do not start the background
+ * thread.
+ */
+void event_log_flush(void);
+
+/**
+ * Get the number of events dropped because the log was
+ * full.
+ *
+ * @return The number of dropped events.
+ */
+uint64_t event_log_dropped(void);
+
+#endif
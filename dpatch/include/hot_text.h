@@ -0,0 +1,83 @@
+/**
+ * @file dpatch/include/hot_text.h
+ *
+ * `hot_text.h` declares functions for copying replacement
+ * functions into executable regions near the code they
+ * replace, so the replaced code can reach them with a short
+ * jump and they share its instruction TLB entries.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_HOT_TEXT_H_
+#define DPATCH_INCLUDE_HOT_TEXT_H_
+
+#include "status.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Enable hot text if the `DPATCH_HOT_TEXT` environment
+ * variable is set to `1`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if the
+ * variable is set to something other than `0` or `1`.
+ */
+dpatch_status hot_text_init_mode(void);
+
+/**
+ * Test if replacement functions are copied into hot text.
+ *
+ * @return `true` if replacements should be copied near the
+ * code they replace.
+ */
+bool hot_text_enabled(void);
+
+/**
+ * Copy a function into a hot text region near an address.
+ *
+ * @param near Address the copy must be reachable from with
+ *      a near jump.
+ * @param function Address of the function to copy.
+ * @param length Length of the function in bytes.
+ * @param label Description of the function, for the log.
+ * @param patch_id Patch the copy is made for, or 0.
+ * @param copy Location to store the address of the copy.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the function can't be relocated or no region could be
+ * mapped near `near`, or an error on failure.
+ */
+dpatch_status hot_text_copy
+(
+    intptr_t near,
+    intptr_t function,
+    size_t length,
+    const char* label,
+    uint64_t patch_id,
+    intptr_t* copy
+);
+
+/**
+ * Find the function a copy in hot text was made from.
+ *
+ * @param address An address in the copy.
+ * @return The function copied, or 0 if `address` isn't in
+ * a copy.
+ */
+intptr_t hot_text_origin(intptr_t address);
+
+/**
+ * Release a copy which nothing jumps to, such as one made
+ * for a batch which was never committed.
+ *
+ * The copy is forgotten, and its space is reused if no
+ * later copy in its region is still in use.
+ *
+ * @param copy Address of the copy.
+ */
+void hot_text_release(intptr_t copy);
+
+#endif
@@ -24,6 +24,60 @@
  */
 typedef struct machine_code machine_code_t;
 
+/**
+ * Mechanism `machine_code_insert` uses to write into
+ * protected program text.
+ */
+typedef enum
+{
+    /**
+     * Temporarily make the target pages writable with
+     * `mprotect`, then restore them.
+     */
+    DPATCH_WRITE_MPROTECT,
+
+    /**
+     * Write through `/proc/self/mem`, which forces writes
+     * to read-only pages and leaves their protections (and
+     * the process' memory mappings) untouched.
+     */
+    DPATCH_WRITE_PROC_MEM,
+} dpatch_write_mode;
+
+/**
+ * Convert a string to a `dpatch_write_mode`.
+ *
+ * @param str String to convert.
+ * @param mode Address to store the write mode in.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status str_to_write_mode(char* str, dpatch_write_mode* mode);
+
+/**
+ * Select the mechanism used to write machine code into
+ * program memory.
+ *
+ * @param mode The write mode to use for future inserts.
+ */
+void machine_code_set_write_mode(dpatch_write_mode mode);
+
+/**
+ * Get the mechanism used to write machine code into
+ * program memory.
+ *
+ * @return The current write mode.
+ */
+dpatch_write_mode machine_code_write_mode(void);
+
+/**
+ * Select the write mode named by the `DPATCH_WRITE_MODE`
+ * environment variable, if it is set.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error if the variable
+ * names an unknown mode.
+ */
+dpatch_status machine_code_init_write_mode(void);
+
 /**
  * Allocate and initialise a new machine code container.
  *
@@ -80,10 +134,32 @@ void machine_code_empty(machine_code_t* machine_code);
 /**
  * Insert machine code into a program segment.
  *
+ * If the code is written into a mapping backed by
+ * transparent huge pages, it is written without splitting
+ * them where possible. File-backed huge pages are replaced
+ * with patched anonymous copies, so `/proc/pid/maps` shows
+ * them as anonymous memory afterwards.
+ *
  * @param machine_code Handle to the machine code to insert.
  * @param address Address to write the code into.
  * @return `DPATCH_STATUS_OK` or an error on failure.
  */
 dpatch_status machine_code_insert(machine_code_t* machine_code, intptr_t address);
 
+/**
+ * Insert machine code into a program segment with a single
+ * atomic store, so threads executing or reading the code
+ * see either the old or new bytes, never a mixture.
+ * Huge pages backing text are kept intact as they are by
+ * `machine_code_insert`.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ *      It must be 1, 2, 4, or 8 bytes long.
+ * @param address Address to write the code into. The
+ *      write must not span a cache line.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ERROR` if the
+ * write can not be made atomically, or an error on failure.
+ */
+dpatch_status machine_code_insert_atomic(machine_code_t* machine_code, intptr_t address);
+
 #endif
@@ -0,0 +1,60 @@
+/**
+ * @file dpatch/include/memory_map.h
+ *
+ * `memory_map.h` declares functions for inspecting the
+ * memory mappings of the current process.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_MEMORY_MAP_H_
+#define DPATCH_INCLUDE_MEMORY_MAP_H_
+
+#include "status.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A single mapping in the process' address space.
+ */
+struct memory_region
+{
+    /** Address of the first byte of the mapping. */
+    uintptr_t start;
+
+    /** Address one past the last byte of the mapping. */
+    uintptr_t end;
+
+    /** `PROT_*` bits the mapping is protected with. */
+    int prot;
+
+    /** Anonymous memory backed by transparent huge pages, in kB. */
+    size_t anon_huge_kb;
+
+    /** File-backed memory mapped with huge pages, in kB. */
+    size_t file_pmd_kb;
+};
+
+/**
+ * Get the size of a transparent huge page.
+ *
+ * @return The huge page size in bytes, or 0 if transparent
+ * huge pages are disabled.
+ */
+size_t memory_map_huge_page_size(void);
+
+/**
+ * Find the mapping containing an address, including its
+ * huge page usage from `/proc/self/smaps`.
+ *
+ * @param address An address inside the mapping.
+ * @param region Location to store the mapping.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if
+ * the process' mappings can't be read, or
+ * `DPATCH_STATUS_ERROR` if `address` is not mapped.
+ */
+dpatch_status memory_map_find(uintptr_t address, struct memory_region* region);
+
+#endif
@@ -15,6 +15,7 @@
 
 #include "code_generator.h"
 #include "machine_code.h"
+#include "redirect.h"
 #include "status.h"
 #include <dlfcn.h>
 #include <stdint.h>
@@ -30,6 +31,19 @@ typedef enum
      */
     DPATCH_OP_REPLACE_FUNCTION_INTERNAL,
 
+    /**
+     * Replace a function with the first of several
+     * candidates the CPU supports the instructions of.
+     */
+    DPATCH_OP_REPLACE_FUNCTION_BEST,
+
+    /**
+     * Replace every changed function a loaded library
+     * exports with its version from a new build of the
+     * library.
+     */
+    DPATCH_OP_REPLACE_LIBRARY,
+
     /**
      * A dummy operation. Perform no patch.
      */
@@ -88,11 +102,31 @@ dpatch_status patch_operation
 void patch_free(patch_t* patch);
 
 /**
- * Attempt to apply a patch to the running program.
+ * Load a replacement library into the program's namespace.
+ *
+ * The library is relocated eagerly and its code faulted
+ * into memory, so calls into it after a patch is committed
+ * don't stall.
+ *
+ * @param library Path to the library to load.
+ * @param handle Location to store the library's handle.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status patch_load_library(const char* library, void** handle);
+
+/**
+ * Prepare a patch to be applied to the running program.
+ *
+ * Preparing a patch performs all of its slow work, such as
+ * loading libraries and resolving symbols, and stages the
+ * writes needed to apply it in `batch`. A function
+ * replacement whose function isn't loaded is deferred
+ * instead, if dpatch is an audit library.
  *
- * @param patch Handle to the patch to apply.
+ * @param patch Handle to the patch to prepare.
+ * @param batch Batch to stage the patch's writes in.
  * @return `DPATCH_STATUS_OK` or an error on failure.
  */
-dpatch_status patch_apply(patch_t* patch);
+dpatch_status patch_prepare(patch_t* patch, redirect_batch_t* batch);
 
 #endif
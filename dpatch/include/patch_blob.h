@@ -0,0 +1,86 @@
+/**
+ * @file dpatch/include/patch_blob.h
+ *
+ * `patch_blob.h` declares functions for compiling a
+ * prepared patch set into a position independent blob,
+ * and for applying a blob in another process.
+ *
+ * A blob records every redirect in a patch set as an
+ * offset from the base of the object containing each end,
+ * so any process which maps the same objects - such as a
+ * pre-forked worker - can apply it without parsing the
+ * script or resolving symbols again.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_PATCH_BLOB_H_
+#define DPATCH_INCLUDE_PATCH_BLOB_H_
+
+#include "patch_set.h"
+#include "redirect.h"
+#include "status.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Compile a prepared patch set into a blob.
+ *
+ * The blob is written to a new, sealed, `memfd`, which
+ * other processes can open through `/proc/<pid>/fd/<fd>`.
+ *
+ * Each redirect is recorded by the function it leads to,
+ * even if this process runs it through a hot text copy or
+ * a guard. Processes applying the blob redirect straight
+ * to the function. Replacements deferred until their
+ * functions are loaded can't be recorded, so a patch set
+ * which deferred any is rejected.
+ *
+ * @param patch_set Handle to the prepared patch set.
+ * @param script_hash Hash of the script the patch set was
+ *      parsed from, so processes can tell which script
+ *      the blob holds.
+ * @param fd Location to store the blob's file descriptor.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * patch set deferred a replacement or redirects to an
+ * address outside every loaded object, or an error on
+ * failure.
+ */
+dpatch_status patch_blob_compile(patch_set_t* patch_set, uint64_t script_hash, int* fd);
+
+/**
+ * Stage the redirects recorded in a blob in a batch.
+ *
+ * Objects named by the blob are located in the current
+ * process, and replacement libraries which are not yet
+ * loaded are loaded.
+ *
+ * @param fd File descriptor of the blob to read.
+ * @param batch Batch to stage the blob's redirects in.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * blob is malformed, or an error on failure.
+ */
+dpatch_status patch_blob_prepare(int fd, redirect_batch_t* batch);
+
+/**
+ * Test if a file starts like a compiled blob.
+ *
+ * @param fd File descriptor of the file to test.
+ * @return `true` if the file starts with the blob magic.
+ */
+bool patch_blob_is_blob(int fd);
+
+/**
+ * Read the hash of the script a blob was compiled from.
+ *
+ * @param fd File descriptor of the blob to read.
+ * @param script_hash Location to store the hash.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * file isn't a blob this version of dpatch can apply, or an
+ * error on failure.
+ */
+dpatch_status patch_blob_script_hash(int fd, uint64_t* script_hash);
+
+#endif
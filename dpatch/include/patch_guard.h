@@ -0,0 +1,79 @@
+/**
+ * @file dpatch/include/patch_guard.h
+ *
+ * `patch_guard.h` declares functions for guarding function
+ * replacements, so a replacement which runs slower than the
+ * function it replaced is reverted automatically.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_PATCH_GUARD_H_
+#define DPATCH_INCLUDE_PATCH_GUARD_H_
+
+#include "status.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Configure guarded replacements from the
+ * `DPATCH_GUARD_WINDOW_MS`, `DPATCH_GUARD_SAMPLE_EVERY` and
+ * `DPATCH_GUARD_THRESHOLD_PCT` environment variables.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if a
+ * variable isn't a non-negative integer.
+ */
+dpatch_status patch_guard_init_mode(void);
+
+/**
+ * Test if function replacements are guarded.
+ *
+ * @return `true` if replacements should be redirected
+ * through a guard.
+ */
+bool patch_guard_enabled(void);
+
+/**
+ * Create a guard which times a function against its
+ * replacement.
+ *
+ * The guard's stub splits calls between the code `from`
+ * currently runs and `replacement`, timing a sample of
+ * them. Once the guard's window has passed, `from` is
+ * redirected to whichever is faster, and the stub is no
+ * longer used.
+ *
+ * @param from Entry point being replaced.
+ * @param function The replacement function.
+ * @param replacement Address which runs `function`, such as
+ *      a copy of it in hot text, or `function` itself.
+ * @param label Description of the replacement, for the log.
+ * @param patch_id Patch the replacement belongs to, or 0.
+ * @param stub Location to store the address to redirect
+ *      `from` to.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the code `from` runs can't be reached once `from` is
+ * overwritten, `DPATCH_STATUS_ERROR` if the thread guards
+ * decide on can't be started, or an error on failure.
+ */
+dpatch_status patch_guard_new
+(
+    intptr_t from,
+    intptr_t function,
+    intptr_t replacement,
+    const char* label,
+    uint64_t patch_id,
+    intptr_t* stub
+);
+
+/**
+ * Release a guard whose stub nothing jumps to, such as one
+ * made for a batch which was never committed.
+ *
+ * @param stub Address of the guard's stub.
+ */
+void patch_guard_release(intptr_t stub);
+
+#endif
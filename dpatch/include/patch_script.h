@@ -14,6 +14,10 @@
 
 #include "patch_set.h"
 #include "status.h"
+#include <stdint.h>
+
+/** The maximum length of a line in a patch script. */
+#define PATCH_SCRIPT_MAX_LINE_LEN 255
 
 /**
  * `patch_script_t` is a handle to a patch script.
@@ -50,6 +54,25 @@ dpatch_status patch_script_path
     char* path
 );
 
+/**
+ * Parse a single line (instruction) of a patch script.
+ *
+ * The symbol to replace may be a glob or a regular
+ * expression between `/`s, which is expanded to every
+ * matching function when the patch is prepared.
+ *
+ * @param line The script line to be parsed. It must be
+ *      shorter than `PATCH_SCRIPT_MAX_LINE_LEN`.
+ * @param patch_set Patch to parse the line into.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * line or its selector is invalid, or an error on failure.
+ */
+dpatch_status parse_script_line
+(
+    char* line,
+    patch_set_t* patch_set
+);
+
 /**
  * Parse a patch script into memory.
  *
@@ -63,4 +86,14 @@ dpatch_status patch_script_parse
     patch_set_t* patch_set
 );
 
+/**
+ * Hash a patch script's contents with 64-bit FNV-1a.
+ *
+ * @param patch_script Handle to the patch script to hash.
+ * @param hash Location to store the hash.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EFILE` if
+ * the script can't be read.
+ */
+dpatch_status patch_script_hash(patch_script_t* patch_script, uint64_t* hash);
+
 #endif
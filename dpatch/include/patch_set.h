@@ -14,7 +14,10 @@
 #define DPATCH_INCLUDE_PATCH_SET_H_
 
 #include "patch.h"
+#include "redirect.h"
 #include "status.h"
+#include <stdint.h>
+#include <time.h>
 
 /**
  * patch_set_t provides an opaque type for representing a
@@ -31,6 +34,40 @@ typedef struct patch_set patch_set_t;
  */
 dpatch_status patch_set_new(patch_set_t** patch_set);
 
+/**
+ * Get the identifier of a patch set.
+ *
+ * Every patch set is given a unique, non-zero identifier
+ * when it is created, which tags the events it logs.
+ *
+ * @param patch_set Handle to the patch set to query.
+ * @return The patch set's identifier.
+ */
+uint64_t patch_set_id(patch_set_t* patch_set);
+
+/**
+ * Get the writes staged by preparing a patch set.
+ *
+ * @param patch_set Handle to the patch set to query.
+ * @return The patch set's batch, or `NULL` if it is not
+ * prepared.
+ */
+redirect_batch_t* patch_set_batch(patch_set_t* patch_set);
+
+/**
+ * Use a compiled patch blob as the contents of a patch set.
+ *
+ * Preparing the patch set stages the blob's pre-resolved
+ * redirects, rather than preparing each patch operation.
+ *
+ * @see patch_blob.h
+ *
+ * @param patch_set Handle to the patch set to configure.
+ * @param fd File descriptor of the blob. It must remain
+ *      open until the patch set is prepared.
+ */
+void patch_set_load_blob(patch_set_t* patch_set, int fd);
+
 /**
  * Free and deallocate a patch set.
  *
@@ -64,7 +101,62 @@ dpatch_status patch_set_add_operation
 );
 
 /**
- * Attempt to apply a patch_set to the target program.
+ * Prepare a patch set to be committed.
+ *
+ * Preparation performs every slow part of applying the
+ * patch set - loading and prefaulting libraries, resolving
+ * symbols, and encoding machine code - without modifying
+ * the program.
+ *
+ * @param patch_set Handle to the patch_set to prepare.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status patch_set_prepare(patch_set_t* patch_set);
+
+/**
+ * Commit a prepared patch set to the target program.
+ *
+ * Committing performs only the writes staged by
+ * `patch_set_prepare`. If they can not be completed before
+ * `deadline`, the program is left unpatched and
+ * `DPATCH_STATUS_ETIMEDOUT` is returned.
+ *
+ * When `DPATCH_REWRITE_POINTERS` is set, function pointers
+ * to the redirected entries are rewritten once the writes
+ * are done.
+ *
+ * Replacements deferred until their functions are loaded
+ * are kept once the writes are done.
+ *
+ * @param patch_set Handle to the prepared patch_set.
+ * @param deadline `CLOCK_MONOTONIC` time the commit must
+ *      complete by, or `NULL` for no deadline.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status patch_set_commit
+(
+    patch_set_t* patch_set,
+    const struct timespec* deadline
+);
+
+/**
+ * Commit a prepared patch set, allowing it `budget_us`
+ * microseconds from now.
+ *
+ * @param patch_set Handle to the prepared patch_set.
+ * @param budget_us Time allowed for the commit, or 0 for
+ *      no limit.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status patch_set_commit_within
+(
+    patch_set_t* patch_set,
+    uint64_t budget_us
+);
+
+/**
+ * Attempt to prepare and commit a patch_set to the target
+ * program.
  *
  * @param patch_set Handle to the patch_set to be applied.
  * @return `DPATCH_STATUS_OK`, or an error on failure.
@@ -0,0 +1,43 @@
+/**
+ * @file dpatch/include/patch_watch.h
+ *
+ * `patch_watch.h` declares a watcher which applies patch
+ * scripts and blobs dropped into a directory.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_PATCH_WATCH_H_
+#define DPATCH_INCLUDE_PATCH_WATCH_H_
+
+#include "status.h"
+
+/**
+ * A function which applies a patch file found by the
+ * watcher.
+ *
+ * @param path Path to the script or blob to apply.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+typedef dpatch_status (*patch_watch_apply)(char* path);
+
+/**
+ * Start watching the directory named by the
+ * `DPATCH_WATCH_DIR` environment variable, if it is set.
+ *
+ * Files written or moved into the directory are applied
+ * once writes to them have been quiet for
+ * `DPATCH_WATCH_DEBOUNCE_MS` milliseconds. A file whose
+ * contents have already been applied is skipped. Files
+ * whose names start with `.` are ignored, so patches can
+ * be written under a hidden name, then renamed into place.
+ *
+ * @param apply Function to apply each new file with.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * directory can't be watched, or an error on failure.
+ */
+dpatch_status patch_watch_start(patch_watch_apply apply);
+
+#endif
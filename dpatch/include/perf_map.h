@@ -0,0 +1,53 @@
+/**
+ * @file dpatch/include/perf_map.h
+ *
+ * `perf_map.h` declares functions for describing the code
+ * dpatch writes to profilers, so samples in jumps, stubs
+ * and thunks are attributed to the patch which created
+ * them rather than to whichever symbol they overwrote.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_PERF_MAP_H_
+#define DPATCH_INCLUDE_PERF_MAP_H_
+
+#include "status.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Enable the profiler maps requested by the `DPATCH_PERF_MAP`
+ * and `DPATCH_JITDUMP` environment variables.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if
+ * `DPATCH_PERF_MAP` is set to something other than `0` or
+ * `1`.
+ */
+dpatch_status perf_map_init(void);
+
+/**
+ * Test if any profiler map is enabled.
+ *
+ * @return `true` if code written by dpatch is recorded.
+ */
+bool perf_map_enabled(void);
+
+/**
+ * Record a region of code written by dpatch.
+ *
+ * The region is appended to `/tmp/perf-<pid>.map` and the
+ * jitdump file, if they are enabled. The code is copied
+ * into the jitdump from memory, so it must already be
+ * written.
+ *
+ * @param start Address of the first byte of the code.
+ * @param length Length of the code in bytes.
+ * @param name Name profilers should show for the code.
+ */
+void perf_map_record(intptr_t start, size_t length, const char* name);
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * @file dpatch/include/pointer_scan.h
+ *
+ * `pointer_scan.h` declares functions for rewriting
+ * function pointers stored in the program's data, so
+ * indirect calls to a replaced function reach its
+ * replacement without passing through the old entry.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_POINTER_SCAN_H_
+#define DPATCH_INCLUDE_POINTER_SCAN_H_
+
+#include "redirect.h"
+#include "status.h"
+#include <stdbool.h>
+
+/**
+ * `pointer_scan_t` is a handle to a scan for pointers to
+ * the functions a batch redirects.
+ */
+typedef struct pointer_scan pointer_scan_t;
+
+/**
+ * Test if pointers are rewritten when patches are
+ * committed.
+ *
+ * @return `true` if committed batches are followed by a
+ * pointer scan.
+ */
+bool pointer_scan_enabled(void);
+
+/**
+ * Enable pointer rewriting if the `DPATCH_REWRITE_POINTERS`
+ * environment variable is set to `1`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if the
+ * variable is set to something other than `0` or `1`.
+ */
+dpatch_status pointer_scan_init_mode(void);
+
+/**
+ * Create a scan for a batch which is about to be
+ * committed, recording where each entry it redirects
+ * currently leads.
+ *
+ * @param new Location to store a handle to the scan.
+ * @param batch Handle to the prepared batch.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status pointer_scan_new(pointer_scan_t** new, redirect_batch_t* batch);
+
+/**
+ * Deallocate a scan.
+ *
+ * @param scan Handle to the scan to free, or `NULL`.
+ */
+void pointer_scan_free(pointer_scan_t* scan);
+
+/**
+ * Rewrite pointers to the entries a committed batch
+ * redirected, in the writable and RELRO segments of every
+ * loaded object.
+ *
+ * Objects are visited with `dl_iterate_phdr`, which holds
+ * the loader's lock, so an object can't be unloaded while
+ * it is scanned.
+ *
+ * @param scan Handle to the scan, created before the batch
+ *      was committed.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EDYN` if the
+ * program's objects can't be listed.
+ */
+dpatch_status pointer_scan_run(pointer_scan_t* scan);
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * @file dpatch/include/profiler.h
+ *
+ * `profiler.h` declares a sampling profiler which reports
+ * how much CPU time is spent in patched code, so a hotfix
+ * can be validated under real load without attaching
+ * external tools.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_PROFILER_H_
+#define DPATCH_INCLUDE_PROFILER_H_
+
+#include "status.h"
+
+/**
+ * Start sampling every thread of the process, if the
+ * `DPATCH_PROFILE_HZ` environment variable is set.
+ *
+ * Samples are reported to the event log every
+ * `DPATCH_PROFILE_REPORT_MS` milliseconds.
+ *
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ERROR` if a
+ * variable is invalid or the profiler can't be started, or
+ * another error on failure.
+ */
+dpatch_status profiler_start(void);
+
+#endif
@@ -0,0 +1,252 @@
+/**
+ * @file dpatch/include/redirect.h
+ *
+ * `redirect.h` declares functions for redirecting calls
+ * from one function entry to another, and tracking the
+ * current target of every redirected entry.
+ *
+ * Redirects are applied in batches. Preparing a batch
+ * plans and encodes every write it needs; committing it
+ * performs only those writes.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_REDIRECT_H_
+#define DPATCH_INCLUDE_REDIRECT_H_
+
+#include "status.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * `redirect_batch_t` is a handle to a set of redirects to
+ * be committed together.
+ */
+typedef struct redirect_batch redirect_batch_t;
+
+/**
+ * A function releasing code staged for a redirect, such as
+ * a copy of a replacement in hot text, or a guard's stub.
+ *
+ * @param address Address of the code to release.
+ */
+typedef void (*redirect_release)(intptr_t address);
+
+/**
+ * Allocate and initialise a new, empty redirect batch.
+ *
+ * @param new Location to store the new batch handle.
+ * @param patch_id Patch the batch belongs to, or 0.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_new(redirect_batch_t** new, uint64_t patch_id);
+
+/**
+ * Deallocate a redirect batch.
+ *
+ * If the batch was never committed, the code staged for it
+ * with `redirect_batch_stage` is released, as nothing can
+ * jump to it.
+ *
+ * @param batch Handle to the batch to free.
+ */
+void redirect_batch_free(redirect_batch_t* batch);
+
+/**
+ * Record code created for a batch's redirects, to be
+ * released if the batch is freed without being committed.
+ *
+ * Code is released in the reverse of the order it was
+ * staged.
+ *
+ * @param batch Handle to the batch the code was created for.
+ * @param address Address of the code.
+ * @param release Function to release the code.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_stage
+(
+    redirect_batch_t* batch,
+    intptr_t address,
+    redirect_release release
+);
+
+/**
+ * Add a redirect of calls arriving at `from` to `to`.
+ *
+ * Redirects take effect in the order they are added.
+ *
+ * @param batch Handle to the batch to add to.
+ * @param from Entry point to redirect.
+ * @param to Address to redirect calls to.
+ * @param label Description of the redirect, for logging.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_add
+(
+    redirect_batch_t* batch,
+    intptr_t from,
+    intptr_t to,
+    const char* label
+);
+
+/**
+ * Add a redirect of calls arriving at `from` to `to`,
+ * which jumps to code standing in for `to`.
+ *
+ * The table records `to` as the function `from` runs, so a
+ * later redirect of `to` moves `from` on too, and a
+ * redirect back to `from` is found to be a cycle.
+ *
+ * @param batch Handle to the batch to add to.
+ * @param from Entry point to redirect.
+ * @param to The function calls to `from` should run.
+ * @param through Address to jump to, such as a copy of `to`
+ *      in hot text, or a guard's stub.
+ * @param label Description of the redirect, for logging.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_add_through
+(
+    redirect_batch_t* batch,
+    intptr_t from,
+    intptr_t to,
+    intptr_t through,
+    const char* label
+);
+
+/**
+ * Plan and encode every write needed to commit a batch.
+ *
+ * If a redirect's target is itself redirected, it is sent
+ * straight to the newest version of the target. Entries
+ * already redirected to a newly redirected function are
+ * rewritten to jump straight to the same place, so a call
+ * never takes more than one hop.
+ *
+ * @param batch Handle to the batch to prepare.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_prepare(redirect_batch_t* batch);
+
+/**
+ * Perform the writes staged in a prepared batch.
+ *
+ * If the batch can not be committed before `deadline`, it
+ * is not started, or any writes already performed are
+ * rolled back, and `DPATCH_STATUS_ETIMEDOUT` is returned.
+ *
+ * @param batch Handle to the batch to commit.
+ * @param deadline `CLOCK_MONOTONIC` time the commit must
+ *      complete by, or `NULL` for no deadline.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_commit
+(
+    redirect_batch_t* batch,
+    const struct timespec* deadline
+);
+
+/**
+ * Get the number of writes a prepared batch will perform.
+ *
+ * @param batch Handle to the batch to query.
+ * @return The number of function entries to be written.
+ */
+size_t redirect_batch_writes(redirect_batch_t* batch);
+
+/**
+ * Get the number of redirects added to a batch.
+ *
+ * @param batch Handle to the batch to query.
+ * @return The number of redirects requested.
+ */
+size_t redirect_batch_length(redirect_batch_t* batch);
+
+/**
+ * Get the patch a batch belongs to.
+ *
+ * @param batch Handle to the batch to query.
+ * @return The patch's identifier, or 0.
+ */
+uint64_t redirect_batch_patch_id(redirect_batch_t* batch);
+
+/**
+ * Get a redirect added to a batch.
+ *
+ * @param batch Handle to the batch to query.
+ * @param index Index of the redirect, in the order added.
+ * @param from Location to store the redirected entry point.
+ * @param to Location to store the redirect's destination.
+ * @param label Location to store the redirect's label.
+ */
+void redirect_batch_request
+(
+    redirect_batch_t* batch,
+    size_t index,
+    intptr_t* from,
+    intptr_t* to,
+    const char** label
+);
+
+/**
+ * Redirect calls arriving at `from` to `to` immediately.
+ *
+ * @param from Entry point to redirect.
+ * @param to The function calls to `from` should run.
+ * @param through Address to jump to, standing in for `to`,
+ *      or `to` itself.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status redirect_install(intptr_t from, intptr_t to, intptr_t through);
+
+/**
+ * Get the address calls to `address` currently arrive at.
+ *
+ * @param address Entry point to resolve.
+ * @return The current target of `address`, or `address`
+ * itself if it is not redirected.
+ */
+intptr_t redirect_resolve(intptr_t address);
+
+/**
+ * Test if calls to any entry point are redirected to an
+ * address.
+ *
+ * @param address Address to test.
+ * @return `true` if `address` is the target of a redirect.
+ */
+bool redirect_is_target(intptr_t address);
+
+/**
+ * Get an address which runs the code calls to `from`
+ * currently run, and keeps running it once `from` is
+ * redirected elsewhere.
+ *
+ * @param from Entry point to bypass.
+ * @return The current target of `from` if it is redirected,
+ * the instruction after its entry NOP if it has patchable
+ * padding, or 0 if its code can't be reached once `from` is
+ * overwritten.
+ */
+intptr_t redirect_bypass(intptr_t from);
+
+/**
+ * Forget the redirects of entry points in an address range
+ * which is being unmapped.
+ *
+ * Nothing is written to the range. Dispatch table slots of
+ * forgotten entries are not reused.
+ *
+ * @param start First address in the range.
+ * @param end Address after the range.
+ * @return The number of redirects forgotten.
+ */
+size_t redirect_forget(intptr_t start, intptr_t end);
+
+#endif
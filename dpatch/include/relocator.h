@@ -0,0 +1,86 @@
+/**
+ * @file dpatch/include/relocator.h
+ *
+ * `relocator.h` declares functions for copying a function's
+ * machine code to a new address, adjusting the instructions
+ * which address memory relative to themselves.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_RELOCATOR_H_
+#define DPATCH_INCLUDE_RELOCATOR_H_
+
+#include "machine_code.h"
+#include "status.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Function called with each address a function refers to
+ * relative to its own instructions.
+ *
+ * @param target The address referred to.
+ * @param context Context passed to `relocate_references`.
+ */
+typedef void (*relocate_reference_visitor)(intptr_t target, void* context);
+
+/**
+ * Get the most space a function's relocated copy can need.
+ *
+ * @param length Length of the function in bytes.
+ * @return The longest the copy can be, in bytes.
+ */
+size_t relocate_max_length(size_t length);
+
+/**
+ * Encode a copy of a function which runs at a new address.
+ *
+ * Branches within the function are kept within the copy.
+ * Branches out of it, and instruction relative memory
+ * operands, are adjusted to reach what they reached from
+ * the original.
+ *
+ * @param function Address of the function's first byte.
+ * @param length Length of the function in bytes.
+ * @param destination Address the copy will be written to.
+ * @param copy Machine code to append the copy to.
+ * @param reason Location to store why the function can't
+ *      be relocated, if it can't.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the function contains an instruction which can't be
+ * relocated, or an error on failure.
+ */
+dpatch_status relocate_function
+(
+    intptr_t function,
+    size_t length,
+    intptr_t destination,
+    machine_code_t* copy,
+    const char** reason
+);
+
+/**
+ * Visit every address outside a function which one of its
+ * branches or instruction relative memory operands refers
+ * to.
+ *
+ * @param function Address of the function's first byte.
+ * @param length Length of the function in bytes.
+ * @param visit Function to call with each address.
+ * @param context Passed to `visit`.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EUNKNOWN`
+ * if the function contains an instruction which can't be
+ * decoded.
+ */
+dpatch_status relocate_references
+(
+    intptr_t function,
+    size_t length,
+    relocate_reference_visitor visit,
+    void* context
+);
+
+#endif
@@ -0,0 +1,97 @@
+/**
+ * @file dpatch/include/safepoint.h
+ *
+ * `safepoint.h` declares cooperative safe points, which let
+ * event loop threads commit a prepared patch themselves
+ * between iterations, rather than being interrupted.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_SAFEPOINT_H_
+#define DPATCH_INCLUDE_SAFEPOINT_H_
+
+#include "patch_set.h"
+#include "status.h"
+#include <stdint.h>
+
+/**
+ * Configure safe points from the
+ * `DPATCH_SAFEPOINT_TIMEOUT_MS` environment variable.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if
+ * the variable isn't a non-negative integer.
+ */
+dpatch_status safepoint_init_mode(void);
+
+/**
+ * Register the calling thread as an event loop thread,
+ * which must reach a safe point before a patch is
+ * committed.
+ *
+ * Registering a thread twice returns the same descriptor.
+ * A thread which exits is unregistered automatically.
+ *
+ * @param fd Location to store a descriptor which is
+ *      readable while a patch waits for the thread to reach
+ *      a safe point.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * descriptor can't be created, or `DPATCH_STATUS_ERROR` if
+ * too many threads are registered.
+ */
+dpatch_status safepoint_register(int* fd);
+
+/**
+ * Unregister the calling thread, closing its descriptor.
+ *
+ * If a patch was waiting only for the calling thread, it
+ * is committed before `safepoint_unregister` returns.
+ */
+void safepoint_unregister(void);
+
+/**
+ * Mark a safe point in the calling thread.
+ *
+ * If a patch is pending, a registered thread checks in,
+ * then waits until the patch is committed or withdrawn.
+ * The thread which completes the check ins commits the
+ * patch while the others wait, so none of them runs during
+ * the commit. The wait is bounded by
+ * `DPATCH_SAFEPOINT_TIMEOUT_MS`, so the calling thread
+ * must not hold anything another registered thread needs
+ * to reach its safe point. When no patch is pending,
+ * `safepoint_reach` only loads one variable.
+ *
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ETIMEDOUT` if
+ * the patch was withdrawn, or the status of the commit.
+ */
+dpatch_status safepoint_reach(void);
+
+/**
+ * Commit a prepared patch set at the registered threads'
+ * next safe points, and wait for it.
+ *
+ * The patch set is committed immediately if no threads are
+ * registered, or if the calling thread is registered, since
+ * it would otherwise wait for itself.
+ *
+ * @param patch_set Handle to the prepared patch set.
+ * @param budget_us Time allowed for the commit, or 0 for
+ *      no limit.
+ * @param commit_us Location to store the time spent
+ *      committing, excluding the wait for safe points.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ETIMEDOUT` if
+ * the threads didn't reach safe points within
+ * `DPATCH_SAFEPOINT_TIMEOUT_MS`, leaving the program
+ * unpatched, or the status of the commit.
+ */
+dpatch_status safepoint_commit
+(
+    patch_set_t* patch_set,
+    uint64_t budget_us,
+    double* commit_us
+);
+
+#endif
@@ -1,7 +1,9 @@
 /**
  * @file `dpatch/include/status.h`
  *
- * `status.h` defines status codes used by dpatch.
+ * `status.h` defines macros for handling the status codes
+ * used by dpatch. The codes themselves are part of the
+ * public API, in `dpatch.h`.
  *
  * @author H Paterson.
  * @copyright BSL-1.0.
@@ -11,6 +13,7 @@
 #ifndef DPATCH_INCLUDE_STATUS_H_
 #define DPATCH_INCLUDE_STATUS_H_
 
+#include "dpatch.h"
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -21,18 +24,19 @@
  * `EXIT_ON_ERROR` for a user macro.
  *
  * @param x A predicate evaluating to a `dpatch_status`.
+ *      It is evaluated exactly once.
  */
 #define _EXIT_ON_ERROR_TEMPLATE(x) \
-    if ((x) != DPATCH_STATUS_OK) \
+    do \
     { \
-        syslog( \
-            LOG_ERR, \
-            "Error: %s. (%s:%d)", \
-            str_status(x), \
-            __FILE__, \
-            __LINE__); \
-        exit(EXIT_FAILURE); \
-    }
+        dpatch_status _exit_status = (x); \
+        if (_exit_status != DPATCH_STATUS_OK) \
+        { \
+            event_log_error(_exit_status, __FILE__, __LINE__); \
+            event_log_flush(); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
 
 /**
  * Template for an error logging macro,
@@ -41,17 +45,17 @@
  * `LOG_ON_ERROR` for a user macro.
  *
  * @param x A predicate evaluating to a `dpatch_status`.
+ *      It is evaluated exactly once.
  */
 #define _LOG_ON_ERROR_TEMPLATE(x) \
-    if ((x) != DPATCH_STATUS_OK) \
+    do \
     { \
-        syslog( \
-            LOG_ERR, \
-            "Error: %s. (%s:%d)", \
-            str_status(x), \
-            __FILE__, \
-            __LINE__); \
-    }
+        dpatch_status _log_status = (x); \
+        if (_log_status != DPATCH_STATUS_OK) \
+        { \
+            event_log_error(_log_status, __FILE__, __LINE__); \
+        } \
+    } while (0)
 
 /**
  * Template for an error propagation macro.
@@ -75,7 +79,9 @@
  * Exit if an error occures.
  *
  * Exit if an error occures, logging an error to the
- * system log.
+ * event log and flushing it.
+ *
+ * @note Users must include `event_log.h`.
  *
  * @param x A predicate evaluating to a `dpatch_status`.
  */
@@ -84,8 +90,10 @@
 /**
  * log if an error occures.
  *
- * Log an error message to the system log if an error
- * occures.
+ * Post an error message to the event log if an error
+ * occures. Posting never blocks.
+ *
+ * @note Users must include `event_log.h`.
  *
  * @param x A predicate evaluating to a `dpatch_status`.
  */
@@ -112,43 +120,4 @@
 #define IS_ERROR(statement) \
     (statement == DPATCH_STATUS_OK ? false : true)
 
-/**
- * Indicates the success or failure of an operation by
- * dpatch.
- */
-typedef enum
-{
-    /** Success. */
-    DPATCH_STATUS_OK = 0,
-
-    /** General or unspecified error. */
-    DPATCH_STATUS_ERROR,
-
-    /** Memory (re)/allocation failed. */
-    DPATCH_STATUS_ENOMEM,
-
-    /** Failed to modify memory protection. */
-    DPATCH_STATUS_EMPROT,
-
-    /** Unsupported or unknown patch operation. */
-    DPATCH_STATUS_EUNKNOWN,
-
-    /** Error accessing dynamic symbols with `dlfcn.h` */
-    DPATCH_STATUS_EDYN,
-
-    /** File I/O error. */
-    DPATCH_STATUS_EFILE,
-
-    /** Script parsing error. */
-    DPATCH_STATUS_ESYNTAX
-} dpatch_status;
-
-/**
- * Get a human readable string describing a status code.
- *
- * @param status Status code to translate.
- * @return Pointer to a string describing the error.
- */
-const char* str_status(dpatch_status status);
-
 #endif
@@ -0,0 +1,173 @@
+/**
+ * @file dpatch/include/symbol_index.h
+ *
+ * `symbol_index.h` declares an index from addresses to the
+ * functions containing them, for attributing instruction
+ * pointers to functions without `dladdr`, and for finding
+ * functions `dlsym` can't see.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_SYMBOL_INDEX_H_
+#define DPATCH_INCLUDE_SYMBOL_INDEX_H_
+
+#include "status.h"
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A function found in the index.
+ */
+struct symbol_info
+{
+    /** Name of the function. */
+    const char* name;
+
+    /** Address of the function's entry point. */
+    uintptr_t start;
+
+    /** Size of the function in bytes. */
+    size_t size;
+
+    /** The object containing the function. */
+    struct link_map* object;
+};
+
+/**
+ * Function called with each function of an object.
+ *
+ * @param function The exported function.
+ * @param context Context passed to `symbol_index_exports` or
+ *      `symbol_index_functions`.
+ * @return `DPATCH_STATUS_OK` to continue, or an error to
+ * stop.
+ */
+typedef dpatch_status (*symbol_index_visitor)(const struct symbol_info* function, void* context);
+
+/**
+ * Add a loaded object to the index.
+ *
+ * The object's symbols are read when the index is next
+ * searched.
+ *
+ * @param object The object to add.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status symbol_index_add_object(struct link_map* object);
+
+/**
+ * Remove an object which is being unloaded from the index.
+ *
+ * @param object The object to remove.
+ */
+void symbol_index_remove_object(struct link_map* object);
+
+/**
+ * Find the function containing an address.
+ *
+ * @param address The address to look up.
+ * @param info Location to store the function found. Its
+ *      strings remain valid until the object containing it
+ *      is removed.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if no
+ * known function contains `address`, or an error on
+ * failure.
+ */
+dpatch_status symbol_index_lookup(uintptr_t address, struct symbol_info* info);
+
+/**
+ * Find a function in an object by name.
+ *
+ * Unlike `dlsym`, functions which aren't exported, such as
+ * `static` functions and functions in programs linked
+ * without `-rdynamic`, are found if the object or its
+ * debug information has a `.symtab`. If several functions
+ * share the name, one of them is returned.
+ *
+ * @param object The object to search.
+ * @param name Name of the function to find.
+ * @param address Location to store the function's address.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * object has no function named `name`, or an error on
+ * failure.
+ */
+dpatch_status symbol_index_find(struct link_map* object, const char* name, uintptr_t* address);
+
+/**
+ * Visit every function the index holds for an object,
+ * including functions which aren't exported.
+ *
+ * @warning `visit` is called with the index locked, so it
+ * must not call other `symbol_index` functions.
+ *
+ * @param object The object to enumerate.
+ * @param visit Function to call with each function. If
+ *      `visit` returns an error, the enumeration stops.
+ * @param context Passed to `visit`.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * object has no indexed functions, or the first error
+ * `visit` returns.
+ */
+dpatch_status symbol_index_functions
+(
+    struct link_map* object,
+    symbol_index_visitor visit,
+    void* context
+);
+
+/**
+ * Find a section of a loaded object.
+ *
+ * @param object The object to search.
+ * @param name Name of the section, such as ".rodata".
+ * @param address Location to store the address the section
+ *      is loaded at.
+ * @param size Location to store the size of the section.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * object has no loaded section named `name`, or
+ * `DPATCH_STATUS_EFILE` if the object's file can't be read.
+ */
+dpatch_status symbol_index_section
+(
+    struct link_map* object,
+    const char* name,
+    uintptr_t* address,
+    size_t* size
+);
+
+/**
+ * Visit every function an object exports.
+ *
+ * Exported functions are the defined, sized, global or
+ * weak functions in the object's `.dynsym`. Indirect
+ * functions are skipped, as their symbols point at their
+ * resolvers rather than their code.
+ *
+ * @param object The object to enumerate.
+ * @param visit Function to call with each export. The
+ *      export's name is only valid during the call. If
+ *      `visit` returns an error, the enumeration stops.
+ * @param context Passed to `visit`.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * object's file can't be read, or the first error `visit`
+ * returns.
+ */
+dpatch_status symbol_index_exports
+(
+    struct link_map* object,
+    symbol_index_visitor visit,
+    void* context
+);
+
+/**
+ * Get the number of functions in the index.
+ *
+ * @return The number of functions indexed so far.
+ */
+size_t symbol_index_length(void);
+
+#endif
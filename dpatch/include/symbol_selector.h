@@ -0,0 +1,85 @@
+/**
+ * @file dpatch/include/symbol_selector.h
+ *
+ * `symbol_selector.h` declares selectors, which match a
+ * family of function names with a glob or regular
+ * expression and derive each replacement's name from the
+ * parts matched.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_INCLUDE_SYMBOL_SELECTOR_H_
+#define DPATCH_INCLUDE_SYMBOL_SELECTOR_H_
+
+#include "status.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * `symbol_selector_t` is a handle to a compiled selector.
+ */
+typedef struct symbol_selector symbol_selector_t;
+
+/**
+ * Test if a symbol name in a patch is a selector.
+ *
+ * @param selector The name to test.
+ * @return `true` if `selector` is a regular expression
+ * between `/`s, or a glob containing `*`, `?` or `[`.
+ */
+bool symbol_selector_is_pattern(const char* selector);
+
+/**
+ * Compile a selector.
+ *
+ * @param new Location to store a handle to the selector.
+ * @param pattern A glob, or an extended regular expression
+ *      between `/`s.
+ * @param replacement Template for each replacement's name.
+ *      For a glob, each `*` or `?` is replaced with the text
+ *      matched by the glob's wildcard in the same position.
+ *      For a regular expression, `\1` to `\9` are replaced
+ *      with the text matched by each group, and `\0` with
+ *      the whole name.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if
+ * the pattern is invalid or the template refers to a
+ * capture the pattern doesn't have, or an error on failure.
+ */
+dpatch_status symbol_selector_new
+(
+    symbol_selector_t** new,
+    const char* pattern,
+    const char* replacement
+);
+
+/**
+ * Deallocate a selector.
+ *
+ * @param selector Handle to the selector to deallocate.
+ */
+void symbol_selector_free(symbol_selector_t* selector);
+
+/**
+ * Match a function name against a selector.
+ *
+ * @param selector Handle to the selector.
+ * @param name The function name to match. The whole name
+ *      must match.
+ * @param replacement Buffer to store the replacement's name
+ *      in.
+ * @param length Size of `replacement` in bytes.
+ * @return `true` if `name` matches and the replacement's
+ * name fits in `replacement`.
+ */
+bool symbol_selector_match
+(
+    const symbol_selector_t* selector,
+    const char* name,
+    char* replacement,
+    size_t length
+);
+
+#endif
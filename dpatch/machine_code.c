@@ -10,16 +10,49 @@
  * @date November 2020.
  */
 
+#include "event_log.h"
 #include "machine_code.h"
+#include "memory_map.h"
 #include "status.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MACHINE_CODE_DEFAULT_LEN 8
 
+#define WRITE_MODE_ENV_VAR "DPATCH_WRITE_MODE"
+#define PROC_SELF_MEM "/proc/self/mem"
+#define CACHE_LINE_LEN 64
+
+/**
+ * How long a mapping looked up in `/proc/self/smaps` is
+ * reused for, in nanoseconds. Reading `smaps` walks the
+ * page tables of every preceding mapping, so a batch of
+ * writes into one mapping shares a single lookup.
+ */
+#define REGION_CACHE_NS 10000000ull
+
+/** Mechanism used to write into program memory. */
+static dpatch_write_mode write_mode = DPATCH_WRITE_MPROTECT;
+
+/** Lazily opened descriptor for `/proc/self/mem`. */
+static int proc_mem_fd = -1;
+
+/** The mapping most recently looked up by an insert. */
+static struct memory_region cached_region;
+
+/** When `cached_region` was looked up, or 0 if never. */
+static uint64_t cached_region_ns = 0;
+
+/** Serialises access to `cached_region`. */
+static pthread_mutex_t cached_region_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Storage for variable length chunks of executable binary.
  */
@@ -205,13 +238,85 @@ dpatch_status mprotect_round_(intptr_t address, size_t length, int prot)
 }
 
 /**
- * Insert machine code into a program segment.
+ * Convert a string to a `dpatch_write_mode`.
+ *
+ * @param str String to convert.
+ * @param mode Address to store the write mode in.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status str_to_write_mode(char* str, dpatch_write_mode* mode)
+{
+    if (strcmp(str, "mprotect") == 0)
+    {
+        *mode = DPATCH_WRITE_MPROTECT;
+    }
+    else if (strcmp(str, "proc_mem") == 0)
+    {
+        *mode = DPATCH_WRITE_PROC_MEM;
+    }
+    else
+    {
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Select the mechanism used to write machine code into
+ * program memory.
+ *
+ * @param mode The write mode to use for future inserts.
+ */
+void machine_code_set_write_mode(dpatch_write_mode mode)
+{
+    write_mode = mode;
+}
+
+/**
+ * Get the mechanism used to write machine code into
+ * program memory.
+ *
+ * @return The current write mode.
+ */
+dpatch_write_mode machine_code_write_mode(void)
+{
+    return write_mode;
+}
+
+/**
+ * Select the write mode named by the `DPATCH_WRITE_MODE`
+ * environment variable, if it is set.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error if the variable
+ * names an unknown mode.
+ */
+dpatch_status machine_code_init_write_mode(void)
+{
+    dpatch_write_mode mode = DPATCH_WRITE_MPROTECT;
+    dpatch_status status = DPATCH_STATUS_OK;
+    char* str = getenv(WRITE_MODE_ENV_VAR);
+    if (str == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    PROPAGATE_ERROR(str_to_write_mode(str, &mode), status);
+    machine_code_set_write_mode(mode);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Write machine code by temporarily making the target
+ * pages writable.
  *
  * @param machine_code Handle to the machine code to insert.
  * @param address Address to write the code into.
  * @return `DPATCH_STATUS_OK` or an error on failure.
  */
-dpatch_status machine_code_insert(machine_code_t* machine_code, intptr_t address)
+dpatch_status machine_code_insert_mprotect_
+(
+    machine_code_t* machine_code,
+    intptr_t address
+)
 {
     dpatch_status status = DPATCH_STATUS_OK;
     status = mprotect_round_(address, machine_code->length, PROT_READ | PROT_WRITE | PROT_EXEC);
@@ -227,3 +332,449 @@ dpatch_status machine_code_insert(machine_code_t* machine_code, intptr_t address
     }
     return DPATCH_STATUS_OK;
 }
+
+/**
+ * Write machine code through `/proc/self/mem`.
+ *
+ * The kernel services writes to `/proc/self/mem` with
+ * `FOLL_FORCE`, so read-only text is written (and
+ * copied-on-write if required) without changing its
+ * protection or splitting its mapping.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ * @param address Address to write the code into.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status machine_code_insert_proc_mem_
+(
+    machine_code_t* machine_code,
+    intptr_t address
+)
+{
+    size_t written = 0;
+    ssize_t result = 0;
+    int fd = __atomic_load_n(&proc_mem_fd, __ATOMIC_ACQUIRE);
+    if (fd == -1)
+    {
+        int expected = -1;
+        fd = open(PROC_SELF_MEM, O_RDWR | O_CLOEXEC);
+        if (fd == -1)
+        {
+            return DPATCH_STATUS_EWRITE;
+        }
+        if (!__atomic_compare_exchange_n(
+            &proc_mem_fd, &expected, fd, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+        ))
+        {
+            /* Another thread opened the file first. */
+            close(fd);
+            fd = expected;
+        }
+    }
+    while (written < machine_code->length)
+    {
+        result = pwrite(
+            fd,
+            machine_code->binary + written,
+            machine_code->length - written,
+            (off_t) (address + written)
+        );
+        if (result <= 0)
+        {
+            return DPATCH_STATUS_EWRITE;
+        }
+        written += (size_t) result;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Write machine code into text backed by anonymous huge
+ * pages, changing protections on whole huge pages.
+ *
+ * Protecting a subrange of a huge page forces the kernel
+ * to split it into small pages. Protecting the aligned
+ * huge pages containing the write keeps them intact.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ * @param address Address to write the code into.
+ * @param region Mapping containing `address`.
+ * @param huge_page_size Size of a huge page, in bytes.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the aligned huge pages leave the mapping, or an error on
+ * failure.
+ */
+dpatch_status machine_code_insert_huge_protect_
+(
+    machine_code_t* machine_code,
+    intptr_t address,
+    const struct memory_region* region,
+    size_t huge_page_size
+)
+{
+    uintptr_t start = (uintptr_t) address & ~(huge_page_size - 1);
+    uintptr_t end = ((uintptr_t) address + machine_code->length + huge_page_size - 1) & ~(huge_page_size - 1);
+    if (start < region->start || end > region->end)
+    {
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    if (mprotect((void*) start, end - start, region->prot | PROT_WRITE) == -1)
+    {
+        return DPATCH_STATUS_EMPROT;
+    }
+    memcpy((void*) address, (void*) machine_code->binary, machine_code->length);
+    if (mprotect((void*) start, end - start, region->prot) == -1)
+    {
+        return DPATCH_STATUS_EMPROT;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Write machine code into file-backed text mapped with a
+ * huge page, by rebuilding the huge page.
+ *
+ * Writing to a private file-backed huge page copies it on
+ * write in small pages. Instead, the aligned huge page is
+ * copied into a new anonymous huge page, the code written
+ * into the copy, and the copy moved over the original with
+ * `mremap`. Other threads see the whole huge page change at
+ * once, so the write is also atomic.
+ *
+ * The text is anonymous memory afterwards. `/proc/pid/maps`
+ * no longer names the object's file for the huge page, so
+ * tools which symbolize addresses through it, such as
+ * `perf` attaching to a running process, show the huge
+ * page as anonymous memory. The page is also no longer
+ * shared with other processes through the page cache.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ * @param address Address to write the code into.
+ * @param region Mapping containing `address`.
+ * @param huge_page_size Size of a huge page, in bytes.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the write does not fit in one huge page of the mapping,
+ * or an error on failure.
+ */
+dpatch_status machine_code_insert_huge_remap_
+(
+    machine_code_t* machine_code,
+    intptr_t address,
+    const struct memory_region* region,
+    size_t huge_page_size
+)
+{
+    uint8_t* reservation = NULL;
+    uint8_t* copy = NULL;
+    uintptr_t start = (uintptr_t) address & ~(huge_page_size - 1);
+    uintptr_t offset = (uintptr_t) address - start;
+    if (
+        start < region->start
+        || start + huge_page_size > region->end
+        || offset + machine_code->length > huge_page_size
+        || (region->prot & PROT_READ) == 0
+    )
+    {
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    /* Over-allocate so an aligned huge page fits inside. */
+    reservation = mmap(
+        NULL, 2 * huge_page_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    if (reservation == MAP_FAILED)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    copy = (uint8_t*) (((uintptr_t) reservation + huge_page_size - 1) & ~(huge_page_size - 1));
+    if (copy != reservation)
+    {
+        munmap(reservation, copy - reservation);
+    }
+    munmap(copy + huge_page_size, reservation + huge_page_size - copy);
+    madvise(copy, huge_page_size, MADV_HUGEPAGE);
+    memcpy(copy, (void*) start, huge_page_size);
+    memcpy(copy + offset, machine_code->binary, machine_code->length);
+    if (mprotect(copy, huge_page_size, region->prot) == -1)
+    {
+        munmap(copy, huge_page_size);
+        return DPATCH_STATUS_EMPROT;
+    }
+    if (mremap(copy, huge_page_size, huge_page_size, MREMAP_MAYMOVE | MREMAP_FIXED, (void*) start) == MAP_FAILED)
+    {
+        munmap(copy, huge_page_size);
+        return DPATCH_STATUS_EWRITE;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Find the mapping containing an address, reusing a recent
+ * lookup of the same mapping if there is one.
+ *
+ * @param address An address inside the mapping.
+ * @param region Location to store the mapping.
+ * @param refresh Whether to ignore any cached lookup.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status find_region_(uintptr_t address, struct memory_region* region, bool refresh)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&cached_region_lock);
+    if (
+        !refresh
+        && cached_region_ns != 0
+        && now - cached_region_ns < REGION_CACHE_NS
+        && address >= cached_region.start
+        && address < cached_region.end
+    )
+    {
+        *region = cached_region;
+        pthread_mutex_unlock(&cached_region_lock);
+        return DPATCH_STATUS_OK;
+    }
+    status = memory_map_find(address, region);
+    if (!IS_ERROR(status))
+    {
+        cached_region = *region;
+        cached_region_ns = now;
+    }
+    pthread_mutex_unlock(&cached_region_lock);
+    return status;
+}
+
+/**
+ * Write machine code with the current write mode.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ * @param address Address to write the code into.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status machine_code_insert_small_
+(
+    machine_code_t* machine_code,
+    intptr_t address
+)
+{
+    switch (write_mode)
+    {
+        case DPATCH_WRITE_PROC_MEM:
+            return machine_code_insert_proc_mem_(machine_code, address);
+        case DPATCH_WRITE_MPROTECT:
+            return machine_code_insert_mprotect_(machine_code, address);
+        default:
+            return DPATCH_STATUS_EUNKNOWN;
+    }
+}
+
+/**
+ * Log the huge page usage of a mapping before and after a
+ * write into it.
+ *
+ * @param address Address the code was written into.
+ * @param region Mapping containing `address`, as it was
+ *      before the write.
+ */
+static void log_huge_write_(intptr_t address, const struct memory_region* region)
+{
+    struct memory_region after;
+    if (find_region_(address, &after, true) == DPATCH_STATUS_OK)
+    {
+        event_logf(
+            after.anon_huge_kb < region->anon_huge_kb ? LOG_WARNING : LOG_INFO,
+            DPATCH_STATUS_OK,
+            0,
+            "Wrote huge page text at %#lx. AnonHugePages %zu kB before, %zu kB after.",
+            (unsigned long) address,
+            region->anon_huge_kb,
+            after.anon_huge_kb
+        );
+    }
+}
+
+/**
+ * Write machine code into text backed by huge pages,
+ * without splitting them, and log the mapping's huge page
+ * usage before and after the write.
+ *
+ * Writes through `/proc/self/mem` to exclusively owned
+ * anonymous huge pages do not split them, so are made
+ * directly. If the huge pages can not be preserved, the
+ * code is written with the current write mode regardless.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ * @param address Address to write the code into.
+ * @param region Mapping containing `address`.
+ * @param huge_page_size Size of a huge page, in bytes.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status machine_code_insert_huge_
+(
+    machine_code_t* machine_code,
+    intptr_t address,
+    const struct memory_region* region,
+    size_t huge_page_size
+)
+{
+    dpatch_status status = DPATCH_STATUS_EUNKNOWN;
+    if (region->file_pmd_kb != 0)
+    {
+        status = machine_code_insert_huge_remap_(machine_code, address, region, huge_page_size);
+    }
+    else if (write_mode == DPATCH_WRITE_MPROTECT)
+    {
+        status = machine_code_insert_huge_protect_(machine_code, address, region, huge_page_size);
+    }
+    if (status == DPATCH_STATUS_EUNKNOWN)
+    {
+        status = machine_code_insert_small_(machine_code, address);
+    }
+    if (IS_ERROR(status))
+    {
+        return status;
+    }
+    log_huge_write_(address, region);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Insert machine code into a program segment.
+ *
+ * If the code is written into a mapping backed by
+ * transparent huge pages, it is written without splitting
+ * them where possible. File-backed huge pages are replaced
+ * with patched anonymous copies, so `/proc/pid/maps` shows
+ * them as anonymous memory afterwards.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ * @param address Address to write the code into.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status machine_code_insert(machine_code_t* machine_code, intptr_t address)
+{
+    struct memory_region region;
+    size_t huge_page_size = memory_map_huge_page_size();
+    assert(machine_code != NULL);
+    if (
+        huge_page_size != 0
+        && find_region_(address, &region, false) == DPATCH_STATUS_OK
+        && (region.anon_huge_kb != 0 || region.file_pmd_kb != 0)
+    )
+    {
+        return machine_code_insert_huge_(machine_code, address, &region, huge_page_size);
+    }
+    return machine_code_insert_small_(machine_code, address);
+}
+
+/**
+ * Insert machine code into a program segment with a single
+ * atomic store, so threads executing or reading the code
+ * see either the old or new bytes, never a mixture.
+ *
+ * The target is made writable with `mprotect` for the
+ * store regardless of the write mode, because writes
+ * through `/proc/self/mem` are not guaranteed to be atomic.
+ * Huge pages backing text are kept intact the same way
+ * `machine_code_insert` keeps them: anonymous huge pages
+ * are protected whole, and file-backed huge pages are
+ * rebuilt and swapped in whole with `mremap`.
+ *
+ * @param machine_code Handle to the machine code to insert.
+ *      It must be 1, 2, 4, or 8 bytes long.
+ * @param address Address to write the code into. The
+ *      write must not span a cache line.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ERROR` if the
+ * write can not be made atomically, or an error on failure.
+ */
+dpatch_status machine_code_insert_atomic(machine_code_t* machine_code, intptr_t address)
+{
+    struct memory_region region;
+    size_t huge_page_size = memory_map_huge_page_size();
+    size_t length = 0;
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t value = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(machine_code != NULL);
+    length = machine_code->length;
+    if (
+        (length != 1 && length != 2 && length != 4 && length != 8)
+        || (uintptr_t) address % CACHE_LINE_LEN + length > CACHE_LINE_LEN
+        || page_size < 1
+    )
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    if (find_region_(address, &region, false) != DPATCH_STATUS_OK)
+    {
+        region.start = 0;
+        region.end = UINTPTR_MAX;
+        region.prot = PROT_READ | PROT_EXEC;
+        region.anon_huge_kb = 0;
+        region.file_pmd_kb = 0;
+    }
+    if (huge_page_size != 0 && region.file_pmd_kb != 0)
+    {
+        status = machine_code_insert_huge_remap_(machine_code, address, &region, huge_page_size);
+        if (status != DPATCH_STATUS_EUNKNOWN)
+        {
+            if (!IS_ERROR(status))
+            {
+                log_huge_write_(address, &region);
+            }
+            return status;
+        }
+    }
+    start = (uintptr_t) address & ~((uintptr_t) page_size - 1);
+    end = start + (uintptr_t) page_size;
+    if (huge_page_size != 0 && region.anon_huge_kb != 0)
+    {
+        uintptr_t huge_start = (uintptr_t) address & ~(huge_page_size - 1);
+        if (huge_start >= region.start && huge_start + huge_page_size <= region.end)
+        {
+            start = huge_start;
+            end = huge_start + huge_page_size;
+        }
+    }
+    memcpy(&value, machine_code->binary, length);
+    if (mprotect((void*) start, end - start, region.prot | PROT_WRITE) == -1)
+    {
+        return DPATCH_STATUS_EMPROT;
+    }
+    switch (length)
+    {
+        case 1:
+            __atomic_store_n((uint8_t*) address, (uint8_t) value, __ATOMIC_RELEASE);
+            break;
+        case 2:
+            __atomic_store_n((uint16_t*) address, (uint16_t) value, __ATOMIC_RELEASE);
+            break;
+        case 4:
+            __atomic_store_n((uint32_t*) address, (uint32_t) value, __ATOMIC_RELEASE);
+            break;
+        default:
+            __atomic_store_n((uint64_t*) address, value, __ATOMIC_RELEASE);
+            break;
+    }
+    if (mprotect((void*) start, end - start, region.prot) == -1)
+    {
+        return DPATCH_STATUS_EMPROT;
+    }
+    return DPATCH_STATUS_OK;
+}
@@ -1,14 +1,34 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <link.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
+#include "deferred_patch.h"
+#include "dispatch_table.h"
+#include "event_log.h"
+#include "hot_text.h"
+#include "machine_code.h"
+#include "patch_blob.h"
+#include "patch_guard.h"
 #include "patch_set.h"
 #include "patch_script.h"
+#include "patch_watch.h"
+#include "perf_map.h"
+#include "pointer_scan.h"
+#include "profiler.h"
 #include "status.h"
+#include "symbol_index.h"
 
 #define PROGRAM_IDENT "dpatch"
+#define COMMIT_DEADLINE_ENV_VAR "DPATCH_COMMIT_DEADLINE_US"
+#define BLOB_ENV_VAR "DPATCH_BLOB"
 
 /**
  * Suppresses unused parameter warnings.
@@ -29,16 +49,354 @@
  */
 bool patch_pending = false;
 
+/** The most recently published patch blob, or -1. */
+static int published_blob_fd = -1;
+
+/**
+ * Get the current monotonic time in microseconds.
+ *
+ * @return Microseconds since an arbitrary epoch.
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Prepares a patch set, then commits it within the budget
+ * given by `DPATCH_COMMIT_DEADLINE_US`, if it is set.
+ *
+ * @param patch_set Handle to the patch set to apply.
+ * @param script_hash Hash of the script the patch set was
+ *      parsed from, recorded in the blob.
+ * @param blob_fd Location to store the descriptor of a
+ *      blob compiled from the prepared patch set before it
+ *      is committed, or `NULL` not to compile one. The
+ *      caller must close it.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status prepare_and_commit(patch_set_t* patch_set, uint64_t script_hash, int* blob_fd)
+{
+    char* budget_str = getenv(COMMIT_DEADLINE_ENV_VAR);
+    uint64_t budget_us = budget_str == NULL ? 0 : strtoull(budget_str, NULL, 10);
+    dpatch_status status = DPATCH_STATUS_OK;
+    double prepare_start = now_us();
+    double commit_start = 0;
+    double commit_end = 0;
+    PROPAGATE_ERROR(patch_set_prepare(patch_set), status);
+    if (blob_fd != NULL)
+    {
+        PROPAGATE_ERROR(patch_blob_compile(patch_set, script_hash, blob_fd), status);
+    }
+    commit_start = now_us();
+    status = patch_set_commit_within(patch_set, budget_us);
+    commit_end = now_us();
+    event_logf(
+        LOG_INFO,
+        status,
+        patch_set_id(patch_set),
+        "Patch prepared in %.1f us, commit %s in %.1f us.",
+        commit_start - prepare_start,
+        IS_ERROR(status) ? "aborted" : "completed",
+        commit_end - commit_start
+    );
+    return status;
+}
+
+/**
+ * Parses the patch script at `script_path`.
+ *
+ * @param script_path Path to the script to parse, or
+ *      `NULL` for the script named by `DPATCH_SCRIPT`.
+ * @param patch_set Location to store the parsed patch set.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status parse_script(char* script_path, patch_set_t** patch_set)
+{
+    patch_script_t* patch_script = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    *patch_set = NULL;
+    PROPAGATE_ERROR(patch_script_new(&patch_script), status);
+    if (script_path != NULL)
+    {
+        status = patch_script_path(patch_script, script_path);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = patch_set_new(patch_set);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = patch_script_parse(patch_script, *patch_set);
+    }
+    if (IS_ERROR(status) && *patch_set != NULL)
+    {
+        patch_set_free(*patch_set);
+        *patch_set = NULL;
+    }
+    patch_script_free(patch_script);
+    return status;
+}
+
+/**
+ * Hashes the contents of the patch script at `script_path`.
+ *
+ * @param script_path Path to the script to hash, or `NULL`
+ *      for the script named by `DPATCH_SCRIPT`.
+ * @param hash Location to store the hash.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status hash_script(char* script_path, uint64_t* hash)
+{
+    patch_script_t* patch_script = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(patch_script_new(&patch_script), status);
+    if (script_path != NULL)
+    {
+        status = patch_script_path(patch_script, script_path);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = patch_script_hash(patch_script, hash);
+    }
+    patch_script_free(patch_script);
+    return status;
+}
+
+/**
+ * Parses and applies the patch script at `script_path`.
+ *
+ * Unlike `do_patch`, errors are returned to the caller
+ * rather than terminating the process.
+ *
+ * @param script_path Path to the script to apply.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status apply_script(char* script_path)
+{
+    patch_set_t* patch_set = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(parse_script(script_path, &patch_set), status);
+    status = prepare_and_commit(patch_set, 0, NULL);
+    patch_set_free(patch_set);
+    return status;
+}
+
+/**
+ * Applies the compiled patch blob at `blob_path`.
+ *
+ * @param blob_path Path to the blob to apply.
+ * @param script_hash Hash of the script the blob must have
+ *      been compiled from, or `NULL` to apply any blob.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESTALE` if the
+ * blob was compiled from a different script, or an error on
+ * failure.
+ */
+dpatch_status apply_blob(char* blob_path, const uint64_t* script_hash)
+{
+    patch_set_t* patch_set = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint64_t blob_hash = 0;
+    int fd = open(blob_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    if (script_hash != NULL)
+    {
+        status = patch_blob_script_hash(fd, &blob_hash);
+        if (!IS_ERROR(status) && blob_hash != *script_hash)
+        {
+            status = DPATCH_STATUS_ESTALE;
+        }
+    }
+    if (!IS_ERROR(status))
+    {
+        status = patch_set_new(&patch_set);
+    }
+    if (!IS_ERROR(status))
+    {
+        patch_set_load_blob(patch_set, fd);
+        status = prepare_and_commit(patch_set, 0, NULL);
+        patch_set_free(patch_set);
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * Applies a script or blob dropped into the watched
+ * directory.
+ *
+ * @param path Path to the script or blob to apply.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status apply_watched(char* path)
+{
+    bool is_blob = false;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    is_blob = patch_blob_is_blob(fd);
+    close(fd);
+    return is_blob ? apply_blob(path, NULL) : apply_script(path);
+}
+
+/**
+ * Publish a compiled blob at `blob_path`, so other
+ * processes can apply it.
+ *
+ * `blob_path` is atomically replaced with a symbolic link
+ * to the blob's descriptor in this process' `/proc/<pid>/fd`.
+ * The blob stays open until the next blob is published.
+ *
+ * @param fd File descriptor of the blob.
+ * @param blob_path Path to publish the blob at.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status publish_blob(int fd, char* blob_path)
+{
+    char target[64];
+    char temporary[PATH_MAX];
+    snprintf(target, sizeof target, "/proc/%d/fd/%d", (int) getpid(), fd);
+    if (snprintf(temporary, sizeof temporary, "%s.%d", blob_path, (int) getpid()) >= (int) sizeof temporary)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    unlink(temporary);
+    if (symlink(target, temporary) == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    if (rename(temporary, blob_path) == -1)
+    {
+        unlink(temporary);
+        return DPATCH_STATUS_EFILE;
+    }
+    if (published_blob_fd != -1)
+    {
+        close(published_blob_fd);
+    }
+    published_blob_fd = fd;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Test whether the blob at `blob_path` was published by
+ * this process.
+ *
+ * @param blob_path Path the blob is published at.
+ * @return `true` if this process published the blob.
+ */
+bool blob_is_own(char* blob_path)
+{
+    char target[PATH_MAX];
+    char own_prefix[64];
+    ssize_t length = readlink(blob_path, target, sizeof target - 1);
+    if (length == -1)
+    {
+        return false;
+    }
+    target[length] = '\0';
+    snprintf(own_prefix, sizeof own_prefix, "/proc/%d/fd/", (int) getpid());
+    return strncmp(target, own_prefix, strlen(own_prefix)) == 0;
+}
+
+/**
+ * Parses and applies the patch script at `script_path`,
+ * then publishes it as a blob at `blob_path`.
+ *
+ * The blob is compiled before the patch is committed, so a
+ * patch which can't be shared with the other processes,
+ * such as one which defers a replacement, isn't applied to
+ * this one either.
+ *
+ * @param script_path Path to the script to apply, or
+ *      `NULL` for the script named by `DPATCH_SCRIPT`.
+ * @param blob_path Path to publish the compiled blob at.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status compile_script(char* script_path, char* blob_path)
+{
+    patch_set_t* patch_set = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint64_t script_hash = 0;
+    int fd = -1;
+    PROPAGATE_ERROR(hash_script(script_path, &script_hash), status);
+    PROPAGATE_ERROR(parse_script(script_path, &patch_set), status);
+    status = prepare_and_commit(patch_set, script_hash, &fd);
+    if (!IS_ERROR(status))
+    {
+        status = publish_blob(fd, blob_path);
+    }
+    if (IS_ERROR(status) && fd != -1)
+    {
+        close(fd);
+    }
+    patch_set_free(patch_set);
+    return status;
+}
+
 /**
  * Applies a pending patch.
  *
+ * If `DPATCH_BLOB` is set, patches are shared through a
+ * compiled blob published at that path. When a blob
+ * published by another process was compiled from the
+ * current contents of `DPATCH_SCRIPT`, this process applies
+ * it. Otherwise, such as when the blob is left over from an
+ * earlier rollout, this process applies the script, then
+ * compiles and publishes it for the others.
+ *
  * @note The patch parsing functions are not reentrant, so
  * they must be called outside of the signal handler, or
  * made reentrant.
  */
 dpatch_status do_patch()
 {
-    syslog(LOG_INFO, "Dynamic patch initiated.");
+    /* Restarts the log's drain thread if we were forked. */
+    LOG_ON_ERROR(event_log_start());
+    event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Dynamic patch initiated.");
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint64_t script_hash = 0;
+    char* blob_path = getenv(BLOB_ENV_VAR);
+    if (blob_path != NULL && access(blob_path, R_OK) == 0 && !blob_is_own(blob_path))
+    {
+        status = hash_script(NULL, &script_hash);
+        if (!IS_ERROR(status))
+        {
+            status = apply_blob(blob_path, &script_hash);
+        }
+        if (status != DPATCH_STATUS_ESTALE)
+        {
+            LOG_ON_ERROR(status);
+            if (!IS_ERROR(status))
+            {
+                event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Dynamic patch applied from blob.");
+            }
+            return status;
+        }
+        event_log_post(
+            LOG_NOTICE,
+            status,
+            0,
+            "The published blob was compiled from another script. Applying the script instead."
+        );
+    }
+    if (blob_path != NULL)
+    {
+        status = compile_script(NULL, blob_path);
+        LOG_ON_ERROR(status);
+        if (!IS_ERROR(status))
+        {
+            event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Dynamic patch applied and published.");
+        }
+        return status;
+    }
     patch_script_t* patch_script = NULL;
     patch_set_t* patch_set = NULL;
     /* 
@@ -49,11 +407,15 @@ dpatch_status do_patch()
     EXIT_ON_ERROR(patch_script_new(&patch_script));
     EXIT_ON_ERROR(patch_set_new(&patch_set));
     EXIT_ON_ERROR(patch_script_parse(patch_script, patch_set));
-    LOG_ON_ERROR(patch_set_apply(patch_set));
+    status = prepare_and_commit(patch_set, 0, NULL);
+    LOG_ON_ERROR(status);
     patch_script_free(patch_script);
     patch_set_free(patch_set);
-    syslog(LOG_INFO, "Dypamic patch applied.");
-    return DPATCH_STATUS_OK;
+    if (!IS_ERROR(status))
+    {
+        event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Dypamic patch applied.");
+    }
+    return status;
 }
 
 /**
@@ -62,14 +424,19 @@ dpatch_status do_patch()
  * `patch_in_thread` is indended to be called from a
  * transient thread spawed to execute a patch.
  *
+ * The thread returns rather than calling `pthread_exit`.
+ * A thread which unwound itself with `pthread_exit` could
+ * leave the next patch thread stuck on the loader's TLS
+ * lock.
+ *
  * @param args Unused, but required by the `pthreads` API.
- * @return Nothing - required by the P
+ * @return `NULL`.
  */
 void* patch_in_thread(void* args)
 {
     UNUSED(args);
-    int status = (int) do_patch();
-    pthread_exit(&status);
+    do_patch();
+    return NULL;
 }
 
 
@@ -80,16 +447,21 @@ void* patch_in_thread(void* args)
  * than from the signal handler, because many functions
  * used by `dpatch` are not reentrant - such as `malloc`.
  * Calling them from inside the signal's interrupt context
- * can cause very undefined behaviour.
+ * can cause very undefined behaviour. The thread is
+ * detached, as nothing joins it.
  *
  * @param signal The incomming singal to handle.
  */
 void sigusr2_handler(int signal)
 {
     pthread_t patch_thread = 0;
+    pthread_attr_t attributes;
     assert(signal == SIGUSR2);
-    syslog(LOG_INFO, "Recieved SIGUSR2. Requesting patch.");
-    pthread_create(&patch_thread, NULL, &patch_in_thread, NULL);
+    event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Recieved SIGUSR2. Requesting patch.");
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_create(&patch_thread, &attributes, &patch_in_thread, NULL);
+    pthread_attr_destroy(&attributes);
 }
 
 /**
@@ -99,11 +471,14 @@ void sigusr2_handler(int signal)
  * `la_version` allows the RTDL to reect this audit library
  * at runtime if it uses an unsupported ABI.
  *
+ * Being called also tells dpatch it is an audit library,
+ * so replacements can be deferred until objects load.
+ *
  * @param version The RTDL Audit API the host supports.
  * @return The RTDL audit API this object was compiled
  * for.
  */
-extern unsigned int la_version(unsigned int version)
+DPATCH_API unsigned int la_version(unsigned int version)
 {
     if (version != LAV_CURRENT)
     {
@@ -112,21 +487,111 @@ extern unsigned int la_version(unsigned int version)
         closelog();
         exit(EXIT_FAILURE);
     }
+    deferred_patch_watch_loads();
     return LAV_CURRENT;
 }
 
+/**
+ * Note each object loaded into the program's namespace in
+ * the symbol index, and apply any deferred replacements of
+ * its functions before its code runs.
+ *
+ * @param map The object which was loaded.
+ * @param lmid The namespace the object was loaded into.
+ * @param cookie Identifies the object in later calls.
+ * @return 0, so dpatch is not asked to audit the object's
+ * symbol bindings.
+ */
+DPATCH_API unsigned int la_objopen(struct link_map* map, Lmid_t lmid, uintptr_t* cookie)
+{
+    *cookie = (uintptr_t) map;
+    if (lmid == LM_ID_BASE)
+    {
+        LOG_ON_ERROR(symbol_index_add_object(map));
+        deferred_patch_object_opened(map);
+    }
+    return 0;
+}
+
+/**
+ * Drop an object which is being unloaded from the symbol
+ * index, and forget the redirects of its functions.
+ *
+ * @param cookie The object's cookie from `la_objopen`.
+ * @return 0. The return value is ignored.
+ */
+DPATCH_API unsigned int la_objclose(uintptr_t* cookie)
+{
+    deferred_patch_object_closed((struct link_map*) *cookie);
+    symbol_index_remove_object((struct link_map*) *cookie);
+    return 0;
+}
+
 /**
  * Preinit hook to be called before the target's `main` is
  * executed.
  *
  * The pre-init hook sets up a signal handler to listen for
- * dynamic patches.
+ * dynamic patches, starts watching `DPATCH_WATCH_DIR` for
+ * patches if it is set, and starts the profiler if
+ * `DPATCH_PROFILE_HZ` is set.
  *
  * @param cookie The object at the head of the link map.
  */
-extern void la_preinit(uintptr_t* cookie)
+DPATCH_API void la_preinit(uintptr_t* cookie)
 {
     UNUSED(cookie);
     openlog(PROGRAM_IDENT, LOG_PERROR, LOG_USER);
+    LOG_ON_ERROR(event_log_start());
+    LOG_ON_ERROR(machine_code_init_write_mode());
+    LOG_ON_ERROR(dispatch_table_init_mode());
+    LOG_ON_ERROR(perf_map_init());
+    LOG_ON_ERROR(patch_guard_init_mode());
+    LOG_ON_ERROR(hot_text_init_mode());
+    LOG_ON_ERROR(pointer_scan_init_mode());
     signal(SIGUSR2, sigusr2_handler);
+    LOG_ON_ERROR(patch_watch_start(&apply_watched));
+    LOG_ON_ERROR(profiler_start());
+}
+
+/**
+ * Prepare dpatch's services when it is loaded by
+ * `dpatch-attach`, rather than as an audit library.
+ */
+static void attach_init(void)
+{
+    openlog(PROGRAM_IDENT, LOG_PERROR, LOG_USER);
+    LOG_ON_ERROR(event_log_start());
+    LOG_ON_ERROR(machine_code_init_write_mode());
+    LOG_ON_ERROR(dispatch_table_init_mode());
+    LOG_ON_ERROR(perf_map_init());
+    LOG_ON_ERROR(patch_guard_init_mode());
+    LOG_ON_ERROR(hot_text_init_mode());
+    LOG_ON_ERROR(pointer_scan_init_mode());
+    LOG_ON_ERROR(profiler_start());
+}
+
+/**
+ * Entry point for `dpatch-attach`.
+ *
+ * `dpatch-attach` loads `libdpatch` into a running process
+ * which was not started under `LD_AUDIT`, then calls
+ * `dpatch_attach` from one of the process' (stopped)
+ * threads to apply a script.
+ *
+ * @param script_path Path to the script to apply.
+ * @return A `dpatch_status` describing the result.
+ */
+DPATCH_API int dpatch_attach(char* script_path)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    attach_init();
+    event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Dynamic patch initiated by attach.");
+    status = apply_script(script_path);
+    LOG_ON_ERROR(status);
+    if (!IS_ERROR(status))
+    {
+        event_log_post(LOG_INFO, DPATCH_STATUS_OK, 0, "Dynamic patch applied.");
+    }
+    return (int) status;
 }
@@ -0,0 +1,135 @@
+/**
+ * @file dpatch/memory_map.c
+ *
+ * `memory_map.c` defines functions for inspecting the
+ * memory mappings of the current process.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "memory_map.h"
+#include "status.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define THP_ENABLED_PATH "/sys/kernel/mm/transparent_hugepage/enabled"
+#define THP_SIZE_PATH "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define SMAPS_PATH "/proc/self/smaps"
+#define SMAPS_MAX_LINE_LEN 512
+
+/**
+ * Get the size of a transparent huge page.
+ *
+ * @return The huge page size in bytes, or 0 if transparent
+ * huge pages are disabled.
+ */
+size_t memory_map_huge_page_size(void)
+{
+    static size_t huge_page_size = (size_t) -1;
+    char mode[128] = "";
+    unsigned long size = 0;
+    FILE* file = NULL;
+    if (huge_page_size != (size_t) -1)
+    {
+        return huge_page_size;
+    }
+    file = fopen(THP_ENABLED_PATH, "r");
+    if (file != NULL)
+    {
+        if (fgets(mode, sizeof mode, file) == NULL)
+        {
+            mode[0] = '\0';
+        }
+        fclose(file);
+    }
+    if (strstr(mode, "[never]") != NULL || mode[0] == '\0')
+    {
+        huge_page_size = 0;
+        return huge_page_size;
+    }
+    file = fopen(THP_SIZE_PATH, "r");
+    if (file != NULL)
+    {
+        if (fscanf(file, "%lu", &size) != 1)
+        {
+            size = 0;
+        }
+        fclose(file);
+    }
+    huge_page_size = size;
+    return huge_page_size;
+}
+
+/**
+ * Convert the permissions field of a mapping to `PROT_*`
+ * bits.
+ *
+ * @param permissions The `rwxp` field from `/proc/self/maps`.
+ * @return The mapping's protection.
+ */
+static int permissions_to_prot(const char* permissions)
+{
+    int prot = PROT_NONE;
+    prot |= permissions[0] == 'r' ? PROT_READ : 0;
+    prot |= permissions[1] == 'w' ? PROT_WRITE : 0;
+    prot |= permissions[2] == 'x' ? PROT_EXEC : 0;
+    return prot;
+}
+
+/**
+ * Find the mapping containing an address, including its
+ * huge page usage from `/proc/self/smaps`.
+ *
+ * @param address An address inside the mapping.
+ * @param region Location to store the mapping.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if
+ * the process' mappings can't be read, or
+ * `DPATCH_STATUS_ERROR` if `address` is not mapped.
+ */
+dpatch_status memory_map_find(uintptr_t address, struct memory_region* region)
+{
+    char line[SMAPS_MAX_LINE_LEN];
+    char permissions[5];
+    unsigned long start = 0;
+    unsigned long end = 0;
+    size_t kb = 0;
+    bool found = false;
+    FILE* smaps = fopen(SMAPS_PATH, "r");
+    if (smaps == NULL)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    while (fgets(line, sizeof line, smaps) != NULL)
+    {
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, permissions) == 3)
+        {
+            if (found)
+            {
+                /* Reached the header of the next mapping. */
+                break;
+            }
+            if (address >= start && address < end)
+            {
+                found = true;
+                region->start = start;
+                region->end = end;
+                region->prot = permissions_to_prot(permissions);
+                region->anon_huge_kb = 0;
+                region->file_pmd_kb = 0;
+            }
+        }
+        else if (found && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+        {
+            region->anon_huge_kb = kb;
+        }
+        else if (found && sscanf(line, "FilePmdMapped: %zu kB", &kb) == 1)
+        {
+            region->file_pmd_kb = kb;
+        }
+    }
+    fclose(smaps);
+    return found ? DPATCH_STATUS_OK : DPATCH_STATUS_ERROR;
+}
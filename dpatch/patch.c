@@ -9,11 +9,34 @@
  * @date November 2020.
  */
 
+#include "cpu_features.h"
+#include "deferred_patch.h"
+#include "event_log.h"
+#include "hot_text.h"
 #include "patch.h"
+#include "patch_guard.h"
+#include "redirect.h"
+#include "relocator.h"
 #include "status.h"
+#include "symbol_index.h"
+#include "symbol_selector.h"
 #include <assert.h>
+#include <limits.h>
+#include <link.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The longest replacement name a selector can produce. */
+#define PATCH_SELECTOR_NAME_LEN 1024
+
+/** The number of matches first allocated when expanding a selector. */
+#define PATCH_SELECTOR_DEFAULT_LENGTH 64
 
 /**
  * A single patch operation to be applied to a target.
@@ -52,7 +75,16 @@ dpatch_status str_to_patch_operation
     if (strcmp(str, "fn_replace_internal") == 0)
     {
         *op = DPATCH_OP_REPLACE_FUNCTION_INTERNAL;
-    } else
+    }
+    else if (strcmp(str, "fn_replace_best") == 0)
+    {
+        *op = DPATCH_OP_REPLACE_FUNCTION_BEST;
+    }
+    else if (strcmp(str, "lib_replace") == 0)
+    {
+        *op = DPATCH_OP_REPLACE_LIBRARY;
+    }
+    else
     {
         return DPATCH_STATUS_EUNKNOWN;
     }
@@ -151,23 +183,585 @@ dpatch_status patch_operation
 }
 
 /**
- * Apply a patch to replace a function inside the same object.
+ * Fault a loaded object's executable segments into memory.
+ *
+ * Replacement code is prefaulted while preparing a patch,
+ * so the first calls into it after the patch is committed
+ * don't stall on page faults.
+ *
+ * @param handle `dlopen` handle to the object to prefault.
+ */
+static void prefault_object(void* handle)
+{
+    struct link_map* map = NULL;
+    ElfW(Ehdr)* header = NULL;
+    ElfW(Phdr)* program_headers = NULL;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t i = 0;
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL || page_size < 1)
+    {
+        return;
+    }
+    header = (ElfW(Ehdr)*) map->l_addr;
+    if (map->l_addr == 0 || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0)
+    {
+        return;
+    }
+    program_headers = (ElfW(Phdr)*) (map->l_addr + header->e_phoff);
+    for (i = 0; i < header->e_phnum; i++)
+    {
+        uintptr_t start = map->l_addr + program_headers[i].p_vaddr;
+        uintptr_t end = start + program_headers[i].p_memsz;
+        uintptr_t page = 0;
+        if (program_headers[i].p_type != PT_LOAD || !(program_headers[i].p_flags & PF_X))
+        {
+            continue;
+        }
+        start -= start % page_size;
+#ifdef MADV_POPULATE_READ
+        if (madvise((void*) start, end - start, MADV_POPULATE_READ) == 0)
+        {
+            continue;
+        }
+#endif
+        madvise((void*) start, end - start, MADV_WILLNEED);
+        for (page = start; page < end; page += page_size)
+        {
+            (void) *(volatile uint8_t*) page;
+        }
+    }
+}
+
+/**
+ * Load a replacement library into the program's namespace.
+ *
+ * The library is loaded into the program's namespace, not
+ * dpatch's audit namespace, so the replacement shares the
+ * program's libraries and state. It is relocated eagerly
+ * and prefaulted, so no lazy binding or page faults happen
+ * after a patch is committed.
+ *
+ * @param library Path to the library to load.
+ * @param handle Location to store the library's handle.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status patch_load_library(const char* library, void** handle)
+{
+    *handle = dlmopen(LM_ID_BASE, library, RTLD_NOW);
+    if (*handle == NULL)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    prefault_object(*handle);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Find a function in a loaded object.
+ *
+ * Exported functions are found with `dlsym`. Others are
+ * found in the object's `.symtab`, or its separate debug
+ * information, so programs need not be linked with
+ * `-rdynamic` to be patched.
+ *
+ * @param handle Handle to the object to search.
+ * @param name Name of the function to find.
+ * @return The function's address, or 0 if it wasn't found.
+ */
+static intptr_t resolve_function(void* handle, const char* name)
+{
+    struct link_map* map = NULL;
+    uintptr_t address = (uintptr_t) dlsym(handle, name);
+    if (address != 0)
+    {
+        return (intptr_t) address;
+    }
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL)
+    {
+        return 0;
+    }
+    if (IS_ERROR(symbol_index_find(map, name, &address)))
+    {
+        return 0;
+    }
+    return (intptr_t) address;
+}
+
+/**
+ * Stage a redirect from a function to its replacement,
+ * through a copy of the replacement in hot text, and a
+ * guard, if they are enabled.
+ *
+ * @param batch Batch to stage the redirect in.
+ * @param from Entry point of the function to replace.
+ * @param to The replacement.
+ * @param label Description of the redirect, for the log.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status add_replacement
+(
+    redirect_batch_t* batch,
+    intptr_t from,
+    intptr_t to,
+    const char* label
+)
+{
+    struct symbol_info info;
+    intptr_t through = to;
+    intptr_t stub = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    /* A replacement which is itself redirected is collapsed past, so isn't worth copying. */
+    if (
+        hot_text_enabled()
+        && redirect_resolve(to) == to
+        && !IS_ERROR(symbol_index_lookup((uintptr_t) to, &info))
+        && info.start == (uintptr_t) to
+        && info.size > 0
+    )
+    {
+        /* A replacement which can't be copied is redirected to where it was loaded. */
+        status = hot_text_copy(from, to, info.size, label, redirect_batch_patch_id(batch), &through);
+        if (!IS_ERROR(status))
+        {
+            /* Released if the batch isn't committed, as no other batch will jump to it. */
+            status = redirect_batch_stage(batch, through, &hot_text_release);
+            if (IS_ERROR(status))
+            {
+                hot_text_release(through);
+                return status;
+            }
+        }
+        else if (status != DPATCH_STATUS_EUNKNOWN)
+        {
+            return status;
+        }
+    }
+    if (patch_guard_enabled())
+    {
+        status = patch_guard_new(from, to, through, label, redirect_batch_patch_id(batch), &stub);
+        if (!IS_ERROR(status))
+        {
+            status = redirect_batch_stage(batch, stub, &patch_guard_release);
+            if (IS_ERROR(status))
+            {
+                patch_guard_release(stub);
+                return status;
+            }
+            through = stub;
+        }
+        else if (status == DPATCH_STATUS_EUNKNOWN)
+        {
+            event_logf(
+                LOG_WARNING,
+                status,
+                redirect_batch_patch_id(batch),
+                "Can't guard %s without patchable padding, so it is replaced unguarded.",
+                label
+            );
+        }
+        else if (IS_ERROR(status))
+        {
+            return status;
+        }
+    }
+    /* The table records `to`, so redirecting `to` later moves `from` on from its copy or stub. */
+    return redirect_batch_add_through(batch, from, to, through, label);
+}
+
+/**
+ * A function matched by a selector.
+ */
+struct family_match
+{
+    /** The function's entry point. */
+    intptr_t from;
+
+    /** The function's name. */
+    char* name;
+
+    /** Name of the function's replacement. */
+    char* replacement;
+};
+
+/**
+ * Progress expanding a selector over the program's
+ * functions.
+ */
+struct function_family
+{
+    /** The selector being expanded. */
+    const symbol_selector_t* selector;
+
+    /** Functions matched. */
+    struct family_match* matches;
+
+    /** The number of `matches`. */
+    size_t length;
+
+    /** The number of `matches` allocated in memory. */
+    size_t allocated;
+
+    /** The number of functions tested against the selector. */
+    size_t scanned;
+};
+
+/**
+ * Record a function if it matches a selector.
+ *
+ * Compiler generated fragments and clones, such as `f.cold`
+ * or `f.isra.0`, are skipped, as they aren't entry points
+ * with their function's calling convention.
  *
- * @param patch Handle to the patch to apply.
+ * @param function The function to test.
+ * @param context The `struct function_family` to add to.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ENOMEM`.
  */
-dpatch_status patch_replace_function_internal(patch_t* patch)
+static dpatch_status match_function(const struct symbol_info* function, void* context)
+{
+    struct function_family* family = context;
+    struct family_match* matches = NULL;
+    char replacement[PATCH_SELECTOR_NAME_LEN];
+    family->scanned++;
+    if (
+        strchr(function->name, '.') != NULL
+        || !symbol_selector_match(family->selector, function->name, replacement, sizeof replacement)
+    )
+    {
+        return DPATCH_STATUS_OK;
+    }
+    if (family->length == family->allocated)
+    {
+        family->allocated = family->allocated == 0 ? PATCH_SELECTOR_DEFAULT_LENGTH : family->allocated * 2;
+        matches = realloc(family->matches, sizeof(struct family_match) * family->allocated);
+        if (matches == NULL)
+        {
+            return DPATCH_STATUS_ENOMEM;
+        }
+        family->matches = matches;
+    }
+    matches = &family->matches[family->length];
+    matches->from = (intptr_t) function->start;
+    matches->name = strdup(function->name);
+    matches->replacement = strdup(replacement);
+    if (matches->name == NULL || matches->replacement == NULL)
+    {
+        free(matches->name);
+        free(matches->replacement);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    family->length++;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * A function the replacement library defines.
+ */
+struct named_function
+{
+    /** The function's name. */
+    char* name;
+
+    /** The function's entry point. */
+    intptr_t address;
+};
+
+/**
+ * The functions a replacement library defines, sorted by
+ * name, so a family's replacements are found without
+ * probing the loader for each.
+ */
+struct function_table
+{
+    /** Functions, sorted by name. */
+    struct named_function* functions;
+
+    /** The number of `functions`. */
+    size_t length;
+
+    /** The number of `functions` allocated in memory. */
+    size_t allocated;
+};
+
+/**
+ * Add a function to a table of functions.
+ *
+ * @param function The function to add.
+ * @param context The `struct function_table` to add to.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ENOMEM`.
+ */
+static dpatch_status table_function(const struct symbol_info* function, void* context)
+{
+    struct function_table* table = context;
+    struct named_function* functions = NULL;
+    if (table->length == table->allocated)
+    {
+        table->allocated = table->allocated == 0 ? PATCH_SELECTOR_DEFAULT_LENGTH : table->allocated * 2;
+        functions = realloc(table->functions, sizeof(struct named_function) * table->allocated);
+        if (functions == NULL)
+        {
+            return DPATCH_STATUS_ENOMEM;
+        }
+        table->functions = functions;
+    }
+    table->functions[table->length].name = strdup(function->name);
+    table->functions[table->length].address = (intptr_t) function->start;
+    if (table->functions[table->length].name == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    table->length++;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Order functions by name.
+ *
+ * @param a The first `struct named_function`.
+ * @param b The second `struct named_function`.
+ * @return Negative, zero or positive as `a`'s name sorts
+ * before, with or after `b`'s.
+ */
+static int compare_function_names(const void* a, const void* b)
+{
+    return strcmp(((const struct named_function*) a)->name, ((const struct named_function*) b)->name);
+}
+
+/**
+ * Find a function in a table of functions by name.
+ *
+ * @param table The table to search.
+ * @param name Name of the function to find.
+ * @return The function's entry point, or 0 if the table
+ * has no function named `name`.
+ */
+static intptr_t table_find(const struct function_table* table, const char* name)
+{
+    struct named_function key = {(char*) name, 0};
+    struct named_function* found = bsearch(
+        &key,
+        table->functions,
+        table->length,
+        sizeof(struct named_function),
+        &compare_function_names
+    );
+    return found == NULL ? 0 : found->address;
+}
+
+/**
+ * Order matched functions by entry point.
+ *
+ * @param a The first `struct family_match`.
+ * @param b The second `struct family_match`.
+ * @return Negative, zero or positive as `a` is before, at
+ * or after `b`.
+ */
+static int compare_matches(const void* a, const void* b)
+{
+    intptr_t left = ((const struct family_match*) a)->from;
+    intptr_t right = ((const struct family_match*) b)->from;
+    return left < right ? -1 : left > right ? 1 : 0;
+}
+
+/**
+ * Stage the redirects a selector expands to.
+ *
+ * The selector is matched against every function in the
+ * symbol index of each object in the program's namespace,
+ * except the library holding the replacements. The
+ * library's functions are read from the index once, and
+ * each match's replacement is looked up among them by name.
+ *
+ * @param patch The patch, whose old symbol is a selector.
+ * @param batch Batch to stage the redirects in.
+ * @param program_handle Handle to the program.
+ * @param library_handle Handle to the object holding the
+ *      replacements.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if
+ * the selector is invalid, `DPATCH_STATUS_EDYN` if no
+ * matching function has a replacement, or an error on
+ * failure.
+ */
+static dpatch_status patch_prepare_replace_function_family
+(
+    patch_t* patch,
+    redirect_batch_t* batch,
+    void* program_handle,
+    void* library_handle
+)
+{
+    struct function_family family = {NULL, NULL, 0, 0, 0};
+    struct function_table replacements = {NULL, 0, 0};
+    struct link_map* object = NULL;
+    struct link_map* library = NULL;
+    struct link_map* replacement_object = NULL;
+    symbol_selector_t* selector = NULL;
+    struct timespec start;
+    struct timespec end;
+    intptr_t to = 0;
+    char* label = NULL;
+    size_t redirected = 0;
+    size_t missing = 0;
+    size_t i = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PROPAGATE_ERROR(symbol_selector_new(&selector, patch->old_symbol, patch->new_symbol), status);
+    if (
+        dlinfo(program_handle, RTLD_DI_LINKMAP, &object) != 0
+        || (patch->library != NULL && dlinfo(library_handle, RTLD_DI_LINKMAP, &library) != 0)
+        || dlinfo(library_handle, RTLD_DI_LINKMAP, &replacement_object) != 0
+    )
+    {
+        symbol_selector_free(selector);
+        return DPATCH_STATUS_EDYN;
+    }
+    status = symbol_index_functions(replacement_object, &table_function, &replacements);
+    /* A library without functions leaves every match without a replacement. */
+    status = status == DPATCH_STATUS_EDYN ? DPATCH_STATUS_OK : status;
+    qsort(replacements.functions, replacements.length, sizeof(struct named_function), &compare_function_names);
+    family.selector = selector;
+    for (; object != NULL && !IS_ERROR(status); object = object->l_next)
+    {
+        if (object != library)
+        {
+            status = symbol_index_functions(object, &match_function, &family);
+            /* Objects without functions, such as the vDSO, have nothing to match. */
+            status = status == DPATCH_STATUS_EDYN ? DPATCH_STATUS_OK : status;
+        }
+    }
+    qsort(family.matches, family.length, sizeof(struct family_match), &compare_matches);
+    for (i = 0; i < family.length && !IS_ERROR(status); i++)
+    {
+        /* Aliases share an entry point, which is redirected once. */
+        if (i > 0 && family.matches[i].from == family.matches[i - 1].from)
+        {
+            continue;
+        }
+        to = table_find(&replacements, family.matches[i].replacement);
+        if (to == 0 || to == family.matches[i].from)
+        {
+            missing += to == 0 ? 1 : 0;
+            continue;
+        }
+        label = malloc(strlen(family.matches[i].name) + strlen(family.matches[i].replacement) + 5);
+        if (label == NULL)
+        {
+            status = DPATCH_STATUS_ENOMEM;
+            break;
+        }
+        sprintf(label, "%s to %s", family.matches[i].name, family.matches[i].replacement);
+        status = add_replacement(batch, family.matches[i].from, to, label);
+        free(label);
+        if (!IS_ERROR(status))
+        {
+            redirected++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    event_logf(
+        LOG_INFO,
+        status,
+        redirect_batch_patch_id(batch),
+        "Expanded %s to %zu functions in %.1f us, from %zu candidates, skipping %zu with no replacement.",
+        patch->old_symbol,
+        redirected,
+        (double) (end.tv_sec - start.tv_sec) * 1e6 + (double) (end.tv_nsec - start.tv_nsec) / 1e3,
+        family.scanned,
+        missing
+    );
+    for (i = 0; i < family.length; i++)
+    {
+        free(family.matches[i].name);
+        free(family.matches[i].replacement);
+    }
+    free(family.matches);
+    for (i = 0; i < replacements.length; i++)
+    {
+        free(replacements.functions[i].name);
+    }
+    free(replacements.functions);
+    symbol_selector_free(selector);
+    if (!IS_ERROR(status) && redirected == 0)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    return status;
+}
+
+/**
+ * Stage a resolved function replacement, or defer it if
+ * the function to replace isn't loaded.
+ *
+ * @param batch Batch to stage the redirect in.
+ * @param from Entry point of the function to replace, or 0
+ *      if it isn't loaded.
+ * @param to The replacement, or 0 if it wasn't found.
+ * @param old_symbol Name of the function to replace.
+ * @param new_symbol Name of the replacement.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if either
+ * function is missing and the replacement can't be
+ * deferred, or an error on failure.
+ */
+static dpatch_status stage_replacement
+(
+    redirect_batch_t* batch,
+    intptr_t from,
+    intptr_t to,
+    const char* old_symbol,
+    const char* new_symbol
+)
+{
+    char* label = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (to == (intptr_t) NULL || (from == (intptr_t) NULL && !deferred_patch_available()))
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    label = malloc(strlen(old_symbol) + strlen(new_symbol) + 5);
+    if (label == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    sprintf(label, "%s to %s", old_symbol, new_symbol);
+    if (from == (intptr_t) NULL)
+    {
+        /* Replace the function when an object defining it is loaded. */
+        status = deferred_patch_add(redirect_batch_patch_id(batch), old_symbol, to, label);
+    }
+    else
+    {
+        status = add_replacement(batch, from, to, label);
+    }
+    free(label);
+    return status;
+}
+
+/**
+ * Prepare a patch to replace a function inside the same object.
+ *
+ * If the old symbol is a selector, every function it
+ * matches is replaced. If the old symbol isn't loaded and
+ * dpatch is an audit library, the replacement is deferred
+ * until an object defining it is loaded.
+ *
+ * @param patch Handle to the patch to prepare.
+ * @param batch Batch to stage the patch's writes in.
+ */
+dpatch_status patch_prepare_replace_function_internal
+(
+    patch_t* patch,
+    redirect_batch_t* batch
+)
 {
     assert(patch != NULL);
     intptr_t patch_from = (intptr_t) NULL;
     intptr_t patch_to = (intptr_t) NULL;
     void* program_handle = NULL;
     void* library_handle = NULL;
-    machine_code_t* machine_code = NULL;
     dpatch_status status = DPATCH_STATUS_OK;
     program_handle = dlopen(NULL, RTLD_LAZY);
     if (patch->library)
     {
-        library_handle = dlopen(patch->library, RTLD_LAZY);
+        patch_load_library(patch->library, &library_handle);
     }
     else
     {
@@ -177,37 +771,489 @@ dpatch_status patch_replace_function_internal(patch_t* patch)
     {
         return DPATCH_STATUS_EDYN;
     }
-    patch_from = (intptr_t) dlsym(program_handle, patch->old_symbol);
-    patch_to = (intptr_t) dlsym(library_handle, patch->new_symbol);
-    if (patch_from == (intptr_t) NULL || patch_to == (intptr_t) NULL)
+    if (symbol_selector_is_pattern(patch->old_symbol))
     {
-        return DPATCH_STATUS_EDYN;
+        status = patch_prepare_replace_function_family(patch, batch, program_handle, library_handle);
+        dlclose(program_handle);
+        return status;
     }
-    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
-    PROPAGATE_ERROR(append_long_jump(machine_code, patch_to), status);
-    PROPAGATE_ERROR(machine_code_insert(machine_code, patch_from), status);
-    machine_code_free(machine_code);
+    patch_from = resolve_function(program_handle, patch->old_symbol);
+    patch_to = resolve_function(library_handle, patch->new_symbol);
+    status = stage_replacement(batch, patch_from, patch_to, patch->old_symbol, patch->new_symbol);
     /* 
      * We do not `dlclose` the library, otherwise the loader may evict
      * its code from memory, causing seg faults.
      */
     dlclose(program_handle);
+    return status;
+}
+
+/**
+ * Prepare a patch to replace a function with the first of
+ * several candidates the CPU can run.
+ *
+ * Candidates are listed best first, separated by commas.
+ * The instruction set extensions each one needs are read
+ * from its name, so `dot_avx512` is skipped on a CPU without
+ * AVX-512, and a name without an extension, such as
+ * `dot_generic`, runs anywhere.
+ *
+ * @param patch Handle to the patch to prepare.
+ * @param batch Batch to stage the patch's writes in.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * old symbol is a selector, `DPATCH_STATUS_EDYN` if no
+ * candidate can run or the old symbol isn't found, or an
+ * error on failure.
+ */
+dpatch_status patch_prepare_replace_function_best
+(
+    patch_t* patch,
+    redirect_batch_t* batch
+)
+{
+    char candidate[PATCH_SELECTOR_NAME_LEN];
+    char needs[PATCH_SELECTOR_NAME_LEN];
+    char skipped[PATCH_SELECTOR_NAME_LEN];
+    intptr_t patch_from = (intptr_t) NULL;
+    intptr_t patch_to = (intptr_t) NULL;
+    void* program_handle = NULL;
+    void* library_handle = NULL;
+    const char* next = patch->new_symbol;
+    const char* end = NULL;
+    uint32_t features = cpu_features_detect();
+    uint32_t missing = 0;
+    size_t skipped_length = 0;
+    size_t chosen = 0;
+    size_t candidates = 0;
+    size_t length = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(patch != NULL);
+    if (symbol_selector_is_pattern(patch->old_symbol))
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    program_handle = dlopen(NULL, RTLD_LAZY);
+    if (patch->library)
+    {
+        patch_load_library(patch->library, &library_handle);
+    }
+    else
+    {
+        library_handle = dlopen(NULL, RTLD_LAZY);
+    }
+    if (library_handle == NULL || program_handle == NULL)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    skipped[0] = '\0';
+    for (; next != NULL; next = end == NULL ? NULL : end + 1)
+    {
+        end = strchr(next, ',');
+        length = end == NULL ? strlen(next) : (size_t) (end - next);
+        candidates++;
+        if (length == 0 || length >= sizeof candidate)
+        {
+            continue;
+        }
+        memcpy(candidate, next, length);
+        candidate[length] = '\0';
+        missing = cpu_features_required(candidate) & ~features;
+        if (missing == 0)
+        {
+            patch_to = resolve_function(library_handle, candidate);
+        }
+        if (patch_to != (intptr_t) NULL)
+        {
+            chosen = candidates;
+            break;
+        }
+        cpu_features_describe(missing, needs, sizeof needs);
+        if (skipped_length < sizeof skipped)
+        {
+            skipped_length += (size_t) snprintf(
+                skipped + skipped_length,
+                sizeof skipped - skipped_length,
+                "%s%s (%s%s)",
+                skipped_length == 0 ? "" : ", ",
+                candidate,
+                missing == 0 ? "not found" : "needs ",
+                needs
+            );
+        }
+    }
+    /* Count the candidates after the one chosen, for the log. */
+    for (; next != NULL && end != NULL; end = strchr(end + 1, ','))
+    {
+        candidates++;
+    }
+    if (patch_to == (intptr_t) NULL)
+    {
+        event_logf(
+            LOG_ERR,
+            DPATCH_STATUS_EDYN,
+            redirect_batch_patch_id(batch),
+            "None of the %zu candidates for %s can run here: %s.",
+            candidates,
+            patch->old_symbol,
+            skipped
+        );
+        dlclose(program_handle);
+        return DPATCH_STATUS_EDYN;
+    }
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        redirect_batch_patch_id(batch),
+        "Selected %s for %s, candidate %zu of %zu%s%s.",
+        candidate,
+        patch->old_symbol,
+        chosen,
+        candidates,
+        skipped_length == 0 ? "" : ", after skipping ",
+        skipped
+    );
+    patch_from = resolve_function(program_handle, patch->old_symbol);
+    status = stage_replacement(batch, patch_from, patch_to, patch->old_symbol, candidate);
+    dlclose(program_handle);
+    return status;
+}
+
+/**
+ * Progress swapping a library's exported functions for
+ * those of a new build.
+ */
+struct library_swap
+{
+    /** Path the new build was loaded from. */
+    const char* library;
+
+    /** Handle to the new build. */
+    void* handle;
+
+    /** The new build. */
+    struct link_map* replacement;
+
+    /** Batch to stage redirects in. */
+    redirect_batch_t* batch;
+
+    /** Whether both builds have the same read-only data. */
+    bool same_rodata;
+
+    /**
+     * Start and end of the old build's sections which
+     * functions may refer to and still be left alone:
+     * `.rodata` and the PLT.
+     */
+    uintptr_t stateless[3][2];
+
+    /**
+     * Whether the function being compared refers to
+     * anything else in the old build.
+     */
+    bool stateful;
+
+    /** The number of functions whose code changed. */
+    size_t changed;
+
+    /** The number of functions whose code is identical. */
+    size_t unchanged;
+
+    /** The number of functions the new build doesn't export. */
+    size_t missing;
+};
+
+/**
+ * Find a loaded object in the program's namespace.
+ *
+ * @param name Path to the object, or the file name of the
+ *      object if it contains no `/`.
+ * @return The object, or `NULL` if it isn't loaded.
+ */
+static struct link_map* find_loaded_object(const char* name)
+{
+    char wanted[PATH_MAX];
+    char loaded[PATH_MAX];
+    struct link_map* map = NULL;
+    const char* file_name = NULL;
+    bool by_path = strchr(name, '/') != NULL;
+    void* program = dlopen(NULL, RTLD_LAZY);
+    if (program == NULL || (by_path && realpath(name, wanted) == NULL))
+    {
+        return NULL;
+    }
+    if (dlinfo(program, RTLD_DI_LINKMAP, &map) != 0)
+    {
+        map = NULL;
+    }
+    dlclose(program);
+    for (; map != NULL; map = map->l_next)
+    {
+        file_name = strrchr(map->l_name, '/');
+        file_name = file_name == NULL ? map->l_name : file_name + 1;
+        if (by_path ? realpath(map->l_name, loaded) != NULL && strcmp(loaded, wanted) == 0 : strcmp(file_name, name) == 0)
+        {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test if two builds of a library have the same read-only
+ * data, at the same offsets.
+ *
+ * Functions reference constants relative to their own
+ * address, so two functions with identical code only
+ * behave the same if the constants they reference match.
+ *
+ * @param original The loaded build.
+ * @param replacement The new build.
+ * @return `true` if both builds' `.rodata` sections are
+ * identical, or neither has one.
+ */
+static bool same_rodata(struct link_map* original, struct link_map* replacement)
+{
+    uintptr_t original_address = 0;
+    uintptr_t replacement_address = 0;
+    size_t original_size = 0;
+    size_t replacement_size = 0;
+    dpatch_status original_status = symbol_index_section(
+        original, ".rodata", &original_address, &original_size
+    );
+    dpatch_status replacement_status = symbol_index_section(
+        replacement, ".rodata", &replacement_address, &replacement_size
+    );
+    if (original_status == DPATCH_STATUS_EDYN && replacement_status == DPATCH_STATUS_EDYN)
+    {
+        return true;
+    }
+    return !IS_ERROR(original_status)
+        && !IS_ERROR(replacement_status)
+        && original_address - original->l_addr == replacement_address - replacement->l_addr
+        && original_size == replacement_size
+        && memcmp((void*) original_address, (void*) replacement_address, original_size) == 0;
+}
+
+/**
+ * Find the sections of a library's old build which a
+ * function can refer to without touching the build's state.
+ *
+ * @param swap The swap in progress.
+ * @param original The old build.
+ */
+static void find_stateless_sections(struct library_swap* swap, struct link_map* original)
+{
+    static const char* const names[] = {".rodata", ".plt", ".plt.sec"};
+    uintptr_t address = 0;
+    size_t size = 0;
+    size_t i = 0;
+    for (i = 0; i < sizeof names / sizeof names[0]; i++)
+    {
+        if (!IS_ERROR(symbol_index_section(original, names[i], &address, &size)))
+        {
+            swap->stateless[i][0] = address;
+            swap->stateless[i][1] = address + size;
+        }
+    }
+}
+
+/**
+ * Note whether an address a function refers to may hold
+ * the old build's state.
+ *
+ * @param target The address referred to.
+ * @param context The `struct library_swap` in progress.
+ */
+static void check_reference(intptr_t target, void* context)
+{
+    struct library_swap* swap = context;
+    bool stateless = false;
+    size_t i = 0;
+    for (i = 0; i < sizeof swap->stateless / sizeof swap->stateless[0]; i++)
+    {
+        stateless = stateless
+            || ((uintptr_t) target >= swap->stateless[i][0] && (uintptr_t) target < swap->stateless[i][1]);
+    }
+    swap->stateful = swap->stateful || !stateless;
+}
+
+/**
+ * Test if a function of a library's old build can be left
+ * running once the new build is swapped in.
+ *
+ * Leaving a function alone is only safe if its code is
+ * identical to the new build's, the constants it reads are
+ * identical, and it refers to nothing else in the old
+ * build. A function which reads `.data`, `.bss` or the GOT,
+ * or calls an internal function which may, would keep using
+ * the old build's globals while the redirected functions
+ * use the new build's, splitting the library's state
+ * between two objects.
+ *
+ * @param swap The swap in progress.
+ * @param function The old build's function.
+ * @param replacement The new build's function.
+ * @return `true` if the function can be left alone.
+ */
+static bool is_unchanged
+(
+    struct library_swap* swap,
+    const struct symbol_info* function,
+    const struct symbol_info* replacement
+)
+{
+    if (
+        !swap->same_rodata
+        || replacement->size != function->size
+        || memcmp((void*) replacement->start, (void*) function->start, function->size) != 0
+    )
+    {
+        return false;
+    }
+    swap->stateful = false;
+    return !IS_ERROR(relocate_references((intptr_t) function->start, function->size, &check_reference, swap))
+        && !swap->stateful;
+}
+
+/**
+ * Redirect one of a library's exported functions to the
+ * new build's version, unless it can be left alone.
+ *
+ * @param function The exported function.
+ * @param context The `struct library_swap` in progress.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status swap_function(const struct symbol_info* function, void* context)
+{
+    struct library_swap* swap = context;
+    struct symbol_info replacement;
+    uintptr_t address = (uintptr_t) dlsym(swap->handle, function->name);
+    char* label = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    /* `dlsym` also searches the new build's dependencies. */
+    if (
+        address == 0
+        || IS_ERROR(symbol_index_lookup(address, &replacement))
+        || replacement.object != swap->replacement
+        || replacement.start != address
+    )
+    {
+        swap->missing++;
+        return DPATCH_STATUS_OK;
+    }
+    if (is_unchanged(swap, function, &replacement))
+    {
+        swap->unchanged++;
+        return DPATCH_STATUS_OK;
+    }
+    label = malloc(2 * strlen(function->name) + strlen(swap->library) + 6);
+    if (label == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    sprintf(label, "%s to %s:%s", function->name, function->name, swap->library);
+    status = redirect_batch_add(swap->batch, (intptr_t) function->start, (intptr_t) address, label);
+    free(label);
+    swap->changed += IS_ERROR(status) ? 0 : 1;
+    return status;
+}
+
+/**
+ * Prepare a patch to replace a loaded library with a new
+ * build of it.
+ *
+ * The new build is loaded, and each function the old build
+ * exports is compared with the new build's function of the
+ * same name. Functions whose code is byte for byte
+ * identical are left alone, provided the builds' read-only
+ * data is also identical and the function refers to no
+ * other state of the old build. The rest are redirected in
+ * the patch's batch, so the whole library is swapped in one
+ * commit.
+ *
+ * @param patch Handle to the patch to prepare. Its old
+ *      symbol names the loaded library, and its new symbol
+ *      the new build.
+ * @param batch Batch to stage the patch's writes in.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * old library isn't loaded or the new build can't be, or an
+ * error on failure.
+ */
+static dpatch_status patch_prepare_replace_library
+(
+    patch_t* patch,
+    redirect_batch_t* batch
+)
+{
+    struct library_swap swap;
+    struct link_map* original = find_loaded_object(patch->old_symbol);
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (original == NULL)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    memset(&swap, 0, sizeof swap);
+    swap.library = patch->new_symbol;
+    swap.batch = batch;
+    PROPAGATE_ERROR(patch_load_library(patch->new_symbol, &swap.handle), status);
+    if (dlinfo(swap.handle, RTLD_DI_LINKMAP, &swap.replacement) != 0 || swap.replacement == original)
+    {
+        /* Loading a library by a name already loaded returns the loaded copy. */
+        return DPATCH_STATUS_EDYN;
+    }
+    PROPAGATE_ERROR(symbol_index_add_object(swap.replacement), status);
+    swap.same_rodata = same_rodata(original, swap.replacement);
+    find_stateless_sections(&swap, original);
+    PROPAGATE_ERROR(symbol_index_exports(original, &swap_function, &swap), status);
+    if (!swap.same_rodata)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            redirect_batch_patch_id(batch),
+            "The read-only data of %s changed, so functions with identical code are replaced too.",
+            patch->new_symbol
+        );
+    }
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        redirect_batch_patch_id(batch),
+        "Replacing %s with %s: %zu functions changed, %zu unchanged, %zu missing.",
+        original->l_name,
+        patch->new_symbol,
+        swap.changed,
+        swap.unchanged,
+        swap.missing
+    );
     return DPATCH_STATUS_OK;
 }
 
 /**
- * Attempt to apply a patch to the running program.
+ * Prepare a patch to be applied to the running program.
+ *
+ * Preparing a patch performs all of its slow work, such as
+ * loading libraries and resolving symbols, and stages the
+ * writes needed to apply it in `batch`.
  *
- * @param patch Handle to the patch to apply.
+ * @param patch Handle to the patch to prepare.
+ * @param batch Batch to stage the patch's writes in.
  * @return `DPATCH_STATUS_OK` or an error on failure.
  */
-dpatch_status patch_apply(struct patch* patch)
+dpatch_status patch_prepare(patch_t* patch, redirect_batch_t* batch)
 {
     assert(patch != NULL);
+    assert(batch != NULL);
     switch (patch->operation)
     {
         case DPATCH_OP_REPLACE_FUNCTION_INTERNAL:
-            return patch_replace_function_internal(patch);
+            return patch_prepare_replace_function_internal(patch, batch);
+            break;
+        case DPATCH_OP_REPLACE_FUNCTION_BEST:
+            return patch_prepare_replace_function_best(patch, batch);
+            break;
+        case DPATCH_OP_REPLACE_LIBRARY:
+            return patch_prepare_replace_library(patch, batch);
             break;
         case DPATCH_OP_NOP:
             return DPATCH_STATUS_OK;
@@ -0,0 +1,535 @@
+/**
+ * @file dpatch/patch_blob.c
+ *
+ * `patch_blob.c` defines functions for compiling a
+ * prepared patch set into a position independent blob,
+ * and for applying a blob in another process.
+ *
+ * A blob is laid out as a header, a table of objects, a
+ * table of redirects, then the strings they refer to. Every
+ * reference inside the blob is an offset from its start.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "deferred_patch.h"
+#include "event_log.h"
+#include "patch.h"
+#include "patch_blob.h"
+#include "patch_set.h"
+#include "redirect.h"
+#include "status.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define PATCH_BLOB_MAGIC "DPATCHBL"
+#define PATCH_BLOB_MAGIC_LEN 8
+#define PATCH_BLOB_VERSION 2
+#define PATCH_BLOB_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/**
+ * The start of a blob.
+ */
+struct patch_blob_header
+{
+    /** `PATCH_BLOB_MAGIC`, without a terminator. */
+    char magic[PATCH_BLOB_MAGIC_LEN];
+
+    /** `PATCH_BLOB_VERSION` of the writer. */
+    uint32_t version;
+
+    /** The number of entries in the object table. */
+    uint32_t object_count;
+
+    /** The number of entries in the redirect table. */
+    uint32_t redirect_count;
+
+    /** Unused, for alignment. */
+    uint32_t reserved;
+
+    /** Length of the blob, in bytes. */
+    uint64_t length;
+
+    /** Offset of the object table. */
+    uint64_t objects_offset;
+
+    /** Offset of the redirect table. */
+    uint64_t redirects_offset;
+
+    /** Hash of the script the blob was compiled from. */
+    uint64_t script_hash;
+};
+
+/**
+ * An object the blob refers to.
+ */
+struct patch_blob_object
+{
+    /** Offset of the object's path, or "" for the program. */
+    uint64_t name_offset;
+};
+
+/**
+ * A redirect, relative to the objects at each end.
+ */
+struct patch_blob_redirect
+{
+    /** Index of the object containing the entry point. */
+    uint32_t from_object;
+
+    /** Index of the object containing the destination. */
+    uint32_t to_object;
+
+    /** Offset of the entry point from its object's base. */
+    uint64_t from_offset;
+
+    /** Offset of the destination from its object's base. */
+    uint64_t to_offset;
+
+    /** Offset of the redirect's label. */
+    uint64_t label_offset;
+};
+
+/**
+ * Find the object containing an address, adding it to the
+ * set of objects seen if it is new.
+ *
+ * @param address Address to locate.
+ * @param objects Objects seen so far.
+ * @param object_count Number of `objects`.
+ * @param index Location to store the object's index.
+ * @param offset Location to store the address' offset
+ *      from the object's base.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status locate_address
+(
+    intptr_t address,
+    struct link_map** objects,
+    uint32_t* object_count,
+    uint32_t* index,
+    uint64_t* offset
+)
+{
+    Dl_info info;
+    struct link_map* map = NULL;
+    uint32_t i = 0;
+    if (dladdr1((void*) address, &info, (void**) &map, RTLD_DL_LINKMAP) == 0 || map == NULL)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    for (i = 0; i < *object_count && objects[i] != map; i++)
+    {
+    }
+    if (i == *object_count)
+    {
+        objects[(*object_count)++] = map;
+    }
+    *index = i;
+    *offset = (uint64_t) address - (uint64_t) map->l_addr;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Write a buffer to a new, sealed, `memfd`.
+ *
+ * @param data Bytes to write.
+ * @param length Number of bytes to write.
+ * @param fd Location to store the file descriptor.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status write_sealed_memfd(const uint8_t* data, size_t length, int* fd)
+{
+    size_t written = 0;
+    ssize_t result = 0;
+    *fd = memfd_create("dpatch-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    while (written < length)
+    {
+        result = write(*fd, data + written, length - written);
+        if (result <= 0)
+        {
+            close(*fd);
+            *fd = -1;
+            return DPATCH_STATUS_EFILE;
+        }
+        written += (size_t) result;
+    }
+    if (fcntl(*fd, F_ADD_SEALS, PATCH_BLOB_SEALS) == -1)
+    {
+        close(*fd);
+        *fd = -1;
+        return DPATCH_STATUS_EFILE;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Compile a prepared patch set into a blob.
+ *
+ * The blob is written to a new, sealed, `memfd`, which
+ * other processes can open through `/proc/<pid>/fd/<fd>`.
+ *
+ * Each redirect is recorded by the function it leads to,
+ * even if this process runs it through a hot text copy or
+ * a guard. Processes applying the blob redirect straight
+ * to the function. Replacements deferred until their
+ * functions are loaded can't be recorded, so a patch set
+ * which deferred any is rejected.
+ *
+ * @param patch_set Handle to the prepared patch set.
+ * @param script_hash Hash of the script the patch set was
+ *      parsed from, so processes can tell which script
+ *      the blob holds.
+ * @param fd Location to store the blob's file descriptor.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * patch set deferred a replacement or redirects to an
+ * address outside every loaded object, or an error on
+ * failure.
+ */
+dpatch_status patch_blob_compile(patch_set_t* patch_set, uint64_t script_hash, int* fd)
+{
+    redirect_batch_t* batch = patch_set_batch(patch_set);
+    struct patch_blob_header* header = NULL;
+    struct patch_blob_object* object_table = NULL;
+    struct patch_blob_redirect* redirect_table = NULL;
+    struct link_map** objects = NULL;
+    uint32_t object_count = 0;
+    uint32_t redirect_count = 0;
+    uint8_t* blob = NULL;
+    size_t strings_length = 0;
+    size_t string_offset = 0;
+    size_t length = 0;
+    size_t deferred = 0;
+    intptr_t from = 0;
+    intptr_t to = 0;
+    const char* label = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    assert(fd != NULL);
+    *fd = -1;
+    if (batch == NULL)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    deferred = deferred_patch_staged(patch_set_id(patch_set));
+    if (deferred != 0)
+    {
+        event_logf(
+            LOG_ERR,
+            DPATCH_STATUS_EDYN,
+            patch_set_id(patch_set),
+            "Can't compile a blob: %zu replacements are deferred until their functions are loaded, and blobs only hold redirects.",
+            deferred
+        );
+        return DPATCH_STATUS_EDYN;
+    }
+    redirect_count = (uint32_t) redirect_batch_length(batch);
+    objects = malloc(sizeof(struct link_map*) * 2 * (redirect_count + 1));
+    redirect_table = malloc(sizeof(struct patch_blob_redirect) * (redirect_count + 1));
+    if (objects == NULL || redirect_table == NULL)
+    {
+        free(objects);
+        free(redirect_table);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    for (i = 0; i < redirect_count && !IS_ERROR(status); i++)
+    {
+        redirect_batch_request(batch, i, &from, &to, &label);
+        status = locate_address(
+            from, objects, &object_count,
+            &redirect_table[i].from_object, &redirect_table[i].from_offset
+        );
+        if (!IS_ERROR(status))
+        {
+            status = locate_address(
+                to, objects, &object_count,
+                &redirect_table[i].to_object, &redirect_table[i].to_offset
+            );
+        }
+        if (IS_ERROR(status))
+        {
+            event_logf(
+                LOG_ERR,
+                status,
+                patch_set_id(patch_set),
+                "Can't compile a blob: %s isn't in a loaded object.",
+                label
+            );
+        }
+        strings_length += strlen(label) + 1;
+    }
+    for (i = 0; i < object_count; i++)
+    {
+        strings_length += strlen(objects[i]->l_name) + 1;
+    }
+    length = sizeof(struct patch_blob_header)
+        + sizeof(struct patch_blob_object) * object_count
+        + sizeof(struct patch_blob_redirect) * redirect_count
+        + strings_length;
+    blob = IS_ERROR(status) ? NULL : calloc(1, length);
+    if (blob == NULL)
+    {
+        free(objects);
+        free(redirect_table);
+        return IS_ERROR(status) ? status : DPATCH_STATUS_ENOMEM;
+    }
+    header = (struct patch_blob_header*) blob;
+    memcpy(header->magic, PATCH_BLOB_MAGIC, PATCH_BLOB_MAGIC_LEN);
+    header->version = PATCH_BLOB_VERSION;
+    header->object_count = object_count;
+    header->redirect_count = redirect_count;
+    header->length = length;
+    header->objects_offset = sizeof(struct patch_blob_header);
+    header->redirects_offset = header->objects_offset + sizeof(struct patch_blob_object) * object_count;
+    header->script_hash = script_hash;
+    object_table = (struct patch_blob_object*) (blob + header->objects_offset);
+    string_offset = header->redirects_offset + sizeof(struct patch_blob_redirect) * redirect_count;
+    for (i = 0; i < object_count; i++)
+    {
+        object_table[i].name_offset = string_offset;
+        strcpy((char*) blob + string_offset, objects[i]->l_name);
+        string_offset += strlen(objects[i]->l_name) + 1;
+    }
+    for (i = 0; i < redirect_count; i++)
+    {
+        redirect_batch_request(batch, i, &from, &to, &label);
+        redirect_table[i].label_offset = string_offset;
+        strcpy((char*) blob + string_offset, label);
+        string_offset += strlen(label) + 1;
+    }
+    memcpy(blob + header->redirects_offset, redirect_table, sizeof(struct patch_blob_redirect) * redirect_count);
+    status = write_sealed_memfd(blob, length, fd);
+    if (!IS_ERROR(status))
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            patch_set_id(patch_set),
+            "Compiled %u redirects across %u objects into a %zu byte blob.",
+            (unsigned) redirect_count,
+            (unsigned) object_count,
+            length
+        );
+    }
+    free(blob);
+    free(objects);
+    free(redirect_table);
+    return status;
+}
+
+/**
+ * Get a string stored in a blob.
+ *
+ * @param blob The blob to read.
+ * @param length Length of the blob.
+ * @param offset Offset of the string.
+ * @return The string, or `NULL` if it is not terminated
+ * inside the blob.
+ */
+static const char* blob_string(const uint8_t* blob, size_t length, uint64_t offset)
+{
+    if (offset >= length || memchr(blob + offset, '\0', length - offset) == NULL)
+    {
+        return NULL;
+    }
+    return (const char*) blob + offset;
+}
+
+/**
+ * Find the base address of an object named by a blob in
+ * the current process, loading it if it is not loaded.
+ *
+ * @param name The object's path, or "" for the program.
+ * @param base Location to store the object's base.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status object_base(const char* name, uintptr_t* base)
+{
+    struct link_map* map = NULL;
+    void* handle = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (name[0] == '\0')
+    {
+        handle = dlopen(NULL, RTLD_LAZY);
+    }
+    else
+    {
+        handle = dlmopen(LM_ID_BASE, name, RTLD_LAZY | RTLD_NOLOAD);
+        if (handle == NULL)
+        {
+            PROPAGATE_ERROR(patch_load_library(name, &handle), status);
+        }
+    }
+    if (handle == NULL || dlinfo(handle, RTLD_DI_LINKMAP, &map) != 0 || map == NULL)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    /*
+     * As in `patch_prepare`, objects are never closed so
+     * their code stays mapped while it might be called.
+     */
+    *base = (uintptr_t) map->l_addr;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Stage the redirects recorded in a mapped blob in a batch.
+ *
+ * @param blob The mapped blob.
+ * @param length Length of the blob.
+ * @param batch Batch to stage the blob's redirects in.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+static dpatch_status patch_blob_prepare_mapped
+(
+    const uint8_t* blob,
+    size_t length,
+    redirect_batch_t* batch
+)
+{
+    const struct patch_blob_header* header = (const struct patch_blob_header*) blob;
+    const struct patch_blob_object* object_table = NULL;
+    const struct patch_blob_redirect* redirect_table = NULL;
+    const char* name = NULL;
+    const char* label = NULL;
+    uintptr_t* bases = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    if (
+        length < sizeof(struct patch_blob_header)
+        || memcmp(header->magic, PATCH_BLOB_MAGIC, PATCH_BLOB_MAGIC_LEN) != 0
+        || header->version != PATCH_BLOB_VERSION
+        || header->length != length
+        || header->objects_offset + sizeof(struct patch_blob_object) * header->object_count > length
+        || header->redirects_offset + sizeof(struct patch_blob_redirect) * header->redirect_count > length
+    )
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    object_table = (const struct patch_blob_object*) (blob + header->objects_offset);
+    redirect_table = (const struct patch_blob_redirect*) (blob + header->redirects_offset);
+    bases = malloc(sizeof(uintptr_t) * (header->object_count + 1));
+    if (bases == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    for (i = 0; i < header->object_count && !IS_ERROR(status); i++)
+    {
+        name = blob_string(blob, length, object_table[i].name_offset);
+        status = name == NULL ? DPATCH_STATUS_ESYNTAX : object_base(name, &bases[i]);
+    }
+    for (i = 0; i < header->redirect_count && !IS_ERROR(status); i++)
+    {
+        label = blob_string(blob, length, redirect_table[i].label_offset);
+        if (
+            label == NULL
+            || redirect_table[i].from_object >= header->object_count
+            || redirect_table[i].to_object >= header->object_count
+        )
+        {
+            status = DPATCH_STATUS_ESYNTAX;
+            break;
+        }
+        status = redirect_batch_add(
+            batch,
+            (intptr_t) (bases[redirect_table[i].from_object] + redirect_table[i].from_offset),
+            (intptr_t) (bases[redirect_table[i].to_object] + redirect_table[i].to_offset),
+            label
+        );
+    }
+    free(bases);
+    return status;
+}
+
+/**
+ * Stage the redirects recorded in a blob in a batch.
+ *
+ * Objects named by the blob are located in the current
+ * process, and replacement libraries which are not yet
+ * loaded are loaded.
+ *
+ * @param fd File descriptor of the blob to read.
+ * @param batch Batch to stage the blob's redirects in.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * blob is malformed, or an error on failure.
+ */
+dpatch_status patch_blob_prepare(int fd, redirect_batch_t* batch)
+{
+    struct stat file_stat;
+    uint8_t* blob = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(batch != NULL);
+    if (fstat(fd, &file_stat) == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    if (file_stat.st_size <= 0)
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    blob = mmap(NULL, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (blob == MAP_FAILED)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    status = patch_blob_prepare_mapped(blob, (size_t) file_stat.st_size, batch);
+    munmap(blob, (size_t) file_stat.st_size);
+    return status;
+}
+
+/**
+ * Test if a file starts like a compiled blob.
+ *
+ * @param fd File descriptor of the file to test.
+ * @return `true` if the file starts with the blob magic.
+ */
+bool patch_blob_is_blob(int fd)
+{
+    char magic[PATCH_BLOB_MAGIC_LEN];
+    if (pread(fd, magic, sizeof magic, 0) != (ssize_t) sizeof magic)
+    {
+        return false;
+    }
+    return memcmp(magic, PATCH_BLOB_MAGIC, PATCH_BLOB_MAGIC_LEN) == 0;
+}
+
+/**
+ * Read the hash of the script a blob was compiled from.
+ *
+ * @param fd File descriptor of the blob to read.
+ * @param script_hash Location to store the hash.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * file isn't a blob this version of dpatch can apply, or an
+ * error on failure.
+ */
+dpatch_status patch_blob_script_hash(int fd, uint64_t* script_hash)
+{
+    struct patch_blob_header header;
+    assert(script_hash != NULL);
+    if (pread(fd, &header, sizeof header, 0) != (ssize_t) sizeof header)
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    if (
+        memcmp(header.magic, PATCH_BLOB_MAGIC, PATCH_BLOB_MAGIC_LEN) != 0
+        || header.version != PATCH_BLOB_VERSION
+    )
+    {
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    *script_hash = header.script_hash;
+    return DPATCH_STATUS_OK;
+}
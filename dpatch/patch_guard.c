@@ -0,0 +1,699 @@
+/**
+ * @file dpatch/patch_guard.c
+ *
+ * `patch_guard.c` defines guards, which check a function
+ * replacement makes the function faster before keeping it.
+ *
+ * A guarded replacement redirects the function to a stub.
+ * The stub forwards most calls straight to the replacement,
+ * but every `DPATCH_GUARD_SAMPLE_EVERY`th call is timed,
+ * alternately running the old code and the replacement.
+ * The first timed call to finish after
+ * `DPATCH_GUARD_WINDOW_MS` hands the guard to a background
+ * thread, which compares the two distributions, then
+ * redirects the function to the replacement, or back to
+ * the old code if the replacement's median is more than
+ * `DPATCH_GUARD_THRESHOLD_PCT` percent slower. The stub
+ * only flags the decision, as the application thread which
+ * reaches it may be in a signal handler, hold locks, or be
+ * latency critical.
+ *
+ * Timed calls return through the stub, so they must not be
+ * unwound by exceptions or `longjmp`. Stubs are never
+ * freed, as threads may still be running them, unless they
+ * were made for a batch which was never committed.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "code_generator.h"
+#include "cpu_features.h"
+#include "event_log.h"
+#include "machine_code.h"
+#include "patch_guard.h"
+#include "perf_map.h"
+#include "redirect.h"
+#include "status.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WINDOW_ENV_VAR "DPATCH_GUARD_WINDOW_MS"
+#define SAMPLE_EVERY_ENV_VAR "DPATCH_GUARD_SAMPLE_EVERY"
+#define THRESHOLD_ENV_VAR "DPATCH_GUARD_THRESHOLD_PCT"
+#define DEFAULT_SAMPLE_EVERY 64
+#define DEFAULT_THRESHOLD_PCT 10
+#define X64_INT3 0xcc
+
+/** Samples each side needs before they are compared. */
+#define GUARD_MIN_SAMPLES 16
+
+/** Timed calls a thread can have in progress at once. */
+#define GUARD_MAX_DEPTH 64
+
+/** Histogram buckets per power of two, as a power of two. */
+#define HISTOGRAM_SUB_BITS 4
+
+/** Histogram buckets, covering every `uint64_t`. */
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+#define PERF_MAP_NAME_LEN 512
+
+/**
+ * A log-linear histogram of call durations in nanoseconds.
+ */
+struct histogram
+{
+    /** The number of durations in each bucket. */
+    uint64_t counts[HISTOGRAM_BUCKETS];
+
+    /** The number of durations recorded. */
+    uint64_t total;
+};
+
+/**
+ * A replacement being timed against the code it replaces.
+ */
+struct patch_guard
+{
+    /**
+     * Calls until the stub times one. Updated without
+     * synchronisation, so racing threads only skew the
+     * sampling rate.
+     */
+    int32_t countdown;
+
+    /** Entry point being replaced. */
+    intptr_t from;
+
+    /** Address which runs the code being replaced. */
+    intptr_t original;
+
+    /** The replacement function. */
+    intptr_t function;
+
+    /** Address which runs `function`. */
+    intptr_t replacement;
+
+    /** The stub `from` is redirected to. */
+    intptr_t stub;
+
+    /** Description of the replacement, for the log. */
+    char* label;
+
+    /** Patch the replacement belongs to, or 0. */
+    uint64_t patch_id;
+
+    /** The number of timed calls started. */
+    uint64_t samples;
+
+    /** `CLOCK_MONOTONIC` time of the first timed call, in ns, or 0. */
+    uint64_t started_ns;
+
+    /** Whether the guard's window has passed, and it has been queued to decide. */
+    bool decided;
+
+    /** The next guard waiting to decide. */
+    struct patch_guard* next_decision;
+
+    /** The next guard created. */
+    struct patch_guard* next;
+
+    /** Durations of timed calls to the code being replaced. */
+    struct histogram original_times;
+
+    /** Durations of timed calls to the replacement. */
+    struct histogram replacement_times;
+};
+
+/**
+ * A timed call in progress.
+ */
+struct guard_frame
+{
+    /** The guard timing the call. */
+    struct patch_guard* guard;
+
+    /** Address the call returns to. */
+    intptr_t return_address;
+
+    /** `CLOCK_MONOTONIC` time the call started, in ns. */
+    uint64_t start_ns;
+
+    /** Whether the call runs the replacement. */
+    bool replacement;
+};
+
+/** Length of the window after which guards decide, in ms, or 0 when guards are off. */
+static unsigned long window_ms = 0;
+
+/** A guard times one in this many calls. */
+static unsigned long sample_every = DEFAULT_SAMPLE_EVERY;
+
+/** Percent slower a replacement must be to be reverted. */
+static unsigned long threshold_pct = DEFAULT_THRESHOLD_PCT;
+
+/** Every guard created, most recent first. */
+static struct patch_guard* guards = NULL;
+
+/** Protects `guards`. */
+static pthread_mutex_t guards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Guards waiting for the decision thread, most recent first. */
+static struct patch_guard* decisions = NULL;
+
+/** Posted each time a guard is queued to decide. */
+static sem_t decisions_queued;
+
+/** Ensures the decision thread is started once. */
+static pthread_once_t decision_thread_once = PTHREAD_ONCE_INIT;
+
+/** Whether the decision thread is running. */
+static bool decision_thread_started = false;
+
+/** The calling thread's timed calls, innermost last. */
+static __thread struct guard_frame frames[GUARD_MAX_DEPTH];
+
+/** The number of the calling thread's timed calls in progress. */
+static __thread size_t frames_length = 0;
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Read a non-negative integer from the environment.
+ *
+ * @param name Name of the variable.
+ * @param value Location to store the value. Unchanged if
+ *      the variable isn't set.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if
+ * the variable isn't a non-negative integer.
+ */
+static dpatch_status read_env_ulong(const char* name, unsigned long* value)
+{
+    char* str = getenv(name);
+    char* end = NULL;
+    unsigned long parsed = 0;
+    if (str == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    errno = 0;
+    parsed = strtoul(str, &end, 10);
+    if (str[0] < '0' || str[0] > '9' || *end != '\0' || errno != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    *value = parsed;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Configure guarded replacements from the
+ * `DPATCH_GUARD_WINDOW_MS`, `DPATCH_GUARD_SAMPLE_EVERY` and
+ * `DPATCH_GUARD_THRESHOLD_PCT` environment variables.
+ *
+ * Replacements are guarded when `DPATCH_GUARD_WINDOW_MS`
+ * is set and not 0.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if a
+ * variable isn't a non-negative integer.
+ */
+dpatch_status patch_guard_init_mode(void)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(read_env_ulong(WINDOW_ENV_VAR, &window_ms), status);
+    PROPAGATE_ERROR(read_env_ulong(SAMPLE_EVERY_ENV_VAR, &sample_every), status);
+    PROPAGATE_ERROR(read_env_ulong(THRESHOLD_ENV_VAR, &threshold_pct), status);
+    if (sample_every == 0 || sample_every > INT32_MAX)
+    {
+        sample_every = DEFAULT_SAMPLE_EVERY;
+        return DPATCH_STATUS_ERROR;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Test if function replacements are guarded.
+ *
+ * @return `true` if replacements should be redirected
+ * through a guard.
+ */
+bool patch_guard_enabled(void)
+{
+    return window_ms != 0;
+}
+
+/**
+ * Get the histogram bucket for a duration.
+ *
+ * @param duration The duration in nanoseconds.
+ * @return Index of the bucket containing `duration`.
+ */
+static size_t histogram_bucket(uint64_t duration)
+{
+    int exponent = 0;
+    if (duration < (1u << HISTOGRAM_SUB_BITS))
+    {
+        return (size_t) duration;
+    }
+    exponent = 63 - __builtin_clzll(duration);
+    return ((size_t) (exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+        + (size_t) ((duration >> (exponent - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/**
+ * Get the smallest duration in a histogram bucket.
+ *
+ * @param bucket Index of the bucket.
+ * @return The bucket's lower bound in nanoseconds.
+ */
+static uint64_t histogram_bucket_start(size_t bucket)
+{
+    size_t exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t mantissa = (1u << HISTOGRAM_SUB_BITS) + (bucket & ((1u << HISTOGRAM_SUB_BITS) - 1));
+    if (bucket < (1u << HISTOGRAM_SUB_BITS))
+    {
+        return (uint64_t) bucket;
+    }
+    return mantissa << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * Get a percentile of a histogram.
+ *
+ * @param histogram The histogram to query.
+ * @param percent The percentile, from 1 to 100.
+ * @return The lower bound of the bucket containing the
+ * percentile, in nanoseconds, or 0 if the histogram is
+ * empty.
+ */
+static uint64_t histogram_percentile(const struct histogram* histogram, unsigned percent)
+{
+    uint64_t rank = (histogram->total * percent + 99) / 100;
+    uint64_t seen = 0;
+    size_t i = 0;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank && seen != 0)
+        {
+            return histogram_bucket_start(i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Log the distribution of one side of a guard.
+ *
+ * @param guard The guard which recorded the distribution.
+ * @param side Name of the side, for the log.
+ * @param histogram The distribution to log.
+ */
+static void log_distribution(struct patch_guard* guard, const char* side, const struct histogram* histogram)
+{
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        guard->patch_id,
+        "Guarded %s, %s: p50 %llu ns, p90 %llu ns, p99 %llu ns over %llu calls.",
+        guard->label,
+        side,
+        (unsigned long long) histogram_percentile(histogram, 50),
+        (unsigned long long) histogram_percentile(histogram, 90),
+        (unsigned long long) histogram_percentile(histogram, 99),
+        (unsigned long long) histogram->total
+    );
+}
+
+/**
+ * Redirect a guard's entry point to the faster of its two
+ * functions, and log why.
+ *
+ * @param guard The guard whose window has passed.
+ */
+static void guard_decide(struct patch_guard* guard)
+{
+    uint64_t original_p50 = histogram_percentile(&guard->original_times, 50);
+    uint64_t replacement_p50 = histogram_percentile(&guard->replacement_times, 50);
+    bool enough = guard->original_times.total >= GUARD_MIN_SAMPLES
+        && guard->replacement_times.total >= GUARD_MIN_SAMPLES;
+    bool revert = enough && replacement_p50 * 100 > original_p50 * (100 + threshold_pct);
+    log_distribution(guard, "old", &guard->original_times);
+    log_distribution(guard, "new", &guard->replacement_times);
+    if (redirect_resolve(guard->from) != guard->stub)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            guard->patch_id,
+            "Guarded %s was superseded, so it is left alone.",
+            guard->label
+        );
+        return;
+    }
+    if (!enough)
+    {
+        event_logf(
+            LOG_WARNING,
+            DPATCH_STATUS_OK,
+            guard->patch_id,
+            "Kept %s: too few calls were timed to compare.",
+            guard->label
+        );
+    }
+    else
+    {
+        event_logf(
+            revert ? LOG_WARNING : LOG_INFO,
+            DPATCH_STATUS_OK,
+            guard->patch_id,
+            "%s %s: the new median is %llu%% of the old, and the limit is %lu%%.",
+            revert ? "Reverted" : "Kept",
+            guard->label,
+            (unsigned long long) (original_p50 == 0 ? 100 : replacement_p50 * 100 / original_p50),
+            100 + threshold_pct
+        );
+    }
+    if (revert)
+    {
+        LOG_ON_ERROR(redirect_install(guard->from, guard->original, guard->original));
+    }
+    else
+    {
+        LOG_ON_ERROR(redirect_install(guard->from, guard->function, guard->replacement));
+    }
+}
+
+/**
+ * Decide each guard as it is queued.
+ *
+ * @param args Unused.
+ * @return Never returns.
+ */
+static void* decision_thread(void* args)
+{
+    struct patch_guard* guard = NULL;
+    (void) args;
+    for (;;)
+    {
+        if (sem_wait(&decisions_queued) != 0)
+        {
+            continue;
+        }
+        guard = __atomic_exchange_n(&decisions, NULL, __ATOMIC_ACQUIRE);
+        for (; guard != NULL; guard = guard->next_decision)
+        {
+            guard_decide(guard);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the thread guards decide on.
+ */
+static void start_decision_thread(void)
+{
+    pthread_attr_t attributes;
+    pthread_t thread;
+    if (sem_init(&decisions_queued, 0, 0) != 0)
+    {
+        return;
+    }
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    decision_thread_started = pthread_create(&thread, &attributes, &decision_thread, NULL) == 0;
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Queue a guard for the decision thread.
+ *
+ * Safe to call from a signal handler, as it only pushes
+ * onto a lock-free list and posts a semaphore.
+ *
+ * @param guard The guard whose window has passed.
+ */
+static void queue_decision(struct patch_guard* guard)
+{
+    struct patch_guard* head = __atomic_load_n(&decisions, __ATOMIC_RELAXED);
+    do
+    {
+        guard->next_decision = head;
+    }
+    while (!__atomic_compare_exchange_n(&decisions, &head, guard, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    sem_post(&decisions_queued);
+}
+
+/**
+ * Start a call through a guard's stub.
+ *
+ * Called by the stub when its countdown underflows.
+ *
+ * @param guard The stub's guard.
+ * @param return_address Address the call returns to.
+ * @return The function to time, or 0 if the call should
+ * go straight to the replacement.
+ */
+static intptr_t guard_enter(struct patch_guard* guard, intptr_t return_address)
+{
+    struct guard_frame* frame = NULL;
+    uint64_t sample = 0;
+    uint64_t unset = 0;
+    __atomic_store_n(&guard->countdown, (int32_t) sample_every - 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&guard->decided, __ATOMIC_RELAXED) || frames_length == GUARD_MAX_DEPTH)
+    {
+        return 0;
+    }
+    sample = __atomic_fetch_add(&guard->samples, 1, __ATOMIC_RELAXED);
+    frame = &frames[frames_length++];
+    frame->guard = guard;
+    frame->return_address = return_address;
+    frame->replacement = sample % 2 == 1;
+    frame->start_ns = now_ns();
+    __atomic_compare_exchange_n(
+        &guard->started_ns, &unset, frame->start_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+    );
+    return frame->replacement ? guard->replacement : guard->original;
+}
+
+/**
+ * Finish a call through a guard's stub.
+ *
+ * Called by the stub when a timed call returns. If the
+ * guard's window has passed, the guard is queued for the
+ * decision thread.
+ *
+ * @param guard The stub's guard.
+ * @return The address the call returns to.
+ */
+static intptr_t guard_leave(struct patch_guard* guard)
+{
+    uint64_t end_ns = now_ns();
+    struct guard_frame* frame = &frames[--frames_length];
+    struct histogram* histogram = frame->replacement ? &guard->replacement_times : &guard->original_times;
+    bool decided = false;
+    __atomic_fetch_add(&histogram->counts[histogram_bucket(end_ns - frame->start_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, 1, __ATOMIC_RELAXED);
+    if (
+        end_ns - guard->started_ns >= window_ms * 1000000ull
+        && __atomic_compare_exchange_n(&guard->decided, &decided, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+    )
+    {
+        queue_decision(guard);
+    }
+    return frame->return_address;
+}
+
+/**
+ * Write a guard's stub into a new executable page.
+ *
+ * @param guard The guard to write the stub for.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status write_stub(struct patch_guard* guard)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    char name[PERF_MAP_NAME_LEN];
+    machine_code_t* machine_code = NULL;
+    void* page = NULL;
+    size_t length = 0;
+    size_t vector_state_size = 0;
+    uint32_t vector_state = cpu_features_vector_state(&vector_state_size);
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    status = append_sampled_call(
+        machine_code,
+        (intptr_t) &guard->countdown,
+        guard->replacement,
+        (intptr_t) guard,
+        (intptr_t) &guard_enter,
+        (intptr_t) &guard_leave,
+        vector_state,
+        vector_state_size
+    );
+    length = machine_code_length(machine_code);
+    if (!IS_ERROR(status))
+    {
+        page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        status = page == MAP_FAILED ? DPATCH_STATUS_ENOMEM : DPATCH_STATUS_OK;
+    }
+    if (!IS_ERROR(status))
+    {
+        memset(page, X64_INT3, page_size);
+        status = mprotect(page, page_size, PROT_READ | PROT_EXEC) == 0 ? DPATCH_STATUS_OK : DPATCH_STATUS_EMPROT;
+        if (!IS_ERROR(status))
+        {
+            status = machine_code_insert(machine_code, (intptr_t) page);
+        }
+        if (IS_ERROR(status))
+        {
+            munmap(page, page_size);
+        }
+    }
+    machine_code_free(machine_code);
+    if (IS_ERROR(status))
+    {
+        return status;
+    }
+    guard->stub = (intptr_t) page;
+    if (perf_map_enabled())
+    {
+        snprintf(name, sizeof name, "dpatch guard %s", guard->label);
+        perf_map_record(guard->stub, length, name);
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Create a guard which times a function against its
+ * replacement.
+ *
+ * The guard's stub splits calls between the code `from`
+ * currently runs and `replacement`, timing a sample of
+ * them. Once the guard's window has passed, `from` is
+ * redirected to whichever is faster, and the stub is no
+ * longer used.
+ *
+ * A function which isn't already redirected needs
+ * patchable padding, so its original code can still be
+ * run by skipping the entry NOP.
+ *
+ * @param from Entry point being replaced.
+ * @param function The replacement function.
+ * @param replacement Address which runs `function`, such as
+ *      a copy of it in hot text, or `function` itself.
+ * @param label Description of the replacement, for the log.
+ * @param patch_id Patch the replacement belongs to, or 0.
+ * @param stub Location to store the address to redirect
+ *      `from` to.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the code `from` runs can't be reached once `from` is
+ * overwritten, `DPATCH_STATUS_ERROR` if the thread guards
+ * decide on can't be started, or an error on failure.
+ */
+dpatch_status patch_guard_new
+(
+    intptr_t from,
+    intptr_t function,
+    intptr_t replacement,
+    const char* label,
+    uint64_t patch_id,
+    intptr_t* stub
+)
+{
+    struct patch_guard* guard = NULL;
+    intptr_t original = redirect_bypass(from);
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (original == 0)
+    {
+        return DPATCH_STATUS_EUNKNOWN;
+    }
+    pthread_once(&decision_thread_once, &start_decision_thread);
+    if (!decision_thread_started)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    guard = calloc(1, sizeof(struct patch_guard));
+    if (guard == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    guard->label = strdup(label);
+    if (guard->label == NULL)
+    {
+        free(guard);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    guard->countdown = (int32_t) sample_every - 1;
+    guard->from = from;
+    guard->original = original;
+    guard->function = function;
+    guard->replacement = replacement;
+    guard->patch_id = patch_id;
+    status = write_stub(guard);
+    if (IS_ERROR(status))
+    {
+        free(guard->label);
+        free(guard);
+        return status;
+    }
+    pthread_mutex_lock(&guards_lock);
+    guard->next = guards;
+    guards = guard;
+    pthread_mutex_unlock(&guards_lock);
+    *stub = guard->stub;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Release a guard whose stub nothing jumps to, such as one
+ * made for a batch which was never committed.
+ *
+ * @param stub Address of the guard's stub.
+ */
+void patch_guard_release(intptr_t stub)
+{
+    struct patch_guard** link = NULL;
+    struct patch_guard* guard = NULL;
+    pthread_mutex_lock(&guards_lock);
+    for (link = &guards; *link != NULL; link = &(*link)->next)
+    {
+        if ((*link)->stub == stub)
+        {
+            guard = *link;
+            *link = guard->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&guards_lock);
+    if (guard == NULL)
+    {
+        return;
+    }
+    /* No call reached the stub, so the guard was never queued to decide. */
+    munmap((void*) guard->stub, (size_t) sysconf(_SC_PAGESIZE));
+    free(guard->label);
+    free(guard);
+}
@@ -11,17 +11,20 @@
 
 #include "patch_script.h"
 #include "status.h"
+#include "symbol_selector.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-#define PATCH_SCRIPT_MAX_LINE_LEN 255
 #define XSTR(x) STR(x)
 #define STR(x) #x
 
 #define DEFAULT_SCRIPT_PATH "/usr/etc/patch.dpatch"
 #define SCRIPT_PATH_ENV_VAR "DPATCH_SCRIPT"
+#define SCRIPT_READ_BUFFER_LEN 4096
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
 
 /**
  * A patch script to be processed.
@@ -131,9 +134,17 @@ dpatch_status patch_script_path
 /**
  * Parse a single line (instruction) of a patch script.
  *
+ * The symbol to replace may be a selector: a glob such as
+ * `codec_v1_*`, or a regular expression between `/`s. Each
+ * wildcard or group it captures can be substituted into the
+ * replacement's name, for example `codec_v2_*` or
+ * `codec_v2_\1`. Selectors are checked here, and expanded
+ * when the patch is prepared.
+ *
  * @param line The script line to be parsed.
  * @param patch_set Patch to parse the line into.
- * @return `DPATCH_STATUS_OK` or an error on failure.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * line or its selector is invalid, or an error on failure.
  */
 dpatch_status parse_script_line
 (
@@ -146,6 +157,7 @@ dpatch_status parse_script_line
     char op_to[PATCH_SCRIPT_MAX_LINE_LEN];
     char* new_symbol_name = NULL;
     char* new_symbol_lib = NULL;
+    symbol_selector_t* selector = NULL;
     dpatch_operation operation = DPATCH_OP_NOP;
     dpatch_status status = DPATCH_STATUS_OK;
     if (sscanf(line, "%s %s %s", operation_str, op_from, op_to) != 3)
@@ -158,6 +170,15 @@ dpatch_status parse_script_line
         str_to_patch_operation(operation_str, &operation),
         status
     );
+    if (symbol_selector_is_pattern(op_from))
+    {
+        if (operation != DPATCH_OP_REPLACE_FUNCTION_INTERNAL)
+        {
+            return DPATCH_STATUS_ESYNTAX;
+        }
+        PROPAGATE_ERROR(symbol_selector_new(&selector, op_from, new_symbol_name), status);
+        symbol_selector_free(selector);
+    }
     PROPAGATE_ERROR(
         patch_set_add_operation
         (
@@ -195,7 +216,46 @@ dpatch_status patch_script_parse
     }
     while (fscanf(script, "%" XSTR(PATCH_SCRIPT_MAX_LINE_LEN) "[^\n]\n", line) == 1)
     {
-        PROPAGATE_ERROR(parse_script_line(line, patch_set), status);      
+        status = parse_script_line(line, patch_set);
+        if (IS_ERROR(status))
+        {
+            fclose(script);
+            return status;
+        }
+    }
+    fclose(script);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Hash a patch script's contents with 64-bit FNV-1a.
+ *
+ * @param patch_script Handle to the patch script to hash.
+ * @param hash Location to store the hash.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EFILE` if
+ * the script can't be read.
+ */
+dpatch_status patch_script_hash(patch_script_t* patch_script, uint64_t* hash)
+{
+    uint8_t buffer[SCRIPT_READ_BUFFER_LEN];
+    size_t length = 0;
+    size_t i = 0;
+    FILE* script = NULL;
+    assert(patch_script != NULL);
+    assert(hash != NULL);
+    script = fopen(patch_script->script_path, "rb");
+    if (script == NULL)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    *hash = FNV_OFFSET_BASIS;
+    while ((length = fread(buffer, 1, sizeof buffer, script)) > 0)
+    {
+        for (i = 0; i < length; i++)
+        {
+            *hash = (*hash ^ buffer[i]) * FNV_PRIME;
+        }
     }
+    fclose(script);
     return DPATCH_STATUS_OK;
 }
@@ -9,8 +9,13 @@
  * @date November 2020.
  */
 
+#include "deferred_patch.h"
+#include "event_log.h"
 #include "patch.h"
+#include "patch_blob.h"
 #include "patch_set.h"
+#include "pointer_scan.h"
+#include "redirect.h"
 #include "status.h"
 #include <assert.h>
 #include <stdlib.h>
@@ -27,8 +32,20 @@ struct patch_set
 
     /** Array of handles to patches to apply. */
     patch_t** patches;
+
+    /** Writes staged by `patch_set_prepare`, or `NULL`. */
+    redirect_batch_t* batch;
+
+    /** Identifier tagging events logged by the patch set. */
+    uint64_t id;
+
+    /** Compiled blob applied instead of `patches`, or -1. */
+    int blob_fd;
 };
 
+/** The identifier of the most recently created patch set. */
+static uint64_t last_patch_id = 0;
+
 /**
  * Allocates and initialises a new patch_set.
  *
@@ -45,6 +62,9 @@ dpatch_status patch_set_new(patch_set_t** patch_set)
         return DPATCH_STATUS_ENOMEM; 
     }
     new_set->length = 0;
+    new_set->batch = NULL;
+    new_set->blob_fd = -1;
+    new_set->id = __atomic_add_fetch(&last_patch_id, 1, __ATOMIC_RELAXED);
     new_set->allocated_length = PATCH_DEFAULT_LENGTH;
     new_set->patches = malloc(sizeof(patch_t*) * new_set->allocated_length);
     if (new_set->patches == NULL)
@@ -56,6 +76,47 @@ dpatch_status patch_set_new(patch_set_t** patch_set)
     return DPATCH_STATUS_OK;
 }
 
+/**
+ * Get the identifier of a patch set.
+ *
+ * @param patch_set Handle to the patch set to query.
+ * @return The patch set's identifier.
+ */
+uint64_t patch_set_id(patch_set_t* patch_set)
+{
+    assert(patch_set != NULL);
+    return patch_set->id;
+}
+
+/**
+ * Get the writes staged by preparing a patch set.
+ *
+ * @param patch_set Handle to the patch set to query.
+ * @return The patch set's batch, or `NULL` if it is not
+ * prepared.
+ */
+redirect_batch_t* patch_set_batch(patch_set_t* patch_set)
+{
+    assert(patch_set != NULL);
+    return patch_set->batch;
+}
+
+/**
+ * Use a compiled patch blob as the contents of a patch set.
+ *
+ * Preparing the patch set stages the blob's pre-resolved
+ * redirects, rather than preparing each patch operation.
+ *
+ * @param patch_set Handle to the patch set to configure.
+ * @param fd File descriptor of the blob. It must remain
+ *      open until the patch set is prepared.
+ */
+void patch_set_load_blob(patch_set_t* patch_set, int fd)
+{
+    assert(patch_set != NULL);
+    patch_set->blob_fd = fd;
+}
+
 /**
  * Free and deallocate a patch set.
  *
@@ -72,6 +133,12 @@ void patch_set_free(patch_set_t* patch_set)
         }
         free(patch_set->patches);
     }
+    if (patch_set->batch != NULL)
+    {
+        redirect_batch_free(patch_set->batch);
+    }
+    deferred_patch_withdraw(patch_set->id);
+    patch_set->batch = NULL;
     patch_set->patches = NULL;
     patch_set->allocated_length = 0;
     patch_set->length = 0;
@@ -141,18 +208,138 @@ dpatch_status patch_set_add_operation
 }
 
 /**
- * Attempt to apply a patch_set to the target program.
+ * Prepare a patch set to be committed.
  *
- * @param patch_set Handle to the patch_set to be applied.
+ * Preparation performs every slow part of applying the
+ * patch set - loading and prefaulting libraries, resolving
+ * symbols, and encoding machine code - without modifying
+ * the program.
+ *
+ * @param patch_set Handle to the patch_set to prepare.
  * @return `DPATCH_STATUS_OK`, or an error on failure.
  */
-dpatch_status patch_set_apply(patch_set_t* patch_set)
+dpatch_status patch_set_prepare(patch_set_t* patch_set)
 {
     size_t i = 0;
     dpatch_status status = DPATCH_STATUS_OK;
-    for (i = 0; i < patch_set->length; i++)
+    assert(patch_set != NULL);
+    if (patch_set->batch != NULL)
     {
-        PROPAGATE_ERROR(patch_apply(patch_set->patches[i]), status);
+        redirect_batch_free(patch_set->batch);
     }
-    return DPATCH_STATUS_OK;
+    deferred_patch_withdraw(patch_set->id);
+    PROPAGATE_ERROR(redirect_batch_new(&patch_set->batch, patch_set->id), status);
+    if (patch_set->blob_fd != -1)
+    {
+        status = patch_blob_prepare(patch_set->blob_fd, patch_set->batch);
+    }
+    for (i = 0; i < patch_set->length && !IS_ERROR(status); i++)
+    {
+        status = patch_prepare(patch_set->patches[i], patch_set->batch);
+    }
+    if (!IS_ERROR(status))
+    {
+        status = redirect_batch_prepare(patch_set->batch);
+    }
+    if (IS_ERROR(status))
+    {
+        redirect_batch_free(patch_set->batch);
+        deferred_patch_withdraw(patch_set->id);
+        patch_set->batch = NULL;
+    }
+    return status;
+}
+
+/**
+ * Commit a prepared patch set to the target program.
+ *
+ * Committing performs only the writes staged by
+ * `patch_set_prepare`. If they can not be completed before
+ * `deadline`, the program is left unpatched and
+ * `DPATCH_STATUS_ETIMEDOUT` is returned.
+ *
+ * When `DPATCH_REWRITE_POINTERS` is set, function pointers
+ * to the redirected entries are rewritten once the writes
+ * are done.
+ *
+ * Replacements deferred until their functions are loaded
+ * are kept once the writes are done.
+ *
+ * @param patch_set Handle to the prepared patch_set.
+ * @param deadline `CLOCK_MONOTONIC` time the commit must
+ *      complete by, or `NULL` for no deadline.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status patch_set_commit
+(
+    patch_set_t* patch_set,
+    const struct timespec* deadline
+)
+{
+    pointer_scan_t* scan = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(patch_set != NULL);
+    if (patch_set->batch == NULL)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    if (pointer_scan_enabled())
+    {
+        LOG_ON_ERROR(pointer_scan_new(&scan, patch_set->batch));
+    }
+    status = redirect_batch_commit(patch_set->batch, deadline);
+    if (!IS_ERROR(status))
+    {
+        deferred_patch_commit(patch_set->id);
+    }
+    if (scan != NULL && !IS_ERROR(status))
+    {
+        LOG_ON_ERROR(pointer_scan_run(scan));
+    }
+    pointer_scan_free(scan);
+    return status;
+}
+
+/**
+ * Commit a prepared patch set, allowing it `budget_us`
+ * microseconds from now.
+ *
+ * @param patch_set Handle to the prepared patch_set.
+ * @param budget_us Time allowed for the commit, or 0 for
+ *      no limit.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status patch_set_commit_within
+(
+    patch_set_t* patch_set,
+    uint64_t budget_us
+)
+{
+    struct timespec deadline;
+    if (budget_us == 0)
+    {
+        return patch_set_commit(patch_set, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += budget_us / 1000000;
+    deadline.tv_nsec += (budget_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return patch_set_commit(patch_set, &deadline);
+}
+
+/**
+ * Attempt to apply a patch_set to the target program.
+ *
+ * @param patch_set Handle to the patch_set to be applied.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status patch_set_apply(patch_set_t* patch_set)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(patch_set_prepare(patch_set), status);
+    return patch_set_commit(patch_set, NULL);
 }
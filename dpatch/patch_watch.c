@@ -0,0 +1,421 @@
+/**
+ * @file dpatch/patch_watch.c
+ *
+ * `patch_watch.c` defines a watcher which applies patch
+ * scripts and blobs dropped into a directory, so a patch
+ * can be rolled out to every process on a host by writing
+ * a single file, rather than signalling each process.
+ *
+ * A background thread waits on `inotify` for files to be
+ * written or moved into the directory. Events are
+ * debounced: a file is applied once the directory has been
+ * quiet for the debounce period, so a burst of writes is
+ * applied once. Each file's contents are hashed with
+ * FNV-1a, and contents which have already been applied are
+ * skipped.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "patch_watch.h"
+#include "status.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_DIR_ENV_VAR "DPATCH_WATCH_DIR"
+#define WATCH_DEBOUNCE_ENV_VAR "DPATCH_WATCH_DEBOUNCE_MS"
+#define WATCH_DEFAULT_DEBOUNCE_MS 100
+#define WATCH_DEFAULT_LENGTH 8
+#define WATCH_EVENT_BUFFER_LEN 4096
+#define WATCH_READ_BUFFER_LEN 4096
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/**
+ * A file waiting for writes to it to finish.
+ */
+struct pending_file
+{
+    /** Name of the file in the watched directory. */
+    char name[NAME_MAX + 1];
+
+    /** When the file was first seen, in microseconds. */
+    double detected_us;
+};
+
+/**
+ * State of the directory watcher.
+ */
+struct patch_watch
+{
+    /** Whether the watcher has been started. */
+    bool started;
+
+    /** The watched directory. */
+    char* directory;
+
+    /** `inotify` instance watching `directory`. */
+    int inotify_fd;
+
+    /** Quiet period before pending files are applied. */
+    int debounce_ms;
+
+    /** Function to apply each new file with. */
+    patch_watch_apply apply;
+
+    /** Files waiting to be applied. */
+    struct pending_file* pending;
+
+    /** The number of files in `pending`. */
+    size_t pending_length;
+
+    /** The number of `pending` allocated in memory. */
+    size_t pending_allocated;
+
+    /** Hashes of the contents of every applied file. */
+    uint64_t* applied;
+
+    /** The number of hashes in `applied`. */
+    size_t applied_length;
+
+    /** The number of `applied` allocated in memory. */
+    size_t applied_allocated;
+};
+
+/** The process' directory watcher. */
+static struct patch_watch watch = {false, NULL, -1, 0, NULL, NULL, 0, 0, NULL, 0, 0};
+
+/**
+ * Get the current monotonic time in microseconds.
+ *
+ * @return Microseconds since an arbitrary epoch.
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Ensure a dynamically allocated array has room for one
+ * more element.
+ *
+ * @param array Address of the array to grow.
+ * @param length The number of elements in use.
+ * @param allocated Address of the array's allocated
+ *      length, in elements.
+ * @param element_size Size of an element, in bytes.
+ * @return `DPATCH_STATUS_OK` on success, or an error.
+ */
+static dpatch_status reserve
+(
+    void** array,
+    size_t length,
+    size_t* allocated,
+    size_t element_size
+)
+{
+    void* realloc_result = NULL;
+    size_t new_length = *allocated == 0 ? WATCH_DEFAULT_LENGTH : *allocated * 2;
+    if (length < *allocated)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    realloc_result = realloc(*array, element_size * new_length);
+    if (realloc_result == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    *array = realloc_result;
+    *allocated = new_length;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Hash a file's contents with 64-bit FNV-1a.
+ *
+ * @param path Path to the file to hash.
+ * @param hash Location to store the hash.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EFILE` if
+ * the file can't be read.
+ */
+static dpatch_status hash_file(const char* path, uint64_t* hash)
+{
+    uint8_t buffer[WATCH_READ_BUFFER_LEN];
+    size_t length = 0;
+    size_t i = 0;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    *hash = FNV_OFFSET_BASIS;
+    while ((length = fread(buffer, 1, sizeof buffer, file)) > 0)
+    {
+        for (i = 0; i < length; i++)
+        {
+            *hash = (*hash ^ buffer[i]) * FNV_PRIME;
+        }
+    }
+    fclose(file);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Test if contents with a hash have been applied.
+ *
+ * @param hash The hash to look for.
+ * @return `true` if the contents have been applied.
+ */
+static bool is_applied(uint64_t hash)
+{
+    size_t i = 0;
+    for (i = 0; i < watch.applied_length; i++)
+    {
+        if (watch.applied[i] == hash)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Note that a file in the watched directory has changed.
+ *
+ * @param name Name of the file in the directory.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status pending_add(const char* name)
+{
+    struct pending_file* file = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    for (i = 0; i < watch.pending_length; i++)
+    {
+        if (strcmp(watch.pending[i].name, name) == 0)
+        {
+            return DPATCH_STATUS_OK;
+        }
+    }
+    PROPAGATE_ERROR(
+        reserve(
+            (void**) &watch.pending,
+            watch.pending_length,
+            &watch.pending_allocated,
+            sizeof(struct pending_file)
+        ),
+        status
+    );
+    file = &watch.pending[watch.pending_length++];
+    strncpy(file->name, name, sizeof file->name - 1);
+    file->name[sizeof file->name - 1] = '\0';
+    file->detected_us = now_us();
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Apply a file which has stopped changing, unless its
+ * contents have already been applied.
+ *
+ * @param file The file to apply.
+ */
+static void apply_file(const struct pending_file* file)
+{
+    char path[PATH_MAX];
+    uint64_t hash = 0;
+    double start_us = 0;
+    double end_us = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    snprintf(path, sizeof path, "%s/%s", watch.directory, file->name);
+    if (IS_ERROR(hash_file(path, &hash)))
+    {
+        /* The file was removed or renamed before it settled. */
+        return;
+    }
+    if (is_applied(hash))
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            0,
+            "Skipped %s: its contents (%016llx) were already applied.",
+            path,
+            (unsigned long long) hash
+        );
+        return;
+    }
+    start_us = now_us();
+    status = watch.apply(path);
+    end_us = now_us();
+    event_logf(
+        IS_ERROR(status) ? LOG_ERR : LOG_INFO,
+        status,
+        0,
+        "%s %s %.1f ms after it was detected: %.1f ms settling, %.1f ms applying.",
+        IS_ERROR(status) ? "Failed to apply" : "Applied",
+        path,
+        (end_us - file->detected_us) / 1e3,
+        (start_us - file->detected_us) / 1e3,
+        (end_us - start_us) / 1e3
+    );
+    if (IS_ERROR(status))
+    {
+        return;
+    }
+    status = reserve(
+        (void**) &watch.applied,
+        watch.applied_length,
+        &watch.applied_allocated,
+        sizeof(uint64_t)
+    );
+    if (IS_ERROR(status))
+    {
+        LOG_ON_ERROR(status);
+        return;
+    }
+    watch.applied[watch.applied_length++] = hash;
+}
+
+/**
+ * Queue every file named by a buffer of `inotify` events.
+ *
+ * @param buffer The events read from `watch.inotify_fd`.
+ * @param length The number of bytes read.
+ */
+static void queue_events(const char* buffer, ssize_t length)
+{
+    const struct inotify_event* event = NULL;
+    ssize_t offset = 0;
+    while (offset < length)
+    {
+        event = (const struct inotify_event*) (buffer + offset);
+        offset += (ssize_t) (sizeof(struct inotify_event) + event->len);
+        if (event->len == 0 || event->name[0] == '.')
+        {
+            continue;
+        }
+        LOG_ON_ERROR(pending_add(event->name));
+    }
+}
+
+/**
+ * Wait for and apply files dropped into the watched
+ * directory.
+ *
+ * @param args Unused, but required by the `pthreads` API.
+ * @return Nothing.
+ */
+static void* watch_thread(void* args)
+{
+    char buffer[WATCH_EVENT_BUFFER_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd poll_fd;
+    ssize_t length = 0;
+    size_t i = 0;
+    int ready = 0;
+    (void) args;
+    poll_fd.fd = watch.inotify_fd;
+    poll_fd.events = POLLIN;
+    for (;;)
+    {
+        ready = poll(&poll_fd, 1, watch.pending_length > 0 ? watch.debounce_ms : -1);
+        if (ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready == -1)
+        {
+            LOG_ON_ERROR(DPATCH_STATUS_EFILE);
+            break;
+        }
+        if (ready == 0)
+        {
+            for (i = 0; i < watch.pending_length; i++)
+            {
+                apply_file(&watch.pending[i]);
+            }
+            watch.pending_length = 0;
+            continue;
+        }
+        length = read(watch.inotify_fd, buffer, sizeof buffer);
+        if (length > 0)
+        {
+            queue_events(buffer, length);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start watching the directory named by the
+ * `DPATCH_WATCH_DIR` environment variable, if it is set.
+ *
+ * Files written or moved into the directory are applied
+ * once writes to them have been quiet for
+ * `DPATCH_WATCH_DEBOUNCE_MS` milliseconds. A file whose
+ * contents have already been applied is skipped. Files
+ * whose names start with `.` are ignored, so patches can
+ * be written under a hidden name, then renamed into place.
+ *
+ * @param apply Function to apply each new file with.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * directory can't be watched, or an error on failure.
+ */
+dpatch_status patch_watch_start(patch_watch_apply apply)
+{
+    char* directory = getenv(WATCH_DIR_ENV_VAR);
+    char* debounce = getenv(WATCH_DEBOUNCE_ENV_VAR);
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int result = 0;
+    if (directory == NULL || watch.started)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    watch.directory = strdup(directory);
+    if (watch.directory == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    watch.debounce_ms = debounce == NULL ? WATCH_DEFAULT_DEBOUNCE_MS : atoi(debounce);
+    watch.apply = apply;
+    watch.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (watch.inotify_fd == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    if (inotify_add_watch(watch.inotify_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        close(watch.inotify_fd);
+        watch.inotify_fd = -1;
+        return DPATCH_STATUS_EFILE;
+    }
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    result = pthread_create(&thread, &attributes, &watch_thread, NULL);
+    pthread_attr_destroy(&attributes);
+    if (result != 0)
+    {
+        close(watch.inotify_fd);
+        watch.inotify_fd = -1;
+        return DPATCH_STATUS_ERROR;
+    }
+    watch.started = true;
+    event_logf(LOG_INFO, DPATCH_STATUS_OK, 0, "Watching %s for patches.", directory);
+    return DPATCH_STATUS_OK;
+}
@@ -0,0 +1,373 @@
+/**
+ * @file dpatch/perf_map.c
+ *
+ * `perf_map.c` defines functions for describing the code
+ * dpatch writes to profilers.
+ *
+ * Two formats are supported. A perf map,
+ * `/tmp/perf-<pid>.map`, names regions of anonymous
+ * memory, such as dispatch table thunks and text remapped
+ * onto huge pages. A jitdump, `jit-<pid>.dump`, also
+ * carries a copy of the code, so `perf inject --jit` can
+ * override the symbols of file backed text, such as a
+ * function entry overwritten with a jump.
+ *
+ * Both files are opened for the process which records into
+ * them, so a forked child writes its own.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "perf_map.h"
+#include "status.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PERF_MAP_ENV_VAR "DPATCH_PERF_MAP"
+#define JITDUMP_ENV_VAR "DPATCH_JITDUMP"
+#define JITDUMP_MAGIC 0x4A695444u
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+
+/**
+ * The header at the start of a jitdump file.
+ */
+struct jitdump_header
+{
+    /** `JITDUMP_MAGIC`. */
+    uint32_t magic;
+
+    /** `JITDUMP_VERSION`. */
+    uint32_t version;
+
+    /** Size of the header in bytes. */
+    uint32_t total_size;
+
+    /** ELF machine the code is for. */
+    uint32_t elf_mach;
+
+    /** Reserved. */
+    uint32_t pad1;
+
+    /** Process the code belongs to. */
+    uint32_t pid;
+
+    /** `CLOCK_MONOTONIC` time the file was created, in ns. */
+    uint64_t timestamp;
+
+    /** Reserved. */
+    uint64_t flags;
+};
+
+/**
+ * A jitdump record describing code which was loaded,
+ * followed by the code's name and bytes.
+ */
+struct jitdump_code_load
+{
+    /** `JITDUMP_CODE_LOAD`. */
+    uint32_t id;
+
+    /** Size of the record, name and code in bytes. */
+    uint32_t total_size;
+
+    /** `CLOCK_MONOTONIC` time the code was loaded, in ns. */
+    uint64_t timestamp;
+
+    /** Process the code belongs to. */
+    uint32_t pid;
+
+    /** Thread which loaded the code. */
+    uint32_t tid;
+
+    /** Address the code runs at. */
+    uint64_t vma;
+
+    /** Address of the code's bytes. */
+    uint64_t code_addr;
+
+    /** Length of the code in bytes. */
+    uint64_t code_size;
+
+    /** Unique index of the record. */
+    uint64_t code_index;
+};
+
+/**
+ * The process' profiler maps.
+ */
+struct perf_map
+{
+    /** Whether to write `/tmp/perf-<pid>.map`. */
+    bool perf_map;
+
+    /** Directory to write `jit-<pid>.dump` in, or `NULL`. */
+    char* jitdump_directory;
+
+    /** Process the files are open for, or 0. */
+    pid_t pid;
+
+    /** The perf map, or `NULL`. */
+    FILE* map_file;
+
+    /** The jitdump, or -1. */
+    int jitdump_fd;
+
+    /** Mapping of the jitdump which tells `perf` where it is. */
+    void* jitdump_marker;
+
+    /** The number of code load records written. */
+    uint64_t code_index;
+};
+
+/** The process' profiler maps. */
+static struct perf_map maps = {false, NULL, 0, NULL, -1, NULL, 0};
+
+/** Serialises writes to `maps`. */
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Enable the profiler maps requested by the `DPATCH_PERF_MAP`
+ * and `DPATCH_JITDUMP` environment variables.
+ *
+ * `DPATCH_PERF_MAP` may be `0` or `1`. `DPATCH_JITDUMP`
+ * names the directory to write jitdump files in.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if
+ * `DPATCH_PERF_MAP` is set to something other than `0` or
+ * `1`.
+ */
+dpatch_status perf_map_init(void)
+{
+    char* perf_map = getenv(PERF_MAP_ENV_VAR);
+    char* jitdump = getenv(JITDUMP_ENV_VAR);
+    if (perf_map != NULL && strcmp(perf_map, "0") != 0 && strcmp(perf_map, "1") != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    pthread_mutex_lock(&maps_lock);
+    maps.perf_map = perf_map != NULL && perf_map[0] == '1';
+    if (jitdump != NULL && jitdump[0] != '\0' && maps.jitdump_directory == NULL)
+    {
+        maps.jitdump_directory = strdup(jitdump);
+    }
+    pthread_mutex_unlock(&maps_lock);
+    if (jitdump != NULL && jitdump[0] != '\0' && maps.jitdump_directory == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Test if any profiler map is enabled.
+ *
+ * @return `true` if code written by dpatch is recorded.
+ */
+bool perf_map_enabled(void)
+{
+    return maps.perf_map || maps.jitdump_directory != NULL;
+}
+
+/**
+ * Close the files opened for another process.
+ *
+ * The files are closed without unlinking them, as they
+ * belong to the process which opened them.
+ */
+static void close_files(void)
+{
+    if (maps.map_file != NULL)
+    {
+        fclose(maps.map_file);
+        maps.map_file = NULL;
+    }
+    if (maps.jitdump_marker != NULL)
+    {
+        munmap(maps.jitdump_marker, (size_t) sysconf(_SC_PAGESIZE));
+        maps.jitdump_marker = NULL;
+    }
+    if (maps.jitdump_fd != -1)
+    {
+        close(maps.jitdump_fd);
+        maps.jitdump_fd = -1;
+    }
+}
+
+/**
+ * Create the jitdump file for the calling process.
+ *
+ * `perf record` finds the file by the executable mapping
+ * of it, which is kept until the process exits.
+ *
+ * @param pid The calling process.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EFILE` if
+ * the file can't be created.
+ */
+static dpatch_status open_jitdump(pid_t pid)
+{
+    char path[PATH_MAX];
+    struct jitdump_header header;
+    void* marker = NULL;
+    int fd = -1;
+    snprintf(path, sizeof path, "%s/jit-%d.dump", maps.jitdump_directory, (int) pid);
+    fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    marker = mmap(NULL, (size_t) sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (marker == MAP_FAILED)
+    {
+        close(fd);
+        return DPATCH_STATUS_EFILE;
+    }
+    memset(&header, 0, sizeof header);
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.total_size = sizeof header;
+    header.elf_mach = EM_X86_64;
+    header.pid = (uint32_t) pid;
+    header.timestamp = now_ns();
+    if (write(fd, &header, sizeof header) != (ssize_t) sizeof header)
+    {
+        munmap(marker, (size_t) sysconf(_SC_PAGESIZE));
+        close(fd);
+        return DPATCH_STATUS_EFILE;
+    }
+    maps.jitdump_fd = fd;
+    maps.jitdump_marker = marker;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Ensure the enabled files are open for the calling
+ * process.
+ *
+ * @warning The caller must hold `maps_lock`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EFILE` if a
+ * file can't be created.
+ */
+static dpatch_status open_files(void)
+{
+    char path[PATH_MAX];
+    pid_t pid = getpid();
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (maps.pid == pid)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    close_files();
+    maps.pid = pid;
+    maps.code_index = 0;
+    if (maps.perf_map)
+    {
+        snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) pid);
+        maps.map_file = fopen(path, "a");
+        if (maps.map_file == NULL)
+        {
+            status = DPATCH_STATUS_EFILE;
+        }
+    }
+    if (maps.jitdump_directory != NULL && IS_ERROR(open_jitdump(pid)))
+    {
+        status = DPATCH_STATUS_EFILE;
+    }
+    return status;
+}
+
+/**
+ * Append a code load record to the jitdump.
+ *
+ * @warning The caller must hold `maps_lock`.
+ *
+ * @param start Address of the first byte of the code.
+ * @param length Length of the code in bytes.
+ * @param name Name profilers should show for the code.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EFILE` if
+ * the record can't be written.
+ */
+static dpatch_status write_code_load(intptr_t start, size_t length, const char* name)
+{
+    struct jitdump_code_load record;
+    struct iovec parts[3];
+    size_t name_length = strlen(name) + 1;
+    ssize_t written = 0;
+    record.id = JITDUMP_CODE_LOAD;
+    record.total_size = (uint32_t) (sizeof record + name_length + length);
+    record.timestamp = now_ns();
+    record.pid = (uint32_t) maps.pid;
+    record.tid = (uint32_t) syscall(SYS_gettid);
+    record.vma = (uint64_t) start;
+    record.code_addr = (uint64_t) start;
+    record.code_size = length;
+    record.code_index = maps.code_index++;
+    parts[0].iov_base = &record;
+    parts[0].iov_len = sizeof record;
+    parts[1].iov_base = (void*) name;
+    parts[1].iov_len = name_length;
+    parts[2].iov_base = (void*) start;
+    parts[2].iov_len = length;
+    written = writev(maps.jitdump_fd, parts, 3);
+    return written == (ssize_t) record.total_size ? DPATCH_STATUS_OK : DPATCH_STATUS_EFILE;
+}
+
+/**
+ * Record a region of code written by dpatch.
+ *
+ * The region is appended to `/tmp/perf-<pid>.map` and the
+ * jitdump file, if they are enabled. The code is copied
+ * into the jitdump from memory, so it must already be
+ * written.
+ *
+ * @param start Address of the first byte of the code.
+ * @param length Length of the code in bytes.
+ * @param name Name profilers should show for the code.
+ */
+void perf_map_record(intptr_t start, size_t length, const char* name)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (!perf_map_enabled() || length == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&maps_lock);
+    status = open_files();
+    if (maps.map_file != NULL)
+    {
+        fprintf(maps.map_file, "%lx %zx %s\n", (unsigned long) start, length, name);
+        fflush(maps.map_file);
+    }
+    if (maps.jitdump_fd != -1 && IS_ERROR(write_code_load(start, length, name)))
+    {
+        status = DPATCH_STATUS_EFILE;
+    }
+    pthread_mutex_unlock(&maps_lock);
+    LOG_ON_ERROR(status);
+}
@@ -0,0 +1,1001 @@
+/**
+ * @file dpatch/pointer_scan.c
+ *
+ * `pointer_scan.c` defines functions for rewriting function
+ * pointers which lead to redirected entries.
+ *
+ * Redirecting an entry leaves callback tables, vtables and
+ * registered handlers pointing at the old entry, so every
+ * indirect call still passes through its jump. After a
+ * batch is committed, the writable and RELRO segments of
+ * each loaded object are scanned for
+ * aligned 8-byte words equal to a redirected entry. Each
+ * match is swapped for the entry's current target with a
+ * compare and exchange, so a concurrent reader sees either
+ * the old pointer or the new one.
+ *
+ * Words are first tested against a few ranges which cover
+ * the sorted entry addresses, four at a time with AVX2 when
+ * the CPU has it. Only words inside a range are searched
+ * for.
+ *
+ * Every pointer rewritten is recorded, so when a later
+ * patch redirects the same entry again, the pointers are
+ * moved on to its new target. Pointers which merely equal
+ * an old target, but weren't rewritten by dpatch, are left
+ * alone.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "patch_guard.h"
+#include "pointer_scan.h"
+#include "redirect.h"
+#include "status.h"
+#include <dlfcn.h>
+#include <immintrin.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REWRITE_POINTERS_ENV_VAR "DPATCH_REWRITE_POINTERS"
+
+/** The number of ranges words are filtered by. */
+#define SCAN_RANGES 4
+
+/**
+ * An entry redirected by the batch being scanned for.
+ */
+struct scan_redirect
+{
+    /** The redirected entry point. */
+    intptr_t from;
+
+    /** Where `from` led before the batch was committed, or 0. */
+    intptr_t previous;
+
+    /** Where `from` leads now. */
+    intptr_t target;
+};
+
+/**
+ * An address being scanned for.
+ */
+struct scan_value
+{
+    /** The address. */
+    uint64_t value;
+
+    /** Index of the redirect the address belongs to. */
+    size_t redirect;
+
+    /** Whether the address is the redirect's previous target, rather than its entry. */
+    bool previous;
+};
+
+/**
+ * A pointer rewritten by dpatch.
+ */
+struct rewritten_pointer
+{
+    /** Address of the pointer. */
+    uintptr_t slot;
+
+    /** The entry point the pointer originally led to. */
+    intptr_t from;
+};
+
+/**
+ * A rewrite of a pointer on a read-only page, waiting for
+ * the page to be made writable.
+ */
+struct queued_rewrite
+{
+    /** Address of the pointer. */
+    uint64_t* slot;
+
+    /** The value the pointer was matched with. */
+    uint64_t expected;
+
+    /** The value to store. */
+    uint64_t target;
+
+    /** The entry point to record the pointer as leading to, or 0 if it needn't be recorded. */
+    intptr_t from;
+};
+
+/**
+ * A scan for pointers to the entries a batch redirects.
+ */
+struct pointer_scan
+{
+    /** The entries redirected. */
+    struct scan_redirect* redirects;
+
+    /** The number of `redirects`. */
+    size_t redirects_length;
+
+    /** Addresses to find, sorted. */
+    struct scan_value* values;
+
+    /** The number of `values`. */
+    size_t values_length;
+
+    /** Lowest address of each range covering `values`. */
+    uint64_t low[SCAN_RANGES];
+
+    /** Size of each range, less one. */
+    uint64_t span[SCAN_RANGES];
+
+    /** Pointers first rewritten by this scan. */
+    struct rewritten_pointer* found;
+
+    /** The number of `found`. */
+    size_t found_length;
+
+    /** The number of `found` allocated. */
+    size_t found_allocated;
+
+    /** The number of pointers rewritten. */
+    size_t rewritten;
+
+    /** Whether the words being scanned are on pages ld.so made read-only. */
+    bool read_only;
+
+    /** Rewrites waiting for the read-only page being scanned. */
+    struct queued_rewrite* queued;
+
+    /** The number of `queued`. */
+    size_t queued_length;
+
+    /** The number of `queued` allocated. */
+    size_t queued_allocated;
+
+    /** Patch the batch belongs to. */
+    uint64_t patch_id;
+};
+
+/** Whether committed batches are followed by a pointer scan. */
+static bool enabled = false;
+
+/** Serialises scans, which share `rewritten`. */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Every pointer rewritten, sorted by `slot`. */
+static struct rewritten_pointer* rewritten = NULL;
+
+/** The number of `rewritten`. */
+static size_t rewritten_length = 0;
+
+/**
+ * Test if pointers are rewritten when patches are
+ * committed.
+ *
+ * @return `true` if committed batches are followed by a
+ * pointer scan.
+ */
+bool pointer_scan_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * Enable pointer rewriting if the `DPATCH_REWRITE_POINTERS`
+ * environment variable is set to `1`.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if the
+ * variable is set to something other than `0` or `1`.
+ */
+dpatch_status pointer_scan_init_mode(void)
+{
+    char* str = getenv(REWRITE_POINTERS_ENV_VAR);
+    if (str == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    if (strcmp(str, "0") != 0 && strcmp(str, "1") != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    enabled = str[0] == '1';
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Get the current monotonic time in microseconds.
+ *
+ * @return Microseconds since an arbitrary epoch.
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Order addresses being scanned for.
+ *
+ * @param a The first `struct scan_value`.
+ * @param b The second `struct scan_value`.
+ * @return Less than, equal to, or greater than 0 as `a`'s
+ * address is below, equal to or above `b`'s.
+ */
+static int compare_values(const void* a, const void* b)
+{
+    uint64_t left = ((const struct scan_value*) a)->value;
+    uint64_t right = ((const struct scan_value*) b)->value;
+    return left < right ? -1 : left > right;
+}
+
+/**
+ * Order rewritten pointers by their address.
+ *
+ * @param a The first `struct rewritten_pointer`.
+ * @param b The second `struct rewritten_pointer`.
+ * @return Less than, equal to, or greater than 0 as `a` is
+ * below, equal to or above `b`.
+ */
+static int compare_pointers(const void* a, const void* b)
+{
+    uintptr_t left = ((const struct rewritten_pointer*) a)->slot;
+    uintptr_t right = ((const struct rewritten_pointer*) b)->slot;
+    return left < right ? -1 : left > right;
+}
+
+/**
+ * Create a scan for a batch which is about to be
+ * committed, recording where each entry it redirects
+ * currently leads.
+ *
+ * @param new Location to store a handle to the scan.
+ * @param batch Handle to the prepared batch.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status pointer_scan_new(pointer_scan_t** new, redirect_batch_t* batch)
+{
+    size_t length = redirect_batch_length(batch);
+    pointer_scan_t* scan = calloc(1, sizeof(struct pointer_scan));
+    const char* label = NULL;
+    intptr_t to = 0;
+    size_t i = 0;
+    *new = NULL;
+    if (scan == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    scan->redirects = calloc(length + 1, sizeof(struct scan_redirect));
+    scan->values = calloc(2 * length + 1, sizeof(struct scan_value));
+    if (scan->redirects == NULL || scan->values == NULL)
+    {
+        pointer_scan_free(scan);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    for (i = 0; i < length; i++)
+    {
+        struct scan_redirect* redirect = &scan->redirects[i];
+        redirect_batch_request(batch, i, &redirect->from, &to, &label);
+        redirect->previous = redirect_resolve(redirect->from);
+        redirect->previous = redirect->previous == redirect->from ? 0 : redirect->previous;
+    }
+    scan->redirects_length = length;
+    scan->patch_id = redirect_batch_patch_id(batch);
+    *new = scan;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Deallocate a scan.
+ *
+ * @param scan Handle to the scan to free, or `NULL`.
+ */
+void pointer_scan_free(pointer_scan_t* scan)
+{
+    if (scan == NULL)
+    {
+        return;
+    }
+    free(scan->redirects);
+    free(scan->values);
+    free(scan->found);
+    free(scan->queued);
+    free(scan);
+}
+
+/**
+ * Collect the addresses to scan for, now the batch is
+ * committed, and cover them with `SCAN_RANGES` ranges split
+ * at the widest gaps between them.
+ *
+ * @param scan Handle to the scan.
+ */
+static void plan_scan(pointer_scan_t* scan)
+{
+    size_t splits[SCAN_RANGES - 1];
+    size_t splits_length = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t first = 0;
+    for (i = 0; i < scan->redirects_length; i++)
+    {
+        struct scan_redirect* redirect = &scan->redirects[i];
+        redirect->target = redirect_resolve(redirect->from);
+        if (redirect->target == redirect->from)
+        {
+            continue;
+        }
+        scan->values[scan->values_length++] = (struct scan_value) {(uint64_t) redirect->from, i, false};
+        if (redirect->previous != 0 && redirect->previous != redirect->target)
+        {
+            scan->values[scan->values_length++] = (struct scan_value) {(uint64_t) redirect->previous, i, true};
+        }
+    }
+    qsort(scan->values, scan->values_length, sizeof(struct scan_value), &compare_values);
+    /* Split after the values followed by the widest gaps. */
+    for (j = 0; j + 1 < SCAN_RANGES && j + 1 < scan->values_length; j++)
+    {
+        size_t widest = 0;
+        uint64_t widest_gap = 0;
+        for (i = 0; i + 1 < scan->values_length; i++)
+        {
+            uint64_t gap = scan->values[i + 1].value - scan->values[i].value;
+            size_t k = 0;
+            for (k = 0; k < splits_length && splits[k] != i; k++)
+            {
+            }
+            if (k == splits_length && gap > widest_gap)
+            {
+                widest = i;
+                widest_gap = gap;
+            }
+        }
+        if (widest_gap == 0)
+        {
+            break;
+        }
+        splits[splits_length++] = widest;
+    }
+    /* Sort the few splits into order. */
+    for (i = 1; i < splits_length; i++)
+    {
+        for (j = i; j > 0 && splits[j - 1] > splits[j]; j--)
+        {
+            size_t swap = splits[j];
+            splits[j] = splits[j - 1];
+            splits[j - 1] = swap;
+        }
+    }
+    for (i = 0; i < SCAN_RANGES; i++)
+    {
+        size_t last = i < splits_length ? splits[i] : scan->values_length - 1;
+        if (scan->values_length == 0)
+        {
+            /* Nothing can match. */
+            scan->low[i] = UINT64_MAX;
+            scan->span[i] = 0;
+        }
+        else if (i > splits_length)
+        {
+            /* Spare ranges repeat the last. */
+            scan->low[i] = scan->low[i - 1];
+            scan->span[i] = scan->span[i - 1];
+        }
+        else
+        {
+            scan->low[i] = scan->values[first].value;
+            scan->span[i] = scan->values[last].value - scan->low[i];
+            first = last + 1;
+        }
+    }
+}
+
+/**
+ * Find the record of a pointer rewritten by an earlier
+ * scan.
+ *
+ * @param slot Address of the pointer.
+ * @return The record, or `NULL` if dpatch hasn't rewritten
+ * the pointer.
+ */
+static struct rewritten_pointer* find_rewritten(uintptr_t slot)
+{
+    size_t low = 0;
+    size_t high = rewritten_length;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (rewritten[middle].slot < slot)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < rewritten_length && rewritten[low].slot == slot ? &rewritten[low] : NULL;
+}
+
+/**
+ * Record a pointer rewritten for the first time.
+ *
+ * @param scan Handle to the scan.
+ * @param slot Address of the pointer.
+ * @param from The entry point the pointer led to.
+ */
+static void record_rewritten(pointer_scan_t* scan, uintptr_t slot, intptr_t from)
+{
+    struct rewritten_pointer* found = NULL;
+    if (scan->found_length == scan->found_allocated)
+    {
+        size_t allocated = scan->found_allocated == 0 ? 64 : scan->found_allocated * 2;
+        found = realloc(scan->found, allocated * sizeof(struct rewritten_pointer));
+        if (found == NULL)
+        {
+            /* The pointer is still rewritten, but won't follow later patches. */
+            return;
+        }
+        scan->found = found;
+        scan->found_allocated = allocated;
+    }
+    scan->found[scan->found_length].slot = slot;
+    scan->found[scan->found_length].from = from;
+    scan->found_length++;
+}
+
+/**
+ * Atomically replace a pointer, if it still holds the
+ * value it was matched with.
+ *
+ * @param scan Handle to the scan.
+ * @param slot Address of the pointer.
+ * @param expected The value the pointer was matched with.
+ * @param target The value to store.
+ * @param from The entry point to record the pointer as
+ *      leading to, or 0 if it needn't be recorded.
+ */
+static void rewrite_slot(pointer_scan_t* scan, uint64_t* slot, uint64_t expected, uint64_t target, intptr_t from)
+{
+    if (!__atomic_compare_exchange_n(slot, &expected, target, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+    scan->rewritten++;
+    if (from != 0)
+    {
+        record_rewritten(scan, (uintptr_t) slot, from);
+    }
+}
+
+/**
+ * Queue a rewrite of a pointer on a read-only page, until
+ * the page has been scanned.
+ *
+ * @param scan Handle to the scan.
+ * @param slot Address of the pointer.
+ * @param expected The value the pointer was matched with.
+ * @param target The value to store.
+ * @param from The entry point to record the pointer as
+ *      leading to, or 0 if it needn't be recorded.
+ */
+static void queue_rewrite(pointer_scan_t* scan, uint64_t* slot, uint64_t expected, uint64_t target, intptr_t from)
+{
+    struct queued_rewrite* queued = NULL;
+    if (scan->queued_length == scan->queued_allocated)
+    {
+        size_t allocated = scan->queued_allocated == 0 ? 16 : scan->queued_allocated * 2;
+        queued = realloc(scan->queued, allocated * sizeof(struct queued_rewrite));
+        if (queued == NULL)
+        {
+            /* The pointer keeps leading through the redirected entry. */
+            return;
+        }
+        scan->queued = queued;
+        scan->queued_allocated = allocated;
+    }
+    scan->queued[scan->queued_length++] = (struct queued_rewrite) {slot, expected, target, from};
+}
+
+/**
+ * Perform the rewrites queued for a read-only page, making
+ * it writable once for all of them.
+ *
+ * @param scan Handle to the scan.
+ * @param page The page's first byte.
+ * @param page_size Size of the page in bytes.
+ */
+static void flush_page(pointer_scan_t* scan, uintptr_t page, size_t page_size)
+{
+    size_t i = 0;
+    if (scan->queued_length == 0)
+    {
+        return;
+    }
+    if (mprotect((void*) page, page_size, PROT_READ | PROT_WRITE) == 0)
+    {
+        for (i = 0; i < scan->queued_length; i++)
+        {
+            struct queued_rewrite* queued = &scan->queued[i];
+            rewrite_slot(scan, queued->slot, queued->expected, queued->target, queued->from);
+        }
+        /* ld.so left the page read-only, and nothing else. */
+        mprotect((void*) page, page_size, PROT_READ);
+    }
+    scan->queued_length = 0;
+}
+
+/**
+ * Rewrite a word which fell inside one of the scan's
+ * ranges, if it points at a redirected entry, or at the
+ * old target of a pointer dpatch rewrote.
+ *
+ * @param scan Handle to the scan.
+ * @param slot Address of the word.
+ */
+static void check_word(pointer_scan_t* scan, uint64_t* slot)
+{
+    uint64_t value = *slot;
+    const struct scan_redirect* owner = NULL;
+    const struct scan_redirect* entry = NULL;
+    struct rewritten_pointer* record = NULL;
+    size_t low = 0;
+    size_t high = scan->values_length;
+    intptr_t target = 0;
+    intptr_t first = 0;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (scan->values[middle].value < value)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == scan->values_length || scan->values[low].value != value)
+    {
+        return;
+    }
+    record = find_rewritten((uintptr_t) slot);
+    for (; low < scan->values_length && scan->values[low].value == value; low++)
+    {
+        const struct scan_redirect* redirect = &scan->redirects[scan->values[low].redirect];
+        if (!scan->values[low].previous)
+        {
+            entry = redirect;
+        }
+        else if (record != NULL && record->from == redirect->from)
+        {
+            owner = redirect;
+        }
+    }
+    if (owner == NULL && entry == NULL)
+    {
+        return;
+    }
+    target = owner != NULL ? owner->target : entry->target;
+    first = owner == NULL && record == NULL ? entry->from : 0;
+    if (scan->read_only)
+    {
+        queue_rewrite(scan, slot, value, (uint64_t) target, first);
+    }
+    else
+    {
+        rewrite_slot(scan, slot, value, (uint64_t) target, first);
+    }
+}
+
+/**
+ * Scan words for pointers to rewrite.
+ *
+ * @param scan Handle to the scan.
+ * @param words The first word to scan.
+ * @param length The number of words to scan.
+ */
+static void scan_words(pointer_scan_t* scan, uint64_t* words, size_t length)
+{
+    size_t i = 0;
+    size_t range = 0;
+    for (i = 0; i < length; i++)
+    {
+        for (range = 0; range < SCAN_RANGES; range++)
+        {
+            if (words[i] - scan->low[range] <= scan->span[range])
+            {
+                check_word(scan, &words[i]);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Scan words for pointers to rewrite, testing four words
+ * against every range at once.
+ *
+ * AVX2 only compares signed 64-bit integers, so each
+ * word's unsigned offset into a range is biased by 2^63
+ * before it is compared with the range's biased span.
+ *
+ * @param scan Handle to the scan.
+ * @param words The first word to scan.
+ * @param length The number of words to scan.
+ */
+__attribute__((target("avx2")))
+static void scan_words_avx2(pointer_scan_t* scan, uint64_t* words, size_t length)
+{
+    const __m256i bias = _mm256_set1_epi64x((long long) (1ull << 63));
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    __m256i low[SCAN_RANGES];
+    __m256i limit[SCAN_RANGES];
+    size_t i = 0;
+    size_t range = 0;
+    size_t lane = 0;
+    for (range = 0; range < SCAN_RANGES; range++)
+    {
+        low[range] = _mm256_set1_epi64x((long long) scan->low[range]);
+        limit[range] = _mm256_xor_si256(_mm256_set1_epi64x((long long) scan->span[range]), bias);
+    }
+    for (i = 0; i + 4 <= length; i += 4)
+    {
+        __m256i word = _mm256_loadu_si256((const __m256i*) &words[i]);
+        __m256i outside = ones;
+        for (range = 0; range < SCAN_RANGES; range++)
+        {
+            __m256i offset = _mm256_xor_si256(_mm256_sub_epi64(word, low[range]), bias);
+            outside = _mm256_and_si256(outside, _mm256_cmpgt_epi64(offset, limit[range]));
+        }
+        if (!_mm256_testc_si256(outside, ones))
+        {
+            for (lane = 0; lane < 4; lane++)
+            {
+                check_word(scan, &words[i + lane]);
+            }
+        }
+    }
+    scan_words(scan, &words[i], length - i);
+}
+
+/**
+ * Scan words for pointers to rewrite, with AVX2 if asked.
+ *
+ * @param scan Handle to the scan.
+ * @param words The first word to scan.
+ * @param length The number of words to scan.
+ * @param vector Whether to use AVX2.
+ */
+static void scan_span(pointer_scan_t* scan, uint64_t* words, size_t length, bool vector)
+{
+    if (vector)
+    {
+        scan_words_avx2(scan, words, length);
+    }
+    else
+    {
+        scan_words(scan, words, length);
+    }
+}
+
+/**
+ * Scan the aligned words between two addresses.
+ *
+ * Read-only words are scanned a page at a time, and each
+ * page with a match is made writable once, for all of its
+ * matches.
+ *
+ * @param scan Handle to the scan.
+ * @param start Address to start at.
+ * @param end Address to end before.
+ * @param read_only Whether ld.so made the words' pages
+ *      read-only, so they must be made writable to rewrite
+ *      them.
+ * @param vector Whether to use AVX2.
+ * @return The number of bytes scanned.
+ */
+static size_t scan_range
+(
+    pointer_scan_t* scan,
+    uintptr_t start,
+    uintptr_t end,
+    bool read_only,
+    bool vector
+)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t page = 0;
+    uintptr_t page_end = 0;
+    uintptr_t i = 0;
+    start = (start + sizeof(uint64_t) - 1) & ~(uintptr_t) (sizeof(uint64_t) - 1);
+    end &= ~(uintptr_t) (sizeof(uint64_t) - 1);
+    if (end <= start)
+    {
+        return 0;
+    }
+    scan->read_only = read_only;
+    if (!read_only)
+    {
+        scan_span(scan, (uint64_t*) start, (end - start) / sizeof(uint64_t), vector);
+        return end - start;
+    }
+    for (i = start; i < end; i = page_end)
+    {
+        page = i - i % page_size;
+        page_end = page + page_size < end ? page + page_size : end;
+        scan_span(scan, (uint64_t*) i, (page_end - i) / sizeof(uint64_t), vector);
+        flush_page(scan, page, page_size);
+    }
+    return end - start;
+}
+
+/**
+ * Progress scanning the program's objects.
+ */
+struct object_walk
+{
+    /** Handle to the scan. */
+    pointer_scan_t* scan;
+
+    /** The program, first in its namespace. */
+    struct link_map* program;
+
+    /** Whether to use AVX2. */
+    bool vector;
+
+    /** The number of objects visited. */
+    size_t visited;
+
+    /** The number of objects scanned. */
+    size_t objects;
+
+    /** The number of bytes scanned. */
+    size_t bytes;
+};
+
+/**
+ * Test if an object contains an address in one of its
+ * loadable segments.
+ *
+ * @param info The object's program headers.
+ * @param address The address to test.
+ * @return `true` if the object maps `address`.
+ */
+static bool object_contains(const struct dl_phdr_info* info, uintptr_t address)
+{
+    size_t i = 0;
+    for (i = 0; i < info->dlpi_phnum; i++)
+    {
+        uintptr_t start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        if (
+            info->dlpi_phdr[i].p_type == PT_LOAD
+            && address >= start
+            && address < start + info->dlpi_phdr[i].p_memsz
+        )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Scan an object's writable and RELRO segments.
+ *
+ * @note The caller must hold the loader's lock.
+ *
+ * @param walk The walk in progress.
+ * @param info The object's program headers.
+ */
+static void scan_segments(struct object_walk* walk, const struct dl_phdr_info* info)
+{
+    const ElfW(Phdr)* program_headers = info->dlpi_phdr;
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t relro_start = 0;
+    uintptr_t relro_end = 0;
+    size_t i = 0;
+    /* Leave dpatch's own records alone, unless it is linked into the program. */
+    if (info->dlpi_name != walk->program->l_name && object_contains(info, (uintptr_t) &enabled))
+    {
+        return;
+    }
+    for (i = 0; i < info->dlpi_phnum; i++)
+    {
+        if (program_headers[i].p_type == PT_GNU_RELRO)
+        {
+            /*
+             * ld.so protects only the whole pages of RELRO. The
+             * page holding its end stays writable, as it may
+             * also hold `.got.plt` or `.data`.
+             */
+            relro_start = info->dlpi_addr + program_headers[i].p_vaddr;
+            relro_end = relro_start + program_headers[i].p_memsz;
+            relro_start -= relro_start % page_size;
+            relro_end -= relro_end % page_size;
+        }
+    }
+    for (i = 0; i < info->dlpi_phnum; i++)
+    {
+        uintptr_t start = info->dlpi_addr + program_headers[i].p_vaddr;
+        uintptr_t end = start + program_headers[i].p_memsz;
+        if (program_headers[i].p_type != PT_LOAD || !(program_headers[i].p_flags & PF_W))
+        {
+            continue;
+        }
+        if (relro_end <= start || relro_start >= end)
+        {
+            walk->bytes += scan_range(walk->scan, start, end, false, walk->vector);
+            continue;
+        }
+        walk->bytes += scan_range(walk->scan, start, relro_start, false, walk->vector);
+        walk->bytes += scan_range(
+            walk->scan,
+            relro_start > start ? relro_start : start,
+            relro_end < end ? relro_end : end,
+            true,
+            walk->vector
+        );
+        walk->bytes += scan_range(walk->scan, relro_end > start ? relro_end : start, end, false, walk->vector);
+    }
+    walk->objects++;
+}
+
+/**
+ * Scan every object in the program's namespace, from
+ * another namespace.
+ *
+ * @note The caller must hold the loader's lock.
+ *
+ * @param walk The walk in progress.
+ */
+static void scan_program_namespace(struct object_walk* walk)
+{
+    struct dl_phdr_info info;
+    struct link_map* map = NULL;
+    int count = 0;
+    for (map = walk->program; map != NULL; map = map->l_next)
+    {
+        memset(&info, 0, sizeof info);
+        /* A link map is the loader's handle to its object. */
+        count = dlinfo(map, RTLD_DI_PHDR, &info.dlpi_phdr);
+        if (count <= 0)
+        {
+            continue;
+        }
+        info.dlpi_addr = map->l_addr;
+        info.dlpi_name = map->l_name;
+        info.dlpi_phnum = (ElfW(Half)) count;
+        scan_segments(walk, &info);
+    }
+}
+
+/**
+ * Scan an object visited by `dl_iterate_phdr`, which holds
+ * the loader's lock, so no object can be unloaded while it
+ * is scanned.
+ *
+ * `dl_iterate_phdr` only visits the caller's namespace.
+ * When dpatch is loaded by `LD_AUDIT`, that is dpatch's own
+ * namespace, so the program's namespace is walked instead
+ * while the lock is held. Every namespace shares the one
+ * loader, and its lock.
+ *
+ * @param info The object's program headers.
+ * @param size Size of `info`.
+ * @param context The `struct object_walk` in progress.
+ * @return 0 to visit the next object, or 1 once the
+ * program's namespace has been walked.
+ */
+static int scan_object(struct dl_phdr_info* info, size_t size, void* context)
+{
+    struct object_walk* walk = context;
+    (void) size;
+    if (walk->visited++ == 0 && info->dlpi_name != walk->program->l_name)
+    {
+        scan_program_namespace(walk);
+        return 1;
+    }
+    scan_segments(walk, info);
+    return 0;
+}
+
+/**
+ * Add the pointers this scan rewrote for the first time to
+ * the record of rewritten pointers.
+ *
+ * @param scan Handle to the scan.
+ */
+static void merge_rewritten(pointer_scan_t* scan)
+{
+    struct rewritten_pointer* merged = NULL;
+    if (scan->found_length == 0)
+    {
+        return;
+    }
+    merged = realloc(rewritten, (rewritten_length + scan->found_length) * sizeof(struct rewritten_pointer));
+    if (merged == NULL)
+    {
+        return;
+    }
+    memcpy(merged + rewritten_length, scan->found, scan->found_length * sizeof(struct rewritten_pointer));
+    rewritten = merged;
+    rewritten_length += scan->found_length;
+    qsort(rewritten, rewritten_length, sizeof(struct rewritten_pointer), &compare_pointers);
+}
+
+/**
+ * Rewrite pointers to the entries a committed batch
+ * redirected, in the writable and RELRO segments of every
+ * loaded object.
+ *
+ * Objects are visited with `dl_iterate_phdr`, which holds
+ * the loader's lock, so an object can't be unloaded while
+ * it is scanned.
+ *
+ * @param scan Handle to the scan, created before the batch
+ *      was committed.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EDYN` if the
+ * program's objects can't be listed.
+ */
+dpatch_status pointer_scan_run(pointer_scan_t* scan)
+{
+    struct object_walk walk;
+    void* program = NULL;
+    double start = 0;
+    double elapsed_us = 0;
+    if (patch_guard_enabled())
+    {
+        event_log_post(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            scan->patch_id,
+            "Skipped rewriting pointers, because guarded replacements may still be reverted."
+        );
+        return DPATCH_STATUS_OK;
+    }
+    memset(&walk, 0, sizeof walk);
+    program = dlopen(NULL, RTLD_LAZY);
+    if (program == NULL || dlinfo(program, RTLD_DI_LINKMAP, &walk.program) != 0 || walk.program == NULL)
+    {
+        if (program != NULL)
+        {
+            dlclose(program);
+        }
+        return DPATCH_STATUS_EDYN;
+    }
+    walk.scan = scan;
+    walk.vector = __builtin_cpu_supports("avx2");
+    pthread_mutex_lock(&scan_lock);
+    start = now_us();
+    plan_scan(scan);
+    if (scan->values_length != 0)
+    {
+        dl_iterate_phdr(&scan_object, &walk);
+    }
+    merge_rewritten(scan);
+    elapsed_us = now_us() - start;
+    pthread_mutex_unlock(&scan_lock);
+    dlclose(program);
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        scan->patch_id,
+        "Rewrote %zu pointers to %zu redirected functions. Scanned %.1f MB in %zu objects in %.2f ms, %.2f GB/s with %s.",
+        scan->rewritten,
+        scan->redirects_length,
+        walk.bytes / 1e6,
+        walk.objects,
+        elapsed_us / 1e3,
+        elapsed_us > 0 ? walk.bytes / elapsed_us / 1e3 : 0.0,
+        walk.vector ? "AVX2" : "scalar comparisons"
+    );
+    return DPATCH_STATUS_OK;
+}
@@ -0,0 +1,568 @@
+/**
+ * @file dpatch/profiler.c
+ *
+ * `profiler.c` defines a sampling profiler which attributes
+ * the process' CPU time to functions, and reports how much
+ * of it lands in patched code.
+ *
+ * A background thread gives each thread in the process a
+ * `timer_create` timer on the thread's CPU clock, which
+ * sends it `SIGPROF` `DPATCH_PROFILE_HZ` times per second
+ * of CPU time it uses. The signal handler appends the
+ * interrupted instruction pointer to the thread's own ring
+ * buffer, without locks or allocation. The background
+ * thread drains the buffers, attributes each sample to a
+ * function through the symbol index, and periodically logs
+ * the share of samples in replacement functions, in the
+ * functions they replaced, and elsewhere.
+ *
+ * Overhead is bounded by the sample rate, which is capped
+ * at `PROFILER_MAX_HZ`: samples which don't fit in a full
+ * buffer are dropped and counted, and at most
+ * `PROFILER_MAX_THREADS` threads are sampled.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "hot_text.h"
+#include "profiler.h"
+#include "redirect.h"
+#include "status.h"
+#include "symbol_index.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define PROFILE_HZ_ENV_VAR "DPATCH_PROFILE_HZ"
+#define PROFILE_REPORT_ENV_VAR "DPATCH_PROFILE_REPORT_MS"
+#define PROFILER_DEFAULT_REPORT_MS 10000
+#define PROFILER_MAX_HZ 1000
+#define PROFILER_MAX_THREADS 256
+#define PROFILER_BUFFER_LEN 1024
+#define PROFILER_SCAN_MS 100
+#define PROFILER_REPORT_TOP 5
+
+/** Functions counted per report, as a power of two. */
+#define PROFILER_FUNCTIONS_BITS 12
+#define PROFILER_FUNCTIONS (1u << PROFILER_FUNCTIONS_BITS)
+
+/**
+ * The CPU clock of another thread in the process, as
+ * encoded by Linux for `CLOCK_THREAD_CPUTIME_ID` clocks.
+ */
+#define THREAD_CPU_CLOCK(tid) ((clockid_t) ((~(unsigned) (tid) << 3) | 6))
+
+/**
+ * A thread being sampled.
+ *
+ * The thread's signal handler is the only writer of `head`
+ * and `ips`, and the profiler thread the only writer of
+ * `tail`.
+ */
+struct sampled_thread
+{
+    /** The thread's ID, or 0 if the slot is free. */
+    pid_t tid;
+
+    /** The thread's timer. */
+    timer_t timer;
+
+    /** Whether the thread was found by the latest scan. */
+    bool seen;
+
+    /** The number of samples written. */
+    uint64_t head;
+
+    /** The number of samples read. */
+    uint64_t tail;
+
+    /** Samples dropped because the buffer was full. */
+    uint64_t dropped;
+
+    /** Interrupted instruction pointers. */
+    uintptr_t ips[PROFILER_BUFFER_LEN];
+};
+
+/**
+ * The samples attributed to one function.
+ */
+struct function_samples
+{
+    /** The function's entry point, or 0 if unused. */
+    uintptr_t start;
+
+    /** The number of samples in the function. */
+    uint64_t samples;
+
+    /** Whether calls are redirected to the function. */
+    bool replacement;
+
+    /** Whether calls to the function are redirected elsewhere. */
+    bool replaced;
+};
+
+/**
+ * Samples collected since the last report.
+ */
+struct profile
+{
+    /** Samples by function, hashed by entry point. */
+    struct function_samples functions[PROFILER_FUNCTIONS];
+
+    /** The number of samples attributed to a function. */
+    uint64_t samples;
+
+    /** Samples outside any known function, or of a function which didn't fit. */
+    uint64_t unknown;
+
+    /** Samples dropped because a buffer was full. */
+    uint64_t dropped;
+
+    /** `CLOCK_MONOTONIC` time the profile was started, in ns. */
+    uint64_t started_ns;
+};
+
+/** Threads being sampled. */
+static struct sampled_thread* threads[PROFILER_MAX_THREADS];
+
+/** Samples collected since the last report. */
+static struct profile profile;
+
+/** Interval between samples, in ns of a thread's CPU time. */
+static long period_ns = 0;
+
+/** Interval between reports, in ns. */
+static uint64_t report_ns = 0;
+
+/** Whether a full thread table has been logged. */
+static bool logged_full = false;
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Record the instruction pointer a thread's timer
+ * interrupted.
+ *
+ * @param signal Unused, but required by `sigaction`.
+ * @param info The timer's signal, carrying the thread's
+ *      buffer.
+ * @param context The interrupted context.
+ */
+static void sigprof_handler(int signal, siginfo_t* info, void* context)
+{
+    struct sampled_thread* thread = info->si_value.sival_ptr;
+    ucontext_t* interrupted = context;
+    uint64_t head = 0;
+    (void) signal;
+    if (info->si_code != SI_TIMER || thread == NULL)
+    {
+        return;
+    }
+    head = __atomic_load_n(&thread->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE) == PROFILER_BUFFER_LEN)
+    {
+        __atomic_fetch_add(&thread->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    thread->ips[head % PROFILER_BUFFER_LEN] = (uintptr_t) interrupted->uc_mcontext.gregs[REG_RIP];
+    __atomic_store_n(&thread->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Attribute a sample to the function containing it, or
+ * the function copied into the hot text containing it.
+ *
+ * @param ip The sampled instruction pointer.
+ */
+static void profile_record(uintptr_t ip)
+{
+    struct symbol_info info;
+    uintptr_t origin = 0;
+    size_t i = 0;
+    size_t probe = 0;
+    /* A copy in hot text isn't in the index, so its samples go to the function copied. */
+    if (IS_ERROR(symbol_index_lookup(ip, &info)))
+    {
+        origin = (uintptr_t) hot_text_origin((intptr_t) ip);
+        if (origin == 0 || IS_ERROR(symbol_index_lookup(origin, &info)))
+        {
+            profile.unknown++;
+            return;
+        }
+    }
+    i = (size_t) (((uint64_t) info.start * 0x9e3779b97f4a7c15ull) >> (64 - PROFILER_FUNCTIONS_BITS));
+    for (probe = 0; probe < PROFILER_FUNCTIONS; probe++, i = (i + 1) % PROFILER_FUNCTIONS)
+    {
+        if (profile.functions[i].start == 0)
+        {
+            profile.functions[i].start = info.start;
+        }
+        if (profile.functions[i].start == info.start)
+        {
+            profile.functions[i].samples++;
+            profile.samples++;
+            return;
+        }
+    }
+    profile.unknown++;
+}
+
+/**
+ * Move a thread's buffered samples into the profile.
+ *
+ * @param thread The thread to drain.
+ */
+static void drain_thread(struct sampled_thread* thread)
+{
+    uint64_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = thread->tail;
+    for (; tail != head; tail++)
+    {
+        profile_record(thread->ips[tail % PROFILER_BUFFER_LEN]);
+    }
+    __atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+    profile.dropped += __atomic_exchange_n(&thread->dropped, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start sampling a thread.
+ *
+ * @param tid The thread's ID.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ENOMEM` if
+ * no slot is free, or `DPATCH_STATUS_ERROR` if the thread's
+ * timer can't be started, for example because it exited.
+ */
+static dpatch_status start_thread(pid_t tid)
+{
+    struct sampled_thread* thread = NULL;
+    struct sigevent event;
+    struct itimerspec interval;
+    size_t i = 0;
+    for (i = 0; i < PROFILER_MAX_THREADS && thread == NULL; i++)
+    {
+        if (threads[i] == NULL)
+        {
+            threads[i] = calloc(1, sizeof(struct sampled_thread));
+        }
+        thread = threads[i] != NULL && threads[i]->tid == 0 ? threads[i] : NULL;
+    }
+    if (thread == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    memset(&event, 0, sizeof event);
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = thread;
+    /* glibc only names the target thread's field in the kernel's headers. */
+    event._sigev_un._tid = tid;
+    if (timer_create(THREAD_CPU_CLOCK(tid), &event, &thread->timer) != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = period_ns;
+    interval.it_value = interval.it_interval;
+    if (timer_settime(thread->timer, 0, &interval, NULL) != 0)
+    {
+        timer_delete(thread->timer);
+        return DPATCH_STATUS_ERROR;
+    }
+    thread->tid = tid;
+    thread->seen = true;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Start sampling threads which started since the last scan,
+ * and stop sampling threads which exited.
+ *
+ * @param self The profiler thread, which isn't sampled.
+ */
+static void scan_threads(pid_t self)
+{
+    DIR* tasks = opendir("/proc/self/task");
+    struct dirent* entry = NULL;
+    pid_t tid = 0;
+    size_t i = 0;
+    bool known = false;
+    if (tasks == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < PROFILER_MAX_THREADS; i++)
+    {
+        if (threads[i] != NULL)
+        {
+            threads[i]->seen = false;
+        }
+    }
+    while ((entry = readdir(tasks)) != NULL)
+    {
+        tid = (pid_t) atoi(entry->d_name);
+        known = false;
+        for (i = 0; i < PROFILER_MAX_THREADS && !known && tid > 0; i++)
+        {
+            known = threads[i] != NULL && threads[i]->tid == tid;
+            if (known)
+            {
+                threads[i]->seen = true;
+            }
+        }
+        if (tid > 0 && tid != self && !known && start_thread(tid) == DPATCH_STATUS_ENOMEM && !logged_full)
+        {
+            logged_full = true;
+            event_logf(
+                LOG_WARNING,
+                DPATCH_STATUS_ENOMEM,
+                0,
+                "The profiler samples at most %d threads, so some threads aren't sampled.",
+                PROFILER_MAX_THREADS
+            );
+        }
+    }
+    closedir(tasks);
+    for (i = 0; i < PROFILER_MAX_THREADS; i++)
+    {
+        if (threads[i] != NULL && threads[i]->tid != 0 && !threads[i]->seen)
+        {
+            timer_delete(threads[i]->timer);
+            drain_thread(threads[i]);
+            threads[i]->tid = 0;
+        }
+    }
+}
+
+/**
+ * Order function samples by descending sample count.
+ *
+ * @param a The first `struct function_samples`.
+ * @param b The second `struct function_samples`.
+ * @return Negative if `a` has more samples than `b`,
+ * positive if it has fewer, and 0 otherwise.
+ */
+static int compare_samples(const void* a, const void* b)
+{
+    uint64_t left = ((const struct function_samples*) a)->samples;
+    uint64_t right = ((const struct function_samples*) b)->samples;
+    return left > right ? -1 : left < right ? 1 : 0;
+}
+
+/**
+ * Get the percentage of the profile's samples a count
+ * represents.
+ *
+ * @param samples The count.
+ * @param total Samples in the profile.
+ * @return The percentage.
+ */
+static double share(uint64_t samples, uint64_t total)
+{
+    return total == 0 ? 0.0 : 100.0 * (double) samples / (double) total;
+}
+
+/**
+ * Log the profile, then start a new one.
+ *
+ * Whether a function is patched is decided when the report
+ * is made, so samples taken before a patch are attributed
+ * as if it had already been applied.
+ */
+static void profile_report(void)
+{
+    struct function_samples* sorted = NULL;
+    struct symbol_info info;
+    uint64_t end_ns = now_ns();
+    uint64_t total = profile.samples + profile.unknown;
+    uint64_t replacement = 0;
+    uint64_t replaced = 0;
+    size_t length = 0;
+    size_t i = 0;
+    if (total != 0)
+    {
+        sorted = malloc(sizeof(struct function_samples) * PROFILER_FUNCTIONS);
+    }
+    for (i = 0; i < PROFILER_FUNCTIONS && sorted != NULL; i++)
+    {
+        if (profile.functions[i].start != 0)
+        {
+            sorted[length] = profile.functions[i];
+            sorted[length].replacement = redirect_is_target((intptr_t) sorted[length].start);
+            sorted[length].replaced = redirect_resolve((intptr_t) sorted[length].start)
+                != (intptr_t) sorted[length].start;
+            replacement += sorted[length].replacement ? sorted[length].samples : 0;
+            replaced += sorted[length].replaced ? sorted[length].samples : 0;
+            length++;
+        }
+    }
+    if (sorted != NULL)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            0,
+            "Profile of %llu ms: %llu samples, %.1f%% in replacements, %.1f%% in replaced functions, %.1f%% elsewhere.",
+            (unsigned long long) ((end_ns - profile.started_ns) / 1000000),
+            (unsigned long long) total,
+            share(replacement, total),
+            share(replaced, total),
+            share(total - replacement - replaced, total)
+        );
+        qsort(sorted, length, sizeof(struct function_samples), &compare_samples);
+        for (i = 0; i < length && i < PROFILER_REPORT_TOP; i++)
+        {
+            event_logf(
+                LOG_INFO,
+                DPATCH_STATUS_OK,
+                0,
+                "Profile: %5.1f%% in %s%s.",
+                share(sorted[i].samples, total),
+                IS_ERROR(symbol_index_lookup(sorted[i].start, &info)) ? "an unloaded function" : info.name,
+                sorted[i].replacement ? " (replacement)" : sorted[i].replaced ? " (replaced)" : ""
+            );
+        }
+        free(sorted);
+    }
+    if (profile.dropped != 0 || profile.unknown != 0)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            0,
+            "Profile: %llu samples were dropped, and %llu were outside known functions.",
+            (unsigned long long) profile.dropped,
+            (unsigned long long) profile.unknown
+        );
+    }
+    memset(&profile, 0, sizeof profile);
+    profile.started_ns = end_ns;
+}
+
+/**
+ * Sample the process' threads, reporting periodically.
+ *
+ * @param args Unused, but required by the `pthreads` API.
+ * @return Nothing - the thread never returns.
+ */
+static void* profiler_thread(void* args)
+{
+    struct timespec scan = {0, PROFILER_SCAN_MS * 1000000l};
+    pid_t self = (pid_t) syscall(SYS_gettid);
+    size_t i = 0;
+    (void) args;
+    profile.started_ns = now_ns();
+    while (true)
+    {
+        for (i = 0; i < PROFILER_MAX_THREADS; i++)
+        {
+            if (threads[i] != NULL && threads[i]->tid != 0)
+            {
+                drain_thread(threads[i]);
+            }
+        }
+        scan_threads(self);
+        if (now_ns() - profile.started_ns >= report_ns)
+        {
+            profile_report();
+        }
+        nanosleep(&scan, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Start sampling every thread of the process, if the
+ * `DPATCH_PROFILE_HZ` environment variable is set.
+ *
+ * Samples are reported to the event log every
+ * `DPATCH_PROFILE_REPORT_MS` milliseconds. The profiler
+ * owns `SIGPROF`, so it doesn't start if the program has
+ * already handled it.
+ *
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ERROR` if a
+ * variable is invalid or the profiler can't be started, or
+ * another error on failure.
+ */
+dpatch_status profiler_start(void)
+{
+    char* hz = getenv(PROFILE_HZ_ENV_VAR);
+    char* report = getenv(PROFILE_REPORT_ENV_VAR);
+    struct sigaction action;
+    struct sigaction previous;
+    pthread_attr_t attributes;
+    pthread_t thread;
+    long rate = 0;
+    long report_ms = PROFILER_DEFAULT_REPORT_MS;
+    int result = 0;
+    if (hz == NULL || period_ns != 0)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    rate = atol(hz);
+    report_ms = report == NULL ? PROFILER_DEFAULT_REPORT_MS : atol(report);
+    if (rate <= 0 || report_ms <= 0)
+    {
+        return rate == 0 && hz[0] == '0' ? DPATCH_STATUS_OK : DPATCH_STATUS_ERROR;
+    }
+    rate = rate > PROFILER_MAX_HZ ? PROFILER_MAX_HZ : rate;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = &sigprof_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, NULL, &previous) != 0 || previous.sa_handler != SIG_DFL)
+    {
+        event_log_post(
+            LOG_WARNING,
+            DPATCH_STATUS_ERROR,
+            0,
+            "SIGPROF is already handled, so the profiler isn't started."
+        );
+        return DPATCH_STATUS_ERROR;
+    }
+    period_ns = 1000000000l / rate;
+    report_ns = (uint64_t) report_ms * 1000000ull;
+    if (sigaction(SIGPROF, &action, NULL) != 0)
+    {
+        period_ns = 0;
+        return DPATCH_STATUS_ERROR;
+    }
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    result = pthread_create(&thread, &attributes, &profiler_thread, NULL);
+    pthread_attr_destroy(&attributes);
+    if (result != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    event_logf(
+        LOG_INFO,
+        DPATCH_STATUS_OK,
+        0,
+        "Sampling %ld times per CPU second, reporting every %ld ms.",
+        rate,
+        report_ms
+    );
+    return DPATCH_STATUS_OK;
+}
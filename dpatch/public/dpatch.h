@@ -0,0 +1,293 @@
+/**
+ * @file dpatch/public/dpatch.h
+ *
+ * `dpatch.h` is dpatch's public, in-process API.
+ *
+ * Programs linked against `libdpatch` (shared or static)
+ * can build a patch from entries in memory and apply it
+ * synchronously, without patch scripts or signals:
+ *
+ *     dpatch_patch_t* patch = NULL;
+ *     struct dpatch_entry entry = {
+ *         "fn_replace_internal", "alpha", "bravo", NULL
+ *     };
+ *     struct dpatch_result result;
+ *     dpatch_patch_new(&patch);
+ *     dpatch_patch_add(patch, &entry);
+ *     if (dpatch_patch_apply(patch, 0) != DPATCH_STATUS_OK)
+ *     {
+ *         ...
+ *     }
+ *     dpatch_patch_result(patch, &result);
+ *     dpatch_patch_free(patch);
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#ifndef DPATCH_PUBLIC_DPATCH_H_
+#define DPATCH_PUBLIC_DPATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Marks a function as part of dpatch's public API.
+ *
+ * dpatch is built with hidden visibility, so only functions
+ * marked `DPATCH_API` are exported from `libdpatch`.
+ */
+#if defined(__GNUC__)
+#define DPATCH_API __attribute__((visibility("default")))
+#else
+#define DPATCH_API
+#endif
+
+/**
+ * Indicates the success or failure of an operation by
+ * dpatch.
+ */
+typedef enum
+{
+    /** Success. */
+    DPATCH_STATUS_OK = 0,
+
+    /** General or unspecified error. */
+    DPATCH_STATUS_ERROR,
+
+    /** Memory (re)/allocation failed. */
+    DPATCH_STATUS_ENOMEM,
+
+    /** Failed to modify memory protection. */
+    DPATCH_STATUS_EMPROT,
+
+    /** Unsupported or unknown patch operation. */
+    DPATCH_STATUS_EUNKNOWN,
+
+    /** Error accessing dynamic symbols with `dlfcn.h` */
+    DPATCH_STATUS_EDYN,
+
+    /** File I/O error. */
+    DPATCH_STATUS_EFILE,
+
+    /** Script parsing error. */
+    DPATCH_STATUS_ESYNTAX,
+
+    /** Failed to write into program memory. */
+    DPATCH_STATUS_EWRITE,
+
+    /** A patch would redirect a function into itself. */
+    DPATCH_STATUS_ECYCLE,
+
+    /** A commit was aborted to avoid missing its deadline. */
+    DPATCH_STATUS_ETIMEDOUT,
+
+    /** A patch blob was compiled from a different script. */
+    DPATCH_STATUS_ESTALE
+} dpatch_status;
+
+/**
+ * Get a human readable string describing a status code.
+ *
+ * @param status Status code to translate.
+ * @return Pointer to a string describing the error.
+ */
+DPATCH_API const char* dpatch_str_status(dpatch_status status);
+
+/**
+ * `dpatch_patch_t` is a handle to a patch being built or
+ * applied through the public API.
+ */
+typedef struct dpatch_patch dpatch_patch_t;
+
+/**
+ * A single patch operation, equivalent to one line of a
+ * patch script.
+ */
+struct dpatch_entry
+{
+    /** Operation to perform, such as "fn_replace_internal". */
+    const char* operation;
+
+    /** Symbol to be replaced. */
+    const char* old_symbol;
+
+    /**
+     * Symbol to replace `old_symbol` with. For
+     * "fn_replace_best", a comma separated list of
+     * candidates, best first.
+     */
+    const char* new_symbol;
+
+    /** Library containing `new_symbol`, or `NULL` for the program. */
+    const char* library;
+};
+
+/**
+ * The outcome of the most recent `dpatch_patch_apply`.
+ */
+struct dpatch_result
+{
+    /** The status `dpatch_patch_apply` returned. */
+    dpatch_status status;
+
+    /** Identifier tagging the patch's events in dpatch's log. */
+    uint64_t patch_id;
+
+    /** The number of redirects the patch requested. */
+    size_t redirects;
+
+    /** The number of function entries written. */
+    size_t writes;
+
+    /** Time spent preparing the patch, in microseconds. */
+    double prepare_us;
+
+    /** Time spent committing the patch, in microseconds. */
+    double commit_us;
+};
+
+/**
+ * Allocate and initialise a new, empty patch.
+ *
+ * @param patch Location to store the new patch handle.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+DPATCH_API dpatch_status dpatch_patch_new(dpatch_patch_t** patch);
+
+/**
+ * Deallocate a patch.
+ *
+ * Deallocating a patch does not revert it.
+ *
+ * @param patch Handle to the patch to free.
+ */
+DPATCH_API void dpatch_patch_free(dpatch_patch_t* patch);
+
+/**
+ * Add an operation to a patch.
+ *
+ * @param patch Handle to the patch to add to.
+ * @param entry The operation to add. Its strings are copied.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the operation is not known, or an error on failure.
+ */
+DPATCH_API dpatch_status dpatch_patch_add(dpatch_patch_t* patch, const struct dpatch_entry* entry);
+
+/**
+ * Add an operation to a patch, written as a line of a
+ * patch script.
+ *
+ * @param patch Handle to the patch to add to.
+ * @param line The operation, such as "fn_replace_internal
+ *      alpha bravo:libbravo.so".
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if the
+ * line is malformed, or an error on failure.
+ */
+DPATCH_API dpatch_status dpatch_patch_add_line(dpatch_patch_t* patch, const char* line);
+
+/**
+ * Apply a patch to the calling process.
+ *
+ * The patch is prepared, loading libraries and resolving
+ * symbols, then committed. If the commit can not finish
+ * within `budget_us` microseconds, the process is left
+ * unpatched and `DPATCH_STATUS_ETIMEDOUT` is returned.
+ *
+ * While threads are registered with
+ * `dpatch_safepoint_register`, the prepared patch is
+ * committed by the registered threads at their next safe
+ * points, and `dpatch_patch_apply` waits for them. If they
+ * don't all reach one within `DPATCH_SAFEPOINT_TIMEOUT_MS`,
+ * the process is left unpatched and
+ * `DPATCH_STATUS_ETIMEDOUT` is returned. A registered
+ * thread which applies a patch commits it immediately.
+ *
+ * The first call starts dpatch's event log, which drains
+ * on a background thread.
+ *
+ * @param patch Handle to the patch to apply.
+ * @param budget_us Time allowed for the commit, or 0 for
+ *      no limit.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+DPATCH_API dpatch_status dpatch_patch_apply(dpatch_patch_t* patch, uint64_t budget_us);
+
+/**
+ * Get the outcome of the most recent attempt to apply a
+ * patch.
+ *
+ * @param patch Handle to the patch to query.
+ * @param result Location to store the outcome.
+ */
+DPATCH_API void dpatch_patch_result(dpatch_patch_t* patch, struct dpatch_result* result);
+
+/**
+ * Get the number of events dpatch's event log has dropped.
+ *
+ * Posting an event never blocks patching, so events posted
+ * while the log's ring buffer is full are dropped and
+ * counted rather than written.
+ *
+ * @return The number of events dropped since dpatch was
+ * loaded.
+ */
+DPATCH_API uint64_t dpatch_events_dropped(void);
+
+/**
+ * Register the calling thread as an event loop thread.
+ *
+ * Once any thread is registered, patches are committed only
+ * after every registered thread has called
+ * `dpatch_safepoint`, by the thread whose call completes
+ * the set. Threads are never interrupted or signalled, and
+ * those which checked in first wait in `dpatch_safepoint`
+ * until the commit is done.
+ *
+ * The returned descriptor is readable while a patch waits
+ * for the thread, so it can be polled with the loop's other
+ * descriptors. Registering a thread twice returns the same
+ * descriptor. A thread which exits is unregistered.
+ *
+ * @param fd Location to store the thread's descriptor. It
+ *      is owned by dpatch, and must not be read or closed.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+DPATCH_API dpatch_status dpatch_safepoint_register(int* fd);
+
+/**
+ * Unregister the calling thread, closing its descriptor.
+ *
+ * A thread leaving its loop is at a safe point, so a patch
+ * which was waiting only for it is committed.
+ */
+DPATCH_API void dpatch_safepoint_unregister(void);
+
+/**
+ * Mark a safe point in the calling thread, such as the
+ * idle point between iterations of an event loop.
+ *
+ * If a patch is pending, the calling thread waits until
+ * every registered thread has reached a safe point and the
+ * patch is committed, or until `DPATCH_SAFEPOINT_TIMEOUT_MS`
+ * passes and it is withdrawn. The calling thread must not
+ * hold anything another registered thread needs to reach
+ * its safe point. When no patch is pending,
+ * `dpatch_safepoint` only loads one variable, so it can be
+ * called every iteration.
+ *
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ETIMEDOUT` if
+ * the patch was withdrawn, or the status of the commit.
+ */
+DPATCH_API dpatch_status dpatch_safepoint(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
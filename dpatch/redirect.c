@@ -0,0 +1,1434 @@
+/**
+ * @file dpatch/redirect.c
+ *
+ * `redirect.c` defines functions for redirecting function
+ * entries, and keeps a table of every entry dpatch has
+ * redirected and where it currently jumps to.
+ *
+ * The table maintains the invariant that no entry jumps to
+ * another redirected entry. Chains such as `alpha` ->
+ * `bravo` -> `charlie` are collapsed as they form, so
+ * `alpha` jumps straight to `charlie`.
+ *
+ * Functions compiled with `-fpatchable-function-entry=16,14`
+ * are redirected without overwriting any instruction a
+ * thread might be executing. A pointer to the target and an
+ * indirect jump through it are staged in the 14 bytes of
+ * padding before the function, then the 2-byte NOP at its
+ * entry is replaced with a short jump to them, in a single
+ * atomic store. Redirecting the function again atomically
+ * replaces the pointer.
+ *
+ * In dispatch table mode, entries jump to a thunk which
+ * jumps through the entry's slot in a dispatch table, and
+ * redirecting them again publishes a new table instead of
+ * writing to program text. Every entry a batch retargets
+ * switches at the same instant.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "code_generator.h"
+#include "dispatch_table.h"
+#include "event_log.h"
+#include "machine_code.h"
+#include "perf_map.h"
+#include "redirect.h"
+#include "status.h"
+#include "symbol_index.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REDIRECT_DEFAULT_LENGTH 8
+#define REDIRECT_MAX_ORIGINAL_LEN 16
+
+/* Assumed cost of a write before any have been timed. */
+#define REDIRECT_DEFAULT_WRITE_NS 20000
+
+/* Padding reserved by `-fpatchable-function-entry=16,14`. */
+#define PATCHABLE_PRE_ENTRY_LEN 14
+#define PATCHABLE_ENTRY_LEN 2
+#define PATCHABLE_POINTER_LEN 8
+#define X64_NOP 0x90
+#define CACHE_LINE_LEN 64
+#define PERF_MAP_NAME_LEN 512
+#define NEAR_JUMP_LEN 5
+
+/** `endbr64`, which precedes the entry padding under CET. */
+static const uint8_t X64_ENDBR64[] = {0xf3, 0x0f, 0x1e, 0xfa};
+
+/**
+ * How a write redirects a function entry.
+ */
+enum redirect_write_kind
+{
+    /** Overwrite the entry with a near jump, or a long jump if the target is out of reach. */
+    REDIRECT_WRITE_LONG_JUMP,
+
+    /** Stage a jump in the entry padding, then enable it. */
+    REDIRECT_WRITE_PADDED,
+
+    /** Replace the pointer staged in the entry padding. */
+    REDIRECT_WRITE_RETARGET,
+
+    /** Replace the entry's slot in the dispatch table. */
+    REDIRECT_WRITE_SLOT,
+};
+
+/**
+ * A single redirected function entry.
+ */
+struct redirect
+{
+    /** The redirected entry point. */
+    intptr_t from;
+
+    /** The function calls to `from` currently run. */
+    intptr_t function;
+
+    /**
+     * Where calls to `from` currently jump to: `function`, or
+     * code standing in for it, such as a copy in hot text or
+     * a guard's stub.
+     */
+    intptr_t target;
+
+    /** Whether `from` is redirected through its entry padding. */
+    bool padded;
+
+    /** Whether `from` is redirected through the dispatch table. */
+    bool dispatched;
+
+    /** The entry's dispatch table slot, if `dispatched`. */
+    size_t slot;
+};
+
+/**
+ * The table of every redirected entry.
+ */
+struct redirect_table
+{
+    /** The number of `redirects` allocated in memory. */
+    size_t allocated_length;
+
+    /** The number of redirects in the table. */
+    size_t length;
+
+    /** Array of redirected entries. */
+    struct redirect* redirects;
+
+    /** The number of dispatch table slots in use. */
+    size_t slots;
+
+    /** Incremented each time a batch is committed. */
+    uint64_t generation;
+};
+
+/**
+ * A redirect requested by a batch.
+ */
+struct redirect_request
+{
+    /** The entry point to redirect. */
+    intptr_t from;
+
+    /** The requested target. */
+    intptr_t to;
+
+    /** The code calls jump to, standing in for `to`. */
+    intptr_t through;
+
+    /** Description of the redirect, for logging. */
+    char* label;
+
+    /** Longest chain through `from` without collapsing. */
+    size_t depth_before;
+
+    /** Whether `from` was redirected through its entry padding. */
+    bool padded;
+
+    /** Whether `from` was redirected through the dispatch table. */
+    bool dispatched;
+};
+
+/**
+ * Code created for a batch, released if it isn't committed.
+ */
+struct redirect_staged
+{
+    /** Address of the code. */
+    intptr_t address;
+
+    /** Function to release the code. */
+    redirect_release release;
+};
+
+/**
+ * A write planned by a batch.
+ */
+struct redirect_write
+{
+    /** The entry point to redirect. */
+    intptr_t from;
+
+    /** The function calls to the entry will run. */
+    intptr_t function;
+
+    /** Where the entry will jump to. */
+    intptr_t target;
+
+    /** Whether `from` has not been redirected before. */
+    bool created;
+
+    /** How the entry is redirected. */
+    enum redirect_write_kind kind;
+
+    /** Whether `from` jumps through the dispatch table. */
+    bool dispatched;
+
+    /** The entry's dispatch table slot, if `dispatched`. */
+    size_t slot;
+
+    /** Where `code` is written. */
+    intptr_t code_address;
+
+    /** The encoded jump, or staged jump and pointer. */
+    machine_code_t* code;
+
+    /** The bytes at `code_address` before the write. */
+    uint8_t previous[REDIRECT_MAX_ORIGINAL_LEN];
+
+    /** Where `enable` is written, for padded writes. */
+    intptr_t enable_address;
+
+    /** Short jump enabling a staged jump, or `NULL`. */
+    machine_code_t* enable;
+
+    /** The bytes at `enable_address` before the write. */
+    uint8_t previous_enable[PATCHABLE_ENTRY_LEN];
+};
+
+/**
+ * A set of redirects to be committed together.
+ */
+struct redirect_batch
+{
+    /** The number of `requests` allocated in memory. */
+    size_t requests_allocated;
+
+    /** The number of redirects requested. */
+    size_t requests_length;
+
+    /** Redirects requested, in order. */
+    struct redirect_request* requests;
+
+    /** The number of `writes` allocated in memory. */
+    size_t writes_allocated;
+
+    /** The number of writes planned. */
+    size_t writes_length;
+
+    /** Writes planned when the batch was prepared. */
+    struct redirect_write* writes;
+
+    /** The table generation the writes were planned for. */
+    uint64_t generation;
+
+    /** Whether `writes` has been planned. */
+    bool prepared;
+
+    /** The number of dispatch table slots in use after the batch. */
+    size_t slots;
+
+    /** Patch the batch belongs to, or 0. */
+    uint64_t patch_id;
+
+    /** The number of `staged` allocated in memory. */
+    size_t staged_allocated;
+
+    /** The number of pieces of code staged. */
+    size_t staged_length;
+
+    /** Code created for the batch's redirects, in order. */
+    struct redirect_staged* staged;
+
+    /** Whether the batch has been committed. */
+    bool committed;
+};
+
+/** Redirects applied to the process. */
+static struct redirect_table table = {0, 0, NULL, 0, 0};
+
+/** Serialises access to `table`. */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Running estimate of the cost of a single write. */
+static uint64_t write_cost_ns = REDIRECT_DEFAULT_WRITE_NS;
+
+/**
+ * Grow a dynamically allocated array.
+ *
+ * @param array Address of the array to grow.
+ * @param allocated Address of the array's allocated
+ *      length, in elements.
+ * @param element_size Size of an element, in bytes.
+ * @return `DPATCH_STATUS_OK` on success, or an error.
+ */
+static dpatch_status grow_array
+(
+    void** array,
+    size_t* allocated,
+    size_t element_size
+)
+{
+    void* realloc_result = NULL;
+    size_t new_length = *allocated == 0
+        ? REDIRECT_DEFAULT_LENGTH
+        : *allocated * 2;
+    realloc_result = realloc(*array, element_size * new_length);
+    if (realloc_result == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    *array = realloc_result;
+    *allocated = new_length;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Get the current monotonic time in nanoseconds.
+ *
+ * @return Nanoseconds since an arbitrary epoch.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Find the redirect for an entry point.
+ *
+ * @param redirects Array of redirects to search.
+ * @param length Length of `redirects`.
+ * @param from The entry point to search for.
+ * @return The entry's redirect, or `NULL` if it is not
+ * redirected.
+ */
+static struct redirect* redirect_find
+(
+    struct redirect* redirects,
+    size_t length,
+    intptr_t from
+)
+{
+    size_t i = 0;
+    for (i = 0; i < length; i++)
+    {
+        if (redirects[i].from == from)
+        {
+            return &redirects[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the address calls to `address` currently arrive at.
+ *
+ * @param address Entry point to resolve.
+ * @return The current target of `address`, or `address`
+ * itself if it is not redirected.
+ */
+intptr_t redirect_resolve(intptr_t address)
+{
+    struct redirect* redirect = NULL;
+    intptr_t target = address;
+    pthread_mutex_lock(&table_lock);
+    redirect = redirect_find(table.redirects, table.length, address);
+    if (redirect != NULL)
+    {
+        target = redirect->target;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return target;
+}
+
+/**
+ * Test if calls to any entry point are redirected to an
+ * address.
+ *
+ * @param address Address to test.
+ * @return `true` if `address` is the target of a redirect,
+ * or the function a redirect's target stands in for.
+ */
+bool redirect_is_target(intptr_t address)
+{
+    bool found = false;
+    size_t i = 0;
+    pthread_mutex_lock(&table_lock);
+    for (i = 0; i < table.length && !found; i++)
+    {
+        found = table.redirects[i].target == address || table.redirects[i].function == address;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return found;
+}
+
+/**
+ * Allocate and initialise a new, empty redirect batch.
+ *
+ * @param new Location to store the new batch handle.
+ * @param patch_id Patch the batch belongs to, or 0.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_new(redirect_batch_t** new, uint64_t patch_id)
+{
+    assert(new != NULL);
+    *new = calloc(1, sizeof(struct redirect_batch));
+    if (*new == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    (*new)->patch_id = patch_id;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Discard the writes planned by a batch.
+ *
+ * @param batch Handle to the batch to reset.
+ */
+static void redirect_batch_clear_writes(redirect_batch_t* batch)
+{
+    size_t i = 0;
+    for (i = 0; i < batch->writes_length; i++)
+    {
+        machine_code_free(batch->writes[i].code);
+        if (batch->writes[i].enable != NULL)
+        {
+            machine_code_free(batch->writes[i].enable);
+        }
+    }
+    batch->writes_length = 0;
+    batch->prepared = false;
+}
+
+/**
+ * Deallocate a redirect batch.
+ *
+ * If the batch was never committed, the code staged for it
+ * with `redirect_batch_stage` is released, as nothing can
+ * jump to it.
+ *
+ * @param batch Handle to the batch to free.
+ */
+void redirect_batch_free(redirect_batch_t* batch)
+{
+    size_t i = 0;
+    assert(batch != NULL);
+    redirect_batch_clear_writes(batch);
+    for (i = 0; i < batch->requests_length; i++)
+    {
+        free(batch->requests[i].label);
+    }
+    /* A commit which missed its deadline or was withdrawn was rolled back, so it left no jumps in. */
+    for (i = batch->staged_length; i > 0 && !batch->committed; i--)
+    {
+        batch->staged[i - 1].release(batch->staged[i - 1].address);
+    }
+    free(batch->staged);
+    free(batch->requests);
+    free(batch->writes);
+    free(batch);
+}
+
+/**
+ * Record code created for a batch's redirects, to be
+ * released if the batch is freed without being committed.
+ *
+ * Code is released in the reverse of the order it was
+ * staged.
+ *
+ * @param batch Handle to the batch the code was created for.
+ * @param address Address of the code.
+ * @param release Function to release the code.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_stage
+(
+    redirect_batch_t* batch,
+    intptr_t address,
+    redirect_release release
+)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(batch != NULL);
+    assert(release != NULL);
+    if (batch->staged_length == batch->staged_allocated)
+    {
+        PROPAGATE_ERROR(
+            grow_array(
+                (void**) &batch->staged,
+                &batch->staged_allocated,
+                sizeof(struct redirect_staged)
+            ),
+            status
+        );
+    }
+    batch->staged[batch->staged_length].address = address;
+    batch->staged[batch->staged_length].release = release;
+    batch->staged_length++;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Add a redirect of calls arriving at `from` to `to`.
+ *
+ * Redirects take effect in the order they are added.
+ *
+ * @param batch Handle to the batch to add to.
+ * @param from Entry point to redirect.
+ * @param to Address to redirect calls to.
+ * @param label Description of the redirect, for logging.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_add
+(
+    redirect_batch_t* batch,
+    intptr_t from,
+    intptr_t to,
+    const char* label
+)
+{
+    return redirect_batch_add_through(batch, from, to, to, label);
+}
+
+/**
+ * Add a redirect of calls arriving at `from` to `to`,
+ * which jumps to code standing in for `to`.
+ *
+ * The table records `to` as the function `from` runs, so a
+ * later redirect of `to` moves `from` on too, and a
+ * redirect back to `from` is found to be a cycle.
+ *
+ * @param batch Handle to the batch to add to.
+ * @param from Entry point to redirect.
+ * @param to The function calls to `from` should run.
+ * @param through Address to jump to, such as a copy of `to`
+ *      in hot text, or a guard's stub.
+ * @param label Description of the redirect, for logging.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_add_through
+(
+    redirect_batch_t* batch,
+    intptr_t from,
+    intptr_t to,
+    intptr_t through,
+    const char* label
+)
+{
+    struct redirect_request* request = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(batch != NULL);
+    assert(label != NULL);
+    if (batch->requests_length == batch->requests_allocated)
+    {
+        PROPAGATE_ERROR(
+            grow_array(
+                (void**) &batch->requests,
+                &batch->requests_allocated,
+                sizeof(struct redirect_request)
+            ),
+            status
+        );
+    }
+    request = &batch->requests[batch->requests_length];
+    request->label = malloc(strlen(label) + 1);
+    if (request->label == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    strcpy(request->label, label);
+    request->from = from;
+    request->to = to;
+    request->through = through;
+    request->depth_before = 0;
+    request->padded = false;
+    request->dispatched = false;
+    batch->requests_length++;
+    redirect_batch_clear_writes(batch);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Find the padding `-fpatchable-function-entry=16,14`
+ * reserves around a function entry.
+ *
+ * The compiler places 14 NOPs before the function, and a
+ * 2-byte NOP at its entry, after any `endbr64`.
+ *
+ * @param from The function's entry point.
+ * @return The address of the entry NOP, or 0 if `from` has
+ * no usable padding.
+ */
+static intptr_t patchable_entry(intptr_t from)
+{
+    uintptr_t page_mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+    intptr_t padding = from - PATCHABLE_PRE_ENTRY_LEN;
+    intptr_t entry = from;
+    size_t i = 0;
+    /* Don't read before the start of the function's page, which may be unmapped. */
+    if (((uintptr_t) padding & page_mask) != ((uintptr_t) from & page_mask))
+    {
+        return 0;
+    }
+    /* Retargeting stores the pointer atomically, so it must be aligned. */
+    if (padding % PATCHABLE_POINTER_LEN != 0)
+    {
+        return 0;
+    }
+    for (i = 0; i < PATCHABLE_PRE_ENTRY_LEN; i++)
+    {
+        if (((uint8_t*) padding)[i] != X64_NOP)
+        {
+            return 0;
+        }
+    }
+    if (memcmp((void*) from, X64_ENDBR64, sizeof X64_ENDBR64) == 0)
+    {
+        entry += sizeof X64_ENDBR64;
+    }
+    if (((uint8_t*) entry)[0] != X64_NOP || ((uint8_t*) entry)[1] != X64_NOP)
+    {
+        return 0;
+    }
+    if (entry % CACHE_LINE_LEN == CACHE_LINE_LEN - 1)
+    {
+        return 0;
+    }
+    return entry;
+}
+
+/**
+ * Encode the code for a planned write.
+ *
+ * Entries with patchable padding get a pointer to the
+ * target and an indirect jump through it staged in the
+ * padding, and a short jump back to them to enable the
+ * redirect. Entries already redirected through their
+ * padding only get a new pointer. Other entries are
+ * overwritten with a near jump if the target is within 2 GB,
+ * or a long jump.
+ *
+ * In dispatch table mode, new entries are given a slot,
+ * and jump to the slot's thunk rather than the target.
+ * Entries already routed through the table only need
+ * their slot changed, which needs no code.
+ *
+ * @param write The write to encode.
+ * @param existing The entry's current redirect, or `NULL`
+ *      if it is not yet redirected.
+ * @param slots The number of dispatch table slots in use,
+ *      which is incremented if a slot is taken.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status redirect_write_encode
+(
+    struct redirect_write* write,
+    const struct redirect* existing,
+    size_t* slots
+)
+{
+    intptr_t destination = write->target;
+    intptr_t entry = 0;
+    intptr_t near = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    write->dispatched = false;
+    if (existing != NULL && existing->dispatched)
+    {
+        write->kind = REDIRECT_WRITE_SLOT;
+        write->dispatched = true;
+        write->slot = existing->slot;
+        write->code_address = write->from;
+        return DPATCH_STATUS_OK;
+    }
+    if (existing != NULL && existing->padded)
+    {
+        write->kind = REDIRECT_WRITE_RETARGET;
+        write->code_address = write->from - PATCHABLE_PRE_ENTRY_LEN;
+        return append_address(write->code, write->target);
+    }
+    if (existing == NULL && dispatch_table_enabled())
+    {
+        write->dispatched = true;
+        write->slot = (*slots)++;
+        PROPAGATE_ERROR(dispatch_table_thunk(write->slot, &destination), status);
+    }
+    entry = existing == NULL ? patchable_entry(write->from) : 0;
+    if (entry == 0)
+    {
+        write->kind = REDIRECT_WRITE_LONG_JUMP;
+        write->code_address = write->from;
+        /* A 5-byte near jump overwrites less of the entry, when the target is in reach. */
+        near = destination - (write->from + NEAR_JUMP_LEN);
+        if (near >= INT32_MIN && near <= INT32_MAX)
+        {
+            return append_near_jump(write->code, (int32_t) near);
+        }
+        return append_long_jump(write->code, destination);
+    }
+    write->kind = REDIRECT_WRITE_PADDED;
+    write->code_address = write->from - PATCHABLE_PRE_ENTRY_LEN;
+    write->enable_address = entry;
+    PROPAGATE_ERROR(append_address(write->code, destination), status);
+    PROPAGATE_ERROR(append_indirect_jump(write->code, -PATCHABLE_PRE_ENTRY_LEN), status);
+    PROPAGATE_ERROR(machine_code_new(&write->enable), status);
+    return append_short_jump(
+        write->enable,
+        (int8_t) ((write->from - PATCHABLE_PRE_ENTRY_LEN + PATCHABLE_POINTER_LEN) - (entry + PATCHABLE_ENTRY_LEN))
+    );
+}
+
+/**
+ * Plan a batch's writes against the current table.
+ *
+ * The batch's requests are applied in order to a scratch
+ * copy of the table. Every scratch entry which ends up
+ * with a new target becomes a write.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param batch Handle to the batch to plan.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status redirect_batch_plan(redirect_batch_t* batch)
+{
+    struct redirect* scratch = NULL;
+    struct redirect* entry = NULL;
+    size_t scratch_length = table.length;
+    size_t scratch_allocated = table.length + batch->requests_length;
+    size_t slots = table.slots;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    size_t j = 0;
+    redirect_batch_clear_writes(batch);
+    if (scratch_allocated == 0)
+    {
+        batch->slots = slots;
+        batch->prepared = true;
+        batch->generation = table.generation;
+        return DPATCH_STATUS_OK;
+    }
+    scratch = malloc(sizeof(struct redirect) * scratch_allocated);
+    if (scratch == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    memcpy(scratch, table.redirects, sizeof(struct redirect) * table.length);
+    for (i = 0; i < batch->requests_length; i++)
+    {
+        struct redirect_request* request = &batch->requests[i];
+        intptr_t function = request->to;
+        intptr_t target = request->through;
+        bool has_upstream = false;
+        entry = redirect_find(scratch, scratch_length, request->to);
+        if (entry != NULL)
+        {
+            function = entry->function;
+            target = entry->target;
+        }
+        if (function == request->from)
+        {
+            free(scratch);
+            return DPATCH_STATUS_ECYCLE;
+        }
+        /* Entries running `from` through a copy or stub of it are moved on too. */
+        for (j = 0; j < scratch_length; j++)
+        {
+            if (scratch[j].function == request->from)
+            {
+                has_upstream = true;
+                scratch[j].function = function;
+                scratch[j].target = target;
+            }
+        }
+        /*
+         * Without collapsing, a call into the upstream-most
+         * entry would jump to `from`, then `to`, then to
+         * wherever `to` was redirected.
+         */
+        request->depth_before = (has_upstream ? 1 : 0) + 1 + (function != request->to ? 1 : 0);
+        entry = redirect_find(scratch, scratch_length, request->from);
+        if (entry == NULL)
+        {
+            entry = &scratch[scratch_length++];
+            entry->from = request->from;
+        }
+        entry->function = function;
+        entry->target = target;
+    }
+    for (i = 0; i < scratch_length && !IS_ERROR(status); i++)
+    {
+        struct redirect_write* write = NULL;
+        bool created = i >= table.length;
+        if (
+            !created
+            && scratch[i].target == table.redirects[i].target
+            && scratch[i].function == table.redirects[i].function
+        )
+        {
+            continue;
+        }
+        if (batch->writes_length == batch->writes_allocated)
+        {
+            status = grow_array(
+                (void**) &batch->writes,
+                &batch->writes_allocated,
+                sizeof(struct redirect_write)
+            );
+            if (IS_ERROR(status))
+            {
+                break;
+            }
+        }
+        write = &batch->writes[batch->writes_length];
+        write->from = scratch[i].from;
+        write->function = scratch[i].function;
+        write->target = scratch[i].target;
+        write->created = created;
+        write->enable = NULL;
+        status = machine_code_new(&write->code);
+        if (IS_ERROR(status))
+        {
+            break;
+        }
+        batch->writes_length++;
+        status = redirect_write_encode(write, created ? NULL : &table.redirects[i], &slots);
+        assert(machine_code_length(write->code) <= REDIRECT_MAX_ORIGINAL_LEN);
+    }
+    free(scratch);
+    if (IS_ERROR(status))
+    {
+        redirect_batch_clear_writes(batch);
+        return status;
+    }
+    batch->slots = slots;
+    batch->generation = table.generation;
+    batch->prepared = true;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Plan and encode every write needed to commit a batch.
+ *
+ * If a redirect's target is itself redirected, it is sent
+ * straight to the newest version of the target. Entries
+ * already redirected to a newly redirected function are
+ * rewritten to jump straight to the same place, so a call
+ * never takes more than one hop.
+ *
+ * @param batch Handle to the batch to prepare.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_prepare(redirect_batch_t* batch)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    assert(batch != NULL);
+    pthread_mutex_lock(&table_lock);
+    status = redirect_batch_plan(batch);
+    pthread_mutex_unlock(&table_lock);
+    return status;
+}
+
+/**
+ * Get the number of writes a prepared batch will perform.
+ *
+ * @param batch Handle to the batch to query.
+ * @return The number of function entries to be written.
+ */
+size_t redirect_batch_writes(redirect_batch_t* batch)
+{
+    assert(batch != NULL);
+    return batch->writes_length;
+}
+
+/**
+ * Get the number of redirects added to a batch.
+ *
+ * @param batch Handle to the batch to query.
+ * @return The number of redirects requested.
+ */
+size_t redirect_batch_length(redirect_batch_t* batch)
+{
+    assert(batch != NULL);
+    return batch->requests_length;
+}
+
+/**
+ * Get the patch a batch belongs to.
+ *
+ * @param batch Handle to the batch to query.
+ * @return The patch's identifier, or 0.
+ */
+uint64_t redirect_batch_patch_id(redirect_batch_t* batch)
+{
+    assert(batch != NULL);
+    return batch->patch_id;
+}
+
+/**
+ * Get a redirect added to a batch.
+ *
+ * @param batch Handle to the batch to query.
+ * @param index Index of the redirect, in the order added.
+ * @param from Location to store the redirected entry point.
+ * @param to Location to store the redirect's destination.
+ * @param label Location to store the redirect's label.
+ */
+void redirect_batch_request
+(
+    redirect_batch_t* batch,
+    size_t index,
+    intptr_t* from,
+    intptr_t* to,
+    const char** label
+)
+{
+    assert(batch != NULL);
+    assert(index < batch->requests_length);
+    *from = batch->requests[index].from;
+    *to = batch->requests[index].to;
+    *label = batch->requests[index].label;
+}
+
+/**
+ * Test if a number of writes would overrun a deadline.
+ *
+ * @param deadline The deadline, or `NULL` for none.
+ * @param writes The number of writes to be performed.
+ * @return `true` if the writes are expected to finish
+ * after the deadline.
+ */
+static bool redirect_would_miss
+(
+    const struct timespec* deadline,
+    size_t writes
+)
+{
+    uint64_t deadline_ns = 0;
+    if (deadline == NULL)
+    {
+        return false;
+    }
+    deadline_ns = (uint64_t) deadline->tv_sec * 1000000000ull + (uint64_t) deadline->tv_nsec;
+    return now_ns() + writes * write_cost_ns > deadline_ns;
+}
+
+/**
+ * Write bytes into a program segment.
+ *
+ * @param address Address to write to.
+ * @param bytes The bytes to write.
+ * @param length The number of bytes to write.
+ * @param atomic Whether to write with a single store.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status redirect_restore
+(
+    intptr_t address,
+    uint8_t* bytes,
+    size_t length,
+    bool atomic
+)
+{
+    machine_code_t* machine_code = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_new(&machine_code), status);
+    status = machine_code_append_array(machine_code, length, bytes);
+    if (!IS_ERROR(status))
+    {
+        status = atomic
+            ? machine_code_insert_atomic(machine_code, address)
+            : machine_code_insert(machine_code, address);
+    }
+    machine_code_free(machine_code);
+    return status;
+}
+
+/**
+ * Undo a performed write.
+ *
+ * @param write The write to undo.
+ */
+static void redirect_write_undo(struct redirect_write* write)
+{
+    if (write->kind == REDIRECT_WRITE_SLOT)
+    {
+        return;
+    }
+    if (write->enable != NULL)
+    {
+        LOG_ON_ERROR(redirect_restore(
+            write->enable_address,
+            write->previous_enable,
+            PATCHABLE_ENTRY_LEN,
+            true
+        ));
+    }
+    LOG_ON_ERROR(redirect_restore(
+        write->code_address,
+        write->previous,
+        machine_code_length(write->code),
+        write->kind == REDIRECT_WRITE_RETARGET
+    ));
+}
+
+/**
+ * Perform a planned write.
+ *
+ * Padded writes stage their jump before atomically
+ * enabling it, and retargets atomically replace the staged
+ * pointer, so no thread can execute a partial write.
+ *
+ * @param write The write to perform.
+ * @return `DPATCH_STATUS_OK`, or an error on failure, in
+ * which case nothing has been written.
+ */
+static dpatch_status redirect_write_apply(struct redirect_write* write)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (write->kind == REDIRECT_WRITE_SLOT)
+    {
+        /* The slot was changed when the batch's table was published. */
+        return DPATCH_STATUS_OK;
+    }
+    memcpy(write->previous, (void*) write->code_address, machine_code_length(write->code));
+    if (write->kind == REDIRECT_WRITE_RETARGET)
+    {
+        return machine_code_insert_atomic(write->code, write->code_address);
+    }
+    PROPAGATE_ERROR(machine_code_insert(write->code, write->code_address), status);
+    if (write->enable == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    memcpy(write->previous_enable, (void*) write->enable_address, PATCHABLE_ENTRY_LEN);
+    status = machine_code_insert_atomic(write->enable, write->enable_address);
+    if (IS_ERROR(status))
+    {
+        LOG_ON_ERROR(redirect_restore(
+            write->code_address,
+            write->previous,
+            machine_code_length(write->code),
+            false
+        ));
+    }
+    return status;
+}
+
+/**
+ * Undo a batch's first `count` writes, most recent first.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param batch Handle to the batch to roll back.
+ * @param count Number of writes which were performed.
+ */
+static void redirect_batch_rollback(redirect_batch_t* batch, size_t count)
+{
+    while (count > 0)
+    {
+        redirect_write_undo(&batch->writes[--count]);
+    }
+}
+
+/**
+ * Describe an address by the function containing it.
+ *
+ * @param address The address to describe.
+ * @param buffer Location to store the description.
+ * @param length Size of `buffer` in bytes.
+ */
+static void describe_address(intptr_t address, char* buffer, size_t length)
+{
+    struct symbol_info info;
+    if (IS_ERROR(symbol_index_lookup((uintptr_t) address, &info)))
+    {
+        snprintf(buffer, length, "0x%lx", (unsigned long) address);
+    }
+    else if (info.start == (uintptr_t) address)
+    {
+        snprintf(buffer, length, "%s", info.name);
+    }
+    else
+    {
+        snprintf(buffer, length, "%s+0x%lx", info.name, (unsigned long) (address - (intptr_t) info.start));
+    }
+}
+
+/**
+ * Describe the code a committed write created to
+ * profilers.
+ *
+ * Jumps over an entry and stubs staged in its padding are
+ * named after the redirect. A dispatch table thunk is
+ * named after the entry it serves, since its target
+ * changes without the thunk being rewritten.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param write The committed write.
+ */
+static void redirect_write_describe(const struct redirect_write* write)
+{
+    char from[PERF_MAP_NAME_LEN / 4];
+    char target[PERF_MAP_NAME_LEN / 4];
+    char name[PERF_MAP_NAME_LEN];
+    intptr_t thunk = 0;
+    describe_address(write->from, from, sizeof from);
+    if (write->dispatched)
+    {
+        snprintf(target, sizeof target, "dispatch table");
+    }
+    else
+    {
+        describe_address(write->function, target, sizeof target);
+    }
+    switch (write->kind)
+    {
+    case REDIRECT_WRITE_LONG_JUMP:
+        snprintf(name, sizeof name, "dpatch jump %s -> %s", from, target);
+        perf_map_record(write->code_address, machine_code_length(write->code), name);
+        break;
+    case REDIRECT_WRITE_PADDED:
+    case REDIRECT_WRITE_RETARGET:
+        snprintf(name, sizeof name, "dpatch stub %s -> %s", from, target);
+        perf_map_record(write->from - PATCHABLE_PRE_ENTRY_LEN, PATCHABLE_PRE_ENTRY_LEN, name);
+        break;
+    case REDIRECT_WRITE_SLOT:
+        break;
+    }
+    if (write->created && write->dispatched && !IS_ERROR(dispatch_table_thunk(write->slot, &thunk)))
+    {
+        snprintf(name, sizeof name, "dpatch thunk %s", from);
+        perf_map_record(thunk, DISPATCH_TABLE_THUNK_LEN, name);
+    }
+}
+
+/**
+ * Record a committed batch's writes in the table.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param batch Handle to the committed batch.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status redirect_batch_record(redirect_batch_t* batch)
+{
+    struct redirect* redirect = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    for (i = 0; i < batch->writes_length; i++)
+    {
+        struct redirect_write* write = &batch->writes[i];
+        if (!write->created)
+        {
+            redirect = redirect_find(table.redirects, table.length, write->from);
+            assert(redirect != NULL);
+            redirect->function = write->function;
+            redirect->target = write->target;
+            continue;
+        }
+        if (table.length == table.allocated_length)
+        {
+            PROPAGATE_ERROR(
+                grow_array(
+                    (void**) &table.redirects,
+                    &table.allocated_length,
+                    sizeof(struct redirect)
+                ),
+                status
+            );
+        }
+        redirect = &table.redirects[table.length++];
+        redirect->from = write->from;
+        redirect->function = write->function;
+        redirect->target = write->target;
+        redirect->padded = write->kind == REDIRECT_WRITE_PADDED;
+        redirect->dispatched = write->dispatched;
+        redirect->slot = write->slot;
+    }
+    for (i = 0; i < batch->requests_length; i++)
+    {
+        redirect = redirect_find(table.redirects, table.length, batch->requests[i].from);
+        batch->requests[i].padded = redirect != NULL && redirect->padded;
+        batch->requests[i].dispatched = redirect != NULL && redirect->dispatched;
+    }
+    table.slots = batch->slots;
+    table.generation++;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Publish the dispatch table a batch switches to.
+ *
+ * The table holds the target of every entry routed through
+ * it, including entries the batch routes for the first
+ * time, which are switched when their text is written.
+ *
+ * @warning The caller must hold `table_lock`.
+ *
+ * @param batch Handle to the batch to publish.
+ * @param switched Location to store the number of slots
+ *      the batch changes, or 0 if no table was published.
+ * @param previous Location to store the table replaced.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status redirect_batch_publish
+(
+    redirect_batch_t* batch,
+    size_t* switched,
+    intptr_t** previous
+)
+{
+    intptr_t* targets = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    *switched = 0;
+    for (i = 0; i < batch->writes_length; i++)
+    {
+        *switched += batch->writes[i].dispatched ? 1 : 0;
+    }
+    if (*switched == 0)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    targets = calloc(batch->slots, sizeof(intptr_t));
+    if (targets == NULL)
+    {
+        *switched = 0;
+        return DPATCH_STATUS_ENOMEM;
+    }
+    for (i = 0; i < table.length; i++)
+    {
+        if (table.redirects[i].dispatched)
+        {
+            targets[table.redirects[i].slot] = table.redirects[i].target;
+        }
+    }
+    for (i = 0; i < batch->writes_length; i++)
+    {
+        if (batch->writes[i].dispatched)
+        {
+            targets[batch->writes[i].slot] = batch->writes[i].target;
+        }
+    }
+    status = dispatch_table_publish(targets, batch->slots, previous);
+    free(targets);
+    if (IS_ERROR(status))
+    {
+        *switched = 0;
+    }
+    return status;
+}
+
+/**
+ * Perform the writes staged in a prepared batch.
+ *
+ * If the batch can not be committed before `deadline`, it
+ * is not started, or any writes already performed are
+ * rolled back, and `DPATCH_STATUS_ETIMEDOUT` is returned.
+ *
+ * Entries routed through the dispatch table are switched
+ * together, by publishing a new table before any program
+ * text is written.
+ *
+ * @param batch Handle to the batch to commit.
+ * @param deadline `CLOCK_MONOTONIC` time the commit must
+ *      complete by, or `NULL` for no deadline.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status redirect_batch_commit
+(
+    redirect_batch_t* batch,
+    const struct timespec* deadline
+)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    intptr_t* previous_table = NULL;
+    size_t switched = 0;
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    size_t i = 0;
+    assert(batch != NULL);
+    pthread_mutex_lock(&table_lock);
+    /* Another batch may have changed the table since prepare. */
+    if (!batch->prepared || batch->generation != table.generation)
+    {
+        status = redirect_batch_plan(batch);
+    }
+    if (!IS_ERROR(status) && redirect_would_miss(deadline, batch->writes_length))
+    {
+        status = DPATCH_STATUS_ETIMEDOUT;
+    }
+    if (!IS_ERROR(status))
+    {
+        status = redirect_batch_publish(batch, &switched, &previous_table);
+    }
+    for (i = 0; i < batch->writes_length && !IS_ERROR(status); i++)
+    {
+        struct redirect_write* write = &batch->writes[i];
+        if (i > 0 && redirect_would_miss(deadline, 1))
+        {
+            status = DPATCH_STATUS_ETIMEDOUT;
+            break;
+        }
+        start = now_ns();
+        status = redirect_write_apply(write);
+        elapsed = now_ns() - start;
+        write_cost_ns = (write_cost_ns * 7 + elapsed) / 8;
+        if (IS_ERROR(status))
+        {
+            break;
+        }
+    }
+    if (IS_ERROR(status))
+    {
+        redirect_batch_rollback(batch, i);
+        if (switched > 0)
+        {
+            dispatch_table_revert(previous_table);
+        }
+    }
+    else
+    {
+        /* The writes are in, so its code is live even if recording them fails. */
+        batch->committed = true;
+        status = redirect_batch_record(batch);
+    }
+    for (i = 0; i < batch->writes_length && !IS_ERROR(status) && perf_map_enabled(); i++)
+    {
+        redirect_write_describe(&batch->writes[i]);
+    }
+    pthread_mutex_unlock(&table_lock);
+    if (IS_ERROR(status))
+    {
+        return status;
+    }
+    if (switched > 0)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            batch->patch_id,
+            "Published a %zu slot dispatch table, switching %zu entries at once.",
+            batch->slots,
+            switched
+        );
+    }
+    for (i = 0; i < batch->requests_length; i++)
+    {
+        event_logf(
+            LOG_INFO,
+            DPATCH_STATUS_OK,
+            batch->patch_id,
+            "Redirected %s%s. Chain depth %zu, collapsed to 1.",
+            batch->requests[i].label,
+            batch->requests[i].dispatched
+                ? " through the dispatch table"
+                : batch->requests[i].padded ? " through its patchable entry" : "",
+            batch->requests[i].depth_before
+        );
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Get an address which runs the code calls to `from`
+ * currently run, and keeps running it once `from` is
+ * redirected elsewhere.
+ *
+ * @param from Entry point to bypass.
+ * @return The current target of `from` if it is redirected,
+ * the instruction after its entry NOP if it has patchable
+ * padding, or 0 if its code can't be reached once `from` is
+ * overwritten.
+ */
+intptr_t redirect_bypass(intptr_t from)
+{
+    intptr_t target = redirect_resolve(from);
+    intptr_t entry = 0;
+    if (target != from)
+    {
+        return target;
+    }
+    entry = patchable_entry(from);
+    return entry == 0 ? 0 : entry + PATCHABLE_ENTRY_LEN;
+}
+
+/**
+ * Redirect calls arriving at `from` to `to` immediately.
+ *
+ * @param from Entry point to redirect.
+ * @param to The function calls to `from` should run.
+ * @param through Address to jump to, standing in for `to`,
+ *      or `to` itself.
+ * @return `DPATCH_STATUS_OK` or an error on failure.
+ */
+dpatch_status redirect_install(intptr_t from, intptr_t to, intptr_t through)
+{
+    redirect_batch_t* batch = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(redirect_batch_new(&batch, 0), status);
+    status = redirect_batch_add_through(batch, from, to, through, "entry");
+    if (!IS_ERROR(status))
+    {
+        status = redirect_batch_commit(batch, NULL);
+    }
+    redirect_batch_free(batch);
+    return status;
+}
+
+/**
+ * Forget the redirects of entry points in an address range
+ * which is being unmapped.
+ *
+ * Nothing is written to the range. Dispatch table slots of
+ * forgotten entries are not reused.
+ *
+ * @param start First address in the range.
+ * @param end Address after the range.
+ * @return The number of redirects forgotten.
+ */
+size_t redirect_forget(intptr_t start, intptr_t end)
+{
+    size_t kept = 0;
+    size_t forgotten = 0;
+    size_t i = 0;
+    pthread_mutex_lock(&table_lock);
+    for (i = 0; i < table.length; i++)
+    {
+        if (table.redirects[i].from >= start && table.redirects[i].from < end)
+        {
+            continue;
+        }
+        table.redirects[kept++] = table.redirects[i];
+    }
+    forgotten = table.length - kept;
+    table.length = kept;
+    if (forgotten > 0)
+    {
+        table.generation++;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return forgotten;
+}
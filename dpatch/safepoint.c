@@ -0,0 +1,526 @@
+/**
+ * @file dpatch/safepoint.c
+ *
+ * `safepoint.c` defines cooperative safe points for event
+ * loop programs.
+ *
+ * Each registered thread owns an `eventfd`, which it polls
+ * with the rest of its loop. Posting a prepared patch marks
+ * every registered thread as outstanding and signals its
+ * descriptor. Each thread checks in when it next calls
+ * `safepoint_reach` between loop iterations, and waits
+ * there. The thread which completes the check ins performs
+ * the commit while the others are held at their safe
+ * points, so no registered thread runs during the writes,
+ * and the program only pays for the wait and the writes.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "event_log.h"
+#include "patch_set.h"
+#include "safepoint.h"
+#include "status.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMEOUT_ENV_VAR "DPATCH_SAFEPOINT_TIMEOUT_MS"
+#define DEFAULT_TIMEOUT_MS 1000
+
+/** The most threads which can be registered at once. */
+#define SAFEPOINT_MAX_THREADS 256
+
+/**
+ * A registered event loop thread.
+ */
+struct safepoint_thread
+{
+    /** Descriptor signalled while the thread must check in. */
+    int fd;
+
+    /** Whether the slot belongs to a thread. */
+    bool registered;
+
+    /** Whether the thread has checked in to the pending patch. */
+    bool checked_in;
+};
+
+/** Serialises registration, check ins and commits. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Broadcast when a pending patch is committed or withdrawn. */
+static pthread_cond_t settled = PTHREAD_COND_INITIALIZER;
+
+/** Ensures `thread_key` is created once. */
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+/** Maps each registered thread to its slot, unregistering it on exit. */
+static pthread_key_t thread_key;
+
+/** Whether `thread_key` was created. */
+static bool thread_key_created = false;
+
+/** Slots for registered threads. */
+static struct safepoint_thread threads[SAFEPOINT_MAX_THREADS];
+
+/** The number of registered threads. */
+static size_t registered = 0;
+
+/** The number of registered threads checked in to the pending patch. */
+static size_t checked_in = 0;
+
+/**
+ * The patch set waiting for safe points, or `NULL`. Read
+ * without the lock by `safepoint_reach`'s fast path.
+ */
+static patch_set_t* pending = NULL;
+
+/** Time allowed for committing the pending patch, or 0. */
+static uint64_t pending_budget_us = 0;
+
+/** `CLOCK_MONOTONIC` time the pending patch was posted, in us. */
+static double posted_us = 0;
+
+/** `CLOCK_REALTIME` time the pending patch is withdrawn, unless `timeout_ms` is 0. */
+static struct timespec posted_deadline;
+
+/** The number of threads registered when the pending patch was posted. */
+static size_t posted_threads = 0;
+
+/** Counts pending patches committed or withdrawn. */
+static uint64_t settlements = 0;
+
+/**
+ * Status of the most recent commit at a safe point, or
+ * `DPATCH_STATUS_ETIMEDOUT` if the most recent pending
+ * patch was withdrawn.
+ */
+static dpatch_status settled_status = DPATCH_STATUS_OK;
+
+/** Time spent on the most recent commit at a safe point, in us. */
+static double settled_commit_us = 0;
+
+/** Time a posted patch waits for safe points, in ms, or 0 for no limit. */
+static unsigned long timeout_ms = DEFAULT_TIMEOUT_MS;
+
+/**
+ * Get the current monotonic time in microseconds.
+ *
+ * @return Microseconds since an arbitrary epoch.
+ */
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Configure safe points from the
+ * `DPATCH_SAFEPOINT_TIMEOUT_MS` environment variable.
+ *
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_ERROR` if
+ * the variable isn't a non-negative integer.
+ */
+dpatch_status safepoint_init_mode(void)
+{
+    char* str = getenv(TIMEOUT_ENV_VAR);
+    char* end = NULL;
+    unsigned long parsed = 0;
+    if (str == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    errno = 0;
+    parsed = strtoul(str, &end, 10);
+    if (str[0] < '0' || str[0] > '9' || *end != '\0' || errno != 0)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    timeout_ms = parsed;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Make a thread's descriptor readable.
+ *
+ * @param thread The thread to signal.
+ */
+static void signal_thread(struct safepoint_thread* thread)
+{
+    uint64_t one = 1;
+    /* Non-blocking; a saturated counter is still readable. */
+    if (write(thread->fd, &one, sizeof one) == -1)
+    {
+        return;
+    }
+}
+
+/**
+ * Drain a thread's descriptor, so it is no longer readable.
+ *
+ * @param thread The thread to clear.
+ */
+static void clear_thread(struct safepoint_thread* thread)
+{
+    uint64_t count = 0;
+    if (read(thread->fd, &count, sizeof count) == -1)
+    {
+        return;
+    }
+}
+
+/**
+ * Commit the pending patch, and wake the thread which
+ * posted it.
+ *
+ * @note The caller must hold `lock`.
+ *
+ * @return The status of the commit.
+ */
+static dpatch_status commit_pending(void)
+{
+    double start = now_us();
+    settled_status = patch_set_commit_within(pending, pending_budget_us);
+    settled_commit_us = now_us() - start;
+    event_logf(
+        LOG_INFO,
+        settled_status,
+        patch_set_id(pending),
+        "Committed at a safe point in %.1f us, after waiting %.1f us for %zu threads.",
+        settled_commit_us,
+        start - posted_us,
+        posted_threads
+    );
+    __atomic_store_n(&pending, NULL, __ATOMIC_RELEASE);
+    settlements++;
+    pthread_cond_broadcast(&settled);
+    return settled_status;
+}
+
+/**
+ * Withdraw the pending patch, leaving the program
+ * unpatched, after the registered threads failed to reach
+ * safe points in time.
+ *
+ * @note The caller must hold `lock`.
+ */
+static void withdraw_pending(void)
+{
+    size_t i = 0;
+    event_logf(
+        LOG_WARNING,
+        DPATCH_STATUS_ETIMEDOUT,
+        patch_set_id(pending),
+        "Withdrew the patch: %zu of %zu threads reached a safe point within %lu ms.",
+        checked_in,
+        registered,
+        timeout_ms
+    );
+    for (i = 0; i < SAFEPOINT_MAX_THREADS; i++)
+    {
+        if (threads[i].registered && !threads[i].checked_in)
+        {
+            clear_thread(&threads[i]);
+        }
+        threads[i].checked_in = false;
+    }
+    checked_in = 0;
+    settled_status = DPATCH_STATUS_ETIMEDOUT;
+    __atomic_store_n(&pending, NULL, __ATOMIC_RELEASE);
+    settlements++;
+    pthread_cond_broadcast(&settled);
+}
+
+/**
+ * Release a thread's slot, committing the pending patch if
+ * it was waiting only for that thread.
+ *
+ * @param thread The slot to release.
+ */
+static void release_thread(struct safepoint_thread* thread)
+{
+    pthread_mutex_lock(&lock);
+    if (thread->checked_in)
+    {
+        checked_in--;
+    }
+    registered--;
+    close(thread->fd);
+    thread->fd = -1;
+    thread->registered = false;
+    thread->checked_in = false;
+    /* A thread leaving its loop is at a safe point. */
+    if (pending != NULL && checked_in == registered)
+    {
+        LOG_ON_ERROR(commit_pending());
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Unregister an exiting thread.
+ *
+ * @param thread The thread's slot.
+ */
+static void thread_exited(void* thread)
+{
+    release_thread(thread);
+}
+
+/**
+ * Create the key which maps threads to their slots.
+ */
+static void create_thread_key(void)
+{
+    thread_key_created = pthread_key_create(&thread_key, &thread_exited) == 0;
+}
+
+/**
+ * Get the calling thread's slot.
+ *
+ * @return The calling thread's slot, or `NULL` if it isn't
+ * registered.
+ */
+static struct safepoint_thread* current_thread(void)
+{
+    pthread_once(&key_once, &create_thread_key);
+    return thread_key_created ? pthread_getspecific(thread_key) : NULL;
+}
+
+/**
+ * Register the calling thread as an event loop thread,
+ * which must reach a safe point before a patch is
+ * committed.
+ *
+ * Registering a thread twice returns the same descriptor.
+ * A thread which exits is unregistered automatically.
+ *
+ * @param fd Location to store a descriptor which is
+ *      readable while a patch waits for the thread to reach
+ *      a safe point.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * descriptor can't be created, or `DPATCH_STATUS_ERROR` if
+ * too many threads are registered.
+ */
+dpatch_status safepoint_register(int* fd)
+{
+    struct safepoint_thread* thread = NULL;
+    size_t i = 0;
+    thread = current_thread();
+    if (thread != NULL)
+    {
+        *fd = thread->fd;
+        return DPATCH_STATUS_OK;
+    }
+    if (!thread_key_created)
+    {
+        return DPATCH_STATUS_ERROR;
+    }
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < SAFEPOINT_MAX_THREADS && threads[i].registered; i++)
+    {
+    }
+    if (i == SAFEPOINT_MAX_THREADS)
+    {
+        pthread_mutex_unlock(&lock);
+        return DPATCH_STATUS_ERROR;
+    }
+    thread = &threads[i];
+    thread->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thread->fd == -1)
+    {
+        pthread_mutex_unlock(&lock);
+        return DPATCH_STATUS_EFILE;
+    }
+    thread->registered = true;
+    thread->checked_in = false;
+    registered++;
+    if (pending != NULL)
+    {
+        signal_thread(thread);
+    }
+    pthread_setspecific(thread_key, thread);
+    pthread_mutex_unlock(&lock);
+    *fd = thread->fd;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Unregister the calling thread, closing its descriptor.
+ *
+ * If a patch was waiting only for the calling thread, it
+ * is committed before `safepoint_unregister` returns.
+ */
+void safepoint_unregister(void)
+{
+    struct safepoint_thread* thread = current_thread();
+    if (thread == NULL)
+    {
+        return;
+    }
+    pthread_setspecific(thread_key, NULL);
+    release_thread(thread);
+}
+
+/**
+ * Mark a safe point in the calling thread.
+ *
+ * If a patch is pending, a registered thread checks in,
+ * then waits until the patch is committed or withdrawn.
+ * The thread which completes the check ins commits the
+ * patch while the others wait, so none of them runs during
+ * the commit. The wait is bounded by
+ * `DPATCH_SAFEPOINT_TIMEOUT_MS`, so the calling thread
+ * must not hold anything another registered thread needs
+ * to reach its safe point. When no patch is pending,
+ * `safepoint_reach` only loads one variable.
+ *
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ETIMEDOUT` if
+ * the patch was withdrawn, or the status of the commit.
+ */
+dpatch_status safepoint_reach(void)
+{
+    struct safepoint_thread* thread = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint64_t settlement = 0;
+    int result = 0;
+    if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    thread = current_thread();
+    pthread_mutex_lock(&lock);
+    if (pending != NULL && thread != NULL && !thread->checked_in)
+    {
+        clear_thread(thread);
+        thread->checked_in = true;
+        checked_in++;
+    }
+    if (pending != NULL && checked_in == registered)
+    {
+        status = commit_pending();
+    }
+    else if (pending != NULL && thread != NULL)
+    {
+        /* Held here, so the thread isn't running the code being patched. */
+        settlement = settlements;
+        while (settlements == settlement && result == 0)
+        {
+            result = timeout_ms == 0
+                ? pthread_cond_wait(&settled, &lock)
+                : pthread_cond_timedwait(&settled, &lock, &posted_deadline);
+        }
+        status = settlements == settlement ? DPATCH_STATUS_ETIMEDOUT : settled_status;
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+/**
+ * Commit a prepared patch set at the registered threads'
+ * next safe points, and wait for it.
+ *
+ * The patch set is committed immediately if no threads are
+ * registered, or if the calling thread is registered, since
+ * it would otherwise wait for itself.
+ *
+ * @param patch_set Handle to the prepared patch set.
+ * @param budget_us Time allowed for the commit, or 0 for
+ *      no limit.
+ * @param commit_us Location to store the time spent
+ *      committing, excluding the wait for safe points.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ETIMEDOUT` if
+ * the threads didn't reach safe points within
+ * `DPATCH_SAFEPOINT_TIMEOUT_MS`, leaving the program
+ * unpatched, or the status of the commit.
+ */
+dpatch_status safepoint_commit
+(
+    patch_set_t* patch_set,
+    uint64_t budget_us,
+    double* commit_us
+)
+{
+    struct timespec deadline;
+    dpatch_status status = DPATCH_STATUS_OK;
+    uint64_t settlement = 0;
+    bool posted = false;
+    double start = now_us();
+    size_t i = 0;
+    int result = 0;
+    bool is_registered = current_thread() != NULL;
+    pthread_mutex_lock(&lock);
+    if (registered == 0 || is_registered)
+    {
+        pthread_mutex_unlock(&lock);
+        status = patch_set_commit_within(patch_set, budget_us);
+        *commit_us = now_us() - start;
+        return status;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    /* One patch waits for safe points at a time. */
+    while (pending != NULL && result == 0)
+    {
+        result = timeout_ms == 0
+            ? pthread_cond_wait(&settled, &lock)
+            : pthread_cond_timedwait(&settled, &lock, &deadline);
+    }
+    if (pending == NULL)
+    {
+        posted = true;
+        pending_budget_us = budget_us;
+        posted_us = now_us();
+        posted_deadline = deadline;
+        posted_threads = registered;
+        checked_in = 0;
+        settlement = settlements;
+        /* Published first, so a woken thread can't miss it. */
+        __atomic_store_n(&pending, patch_set, __ATOMIC_RELEASE);
+        for (i = 0; i < SAFEPOINT_MAX_THREADS; i++)
+        {
+            if (threads[i].registered)
+            {
+                threads[i].checked_in = false;
+                signal_thread(&threads[i]);
+            }
+        }
+        while (settlements == settlement && result == 0)
+        {
+            result = timeout_ms == 0
+                ? pthread_cond_wait(&settled, &lock)
+                : pthread_cond_timedwait(&settled, &lock, &deadline);
+        }
+    }
+    if (posted && settlements != settlement)
+    {
+        status = settled_status;
+        *commit_us = settled_commit_us;
+    }
+    else
+    {
+        if (posted)
+        {
+            withdraw_pending();
+        }
+        status = DPATCH_STATUS_ETIMEDOUT;
+        *commit_us = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return status;
+}
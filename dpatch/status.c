@@ -10,7 +10,7 @@
 
 #include "status.h"
 
-char* status_strings[] =
+static const char* status_strings[] =
 {
     [DPATCH_STATUS_OK] = "Success",
     [DPATCH_STATUS_ERROR] = "General, unspecified, or unknown error",
@@ -19,7 +19,11 @@ char* status_strings[] =
     [DPATCH_STATUS_EUNKNOWN] = "Unsupported or unknown patch operation",
     [DPATCH_STATUS_EDYN] = "Error accessing dynamic symbols",
     [DPATCH_STATUS_EFILE] = "File I/O error",
-    [DPATCH_STATUS_ESYNTAX] = "Script parsing error"
+    [DPATCH_STATUS_ESYNTAX] = "Script parsing error",
+    [DPATCH_STATUS_EWRITE] = "Failed to write program memory",
+    [DPATCH_STATUS_ECYCLE] = "Patch would create a redirection cycle",
+    [DPATCH_STATUS_ETIMEDOUT] = "Commit aborted to meet its deadline",
+    [DPATCH_STATUS_ESTALE] = "Patch blob was compiled from a different script"
 };
 
 /**
@@ -28,7 +32,7 @@ char* status_strings[] =
  * @param status Status code to translate.
  * @return Pointer to a string describing the error.
  */
-const char* str_status(dpatch_status status)
+const char* dpatch_str_status(dpatch_status status)
 {
     return status_strings[status];
 }
@@ -0,0 +1,1117 @@
+/**
+ * @file dpatch/symbol_index.c
+ *
+ * `symbol_index.c` defines an index from addresses to the
+ * functions containing them.
+ *
+ * `dladdr` takes the loader's lock and scans each object's
+ * symbols on every call, which is too slow to attribute
+ * thousands of sampled instruction pointers. The index
+ * instead reads every function symbol, with its size, from
+ * the `.symtab` and `.dynsym` sections of each loaded
+ * object once, and keeps each object's functions sorted by
+ * entry point. The entry points are kept in their own
+ * array, so a lookup is a binary search over objects then
+ * a binary search over densely packed addresses.
+ *
+ * Objects are added and removed as they are loaded and
+ * unloaded, and their symbols are read lazily, the next
+ * time the index is searched.
+ *
+ * Functions can also be found by name, including functions
+ * which aren't exported. An object's names are hashed into
+ * an open addressing table the first time one of its
+ * functions is looked up by name. Objects stripped of
+ * `.symtab` are indexed from their separate debug
+ * information, located by build ID, if it is installed.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "symbol_index.h"
+#include "status.h"
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SYMBOL_INDEX_DEFAULT_LENGTH 16
+#define MAIN_PROGRAM_PATH "/proc/self/exe"
+#define DEBUG_BUILD_ID_DIR "/usr/lib/debug/.build-id"
+#define BUILD_ID_SECTION ".note.gnu.build-id"
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/**
+ * A function symbol read from an object.
+ */
+struct function_symbol
+{
+    /** Address of the function's entry point. */
+    uintptr_t start;
+
+    /** Size of the function in bytes. */
+    uint32_t size;
+
+    /** Name of the function, in the object's string table. */
+    const char* name;
+};
+
+/**
+ * The functions of one loaded object.
+ */
+struct indexed_object
+{
+    /** The object. */
+    struct link_map* map;
+
+    /** Whether the object's symbols have been read. */
+    bool indexed;
+
+    /** Lowest function entry point in the object. */
+    uintptr_t low;
+
+    /** One past the end of the highest function. */
+    uintptr_t high;
+
+    /** The number of functions in the object. */
+    size_t length;
+
+    /** Entry points of the functions, in ascending order. */
+    uintptr_t* starts;
+
+    /** Size of each function. */
+    uint32_t* sizes;
+
+    /** Offset of each function's name in `strings`. */
+    uint32_t* names;
+
+    /** The functions' names. */
+    char* strings;
+
+    /** Function indexes plus one, hashed by name, or 0. */
+    uint32_t* buckets;
+
+    /** The number of `buckets`, a power of two. */
+    size_t buckets_length;
+};
+
+/**
+ * The index of every loaded object's functions.
+ */
+struct symbol_index
+{
+    /** Indexed objects, sorted by `low` once indexed. */
+    struct indexed_object* objects;
+
+    /** The number of `objects`. */
+    size_t length;
+
+    /** The number of `objects` allocated in memory. */
+    size_t allocated;
+
+    /** The number of objects whose symbols are unread. */
+    size_t pending;
+
+    /** Whether objects loaded before dpatch have been added. */
+    bool seeded;
+
+    /** The total number of functions indexed. */
+    size_t symbols;
+};
+
+/** The process' symbol index. */
+static struct symbol_index index_ = {NULL, 0, 0, 0, false, 0};
+
+/** Serialises changes to `index_` against lookups. */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Order function symbols by entry point, largest first
+ * among aliases.
+ */
+static int compare_symbols(const void* a, const void* b)
+{
+    const struct function_symbol* left = a;
+    const struct function_symbol* right = b;
+    if (left->start != right->start)
+    {
+        return left->start < right->start ? -1 : 1;
+    }
+    return left->size > right->size ? -1 : left->size < right->size;
+}
+
+/**
+ * Order indexed objects by their lowest function.
+ */
+static int compare_objects(const void* a, const void* b)
+{
+    const struct indexed_object* left = a;
+    const struct indexed_object* right = b;
+    if (left->low != right->low)
+    {
+        return left->low < right->low ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Test if an ELF section lies inside a mapped file.
+ *
+ * @param section The section header.
+ * @param file_size Size of the file.
+ * @return `true` if the section's contents are in bounds.
+ */
+static bool section_in_bounds(const Elf64_Shdr* section, size_t file_size)
+{
+    return section->sh_offset <= file_size && section->sh_size <= file_size - section->sh_offset;
+}
+
+/**
+ * Validate the header of a mapped ELF file.
+ *
+ * @param file The mapped file.
+ * @param file_size Size of the file.
+ * @return The file's section headers, or `NULL` if the
+ * file isn't a 64-bit ELF file.
+ */
+static const Elf64_Shdr* elf_sections(const uint8_t* file, size_t file_size)
+{
+    const Elf64_Ehdr* header = (const Elf64_Ehdr*) file;
+    if (
+        file_size < sizeof(Elf64_Ehdr)
+        || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0
+        || header->e_ident[EI_CLASS] != ELFCLASS64
+        || header->e_shentsize != sizeof(Elf64_Shdr)
+        || header->e_shoff > file_size
+        || (size_t) header->e_shnum * sizeof(Elf64_Shdr) > file_size - header->e_shoff
+    )
+    {
+        return NULL;
+    }
+    return (const Elf64_Shdr*) (file + header->e_shoff);
+}
+
+/**
+ * Collect the function symbols of a mapped ELF file.
+ *
+ * @param file The mapped file.
+ * @param file_size Size of the file.
+ * @param base Address the object is loaded at.
+ * @param symbols Address of an allocated array of symbols
+ *      to append to. Appended symbols point into `file`.
+ * @param length Address of the number of `symbols`.
+ * @param has_symtab Location to store whether the file has
+ *      a `.symtab`.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * file isn't a 64-bit ELF file, or an error on failure.
+ */
+static dpatch_status collect_symbols
+(
+    const uint8_t* file,
+    size_t file_size,
+    uintptr_t base,
+    struct function_symbol** symbols,
+    size_t* length,
+    bool* has_symtab
+)
+{
+    const Elf64_Ehdr* header = (const Elf64_Ehdr*) file;
+    const Elf64_Shdr* sections = elf_sections(file, file_size);
+    struct function_symbol* grown = NULL;
+    size_t capacity = *length;
+    size_t i = 0;
+    size_t j = 0;
+    *has_symtab = false;
+    if (sections == NULL)
+    {
+        return DPATCH_STATUS_EFILE;
+    }
+    for (i = 0; i < header->e_shnum; i++)
+    {
+        if (sections[i].sh_type == SHT_SYMTAB || sections[i].sh_type == SHT_DYNSYM)
+        {
+            capacity += sections[i].sh_size / sizeof(Elf64_Sym);
+        }
+        *has_symtab = *has_symtab || sections[i].sh_type == SHT_SYMTAB;
+    }
+    if (capacity == *length)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    grown = realloc(*symbols, sizeof(struct function_symbol) * capacity);
+    if (grown == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    *symbols = grown;
+    for (i = 0; i < header->e_shnum; i++)
+    {
+        const Elf64_Shdr* table = &sections[i];
+        const Elf64_Shdr* strings = NULL;
+        const Elf64_Sym* entries = NULL;
+        if (table->sh_type != SHT_SYMTAB && table->sh_type != SHT_DYNSYM)
+        {
+            continue;
+        }
+        if (table->sh_link >= header->e_shnum)
+        {
+            continue;
+        }
+        strings = &sections[table->sh_link];
+        if (!section_in_bounds(table, file_size) || !section_in_bounds(strings, file_size))
+        {
+            continue;
+        }
+        entries = (const Elf64_Sym*) (file + table->sh_offset);
+        for (j = 0; j < table->sh_size / sizeof(Elf64_Sym); j++)
+        {
+            const Elf64_Sym* entry = &entries[j];
+            unsigned char type = ELF64_ST_TYPE(entry->st_info);
+            if (
+                (type != STT_FUNC && type != STT_GNU_IFUNC)
+                || entry->st_shndx == SHN_UNDEF
+                || entry->st_size == 0
+                || entry->st_name == 0
+                || entry->st_name >= strings->sh_size
+            )
+            {
+                continue;
+            }
+            (*symbols)[*length].start = base + entry->st_value;
+            (*symbols)[*length].size = entry->st_size > UINT32_MAX ? UINT32_MAX : (uint32_t) entry->st_size;
+            (*symbols)[*length].name = (const char*) (file + strings->sh_offset + entry->st_name);
+            (*length)++;
+        }
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Get the path of an object's separate debug information
+ * from its build ID.
+ *
+ * @param file The object's mapped file.
+ * @param file_size Size of the file.
+ * @param path Buffer to store the path in.
+ * @param path_size Size of `path`.
+ * @return `true` if the object has a build ID.
+ */
+static bool debug_file_path(const uint8_t* file, size_t file_size, char* path, size_t path_size)
+{
+    const Elf64_Ehdr* header = (const Elf64_Ehdr*) file;
+    const Elf64_Shdr* sections = elf_sections(file, file_size);
+    const Elf64_Shdr* names = NULL;
+    const Elf64_Nhdr* note = NULL;
+    const uint8_t* id = NULL;
+    size_t written = 0;
+    size_t i = 0;
+    if (sections == NULL || header->e_shstrndx >= header->e_shnum)
+    {
+        return false;
+    }
+    names = &sections[header->e_shstrndx];
+    if (!section_in_bounds(names, file_size))
+    {
+        return false;
+    }
+    for (i = 0; i < header->e_shnum; i++)
+    {
+        if (
+            sections[i].sh_type == SHT_NOTE
+            && sections[i].sh_name < names->sh_size
+            && strcmp((const char*) (file + names->sh_offset + sections[i].sh_name), BUILD_ID_SECTION) == 0
+            && section_in_bounds(&sections[i], file_size)
+            && sections[i].sh_size >= sizeof(Elf64_Nhdr)
+        )
+        {
+            note = (const Elf64_Nhdr*) (file + sections[i].sh_offset);
+            break;
+        }
+    }
+    if (
+        note == NULL
+        || note->n_type != NT_GNU_BUILD_ID
+        || note->n_descsz < 2
+        || sizeof(Elf64_Nhdr) + ((note->n_namesz + 3) & ~3u) + note->n_descsz > sections[i].sh_size
+    )
+    {
+        return false;
+    }
+    id = (const uint8_t*) note + sizeof(Elf64_Nhdr) + ((note->n_namesz + 3) & ~3u);
+    /* The first byte of the ID names a directory, and the rest the file. */
+    written = (size_t) snprintf(path, path_size, "%s/%02x/", DEBUG_BUILD_ID_DIR, id[0]);
+    for (i = 1; i < note->n_descsz && written + 3 < path_size; i++)
+    {
+        written += (size_t) snprintf(path + written, path_size - written, "%02x", id[i]);
+    }
+    return (size_t) snprintf(path + written, path_size - written, ".debug") < path_size - written;
+}
+
+/**
+ * Map a file read only.
+ *
+ * @param path Path to the file.
+ * @param size Location to store the size of the file.
+ * @return The mapped file, or `NULL` if it can't be read.
+ */
+static uint8_t* map_file(const char* path, size_t* size)
+{
+    struct stat file_stat;
+    void* file = MAP_FAILED;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    {
+        file = mmap(NULL, (size_t) file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (file == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = (size_t) file_stat.st_size;
+    return file;
+}
+
+/**
+ * Copy sorted, unique symbols into an indexed object.
+ *
+ * @param object The object to fill.
+ * @param symbols The object's symbols, sorted by entry.
+ * @param length The number of `symbols`.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status fill_object
+(
+    struct indexed_object* object,
+    const struct function_symbol* symbols,
+    size_t length
+)
+{
+    size_t strings_length = 0;
+    size_t unique = 0;
+    size_t offset = 0;
+    size_t i = 0;
+    for (i = 0; i < length; i++)
+    {
+        if (i > 0 && symbols[i].start == symbols[i - 1].start)
+        {
+            continue;
+        }
+        unique++;
+        strings_length += strlen(symbols[i].name) + 1;
+    }
+    object->starts = malloc(sizeof(uintptr_t) * unique);
+    object->sizes = malloc(sizeof(uint32_t) * unique);
+    object->names = malloc(sizeof(uint32_t) * unique);
+    object->strings = malloc(strings_length);
+    if (object->starts == NULL || object->sizes == NULL || object->names == NULL || object->strings == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    for (i = 0; i < length; i++)
+    {
+        if (i > 0 && symbols[i].start == symbols[i - 1].start)
+        {
+            /* Aliases of a function share its entry; keep the first name. */
+            continue;
+        }
+        object->starts[object->length] = symbols[i].start;
+        object->sizes[object->length] = symbols[i].size;
+        object->names[object->length] = (uint32_t) offset;
+        strcpy(object->strings + offset, symbols[i].name);
+        offset += strlen(symbols[i].name) + 1;
+        if (symbols[i].start + symbols[i].size > object->high)
+        {
+            object->high = symbols[i].start + symbols[i].size;
+        }
+        object->length++;
+    }
+    object->low = unique > 0 ? object->starts[0] : 0;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Read the function symbols of an object from its file,
+ * and from its separate debug information if the file has
+ * no `.symtab`.
+ *
+ * Objects which have no file, such as the vDSO, are
+ * indexed with no functions.
+ *
+ * @param object The object to index.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status index_object(struct indexed_object* object)
+{
+    const char* path = object->map->l_name[0] == '\0' ? MAIN_PROGRAM_PATH : object->map->l_name;
+    char debug_path[PATH_MAX];
+    struct function_symbol* symbols = NULL;
+    uint8_t* file = NULL;
+    uint8_t* debug_file = NULL;
+    size_t file_size = 0;
+    size_t debug_file_size = 0;
+    size_t length = 0;
+    bool has_symtab = false;
+    dpatch_status status = DPATCH_STATUS_OK;
+    object->indexed = true;
+    file = map_file(path, &file_size);
+    if (file == NULL)
+    {
+        return DPATCH_STATUS_OK;
+    }
+    status = collect_symbols(file, file_size, object->map->l_addr, &symbols, &length, &has_symtab);
+    if (
+        !IS_ERROR(status)
+        && !has_symtab
+        && debug_file_path(file, file_size, debug_path, sizeof debug_path)
+    )
+    {
+        debug_file = map_file(debug_path, &debug_file_size);
+    }
+    if (debug_file != NULL)
+    {
+        status = collect_symbols(debug_file, debug_file_size, object->map->l_addr, &symbols, &length, &has_symtab);
+    }
+    if (!IS_ERROR(status) && length > 0)
+    {
+        qsort(symbols, length, sizeof(struct function_symbol), &compare_symbols);
+        status = fill_object(object, symbols, length);
+    }
+    free(symbols);
+    if (debug_file != NULL)
+    {
+        munmap(debug_file, debug_file_size);
+    }
+    munmap(file, file_size);
+    /* Files which aren't ELF objects just have no functions to index. */
+    return status == DPATCH_STATUS_EFILE ? DPATCH_STATUS_OK : status;
+}
+
+/**
+ * Free the functions of an indexed object.
+ *
+ * @param object The object to clear.
+ */
+static void clear_object(struct indexed_object* object)
+{
+    free(object->starts);
+    free(object->sizes);
+    free(object->names);
+    free(object->strings);
+    free(object->buckets);
+}
+
+/**
+ * Add an object to the index, unless it is already in it.
+ *
+ * @warning The caller must hold `index_lock` for writing.
+ *
+ * @param object The object to add.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status add_object_locked(struct link_map* object)
+{
+    struct indexed_object* objects = NULL;
+    size_t allocated = 0;
+    size_t i = 0;
+    for (i = 0; i < index_.length; i++)
+    {
+        if (index_.objects[i].map == object)
+        {
+            return DPATCH_STATUS_OK;
+        }
+    }
+    if (index_.length == index_.allocated)
+    {
+        allocated = index_.allocated == 0 ? SYMBOL_INDEX_DEFAULT_LENGTH : index_.allocated * 2;
+        objects = realloc(index_.objects, sizeof(struct indexed_object) * allocated);
+        if (objects == NULL)
+        {
+            return DPATCH_STATUS_ENOMEM;
+        }
+        index_.objects = objects;
+        index_.allocated = allocated;
+    }
+    memset(&index_.objects[index_.length], 0, sizeof(struct indexed_object));
+    index_.objects[index_.length++].map = object;
+    index_.pending++;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Add the objects loaded before dpatch could observe them.
+ *
+ * When dpatch is an audit library, every object is added
+ * as it is loaded. When it is attached or linked into a
+ * program, the objects already loaded are found by walking
+ * the program's link map.
+ *
+ * @warning The caller must hold `index_lock` for writing.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status seed_locked(void)
+{
+    struct link_map* map = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    void* program = dlopen(NULL, RTLD_LAZY);
+    index_.seeded = true;
+    if (program == NULL)
+    {
+        return DPATCH_STATUS_EDYN;
+    }
+    if (dlinfo(program, RTLD_DI_LINKMAP, &map) != 0 || map == NULL)
+    {
+        dlclose(program);
+        return DPATCH_STATUS_EDYN;
+    }
+    while (map->l_prev != NULL)
+    {
+        map = map->l_prev;
+    }
+    for (; map != NULL && !IS_ERROR(status); map = map->l_next)
+    {
+        status = add_object_locked(map);
+    }
+    dlclose(program);
+    return status;
+}
+
+/**
+ * Read the symbols of every pending object, and re-sort
+ * the objects.
+ *
+ * @warning The caller must hold `index_lock` for writing.
+ *
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status index_pending_locked(void)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    if (!index_.seeded)
+    {
+        PROPAGATE_ERROR(seed_locked(), status);
+    }
+    for (i = 0; i < index_.length; i++)
+    {
+        if (!index_.objects[i].indexed)
+        {
+            PROPAGATE_ERROR(index_object(&index_.objects[i]), status);
+            index_.symbols += index_.objects[i].length;
+        }
+    }
+    index_.pending = 0;
+    qsort(index_.objects, index_.length, sizeof(struct indexed_object), &compare_objects);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Add a loaded object to the index.
+ *
+ * The object's symbols are read when the index is next
+ * searched.
+ *
+ * @param object The object to add.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status symbol_index_add_object(struct link_map* object)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    pthread_rwlock_wrlock(&index_lock);
+    status = add_object_locked(object);
+    pthread_rwlock_unlock(&index_lock);
+    return status;
+}
+
+/**
+ * Remove an object which is being unloaded from the index.
+ *
+ * @param object The object to remove.
+ */
+void symbol_index_remove_object(struct link_map* object)
+{
+    size_t i = 0;
+    pthread_rwlock_wrlock(&index_lock);
+    for (i = 0; i < index_.length; i++)
+    {
+        if (index_.objects[i].map != object)
+        {
+            continue;
+        }
+        if (!index_.objects[i].indexed)
+        {
+            index_.pending--;
+        }
+        index_.symbols -= index_.objects[i].length;
+        clear_object(&index_.objects[i]);
+        /* Shifting down keeps the remaining objects sorted. */
+        memmove(
+            &index_.objects[i],
+            &index_.objects[i + 1],
+            sizeof(struct indexed_object) * (index_.length - i - 1)
+        );
+        index_.length--;
+        break;
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+/**
+ * Find the last element of a sorted array not greater than
+ * a key.
+ *
+ * @param starts The sorted array.
+ * @param length The length of `starts`.
+ * @param key The value to search for.
+ * @return The element's index, or `length` if every
+ * element is greater than `key`.
+ */
+static size_t floor_search(const uintptr_t* starts, size_t length, uintptr_t key)
+{
+    size_t low = 0;
+    size_t high = length;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (starts[middle] <= key)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low == 0 ? length : low - 1;
+}
+
+/**
+ * Find the function containing an address.
+ *
+ * @warning The caller must hold `index_lock`.
+ *
+ * @param address The address to look up.
+ * @param info Location to store the function found.
+ * @return `true` if a function was found.
+ */
+static bool lookup_locked(uintptr_t address, struct symbol_info* info)
+{
+    const struct indexed_object* object = NULL;
+    size_t low = 0;
+    size_t high = index_.length;
+    size_t i = 0;
+    /* Objects are sorted by `low`; find the last starting at or below `address`. */
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (index_.objects[middle].low <= address)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == 0)
+    {
+        return false;
+    }
+    object = &index_.objects[low - 1];
+    if (address >= object->high)
+    {
+        return false;
+    }
+    i = floor_search(object->starts, object->length, address);
+    if (i == object->length || address - object->starts[i] >= object->sizes[i])
+    {
+        return false;
+    }
+    info->name = object->strings + object->names[i];
+    info->start = object->starts[i];
+    info->size = object->sizes[i];
+    info->object = object->map;
+    return true;
+}
+
+/**
+ * Find the function containing an address.
+ *
+ * @param address The address to look up.
+ * @param info Location to store the function found. Its
+ *      strings remain valid until the object containing it
+ *      is removed.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if no
+ * known function contains `address`, or an error on
+ * failure.
+ */
+dpatch_status symbol_index_lookup(uintptr_t address, struct symbol_info* info)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    bool found = false;
+    pthread_rwlock_rdlock(&index_lock);
+    while (index_.pending > 0 || !index_.seeded)
+    {
+        pthread_rwlock_unlock(&index_lock);
+        pthread_rwlock_wrlock(&index_lock);
+        status = index_pending_locked();
+        pthread_rwlock_unlock(&index_lock);
+        if (IS_ERROR(status))
+        {
+            return status;
+        }
+        pthread_rwlock_rdlock(&index_lock);
+    }
+    found = lookup_locked(address, info);
+    pthread_rwlock_unlock(&index_lock);
+    return found ? DPATCH_STATUS_OK : DPATCH_STATUS_EDYN;
+}
+
+/**
+ * Hash a name with 64-bit FNV-1a.
+ *
+ * @param name The name to hash.
+ * @return The name's hash.
+ */
+static uint64_t hash_name(const char* name)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (; *name != '\0'; name++)
+    {
+        hash = (hash ^ (uint8_t) *name) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Hash an object's function names into its buckets.
+ *
+ * @param object The object to hash.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status hash_object_names(struct indexed_object* object)
+{
+    size_t mask = 0;
+    size_t slot = 0;
+    size_t i = 0;
+    object->buckets_length = SYMBOL_INDEX_DEFAULT_LENGTH;
+    /* Keep the table at most half full, so probes stay short. */
+    while (object->buckets_length < object->length * 2)
+    {
+        object->buckets_length *= 2;
+    }
+    object->buckets = calloc(object->buckets_length, sizeof(uint32_t));
+    if (object->buckets == NULL)
+    {
+        object->buckets_length = 0;
+        return DPATCH_STATUS_ENOMEM;
+    }
+    mask = object->buckets_length - 1;
+    for (i = 0; i < object->length; i++)
+    {
+        slot = hash_name(object->strings + object->names[i]) & mask;
+        while (object->buckets[slot] != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+        object->buckets[slot] = (uint32_t) i + 1;
+    }
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Find a function in an object by name.
+ *
+ * Unlike `dlsym`, functions which aren't exported, such as
+ * `static` functions and functions in programs linked
+ * without `-rdynamic`, are found if the object or its
+ * debug information has a `.symtab`. If several functions
+ * share the name, one of them is returned.
+ *
+ * @param object The object to search.
+ * @param name Name of the function to find.
+ * @param address Location to store the function's address.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * object has no function named `name`, or an error on
+ * failure.
+ */
+dpatch_status symbol_index_find(struct link_map* object, const char* name, uintptr_t* address)
+{
+    struct indexed_object* indexed = NULL;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t mask = 0;
+    size_t slot = 0;
+    size_t i = 0;
+    pthread_rwlock_wrlock(&index_lock);
+    status = add_object_locked(object);
+    if (!IS_ERROR(status) && (index_.pending > 0 || !index_.seeded))
+    {
+        status = index_pending_locked();
+    }
+    for (i = 0; i < index_.length && !IS_ERROR(status); i++)
+    {
+        if (index_.objects[i].map == object)
+        {
+            indexed = &index_.objects[i];
+            break;
+        }
+    }
+    if (!IS_ERROR(status) && indexed != NULL && indexed->buckets == NULL && indexed->length > 0)
+    {
+        status = hash_object_names(indexed);
+    }
+    if (IS_ERROR(status) || indexed == NULL || indexed->buckets == NULL)
+    {
+        pthread_rwlock_unlock(&index_lock);
+        return IS_ERROR(status) ? status : DPATCH_STATUS_EDYN;
+    }
+    status = DPATCH_STATUS_EDYN;
+    mask = indexed->buckets_length - 1;
+    for (slot = hash_name(name) & mask; indexed->buckets[slot] != 0; slot = (slot + 1) & mask)
+    {
+        i = indexed->buckets[slot] - 1;
+        if (strcmp(indexed->strings + indexed->names[i], name) == 0)
+        {
+            *address = indexed->starts[i];
+            status = DPATCH_STATUS_OK;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return status;
+}
+
+/**
+ * Visit every function the index holds for an object.
+ *
+ * The functions are read from the object's `.symtab`, or
+ * that of its debug information, as well as its `.dynsym`,
+ * so functions which aren't exported are included. They
+ * are visited in order of entry point.
+ *
+ * @warning `visit` is called with the index locked, so it
+ * must not call other `symbol_index` functions.
+ *
+ * @param object The object to enumerate.
+ * @param visit Function to call with each function. If
+ *      `visit` returns an error, the enumeration stops.
+ * @param context Passed to `visit`.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * object has no indexed functions, or the first error
+ * `visit` returns.
+ */
+dpatch_status symbol_index_functions
+(
+    struct link_map* object,
+    symbol_index_visitor visit,
+    void* context
+)
+{
+    struct indexed_object* indexed = NULL;
+    struct symbol_info info;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    pthread_rwlock_wrlock(&index_lock);
+    status = add_object_locked(object);
+    if (!IS_ERROR(status) && (index_.pending > 0 || !index_.seeded))
+    {
+        status = index_pending_locked();
+    }
+    for (i = 0; i < index_.length && !IS_ERROR(status); i++)
+    {
+        if (index_.objects[i].map == object)
+        {
+            indexed = &index_.objects[i];
+            break;
+        }
+    }
+    if (!IS_ERROR(status) && (indexed == NULL || indexed->length == 0))
+    {
+        status = DPATCH_STATUS_EDYN;
+    }
+    info.object = object;
+    for (i = 0; !IS_ERROR(status) && i < indexed->length; i++)
+    {
+        info.name = indexed->strings + indexed->names[i];
+        info.start = indexed->starts[i];
+        info.size = indexed->sizes[i];
+        status = visit(&info, context);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return status;
+}
+
+/**
+ * Find a section of a loaded object.
+ *
+ * @param object The object to search.
+ * @param name Name of the section, such as ".rodata".
+ * @param address Location to store the address the section
+ *      is loaded at.
+ * @param size Location to store the size of the section.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EDYN` if the
+ * object has no loaded section named `name`, or
+ * `DPATCH_STATUS_EFILE` if the object's file can't be read.
+ */
+dpatch_status symbol_index_section
+(
+    struct link_map* object,
+    const char* name,
+    uintptr_t* address,
+    size_t* size
+)
+{
+    const char* path = object->l_name[0] == '\0' ? MAIN_PROGRAM_PATH : object->l_name;
+    const Elf64_Ehdr* header = NULL;
+    const Elf64_Shdr* sections = NULL;
+    const Elf64_Shdr* names = NULL;
+    uint8_t* file = NULL;
+    size_t file_size = 0;
+    dpatch_status status = DPATCH_STATUS_EDYN;
+    size_t i = 0;
+    file = map_file(path, &file_size);
+    sections = file == NULL ? NULL : elf_sections(file, file_size);
+    header = (const Elf64_Ehdr*) file;
+    if (sections == NULL || header->e_shstrndx >= header->e_shnum)
+    {
+        if (file != NULL)
+        {
+            munmap(file, file_size);
+        }
+        return DPATCH_STATUS_EFILE;
+    }
+    names = &sections[header->e_shstrndx];
+    for (i = 0; i < header->e_shnum && section_in_bounds(names, file_size); i++)
+    {
+        if (
+            (sections[i].sh_flags & SHF_ALLOC) != 0
+            && sections[i].sh_name < names->sh_size
+            && strncmp((const char*) file + names->sh_offset + sections[i].sh_name, name, names->sh_size - sections[i].sh_name) == 0
+        )
+        {
+            *address = object->l_addr + sections[i].sh_addr;
+            *size = sections[i].sh_size;
+            status = DPATCH_STATUS_OK;
+            break;
+        }
+    }
+    munmap(file, file_size);
+    return status;
+}
+
+/**
+ * Visit every function an object exports.
+ *
+ * Exported functions are the defined, sized, global or
+ * weak functions in the object's `.dynsym`. Indirect
+ * functions are skipped, as their symbols point at their
+ * resolvers rather than their code.
+ *
+ * @param object The object to enumerate.
+ * @param visit Function to call with each export. The
+ *      export's name is only valid during the call. If
+ *      `visit` returns an error, the enumeration stops.
+ * @param context Passed to `visit`.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EFILE` if the
+ * object's file can't be read, or the first error `visit`
+ * returns.
+ */
+dpatch_status symbol_index_exports
+(
+    struct link_map* object,
+    symbol_index_visitor visit,
+    void* context
+)
+{
+    const char* path = object->l_name[0] == '\0' ? MAIN_PROGRAM_PATH : object->l_name;
+    const Elf64_Ehdr* header = NULL;
+    const Elf64_Shdr* sections = NULL;
+    struct symbol_info info;
+    uint8_t* file = NULL;
+    size_t file_size = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    size_t i = 0;
+    size_t j = 0;
+    file = map_file(path, &file_size);
+    sections = file == NULL ? NULL : elf_sections(file, file_size);
+    if (sections == NULL)
+    {
+        if (file != NULL)
+        {
+            munmap(file, file_size);
+        }
+        return DPATCH_STATUS_EFILE;
+    }
+    header = (const Elf64_Ehdr*) file;
+    info.object = object;
+    for (i = 0; i < header->e_shnum && !IS_ERROR(status); i++)
+    {
+        const Elf64_Shdr* table = &sections[i];
+        const Elf64_Shdr* strings = NULL;
+        const Elf64_Sym* entries = NULL;
+        if (table->sh_type != SHT_DYNSYM || table->sh_link >= header->e_shnum)
+        {
+            continue;
+        }
+        strings = &sections[table->sh_link];
+        if (!section_in_bounds(table, file_size) || !section_in_bounds(strings, file_size))
+        {
+            continue;
+        }
+        entries = (const Elf64_Sym*) (file + table->sh_offset);
+        for (j = 0; j < table->sh_size / sizeof(Elf64_Sym) && !IS_ERROR(status); j++)
+        {
+            const Elf64_Sym* entry = &entries[j];
+            unsigned char binding = ELF64_ST_BIND(entry->st_info);
+            if (
+                ELF64_ST_TYPE(entry->st_info) != STT_FUNC
+                || (binding != STB_GLOBAL && binding != STB_WEAK)
+                || ELF64_ST_VISIBILITY(entry->st_other) == STV_HIDDEN
+                || ELF64_ST_VISIBILITY(entry->st_other) == STV_INTERNAL
+                || entry->st_shndx == SHN_UNDEF
+                || entry->st_size == 0
+                || entry->st_name == 0
+                || entry->st_name >= strings->sh_size
+            )
+            {
+                continue;
+            }
+            info.name = (const char*) (file + strings->sh_offset + entry->st_name);
+            info.start = object->l_addr + entry->st_value;
+            info.size = entry->st_size;
+            status = visit(&info, context);
+        }
+    }
+    munmap(file, file_size);
+    return status;
+}
+
+/**
+ * Get the number of functions in the index.
+ *
+ * @return The number of functions indexed so far.
+ */
+size_t symbol_index_length(void)
+{
+    size_t length = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    length = index_.symbols;
+    pthread_rwlock_unlock(&index_lock);
+    return length;
+}
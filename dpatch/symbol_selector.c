@@ -0,0 +1,300 @@
+/**
+ * @file dpatch/symbol_selector.c
+ *
+ * `symbol_selector.c` defines selectors, which match a
+ * family of function names, such as every `codec_v1_*`,
+ * and derive each replacement's name, such as `codec_v2_*`,
+ * from the parts matched.
+ *
+ * Globs are translated into anchored POSIX extended regular
+ * expressions with one group per `*` or `?`, so both kinds of
+ * selector are matched by `regexec`. Replacement templates
+ * are stored with a `\N` reference for each substitution.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "status.h"
+#include "symbol_selector.h"
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** The most groups a template can refer to, plus one for the whole name. */
+#define SELECTOR_MAX_GROUPS 10
+
+/**
+ * A compiled selector.
+ */
+struct symbol_selector
+{
+    /** The pattern, as an extended regular expression. */
+    regex_t regex;
+
+    /** Replacement name template, with `\N` group references. */
+    char* replacement;
+};
+
+/**
+ * Test if a symbol name in a patch is a selector.
+ *
+ * @param selector The name to test.
+ * @return `true` if `selector` is a regular expression
+ * between `/`s, or a glob containing `*`, `?` or `[`.
+ */
+bool symbol_selector_is_pattern(const char* selector)
+{
+    size_t length = strlen(selector);
+    if (length >= 2 && selector[0] == '/' && selector[length - 1] == '/')
+    {
+        return true;
+    }
+    return strpbrk(selector, "*?[") != NULL;
+}
+
+/**
+ * Translate a glob into an anchored extended regular
+ * expression, and its replacement into a template.
+ *
+ * @param glob The glob to translate.
+ * @param replacement The glob's replacement, with a `*` or
+ *      `?` for each wildcard to substitute.
+ * @param regex Location to store the regular expression.
+ *      The caller must free it.
+ * @param template Location to store the template. The
+ *      caller must free it.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if a
+ * `[` is unterminated, or `DPATCH_STATUS_ENOMEM`.
+ */
+static dpatch_status translate_glob
+(
+    const char* glob,
+    const char* replacement,
+    char** regex,
+    char** template
+)
+{
+    /* Each character becomes at most four, plus the anchors. */
+    char* out = malloc(strlen(glob) * 4 + 3);
+    char* substituted = malloc(strlen(replacement) * 2 + 1);
+    size_t length = 0;
+    size_t group = 0;
+    size_t i = 0;
+    if (out == NULL || substituted == NULL)
+    {
+        free(out);
+        free(substituted);
+        return DPATCH_STATUS_ENOMEM;
+    }
+    out[length++] = '^';
+    for (i = 0; glob[i] != '\0'; i++)
+    {
+        if (glob[i] == '*' || glob[i] == '?')
+        {
+            memcpy(out + length, glob[i] == '*' ? "(.*)" : "(.)", glob[i] == '*' ? 4 : 3);
+            length += glob[i] == '*' ? 4 : 3;
+        }
+        else if (glob[i] == '[')
+        {
+            out[length++] = '[';
+            i++;
+            if (glob[i] == '!')
+            {
+                out[length++] = '^';
+                i++;
+            }
+            /* A `]` first in the set is a member, not its end. */
+            do
+            {
+                out[length++] = glob[i++];
+            }
+            while (glob[i - 1] != '\0' && glob[i] != ']' && glob[i] != '\0');
+            if (glob[i - 1] == '\0' || glob[i] != ']')
+            {
+                free(out);
+                free(substituted);
+                return DPATCH_STATUS_ESYNTAX;
+            }
+            out[length++] = ']';
+        }
+        else
+        {
+            if (strchr(".^$+(){}|\\", glob[i]) != NULL)
+            {
+                out[length++] = '\\';
+            }
+            out[length++] = glob[i];
+        }
+    }
+    out[length++] = '$';
+    out[length] = '\0';
+    length = 0;
+    for (i = 0; replacement[i] != '\0'; i++)
+    {
+        if (replacement[i] == '*' || replacement[i] == '?')
+        {
+            group++;
+            if (group >= SELECTOR_MAX_GROUPS)
+            {
+                free(out);
+                free(substituted);
+                return DPATCH_STATUS_ESYNTAX;
+            }
+            substituted[length++] = '\\';
+            substituted[length++] = (char) ('0' + group);
+        }
+        else
+        {
+            substituted[length++] = replacement[i];
+        }
+    }
+    substituted[length] = '\0';
+    *regex = out;
+    *template = substituted;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Compile a selector.
+ *
+ * @param new Location to store a handle to the selector.
+ * @param pattern A glob, or an extended regular expression
+ *      between `/`s.
+ * @param replacement Template for each replacement's name.
+ *      For a glob, each `*` or `?` is replaced with the text
+ *      matched by the glob's wildcard in the same position.
+ *      For a regular expression, `\1` to `\9` are replaced
+ *      with the text matched by each group, and `\0` with
+ *      the whole name.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_ESYNTAX` if
+ * the pattern is invalid or the template refers to a
+ * capture the pattern doesn't have, or an error on failure.
+ */
+dpatch_status symbol_selector_new
+(
+    symbol_selector_t** new,
+    const char* pattern,
+    const char* replacement
+)
+{
+    symbol_selector_t* selector = NULL;
+    char* regex = NULL;
+    char* template = NULL;
+    size_t length = strlen(pattern);
+    size_t i = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    if (length >= 2 && pattern[0] == '/' && pattern[length - 1] == '/')
+    {
+        regex = strndup(pattern + 1, length - 2);
+        template = strdup(replacement);
+        status = regex == NULL || template == NULL ? DPATCH_STATUS_ENOMEM : DPATCH_STATUS_OK;
+    }
+    else
+    {
+        status = translate_glob(pattern, replacement, &regex, &template);
+    }
+    selector = IS_ERROR(status) ? NULL : calloc(1, sizeof(struct symbol_selector));
+    if (selector == NULL)
+    {
+        free(regex);
+        free(template);
+        return IS_ERROR(status) ? status : DPATCH_STATUS_ENOMEM;
+    }
+    if (regcomp(&selector->regex, regex, REG_EXTENDED) != 0)
+    {
+        free(regex);
+        free(template);
+        free(selector);
+        return DPATCH_STATUS_ESYNTAX;
+    }
+    free(regex);
+    selector->replacement = template;
+    for (i = 0; template[i] != '\0'; i++)
+    {
+        if (template[i] == '\\' && template[i + 1] >= '0' && template[i + 1] <= '9')
+        {
+            if ((size_t) (template[i + 1] - '0') > selector->regex.re_nsub)
+            {
+                symbol_selector_free(selector);
+                return DPATCH_STATUS_ESYNTAX;
+            }
+            i++;
+        }
+    }
+    *new = selector;
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Deallocate a selector.
+ *
+ * @param selector Handle to the selector to deallocate.
+ */
+void symbol_selector_free(symbol_selector_t* selector)
+{
+    if (selector == NULL)
+    {
+        return;
+    }
+    regfree(&selector->regex);
+    free(selector->replacement);
+    free(selector);
+}
+
+/**
+ * Match a function name against a selector.
+ *
+ * @param selector Handle to the selector.
+ * @param name The function name to match. The whole name
+ *      must match.
+ * @param replacement Buffer to store the replacement's name
+ *      in.
+ * @param length Size of `replacement` in bytes.
+ * @return `true` if `name` matches and the replacement's
+ * name fits in `replacement`.
+ */
+bool symbol_selector_match
+(
+    const symbol_selector_t* selector,
+    const char* name,
+    char* replacement,
+    size_t length
+)
+{
+    regmatch_t groups[SELECTOR_MAX_GROUPS];
+    const char* template = selector->replacement;
+    size_t used = 0;
+    size_t part = 0;
+    const char* text = NULL;
+    if (
+        regexec(&selector->regex, name, SELECTOR_MAX_GROUPS, groups, 0) != 0
+        || groups[0].rm_so != 0
+        || name[groups[0].rm_eo] != '\0'
+    )
+    {
+        return false;
+    }
+    for (; *template != '\0'; template++)
+    {
+        text = template;
+        part = 1;
+        if (template[0] == '\\' && template[1] >= '0' && template[1] <= '9')
+        {
+            template++;
+            text = name + groups[*template - '0'].rm_so;
+            part = groups[*template - '0'].rm_so == -1
+                ? 0
+                : (size_t) (groups[*template - '0'].rm_eo - groups[*template - '0'].rm_so);
+        }
+        if (used + part >= length)
+        {
+            return false;
+        }
+        memcpy(replacement + used, text, part);
+        used += part;
+    }
+    replacement[used] = '\0';
+    return true;
+}
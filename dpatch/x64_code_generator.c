@@ -25,20 +25,50 @@ dpatch_status append_undefined_opcode(machine_code_t* machine_code)
 }
 
 /**
- * Generate a long jump to a 64-bit address.
+ * Generate a short jump, relative to the end of the jump.
  *
  * @param machine_code The binary container to append to.
- * @param addr Address to jump to.
+ * @param displacement Signed distance to jump.
  * @return `DPATCH_STATUS_OK`, or an error on failure.
  */
-dpatch_status append_long_jump(machine_code_t* machine_code, intptr_t addr)
+dpatch_status append_short_jump(machine_code_t* machine_code, int8_t displacement)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    const uint8_t JMP_REL8_OPCODE = 0xeb;
+    PROPAGATE_ERROR(machine_code_append(machine_code, JMP_REL8_OPCODE), status);
+    return machine_code_append(machine_code, (uint8_t) displacement);
+}
+
+/**
+ * Generate a near jump, relative to the end of the jump.
+ *
+ * @param machine_code The binary container to append to.
+ * @param displacement Signed distance to jump.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_near_jump(machine_code_t* machine_code, int32_t displacement)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    const uint8_t JMP_REL32_OPCODE = 0xe9;
+    PROPAGATE_ERROR(machine_code_append(machine_code, JMP_REL32_OPCODE), status);
+    return machine_code_append_array(machine_code, sizeof displacement, (uint8_t*) &displacement);
+}
+
+/**
+ * Generate a jump to the 64-bit address stored at a
+ * location relative to the end of the jump.
+ *
+ * @param machine_code The binary container to append to.
+ * @param displacement Signed distance from the end of the
+ *      jump to the address to jump to.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_indirect_jump(machine_code_t* machine_code, int32_t displacement)
 {
     dpatch_status status = DPATCH_STATUS_OK;
     const uint8_t LJMP_OPCODE = 0xff;
     const uint8_t LJMP_MODRM_EXTENSION = 0x1 << 5;
     const uint8_t MODRM_RIP_RELATIVE = 0x5;
-    /* The jump pointer is immediately after this instruction. */
-    const uint32_t LJMP_RIP_DISPLACEMENT = 0x0;
     PROPAGATE_ERROR(
         machine_code_append(machine_code, LJMP_OPCODE),
         status
@@ -51,17 +81,296 @@ dpatch_status append_long_jump(machine_code_t* machine_code, intptr_t addr)
     );
     PROPAGATE_ERROR(
         machine_code_append_array(machine_code,
-            sizeof LJMP_RIP_DISPLACEMENT,
-            (uint8_t*) &LJMP_RIP_DISPLACEMENT
+            sizeof displacement,
+            (uint8_t*) &displacement
         ),
         status
     );
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Append a 64-bit address, as data, to machine code.
+ *
+ * @param machine_code The binary container to append to.
+ * @param addr The address to append.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_address(machine_code_t* machine_code, intptr_t addr)
+{
+    return machine_code_append_array(machine_code, sizeof addr, (uint8_t*) &addr);
+}
+
+/**
+ * Generate a long jump to a 64-bit address.
+ *
+ * @param machine_code The binary container to append to.
+ * @param addr Address to jump to.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_long_jump(machine_code_t* machine_code, intptr_t addr)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    /* The jump pointer is immediately after this instruction. */
+    PROPAGATE_ERROR(append_indirect_jump(machine_code, 0), status);
+    PROPAGATE_ERROR(append_address(machine_code, addr), status);
+    return DPATCH_STATUS_OK;
+}
+
+/**
+ * Generate a jump through a slot of a dispatch table.
+ *
+ * The table is found through a pointer at a fixed
+ * address, so every slot can be switched to a new table by
+ * replacing that pointer. The jump clobbers `r11`, which
+ * is free at a function's entry.
+ *
+ * @param machine_code The binary container to append to.
+ * @param table Address of the pointer to the current table.
+ * @param slot Index of the table entry to jump through.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_dispatch_jump(machine_code_t* machine_code, intptr_t table, uint32_t slot)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    /* mov r11, imm64 */
+    const uint8_t MOV_R11_IMM64[] = {0x49, 0xbb};
+    /* mov r11, [r11] */
+    const uint8_t MOV_R11_MEM_R11[] = {0x4d, 0x8b, 0x1b};
+    /* jmp [r11 + disp32] */
+    const uint8_t JMP_MEM_R11_DISP32[] = {0x41, 0xff, 0xa3};
+    int32_t displacement = (int32_t) (slot * sizeof(intptr_t));
     PROPAGATE_ERROR(
-        machine_code_append_array(machine_code,
-            sizeof addr,
-            (uint8_t*) &addr
-        ),
+        machine_code_append_array(machine_code, sizeof MOV_R11_IMM64, (uint8_t*) MOV_R11_IMM64),
         status
     );
-    return DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(append_address(machine_code, table), status);
+    PROPAGATE_ERROR(
+        machine_code_append_array(machine_code, sizeof MOV_R11_MEM_R11, (uint8_t*) MOV_R11_MEM_R11),
+        status
+    );
+    PROPAGATE_ERROR(
+        machine_code_append_array(machine_code, sizeof JMP_MEM_R11_DISP32, (uint8_t*) JMP_MEM_R11_DISP32),
+        status
+    );
+    return machine_code_append_array(machine_code, sizeof displacement, (uint8_t*) &displacement);
+}
+
+/**
+ * Append a `mov` of a 64-bit immediate to a register.
+ *
+ * @param machine_code The binary container to append to.
+ * @param opcode The REX prefix and opcode selecting the
+ *      register.
+ * @param value The immediate to load.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_mov_imm64(machine_code_t* machine_code, const uint8_t opcode[2], intptr_t value)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, 2, (uint8_t*) opcode), status);
+    return append_address(machine_code, value);
+}
+
+/**
+ * Append code which saves the x87 and vector registers in
+ * an area allocated on the stack.
+ *
+ * `rbp` must hold the stack pointer to restore afterwards.
+ * The code clobbers `rax` and `rdx`, and leaves the stack
+ * 64-byte aligned.
+ *
+ * @param machine_code The binary container to append to.
+ * @param components The `xsave` state components to save,
+ *      or 0 to save with `fxsave`.
+ * @param size Size of the `xsave` area in bytes.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_save_vector_state(machine_code_t* machine_code, uint32_t components, size_t size)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    /* sub rsp, imm32 */
+    const uint8_t SUB_RSP_IMM32[] = {0x48, 0x81, 0xec};
+    /* and rsp, -64 */
+    const uint8_t ALIGN_RSP[] = {0x48, 0x83, 0xe4, 0xc0};
+    /* xor eax, eax */
+    const uint8_t ZERO_RAX[] = {0x31, 0xc0};
+    /* mov [rsp + disp32], rax */
+    const uint8_t STORE_RAX[] = {0x48, 0x89, 0x84, 0x24};
+    /* mov eax, imm32 */
+    const uint8_t MOV_EAX_IMM32 = 0xb8;
+    /* xor edx, edx; xsave64 [rsp] */
+    const uint8_t XSAVE[] = {0x31, 0xd2, 0x48, 0x0f, 0xae, 0x24, 0x24};
+    /* fxsave64 [rsp] */
+    const uint8_t FXSAVE[] = {0x48, 0x0f, 0xae, 0x04, 0x24};
+    /* The `xsave` header follows the 512-byte legacy region, and must start zeroed. */
+    int32_t header = 512;
+    int32_t length = (int32_t) (components == 0 ? 512 : size);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof SUB_RSP_IMM32, (uint8_t*) SUB_RSP_IMM32), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof length, (uint8_t*) &length), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof ALIGN_RSP, (uint8_t*) ALIGN_RSP), status);
+    if (components == 0)
+    {
+        return machine_code_append_array(machine_code, sizeof FXSAVE, (uint8_t*) FXSAVE);
+    }
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof ZERO_RAX, (uint8_t*) ZERO_RAX), status);
+    for (; header < 576; header += 8)
+    {
+        PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof STORE_RAX, (uint8_t*) STORE_RAX), status);
+        PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof header, (uint8_t*) &header), status);
+    }
+    PROPAGATE_ERROR(machine_code_append(machine_code, MOV_EAX_IMM32), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof components, (uint8_t*) &components), status);
+    return machine_code_append_array(machine_code, sizeof XSAVE, (uint8_t*) XSAVE);
+}
+
+/**
+ * Append code which restores the registers saved by
+ * `append_save_vector_state`, and frees the area.
+ *
+ * The code clobbers `rax` and `rdx`, and restores the stack
+ * pointer from `rbp`.
+ *
+ * @param machine_code The binary container to append to.
+ * @param components The `xsave` state components saved,
+ *      or 0 if they were saved with `fxsave`.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_restore_vector_state(machine_code_t* machine_code, uint32_t components)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    /* mov eax, imm32 */
+    const uint8_t MOV_EAX_IMM32 = 0xb8;
+    /* xor edx, edx; xrstor64 [rsp] */
+    const uint8_t XRSTOR[] = {0x31, 0xd2, 0x48, 0x0f, 0xae, 0x2c, 0x24};
+    /* fxrstor64 [rsp] */
+    const uint8_t FXRSTOR[] = {0x48, 0x0f, 0xae, 0x0c, 0x24};
+    /* mov rsp, rbp */
+    const uint8_t FREE_AREA[] = {0x48, 0x89, 0xec};
+    if (components == 0)
+    {
+        PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof FXRSTOR, (uint8_t*) FXRSTOR), status);
+    }
+    else
+    {
+        PROPAGATE_ERROR(machine_code_append(machine_code, MOV_EAX_IMM32), status);
+        PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof components, (uint8_t*) &components), status);
+        PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof XRSTOR, (uint8_t*) XRSTOR), status);
+    }
+    return machine_code_append_array(machine_code, sizeof FREE_AREA, (uint8_t*) FREE_AREA);
+}
+
+/**
+ * Generate a stub which forwards most calls to `target`, and
+ * times every `*countdown`th call.
+ *
+ * The stub decrements the 32-bit counter at `countdown`, and
+ * jumps to `target` unless it underflows. On underflow, it
+ * saves the argument registers and the x87 and vector
+ * registers, and calls `enter(context, return_address)`,
+ * which resets the counter and returns the function to
+ * time, or 0 to decline. The stub then calls that function
+ * in place of its caller's return address, saves its return
+ * registers and the x87 and vector registers again, and
+ * calls `leave(context)`, which returns the caller's return
+ * address for the stub to jump back to.
+ *
+ * The x87 and vector registers are saved whole with `xsave`,
+ * so YMM and ZMM arguments and results survive the calls to
+ * `enter` and `leave`. If the kernel hasn't enabled `xsave`,
+ * there are no such registers, and `fxsave` is used. The
+ * sampled path doesn't preserve `r11`, which is free at a
+ * function's entry and exit.
+ *
+ * @param machine_code The binary container to append to.
+ * @param countdown Address of the 32-bit call counter.
+ * @param target Function unsampled calls are forwarded to.
+ * @param context Passed to `enter` and `leave`.
+ * @param enter Address of the function to call before a
+ *      sampled call.
+ * @param leave Address of the function to call after a
+ *      sampled call.
+ * @param vector_state The `xsave` state components to
+ *      save, or 0 to save with `fxsave`.
+ * @param vector_state_size Size of an `xsave` area holding
+ *      `vector_state`, in bytes.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+dpatch_status append_sampled_call
+(
+    machine_code_t* machine_code,
+    intptr_t countdown,
+    intptr_t target,
+    intptr_t context,
+    intptr_t enter,
+    intptr_t leave,
+    uint32_t vector_state,
+    size_t vector_state_size
+)
+{
+    dpatch_status status = DPATCH_STATUS_OK;
+    const uint8_t MOV_RAX_IMM64[] = {0x48, 0xb8};
+    const uint8_t MOV_RDI_IMM64[] = {0x48, 0xbf};
+    const uint8_t MOV_R11_IMM64[] = {0x49, 0xbb};
+    /* sub dword [r11], 1; jb over the forwarding jump. */
+    const uint8_t DECREMENT[] = {0x41, 0x83, 0x2b, 0x01, 0x72, 13};
+    /* jmp r11 */
+    const uint8_t JMP_R11[] = {0x41, 0xff, 0xe3};
+    /* push rdi, rsi, rdx, rcx, r8, r9, r10, rax, rbp; mov rbp, rsp */
+    const uint8_t SAVE_ARGUMENTS[] = {
+        0x57, 0x56, 0x52, 0x51, 0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x50, 0x55,
+        0x48, 0x89, 0xe5,
+    };
+    /* mov rsi, [rbp + 72], the caller's return address. */
+    const uint8_t LOAD_RETURN_ADDRESS[] = {0x48, 0x8b, 0x75, 0x48};
+    /* call rax; mov r11, rax */
+    const uint8_t CALL_RAX[] = {0xff, 0xd0, 0x49, 0x89, 0xc3};
+    /* The reverse of `SAVE_ARGUMENTS`, once the stack pointer is restored. */
+    const uint8_t RESTORE_ARGUMENTS[] = {
+        0x5d, 0x58, 0x41, 0x5a, 0x41, 0x59, 0x41, 0x58, 0x59, 0x5a, 0x5e, 0x5f,
+    };
+    /* test r11, r11; jnz over the forwarding jump. */
+    const uint8_t TEST_R11[] = {0x4d, 0x85, 0xdb, 0x75, 13};
+    /* add rsp, 8, dropping the caller's return address; call r11 */
+    const uint8_t CALL_R11[] = {0x48, 0x83, 0xc4, 0x08, 0x41, 0xff, 0xd3};
+    /* push rax, rdx, rbp; mov rbp, rsp */
+    const uint8_t SAVE_RESULT[] = {0x50, 0x52, 0x55, 0x48, 0x89, 0xe5};
+    /* The reverse of `SAVE_RESULT`, once the stack pointer is restored. */
+    const uint8_t RESTORE_RESULT[] = {0x5d, 0x5a, 0x58};
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_R11_IMM64, countdown), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof DECREMENT, (uint8_t*) DECREMENT), status);
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_R11_IMM64, target), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof JMP_R11, (uint8_t*) JMP_R11), status);
+    PROPAGATE_ERROR(
+        machine_code_append_array(machine_code, sizeof SAVE_ARGUMENTS, (uint8_t*) SAVE_ARGUMENTS),
+        status
+    );
+    PROPAGATE_ERROR(append_save_vector_state(machine_code, vector_state, vector_state_size), status);
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_RDI_IMM64, context), status);
+    PROPAGATE_ERROR(
+        machine_code_append_array(machine_code, sizeof LOAD_RETURN_ADDRESS, (uint8_t*) LOAD_RETURN_ADDRESS),
+        status
+    );
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_RAX_IMM64, enter), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof CALL_RAX, (uint8_t*) CALL_RAX), status);
+    PROPAGATE_ERROR(append_restore_vector_state(machine_code, vector_state), status);
+    PROPAGATE_ERROR(
+        machine_code_append_array(machine_code, sizeof RESTORE_ARGUMENTS, (uint8_t*) RESTORE_ARGUMENTS),
+        status
+    );
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof TEST_R11, (uint8_t*) TEST_R11), status);
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_R11_IMM64, target), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof JMP_R11, (uint8_t*) JMP_R11), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof CALL_R11, (uint8_t*) CALL_R11), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof SAVE_RESULT, (uint8_t*) SAVE_RESULT), status);
+    PROPAGATE_ERROR(append_save_vector_state(machine_code, vector_state, vector_state_size), status);
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_RDI_IMM64, context), status);
+    PROPAGATE_ERROR(append_mov_imm64(machine_code, MOV_RAX_IMM64, leave), status);
+    PROPAGATE_ERROR(machine_code_append_array(machine_code, sizeof CALL_RAX, (uint8_t*) CALL_RAX), status);
+    PROPAGATE_ERROR(append_restore_vector_state(machine_code, vector_state), status);
+    PROPAGATE_ERROR(
+        machine_code_append_array(machine_code, sizeof RESTORE_RESULT, (uint8_t*) RESTORE_RESULT),
+        status
+    );
+    return machine_code_append_array(machine_code, sizeof JMP_R11, (uint8_t*) JMP_R11);
 }
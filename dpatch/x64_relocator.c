@@ -0,0 +1,1038 @@
+/**
+ * @file dpatch/x64_relocator.c
+ *
+ * Relocator for x64 functions.
+ *
+ * Each instruction's length is decoded from its prefixes,
+ * opcode, ModRM, SIB, displacement and immediate, which is
+ * all a copy needs: no instruction's meaning is decoded
+ * beyond whether it branches or addresses memory relative to
+ * the instruction pointer. Instructions which can't be
+ * decoded, such as 3DNow! and XOP, or which are relative in
+ * ways that aren't adjusted, such as `loop`, `jrcxz` and
+ * `xbegin`, fail the relocation rather than being copied
+ * unadjusted.
+ *
+ * Branches are laid out again in the copy with 32-bit
+ * displacements. A branch out of the function which the
+ * copy can't reach with 32 bits jumps through a pointer in a
+ * pool after the copy. An operand out of reach is only
+ * rewritten for `lea` and loads with `mov`, which become a
+ * `mov` of the 64-bit address.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include "machine_code.h"
+#include "relocator.h"
+#include "status.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define X64_MAX_INSTRUCTION_LEN 15
+#define X64_INT3 0xcc
+#define X64_REX_W 0x08
+#define POOL_ENTRY_LEN 8
+
+/**
+ * The most a copied instruction can grow by, as a multiple
+ * of its length. A 2-byte conditional jump can become an
+ * 8-byte jump through an 8-byte pointer.
+ */
+#define RELOCATE_MAX_GROWTH 8
+
+/* Operands following a one or two byte opcode. */
+#define OPERAND_MODRM 0x001
+#define OPERAND_IMM8 0x002
+#define OPERAND_IMM16 0x004
+/* 32 bits, or 16 with an operand size prefix. */
+#define OPERAND_IMMZ 0x008
+/* 32 bits, 64 with `REX.W`, or 16 with an operand size prefix. */
+#define OPERAND_IMMV 0x010
+/* A 64-bit address, or 32 with an address size prefix. */
+#define OPERAND_MOFFS 0x020
+#define OPERAND_REL8 0x040
+#define OPERAND_REL32 0x080
+/* An immediate, if ModRM.reg is 0 or 1. */
+#define OPERAND_GROUP3 0x100
+#define OPERAND_INVALID 0x200
+
+/**
+ * What an instruction refers to relative to itself.
+ */
+enum instruction_kind
+{
+    /** Nothing. The instruction is copied as it is. */
+    INSTRUCTION_PLAIN,
+
+    /** A memory operand relative to the instruction pointer. */
+    INSTRUCTION_RIP_RELATIVE,
+
+    /** An unconditional jump. */
+    INSTRUCTION_JUMP,
+
+    /** A conditional jump. */
+    INSTRUCTION_CONDITIONAL_JUMP,
+
+    /** A call. */
+    INSTRUCTION_CALL,
+};
+
+/**
+ * How an instruction is written in the copy.
+ */
+enum instruction_form
+{
+    /** Copied, with any relative displacement adjusted. */
+    FORM_COPY,
+
+    /** A branch with a 32-bit displacement. */
+    FORM_NEAR,
+
+    /** A branch through a pointer in the pool. */
+    FORM_POOL,
+
+    /** `lea` replaced with a `mov` of the address. */
+    FORM_ABSOLUTE_LEA,
+
+    /** A load replaced with a `mov` of the address, then a load through it. */
+    FORM_ABSOLUTE_LOAD,
+};
+
+/**
+ * An instruction in the function being relocated.
+ */
+struct instruction
+{
+    /** Offset of the instruction in the function. */
+    size_t offset;
+
+    /** Length of the instruction in bytes. */
+    size_t length;
+
+    /** What the instruction refers to relative to itself. */
+    enum instruction_kind kind;
+
+    /** Offset of the relative displacement in the instruction. */
+    size_t displacement_offset;
+
+    /** Size of the relative displacement in bytes. */
+    size_t displacement_length;
+
+    /** Condition code of a conditional jump. */
+    uint8_t condition;
+
+    /** Address the instruction refers to. */
+    intptr_t target;
+
+    /** Whether `target` is inside the function. */
+    bool internal;
+
+    /** Index of the instruction at `target`, if `internal`. */
+    size_t target_index;
+
+    /** Whether the instruction has legacy prefixes. */
+    bool prefixed;
+
+    /** The instruction's `REX` prefix, or 0. */
+    uint8_t rex;
+
+    /** Opcode map: 0 for one-byte opcodes, 1 for `0f`, 2 for `0f 38` or 3 for `0f 3a`. */
+    uint8_t map;
+
+    /** The instruction's opcode. */
+    uint8_t opcode;
+
+    /** The instruction's ModRM byte, or 0. */
+    uint8_t modrm;
+
+    /** How the instruction is written in the copy. */
+    enum instruction_form form;
+
+    /** Offset of the instruction in the copy. */
+    size_t new_offset;
+
+    /** Length of the instruction in the copy. */
+    size_t new_length;
+
+    /** Index of the instruction's pointer in the pool, if `FORM_POOL`. */
+    size_t pool_index;
+};
+
+/**
+ * Get the operands of a one-byte opcode.
+ *
+ * @param opcode The opcode.
+ * @return `OPERAND_*` flags.
+ */
+static unsigned int one_byte_operands(uint8_t opcode)
+{
+    if (opcode < 0x40)
+    {
+        switch (opcode & 0x07)
+        {
+        case 0x04:
+            return OPERAND_IMM8;
+        case 0x05:
+            return OPERAND_IMMZ;
+        case 0x06:
+        case 0x07:
+            return OPERAND_INVALID;
+        default:
+            return OPERAND_MODRM;
+        }
+    }
+    if ((opcode >= 0x50 && opcode <= 0x5f) || (opcode >= 0x90 && opcode <= 0x99) || (opcode >= 0x9b && opcode <= 0x9f))
+    {
+        return 0;
+    }
+    if (opcode >= 0x70 && opcode <= 0x7f)
+    {
+        return OPERAND_REL8;
+    }
+    if (opcode >= 0xb0 && opcode <= 0xb7)
+    {
+        return OPERAND_IMM8;
+    }
+    if (opcode >= 0xb8 && opcode <= 0xbf)
+    {
+        return OPERAND_IMMV;
+    }
+    if ((opcode >= 0x84 && opcode <= 0x8f) || (opcode >= 0xd0 && opcode <= 0xd3) || (opcode >= 0xd8 && opcode <= 0xdf))
+    {
+        return OPERAND_MODRM;
+    }
+    switch (opcode)
+    {
+    case 0x63:
+    case 0xfe:
+    case 0xff:
+        return OPERAND_MODRM;
+    case 0x69:
+    case 0x81:
+    case 0xc7:
+        return OPERAND_MODRM | OPERAND_IMMZ;
+    case 0x6b:
+    case 0x80:
+    case 0x83:
+    case 0xc0:
+    case 0xc1:
+    case 0xc6:
+        return OPERAND_MODRM | OPERAND_IMM8;
+    case 0xf6:
+    case 0xf7:
+        return OPERAND_MODRM | OPERAND_GROUP3;
+    case 0x68:
+    case 0xa9:
+        return OPERAND_IMMZ;
+    case 0x6a:
+    case 0xa8:
+    case 0xcd:
+    case 0xe4:
+    case 0xe5:
+    case 0xe6:
+    case 0xe7:
+        return OPERAND_IMM8;
+    case 0xc2:
+    case 0xca:
+        return OPERAND_IMM16;
+    case 0xc8:
+        return OPERAND_IMM16 | OPERAND_IMM8;
+    case 0xa0:
+    case 0xa1:
+    case 0xa2:
+    case 0xa3:
+        return OPERAND_MOFFS;
+    case 0xe8:
+    case 0xe9:
+        return OPERAND_REL32;
+    case 0xeb:
+        return OPERAND_REL8;
+    case 0x6c:
+    case 0x6d:
+    case 0x6e:
+    case 0x6f:
+    case 0xa4:
+    case 0xa5:
+    case 0xa6:
+    case 0xa7:
+    case 0xaa:
+    case 0xab:
+    case 0xac:
+    case 0xad:
+    case 0xae:
+    case 0xaf:
+    case 0xc3:
+    case 0xc9:
+    case 0xcb:
+    case 0xcc:
+    case 0xcf:
+    case 0xd7:
+    case 0xec:
+    case 0xed:
+    case 0xee:
+    case 0xef:
+    case 0xf1:
+    case 0xf4:
+    case 0xf5:
+    case 0xf8:
+    case 0xf9:
+    case 0xfa:
+    case 0xfb:
+    case 0xfc:
+    case 0xfd:
+        return 0;
+    default:
+        /* Including `loop` and `jrcxz`, whose 8-bit displacements can't be widened. */
+        return OPERAND_INVALID;
+    }
+}
+
+/**
+ * Test if an opcode in the `0f` map takes an 8-bit
+ * immediate.
+ *
+ * @param opcode The opcode, after `0f`.
+ * @return `true` if an 8-bit immediate follows the ModRM.
+ */
+static bool two_byte_takes_imm8(uint8_t opcode)
+{
+    return (opcode >= 0x70 && opcode <= 0x73)
+        || opcode == 0xa4
+        || opcode == 0xac
+        || opcode == 0xba
+        || opcode == 0xc2
+        || opcode == 0xc4
+        || opcode == 0xc5
+        || opcode == 0xc6;
+}
+
+/**
+ * Get the operands of an opcode in the `0f` map.
+ *
+ * @param opcode The opcode, after `0f`.
+ * @return `OPERAND_*` flags.
+ */
+static unsigned int two_byte_operands(uint8_t opcode)
+{
+    if (opcode >= 0x80 && opcode <= 0x8f)
+    {
+        return OPERAND_REL32;
+    }
+    if (
+        (opcode >= 0x05 && opcode <= 0x09)
+        || opcode == 0x0b
+        || opcode == 0x0e
+        || (opcode >= 0x30 && opcode <= 0x37)
+        || opcode == 0x77
+        || (opcode >= 0xa0 && opcode <= 0xa2)
+        || (opcode >= 0xa8 && opcode <= 0xaa)
+        || (opcode >= 0xc8 && opcode <= 0xcf)
+    )
+    {
+        return 0;
+    }
+    if (opcode == 0x0f)
+    {
+        /* 3DNow! */
+        return OPERAND_INVALID;
+    }
+    return OPERAND_MODRM | (two_byte_takes_imm8(opcode) ? OPERAND_IMM8 : 0);
+}
+
+/**
+ * Test if a byte is a legacy prefix.
+ *
+ * @param byte The byte to test.
+ * @return `true` if `byte` is a lock, repeat, segment,
+ * operand size or address size prefix.
+ */
+static bool is_legacy_prefix(uint8_t byte)
+{
+    switch (byte)
+    {
+    case 0x26:
+    case 0x2e:
+    case 0x36:
+    case 0x3e:
+    case 0x64:
+    case 0x65:
+    case 0x66:
+    case 0x67:
+    case 0xf0:
+    case 0xf2:
+    case 0xf3:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Decode the length of an instruction, and where any
+ * relative displacement in it is.
+ *
+ * @param code The instruction.
+ * @param available The number of bytes readable at `code`.
+ * @param instruction Location to store the instruction.
+ * @param reason Location to store why the instruction
+ *      can't be decoded, if it can't.
+ * @return `true` if the instruction was decoded.
+ */
+static bool decode_instruction
+(
+    const uint8_t* code,
+    size_t available,
+    struct instruction* instruction,
+    const char** reason
+)
+{
+    unsigned int operands = 0;
+    bool operand_size = false;
+    bool address_size = false;
+    size_t vex_length = 0;
+    size_t displacement = 0;
+    size_t i = 0;
+    uint8_t mod = 0;
+    if (available > X64_MAX_INSTRUCTION_LEN)
+    {
+        available = X64_MAX_INSTRUCTION_LEN;
+    }
+    *reason = "an instruction runs past the end of the function";
+    for (; i < available && is_legacy_prefix(code[i]); i++)
+    {
+        operand_size = operand_size || code[i] == 0x66;
+        address_size = address_size || code[i] == 0x67;
+        instruction->prefixed = true;
+    }
+    if (i < available && (code[i] & 0xf0) == 0x40)
+    {
+        instruction->rex = code[i++];
+    }
+    if (i >= available)
+    {
+        return false;
+    }
+    instruction->opcode = code[i++];
+    if (instruction->opcode == 0xc4 || instruction->opcode == 0xc5 || instruction->opcode == 0x62)
+    {
+        /* VEX and EVEX prefixes, which are never `les`, `lds` or `bound` in 64-bit mode. */
+        vex_length = instruction->opcode == 0xc5 ? 1 : instruction->opcode == 0xc4 ? 2 : 3;
+        if (i + vex_length >= available)
+        {
+            return false;
+        }
+        instruction->map = instruction->opcode == 0xc5
+            ? 1
+            : (uint8_t) (code[i] & (instruction->opcode == 0xc4 ? 0x1f : 0x07));
+        i += vex_length;
+        instruction->opcode = code[i++];
+        if (instruction->map < 1 || instruction->map > 3)
+        {
+            *reason = "an instruction uses an unknown VEX or EVEX opcode map";
+            return false;
+        }
+        operands = OPERAND_MODRM
+            | (instruction->map == 3 || (instruction->map == 1 && two_byte_takes_imm8(instruction->opcode))
+                ? OPERAND_IMM8
+                : 0);
+        if (instruction->map == 1 && instruction->opcode == 0x77)
+        {
+            /* `vzeroupper` and `vzeroall`. */
+            operands = 0;
+        }
+    }
+    else if (instruction->opcode == 0x0f)
+    {
+        if (i >= available)
+        {
+            return false;
+        }
+        instruction->opcode = code[i++];
+        instruction->map = 1;
+        if (instruction->opcode == 0x38 || instruction->opcode == 0x3a)
+        {
+            if (i >= available)
+            {
+                return false;
+            }
+            instruction->map = instruction->opcode == 0x38 ? 2 : 3;
+            instruction->opcode = code[i++];
+            operands = OPERAND_MODRM | (instruction->map == 3 ? OPERAND_IMM8 : 0);
+        }
+        else
+        {
+            operands = two_byte_operands(instruction->opcode);
+        }
+    }
+    else
+    {
+        operands = one_byte_operands(instruction->opcode);
+        /* `8f` with a non-zero ModRM.reg is an XOP prefix. */
+        if (instruction->opcode == 0x8f && i < available && (code[i] & 0x38) != 0)
+        {
+            operands = OPERAND_INVALID;
+        }
+    }
+    if (operands & OPERAND_INVALID)
+    {
+        *reason = "an instruction couldn't be decoded";
+        return false;
+    }
+    if (operands & OPERAND_MODRM)
+    {
+        if (i >= available)
+        {
+            return false;
+        }
+        instruction->modrm = code[i++];
+        mod = instruction->modrm >> 6;
+        if (mod != 3 && (instruction->modrm & 0x07) == 0x04)
+        {
+            if (i >= available)
+            {
+                return false;
+            }
+            displacement = mod == 0 && (code[i] & 0x07) == 0x05 ? 4 : 0;
+            i++;
+        }
+        if (mod == 0 && (instruction->modrm & 0x07) == 0x05)
+        {
+            instruction->kind = INSTRUCTION_RIP_RELATIVE;
+            instruction->displacement_offset = i;
+            instruction->displacement_length = 4;
+            displacement = 4;
+        }
+        else if (mod == 1)
+        {
+            displacement = 1;
+        }
+        else if (mod == 2)
+        {
+            displacement = 4;
+        }
+        i += displacement;
+        if ((operands & OPERAND_GROUP3) && ((instruction->modrm >> 3) & 0x07) < 2)
+        {
+            operands |= instruction->opcode == 0xf6 ? OPERAND_IMM8 : OPERAND_IMMZ;
+        }
+        if (instruction->map == 0 && instruction->opcode == 0xc7 && instruction->modrm == 0xf8)
+        {
+            *reason = "the function uses xbegin";
+            return false;
+        }
+    }
+    if (operands & (OPERAND_REL8 | OPERAND_REL32))
+    {
+        /* `REX.W` overrides the operand size prefix, as in the padding before calls to `__tls_get_addr`. */
+        if (operand_size && !(instruction->rex & X64_REX_W))
+        {
+            *reason = "the function has a 16-bit branch";
+            return false;
+        }
+        instruction->displacement_offset = i;
+        instruction->displacement_length = operands & OPERAND_REL8 ? 1 : 4;
+        i += instruction->displacement_length;
+        if (instruction->map == 0 && instruction->opcode == 0xe8)
+        {
+            instruction->kind = INSTRUCTION_CALL;
+        }
+        else if (instruction->map == 0 && (instruction->opcode == 0xe9 || instruction->opcode == 0xeb))
+        {
+            instruction->kind = INSTRUCTION_JUMP;
+        }
+        else
+        {
+            instruction->kind = INSTRUCTION_CONDITIONAL_JUMP;
+            instruction->condition = instruction->opcode & 0x0f;
+        }
+    }
+    i += operands & OPERAND_IMM8 ? 1 : 0;
+    i += operands & OPERAND_IMM16 ? 2 : 0;
+    i += operands & OPERAND_IMMZ ? (operand_size && !(instruction->rex & X64_REX_W) ? 2 : 4) : 0;
+    i += operands & OPERAND_IMMV ? (instruction->rex & X64_REX_W ? 8 : operand_size ? 2 : 4) : 0;
+    i += operands & OPERAND_MOFFS ? (address_size ? 4 : 8) : 0;
+    if (i > available)
+    {
+        return false;
+    }
+    if (instruction->kind == INSTRUCTION_RIP_RELATIVE && address_size)
+    {
+        *reason = "the function has a 32-bit instruction relative operand";
+        return false;
+    }
+    instruction->length = i;
+    return true;
+}
+
+/**
+ * Read an instruction's relative displacement, and find
+ * the address it refers to.
+ *
+ * @param instruction The decoded instruction.
+ * @param address Address of the instruction.
+ * @return The address the displacement refers to.
+ */
+static intptr_t relative_target(const struct instruction* instruction, intptr_t address)
+{
+    const uint8_t* field = (const uint8_t*) address + instruction->displacement_offset;
+    int32_t displacement = 0;
+    int8_t short_displacement = 0;
+    if (instruction->displacement_length == 1)
+    {
+        memcpy(&short_displacement, field, 1);
+        displacement = short_displacement;
+    }
+    else
+    {
+        memcpy(&displacement, field, 4);
+    }
+    return address + (intptr_t) instruction->length + displacement;
+}
+
+/**
+ * Test if an address can be reached with a 32-bit
+ * displacement from anywhere near another.
+ *
+ * @param from Address the displacement is relative to.
+ * @param to Address to reach.
+ * @param slack Distance `from` may move by.
+ * @return `true` if `to` is in reach.
+ */
+static bool in_reach(intptr_t from, intptr_t to, intptr_t slack)
+{
+    intptr_t distance = to - from;
+    return distance > (intptr_t) INT32_MIN + slack && distance < (intptr_t) INT32_MAX - slack;
+}
+
+/**
+ * Get the register an instruction's ModRM.reg names.
+ *
+ * @param instruction The instruction.
+ * @return The register's number, from 0 to 15.
+ */
+static uint8_t modrm_register(const struct instruction* instruction)
+{
+    return (uint8_t) (((instruction->rex >> 2) & 0x01) << 3 | ((instruction->modrm >> 3) & 0x07));
+}
+
+/**
+ * Get the length of a load through the register it loads,
+ * as written by `FORM_ABSOLUTE_LOAD`.
+ *
+ * @param instruction The load being rewritten.
+ * @return Length of the load in bytes.
+ */
+static size_t indirect_load_length(const struct instruction* instruction)
+{
+    uint8_t reg = modrm_register(instruction);
+    size_t length = 2;
+    if ((instruction->rex & X64_REX_W) || reg >= 8)
+    {
+        length++;
+    }
+    /* `rsp` and `r12` need a SIB, and `rbp` and `r13` a displacement. */
+    if ((reg & 0x07) == 0x04 || (reg & 0x07) == 0x05)
+    {
+        length++;
+    }
+    return length;
+}
+
+/**
+ * Choose how an instruction is written in the copy.
+ *
+ * @param instruction The instruction.
+ * @param destination Address the copy will be written to.
+ * @param slack Distance between `destination` and the end
+ *      of the copy, at most.
+ * @param reason Location to store why the instruction
+ *      can't be relocated, if it can't.
+ * @return `true` if the instruction can be relocated.
+ */
+static bool choose_form
+(
+    struct instruction* instruction,
+    intptr_t destination,
+    intptr_t slack,
+    const char** reason
+)
+{
+    bool reachable = instruction->internal || in_reach(destination, instruction->target, slack);
+    instruction->form = FORM_COPY;
+    instruction->new_length = instruction->length;
+    switch (instruction->kind)
+    {
+    case INSTRUCTION_PLAIN:
+        return true;
+    case INSTRUCTION_RIP_RELATIVE:
+        if (reachable)
+        {
+            return true;
+        }
+        if (instruction->prefixed || instruction->map != 0)
+        {
+            break;
+        }
+        if (instruction->opcode == 0x8d && (instruction->rex & X64_REX_W))
+        {
+            instruction->form = FORM_ABSOLUTE_LEA;
+            instruction->new_length = 10;
+            return true;
+        }
+        if (instruction->opcode == 0x8b)
+        {
+            instruction->form = FORM_ABSOLUTE_LOAD;
+            instruction->new_length = 10 + indirect_load_length(instruction);
+            return true;
+        }
+        break;
+    case INSTRUCTION_JUMP:
+    case INSTRUCTION_CALL:
+        instruction->form = reachable ? FORM_NEAR : FORM_POOL;
+        instruction->new_length = reachable ? 5 : 6;
+        return true;
+    case INSTRUCTION_CONDITIONAL_JUMP:
+        instruction->form = reachable ? FORM_NEAR : FORM_POOL;
+        instruction->new_length = reachable ? 6 : 8;
+        return true;
+    }
+    *reason = "an instruction relative operand is out of reach of the copy";
+    return false;
+}
+
+/**
+ * Append a 32-bit displacement to machine code.
+ *
+ * @param copy The machine code to append to.
+ * @param displacement The displacement.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_int32(machine_code_t* copy, intptr_t displacement)
+{
+    int32_t value = (int32_t) displacement;
+    return machine_code_append_array(copy, sizeof value, (uint8_t*) &value);
+}
+
+/**
+ * Append a `mov` of a 64-bit immediate to a register.
+ *
+ * @param copy The machine code to append to.
+ * @param reg The register's number, from 0 to 15.
+ * @param value The immediate.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_mov_imm64(machine_code_t* copy, uint8_t reg, intptr_t value)
+{
+    uint8_t opcode[2];
+    opcode[0] = (uint8_t) (0x48 | (reg >> 3));
+    opcode[1] = (uint8_t) (0xb8 + (reg & 0x07));
+    dpatch_status status = DPATCH_STATUS_OK;
+    PROPAGATE_ERROR(machine_code_append_array(copy, sizeof opcode, opcode), status);
+    return machine_code_append_array(copy, sizeof value, (uint8_t*) &value);
+}
+
+/**
+ * Append a load through the register being loaded, as
+ * written by `FORM_ABSOLUTE_LOAD`.
+ *
+ * @param copy The machine code to append to.
+ * @param instruction The load being rewritten.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_indirect_load(machine_code_t* copy, const struct instruction* instruction)
+{
+    uint8_t reg = modrm_register(instruction);
+    uint8_t low = reg & 0x07;
+    uint8_t bytes[5];
+    size_t length = 0;
+    if ((instruction->rex & X64_REX_W) || reg >= 8)
+    {
+        /* `REX.R` and `REX.B` both name the same register. */
+        bytes[length++] = (uint8_t) (0x40 | (instruction->rex & X64_REX_W) | (reg >= 8 ? 0x05 : 0x00));
+    }
+    bytes[length++] = 0x8b;
+    if (low == 0x05)
+    {
+        bytes[length++] = (uint8_t) (0x40 | low << 3 | low);
+        bytes[length++] = 0x00;
+    }
+    else if (low == 0x04)
+    {
+        bytes[length++] = (uint8_t) (low << 3 | 0x04);
+        bytes[length++] = 0x24;
+    }
+    else
+    {
+        bytes[length++] = (uint8_t) (low << 3 | low);
+    }
+    return machine_code_append_array(copy, length, bytes);
+}
+
+/**
+ * Append an instruction to the copy, in its chosen form.
+ *
+ * @param copy The machine code to append to.
+ * @param instructions Every instruction in the function.
+ * @param instruction The instruction to append.
+ * @param function Address of the original function.
+ * @param destination Address the copy will be written to.
+ * @param pool Offset of the pointer pool in the copy.
+ * @return `DPATCH_STATUS_OK`, or an error on failure.
+ */
+static dpatch_status append_instruction
+(
+    machine_code_t* copy,
+    const struct instruction* instructions,
+    const struct instruction* instruction,
+    intptr_t function,
+    intptr_t destination,
+    size_t pool
+)
+{
+    uint8_t bytes[X64_MAX_INSTRUCTION_LEN];
+    intptr_t end = destination + (intptr_t) (instruction->new_offset + instruction->new_length);
+    intptr_t target = instruction->internal
+        ? destination + (intptr_t) instructions[instruction->target_index].new_offset
+        : instruction->target;
+    intptr_t pointer = destination + (intptr_t) (pool + instruction->pool_index * POOL_ENTRY_LEN);
+    int32_t displacement = (int32_t) (target - end);
+    dpatch_status status = DPATCH_STATUS_OK;
+    memcpy(bytes, (const uint8_t*) function + instruction->offset, instruction->length);
+    switch (instruction->form)
+    {
+    case FORM_COPY:
+        if (instruction->kind == INSTRUCTION_RIP_RELATIVE)
+        {
+            memcpy(bytes + instruction->displacement_offset, &displacement, sizeof displacement);
+        }
+        return machine_code_append_array(copy, instruction->length, bytes);
+    case FORM_NEAR:
+        if (instruction->kind == INSTRUCTION_CONDITIONAL_JUMP)
+        {
+            PROPAGATE_ERROR(machine_code_append(copy, 0x0f), status);
+            PROPAGATE_ERROR(machine_code_append(copy, (uint8_t) (0x80 | instruction->condition)), status);
+        }
+        else
+        {
+            PROPAGATE_ERROR(
+                machine_code_append(copy, instruction->kind == INSTRUCTION_CALL ? 0xe8 : 0xe9),
+                status
+            );
+        }
+        return append_int32(copy, target - end);
+    case FORM_POOL:
+        if (instruction->kind == INSTRUCTION_CONDITIONAL_JUMP)
+        {
+            /* Skip the jump through the pool unless the condition holds. */
+            PROPAGATE_ERROR(machine_code_append(copy, (uint8_t) (0x70 | (instruction->condition ^ 0x01))), status);
+            PROPAGATE_ERROR(machine_code_append(copy, 0x06), status);
+        }
+        PROPAGATE_ERROR(machine_code_append(copy, 0xff), status);
+        PROPAGATE_ERROR(
+            machine_code_append(copy, instruction->kind == INSTRUCTION_CALL ? 0x15 : 0x25),
+            status
+        );
+        return append_int32(copy, pointer - end);
+    case FORM_ABSOLUTE_LEA:
+        return append_mov_imm64(copy, modrm_register(instruction), instruction->target);
+    case FORM_ABSOLUTE_LOAD:
+        PROPAGATE_ERROR(append_mov_imm64(copy, modrm_register(instruction), instruction->target), status);
+        return append_indirect_load(copy, instruction);
+    }
+    return DPATCH_STATUS_ERROR;
+}
+
+/**
+ * Find the instruction at an offset in the function.
+ *
+ * @param instructions The function's instructions, in order.
+ * @param count The number of instructions.
+ * @param offset The offset to find.
+ * @param index Location to store the instruction's index.
+ * @return `true` if an instruction starts at `offset`.
+ */
+static bool find_instruction
+(
+    const struct instruction* instructions,
+    size_t count,
+    size_t offset,
+    size_t* index
+)
+{
+    size_t low = 0;
+    size_t high = count;
+    size_t middle = 0;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (instructions[middle].offset < offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    *index = low;
+    return low < count && instructions[low].offset == offset;
+}
+
+/**
+ * Get the most space a function's relocated copy can need.
+ *
+ * @param length Length of the function in bytes.
+ * @return The longest the copy can be, in bytes.
+ */
+size_t relocate_max_length(size_t length)
+{
+    return length * RELOCATE_MAX_GROWTH + POOL_ENTRY_LEN;
+}
+
+/**
+ * Encode a copy of a function which runs at a new address.
+ *
+ * Branches within the function are kept within the copy.
+ * Branches out of it, and instruction relative memory
+ * operands, are adjusted to reach what they reached from
+ * the original.
+ *
+ * @param function Address of the function's first byte.
+ * @param length Length of the function in bytes.
+ * @param destination Address the copy will be written to.
+ * @param copy Machine code to append the copy to.
+ * @param reason Location to store why the function can't
+ *      be relocated, if it can't.
+ * @return `DPATCH_STATUS_OK`, `DPATCH_STATUS_EUNKNOWN` if
+ * the function contains an instruction which can't be
+ * relocated, or an error on failure.
+ */
+dpatch_status relocate_function
+(
+    intptr_t function,
+    size_t length,
+    intptr_t destination,
+    machine_code_t* copy,
+    const char** reason
+)
+{
+    struct instruction* instructions = NULL;
+    intptr_t slack = (intptr_t) relocate_max_length(length);
+    size_t count = 0;
+    size_t offset = 0;
+    size_t pool = 0;
+    size_t pool_length = 0;
+    size_t i = 0;
+    dpatch_status status = DPATCH_STATUS_OK;
+    instructions = calloc(length == 0 ? 1 : length, sizeof(struct instruction));
+    if (instructions == NULL)
+    {
+        return DPATCH_STATUS_ENOMEM;
+    }
+    for (offset = 0; offset < length; offset += instructions[count++].length)
+    {
+        instructions[count].offset = offset;
+        if (!decode_instruction((const uint8_t*) function + offset, length - offset, &instructions[count], reason))
+        {
+            free(instructions);
+            return DPATCH_STATUS_EUNKNOWN;
+        }
+        if (instructions[count].kind != INSTRUCTION_PLAIN)
+        {
+            instructions[count].target = relative_target(&instructions[count], function + (intptr_t) offset);
+        }
+    }
+    for (i = 0; i < count; i++)
+    {
+        struct instruction* instruction = &instructions[i];
+        instruction->internal = instruction->kind != INSTRUCTION_PLAIN
+            && instruction->target >= function
+            && instruction->target < function + (intptr_t) length;
+        if (
+            instruction->internal
+            && !find_instruction(instructions, count, (size_t) (instruction->target - function), &instruction->target_index)
+        )
+        {
+            *reason = "a branch or operand refers into the middle of an instruction";
+            free(instructions);
+            return DPATCH_STATUS_EUNKNOWN;
+        }
+        if (!choose_form(instruction, destination, slack, reason))
+        {
+            free(instructions);
+            return DPATCH_STATUS_EUNKNOWN;
+        }
+        instruction->new_offset = pool;
+        instruction->pool_index = pool_length;
+        pool += instruction->new_length;
+        pool_length += instruction->form == FORM_POOL ? 1 : 0;
+    }
+    /* The pool follows the code, aligned so its pointers are. */
+    pool = (pool + POOL_ENTRY_LEN - 1) / POOL_ENTRY_LEN * POOL_ENTRY_LEN;
+    for (i = 0; i < count && !IS_ERROR(status); i++)
+    {
+        status = append_instruction(copy, instructions, &instructions[i], function, destination, pool);
+    }
+    while (!IS_ERROR(status) && machine_code_length(copy) < pool)
+    {
+        status = machine_code_append(copy, X64_INT3);
+    }
+    for (i = 0; i < count && !IS_ERROR(status); i++)
+    {
+        if (instructions[i].form == FORM_POOL)
+        {
+            status = machine_code_append_array(copy, sizeof instructions[i].target, (uint8_t*) &instructions[i].target);
+        }
+    }
+    free(instructions);
+    return status;
+}
+
+/**
+ * Visit every address outside a function which one of its
+ * branches or instruction relative memory operands refers
+ * to.
+ *
+ * @param function Address of the function's first byte.
+ * @param length Length of the function in bytes.
+ * @param visit Function to call with each address.
+ * @param context Passed to `visit`.
+ * @return `DPATCH_STATUS_OK`, or `DPATCH_STATUS_EUNKNOWN`
+ * if the function contains an instruction which can't be
+ * decoded.
+ */
+dpatch_status relocate_references
+(
+    intptr_t function,
+    size_t length,
+    relocate_reference_visitor visit,
+    void* context
+)
+{
+    struct instruction instruction;
+    const char* reason = NULL;
+    intptr_t target = 0;
+    size_t offset = 0;
+    for (offset = 0; offset < length; offset += instruction.length)
+    {
+        memset(&instruction, 0, sizeof instruction);
+        if (!decode_instruction((const uint8_t*) function + offset, length - offset, &instruction, &reason))
+        {
+            return DPATCH_STATUS_EUNKNOWN;
+        }
+        if (instruction.kind == INSTRUCTION_PLAIN)
+        {
+            continue;
+        }
+        target = relative_target(&instruction, function + (intptr_t) offset);
+        if (target < function || target >= function + (intptr_t) length)
+        {
+            visit(target, context);
+        }
+    }
+    return DPATCH_STATUS_OK;
+}
@@ -0,0 +1,513 @@
+/**
+ * @file tools/attach.c
+ *
+ * `dpatch-attach` applies a patch script to a running
+ * process which was not started under `LD_AUDIT`.
+ *
+ * The tool stops every thread of the target with `ptrace`,
+ * hijacks one thread to call `dlopen` on `libdpatch`, then
+ * calls `libdpatch`'s `dpatch_attach` entry point to apply
+ * the script before restoring the thread and detaching.
+ *
+ * Addresses in the target are found by looking up the
+ * offset of a symbol in this process' copy of its object,
+ * then adding the base address of the same object in the
+ * target's `/proc/<pid>/maps`.
+ *
+ * @warning The hijacked thread calls `dlopen` and `malloc`
+ * from whatever point it was stopped at. If another thread
+ * was stopped holding the loader or allocator locks, the
+ * call will deadlock.
+ *
+ * @author H Paterson.
+ * @copyright BSL-1.0.
+ * @date October 2026.
+ */
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ATTACH_ENTRY_SYMBOL "dpatch_attach"
+#define MAX_THREADS 4096
+
+/* Stack space skipped below the target's stack pointer. */
+#define RED_ZONE 128
+#define STACK_MARGIN 256
+
+#ifndef DPATCH_LIBRARY_PATH
+#define DPATCH_LIBRARY_PATH "/usr/local/lib/libdpatch.so"
+#endif
+
+/**
+ * A process being attached to.
+ */
+struct target
+{
+    /** The target's process ID. */
+    pid_t pid;
+
+    /** File descriptor for `/proc/<pid>/mem`. */
+    int mem_fd;
+
+    /** Thread IDs stopped by the tool. */
+    pid_t threads[MAX_THREADS];
+
+    /** The number of threads stopped. */
+    size_t thread_count;
+};
+
+/**
+ * Get the current monotonic time in milliseconds.
+ *
+ * @return Milliseconds since an arbitrary epoch.
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Test if a thread has already been stopped.
+ *
+ * @param target The target process.
+ * @param tid The thread ID to test.
+ * @return `true` if `tid` is attached.
+ */
+static int is_attached(struct target* target, pid_t tid)
+{
+    size_t i = 0;
+    for (i = 0; i < target->thread_count; i++)
+    {
+        if (target->threads[i] == tid)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Seize and interrupt a single thread, waiting until it
+ * has stopped.
+ *
+ * @param tid The thread to stop.
+ * @return 0, or -1 on failure.
+ */
+static int stop_thread(pid_t tid)
+{
+    int wstatus = 0;
+    if (ptrace(PTRACE_SEIZE, tid, NULL, NULL) == -1)
+    {
+        return -1;
+    }
+    if (ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1)
+    {
+        return -1;
+    }
+    if (waitpid(tid, &wstatus, __WALL) == -1 || !WIFSTOPPED(wstatus))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop every thread in the target.
+ *
+ * The thread list is re-read until no new threads appear,
+ * so threads created while attaching are also stopped.
+ *
+ * @param target The target process.
+ * @return 0, or -1 on failure.
+ */
+static int stop_all_threads(struct target* target)
+{
+    char path[PATH_MAX];
+    struct dirent* entry = NULL;
+    DIR* tasks = NULL;
+    int found_new = 1;
+    snprintf(path, sizeof path, "/proc/%d/task", (int) target->pid);
+    while (found_new)
+    {
+        found_new = 0;
+        tasks = opendir(path);
+        if (tasks == NULL)
+        {
+            return -1;
+        }
+        while ((entry = readdir(tasks)) != NULL)
+        {
+            pid_t tid = (pid_t) strtol(entry->d_name, NULL, 10);
+            if (tid <= 0 || is_attached(target, tid))
+            {
+                continue;
+            }
+            if (target->thread_count == MAX_THREADS || stop_thread(tid) == -1)
+            {
+                closedir(tasks);
+                return -1;
+            }
+            target->threads[target->thread_count++] = tid;
+            found_new = 1;
+        }
+        closedir(tasks);
+    }
+    return 0;
+}
+
+/**
+ * Detach from every stopped thread in the target.
+ *
+ * @param target The target process.
+ */
+static void detach_all_threads(struct target* target)
+{
+    size_t i = 0;
+    for (i = 0; i < target->thread_count; i++)
+    {
+        ptrace(PTRACE_DETACH, target->threads[i], NULL, NULL);
+    }
+    target->thread_count = 0;
+}
+
+/**
+ * Find the base address of an object mapped into the
+ * target.
+ *
+ * @param pid The target process.
+ * @param object Canonical path of the object to find.
+ * @return The address the object's first page is mapped
+ * at, or 0 if the object is not mapped.
+ */
+static uintptr_t find_object_base(pid_t pid, const char* object)
+{
+    char path[PATH_MAX];
+    char line[PATH_MAX + 128];
+    uintptr_t base = 0;
+    FILE* maps = NULL;
+    snprintf(path, sizeof path, "/proc/%d/maps", (int) pid);
+    maps = fopen(path, "r");
+    if (maps == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof line, maps) != NULL)
+    {
+        unsigned long start = 0;
+        unsigned long offset = 0;
+        int name_start = 0;
+        char* name = NULL;
+        if (sscanf(line, "%lx-%*x %*s %lx %*s %*s %n", &start, &offset, &name_start) < 2)
+        {
+            continue;
+        }
+        name = line + name_start;
+        name[strcspn(name, "\n")] = '\0';
+        if (offset == 0 && strcmp(name, object) == 0)
+        {
+            base = (uintptr_t) start;
+            break;
+        }
+    }
+    fclose(maps);
+    return base;
+}
+
+/**
+ * Translate the address of a symbol in this process into
+ * the address of the same symbol in the target.
+ *
+ * @param pid The target process.
+ * @param local Address of the symbol in this process.
+ * @return The symbol's address in the target, or 0.
+ */
+static uintptr_t remote_address(pid_t pid, void* local)
+{
+    char object[PATH_MAX];
+    Dl_info info;
+    uintptr_t base = 0;
+    if (dladdr(local, &info) == 0 || info.dli_fname == NULL)
+    {
+        return 0;
+    }
+    if (realpath(info.dli_fname, object) == NULL)
+    {
+        return 0;
+    }
+    base = find_object_base(pid, object);
+    if (base == 0)
+    {
+        return 0;
+    }
+    return base + ((uintptr_t) local - (uintptr_t) info.dli_fbase);
+}
+
+/**
+ * Write a block of memory into the target.
+ *
+ * @param target The target process.
+ * @param address Address to write to in the target.
+ * @param data Data to write.
+ * @param length Number of bytes to write.
+ * @return 0, or -1 on failure.
+ */
+static int write_remote(struct target* target, uintptr_t address, const void* data, size_t length)
+{
+    if (pwrite(target->mem_fd, data, length, (off_t) address) != (ssize_t) length)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Call a function in the target from a stopped thread.
+ *
+ * The call is made on the thread's own stack, below its
+ * red zone, with a return address of zero. The thread
+ * faults when the function returns, which hands control
+ * back to the tool.
+ *
+ * @param target The target process.
+ * @param tid The stopped thread to call from.
+ * @param saved The thread's registers when it stopped.
+ * @param function Address of the function in the target.
+ * @param arg0 First integer argument.
+ * @param arg1 Second integer argument.
+ * @param result Location to store the function's return
+ *      value.
+ * @return 0, or -1 on failure.
+ */
+static int remote_call
+(
+    struct target* target,
+    pid_t tid,
+    struct user_regs_struct* saved,
+    uintptr_t function,
+    uintptr_t arg0,
+    uintptr_t arg1,
+    uintptr_t* result
+)
+{
+    struct user_regs_struct regs = *saved;
+    const uintptr_t return_address = 0;
+    int wstatus = 0;
+    regs.rsp = (saved->rsp - RED_ZONE - STACK_MARGIN) & ~(uintptr_t) 0xf;
+    /* Functions expect `rsp + 8` to be 16 byte aligned. */
+    regs.rsp -= sizeof return_address;
+    if (write_remote(target, regs.rsp, &return_address, sizeof return_address) == -1)
+    {
+        return -1;
+    }
+    regs.rip = function;
+    regs.rdi = arg0;
+    regs.rsi = arg1;
+    regs.rax = 0;
+    /* Don't let the kernel restart an interrupted syscall. */
+    regs.orig_rax = (unsigned long long) -1;
+    if (ptrace(PTRACE_SETREGS, tid, NULL, &regs) == -1)
+    {
+        return -1;
+    }
+    if (ptrace(PTRACE_CONT, tid, NULL, NULL) == -1)
+    {
+        return -1;
+    }
+    while (1)
+    {
+        int signal = 0;
+        if (waitpid(tid, &wstatus, __WALL) == -1 || !WIFSTOPPED(wstatus))
+        {
+            return -1;
+        }
+        signal = WSTOPSIG(wstatus);
+        if (signal == SIGSEGV || signal == SIGBUS)
+        {
+            break;
+        }
+        /* Deliver unrelated signals; suppress ptrace stops. */
+        if (wstatus >> 16 != 0 || signal == SIGTRAP || signal == SIGSTOP)
+        {
+            signal = 0;
+        }
+        if (ptrace(PTRACE_CONT, tid, NULL, (void*) (uintptr_t) signal) == -1)
+        {
+            return -1;
+        }
+    }
+    if (ptrace(PTRACE_GETREGS, tid, NULL, &regs) == -1)
+    {
+        return -1;
+    }
+    if (regs.rip != return_address)
+    {
+        fprintf(stderr, "dpatch-attach: target faulted at %#llx.\n", regs.rip);
+        return -1;
+    }
+    *result = regs.rax;
+    return 0;
+}
+
+/**
+ * Load `libdpatch` into the target and apply a script.
+ *
+ * @param target The (stopped) target process.
+ * @param library Canonical path to `libdpatch`.
+ * @param script Canonical path to the patch script.
+ * @param status Location to store the `dpatch_status`
+ *      returned by the target.
+ * @return 0, or -1 on failure.
+ */
+static int inject(struct target* target, const char* library, const char* script, int* status)
+{
+    struct user_regs_struct saved;
+    pid_t tid = target->pid;
+    uintptr_t remote_dlopen = remote_address(target->pid, dlsym(RTLD_DEFAULT, "dlopen"));
+    uintptr_t remote_entry = 0;
+    uintptr_t library_string = 0;
+    uintptr_t script_string = 0;
+    uintptr_t result = 0;
+    void* local_library = NULL;
+    void* local_entry = NULL;
+    int call_status = 0;
+    if (remote_dlopen == 0)
+    {
+        fprintf(stderr, "dpatch-attach: `dlopen` is not mapped in the target.\n");
+        return -1;
+    }
+    local_library = dlopen(library, RTLD_LAZY | RTLD_LOCAL);
+    if (local_library == NULL)
+    {
+        fprintf(stderr, "dpatch-attach: %s\n", dlerror());
+        return -1;
+    }
+    local_entry = dlsym(local_library, ATTACH_ENTRY_SYMBOL);
+    if (local_entry == NULL)
+    {
+        fprintf(stderr, "dpatch-attach: %s\n", dlerror());
+        return -1;
+    }
+    if (ptrace(PTRACE_GETREGS, tid, NULL, &saved) == -1)
+    {
+        return -1;
+    }
+    /* Strings live just below the red zone; calls run below them. */
+    library_string = saved.rsp - RED_ZONE - strlen(library) - 1;
+    script_string = library_string - strlen(script) - 1;
+    if (
+        write_remote(target, library_string, library, strlen(library) + 1) == -1
+        || write_remote(target, script_string, script, strlen(script) + 1) == -1
+    )
+    {
+        return -1;
+    }
+    /* `remote_call` builds its frame below the strings. */
+    saved.rsp = script_string;
+    call_status = remote_call(target, tid, &saved, remote_dlopen, library_string, RTLD_NOW, &result);
+    if (call_status == 0 && result == 0)
+    {
+        fprintf(stderr, "dpatch-attach: `dlopen` failed in the target.\n");
+        call_status = -1;
+    }
+    if (call_status == 0)
+    {
+        remote_entry = remote_address(target->pid, local_entry);
+        call_status = remote_entry == 0 ? -1 : remote_call(target, tid, &saved, remote_entry, script_string, 0, &result);
+        *status = (int) result;
+    }
+    dlclose(local_library);
+    return call_status;
+}
+
+int main(int argc, char** argv)
+{
+    char library[PATH_MAX];
+    char script[PATH_MAX];
+    char mem_path[PATH_MAX];
+    struct user_regs_struct original;
+    struct target* target = NULL;
+    double stopped_at = 0;
+    double resumed_at = 0;
+    size_t thread_count = 0;
+    int status = 0;
+    int result = 0;
+    if (argc < 3 || argc > 4)
+    {
+        fprintf(stderr, "Usage: %s PID SCRIPT [LIBDPATCH]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (realpath(argv[2], script) == NULL)
+    {
+        fprintf(stderr, "dpatch-attach: %s: %s\n", argv[2], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (realpath(argc == 4 ? argv[3] : DPATCH_LIBRARY_PATH, library) == NULL)
+    {
+        fprintf(stderr, "dpatch-attach: cannot find libdpatch: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    target = calloc(1, sizeof *target);
+    if (target == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    target->pid = (pid_t) strtol(argv[1], NULL, 10);
+    snprintf(mem_path, sizeof mem_path, "/proc/%d/mem", (int) target->pid);
+    stopped_at = now_ms();
+    if (stop_all_threads(target) == -1)
+    {
+        fprintf(stderr, "dpatch-attach: cannot stop %d: %s\n", (int) target->pid, strerror(errno));
+        detach_all_threads(target);
+        free(target);
+        return EXIT_FAILURE;
+    }
+    target->mem_fd = open(mem_path, O_RDWR | O_CLOEXEC);
+    if (target->mem_fd == -1 || ptrace(PTRACE_GETREGS, target->pid, NULL, &original) == -1)
+    {
+        fprintf(stderr, "dpatch-attach: cannot access %d: %s\n", (int) target->pid, strerror(errno));
+        detach_all_threads(target);
+        free(target);
+        return EXIT_FAILURE;
+    }
+    result = inject(target, library, script, &status);
+    /* Restore the hijacked thread exactly as it was stopped. */
+    ptrace(PTRACE_SETREGS, target->pid, NULL, &original);
+    thread_count = target->thread_count;
+    detach_all_threads(target);
+    resumed_at = now_ms();
+    close(target->mem_fd);
+    printf(
+        "Target %d stopped for %.3f ms (%zu threads).\n",
+        (int) target->pid,
+        resumed_at - stopped_at,
+        thread_count
+    );
+    free(target);
+    if (result == -1)
+    {
+        fprintf(stderr, "dpatch-attach: injection failed.\n");
+        return EXIT_FAILURE;
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "dpatch-attach: patch failed with status %d.\n", status);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}